@@ -0,0 +1,35 @@
+#include "alloc_count.h"
+
+#include <stddef.h>
+
+// benchmarks are single threaded
+static uint64_t allocs;
+
+void* __real_malloc(size_t size);
+void* __wrap_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __wrap_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+	allocs++;
+
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+	allocs++;
+
+	return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+	allocs++;
+
+	return __real_realloc(ptr, size);
+}
+
+uint64_t alloc_count(void) {
+	return allocs;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <stdint.h>
+
+// heap allocations (malloc, calloc, realloc) made by benchmark and code linked into it since start
+// counted by linker wrappers, so binary must be linked with ALLOC_WRAP (see Makefile), allocations inside libc are not seen
+__attribute__((warn_unused_result))
+uint64_t alloc_count(void);
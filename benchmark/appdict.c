@@ -0,0 +1,608 @@
+// trains preset dictionary of app messages and compares codecs of node (lz, zlib on reused raw deflate streams with
+// and without dictionary and codec picked per message, see node_app.c) with old path that created zlib stream
+// for every message
+// messages are read one per line, every second one is held out of training and compression is measured on them
+// messages that nodes got are in their log:
+// sed -n 's/.*App got message (length [0-9]*, id [0-9]*): \(.*\)]$/\1/p' logs.log > messages.txt
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// static functions and dictionary of node are used in place
+#include "node_app.c"
+
+// dictionary is made of segments of messages, segment is valued by k-grams it has that other messages have too
+#define KGRAM_LEN 6
+#define SEGMENT_LEN 24
+#define REPEATS 20
+
+struct message {
+	uint8_t data[APP_MESSAGE_LEN];
+	uint8_t len;
+};
+
+struct corpus {
+	struct message* messages;
+	size_t count;
+	size_t capacity;
+};
+
+struct path_stats {
+	uint64_t bytes;
+	uint64_t compressed;
+	uint32_t grown;
+	uint32_t bypassed;
+	uint32_t broken;
+	double compress_ns;
+	double decompress_ns;
+};
+
+typedef void (*encode_fn)(struct app_payload* app);
+
+typedef bool (*decode_fn)(struct app_payload* app);
+
+struct options {
+	const char* input;
+	const char* output;
+	uint32_t generate;
+	size_t dict_len;
+	uint64_t seed;
+};
+
+static struct options opts = {
+	.input = NULL,
+	.output = APP_DICT_PATH,
+	.generate = 0,
+	.dict_len = APP_DICT_MAX_LEN,
+	.seed = 1,
+};
+
+static uint64_t rng_state;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+	return x ^ (x >> 31);
+}
+
+static uint32_t rng_below(uint32_t n) {
+	rng_state = mix64(rng_state);
+
+	return (uint32_t) (rng_state % n);
+}
+
+static bool corpus_add(struct corpus* corpus, const char* data, size_t len) {
+	struct message* messages;
+
+	if (len == 0) {
+		return true;
+	}
+	if (corpus->count == corpus->capacity) {
+		corpus->capacity = corpus->capacity ? corpus->capacity * 2 : 1024;
+		messages = realloc(corpus->messages, corpus->capacity * sizeof(*messages));
+		if (messages == NULL) {
+			return false;
+		}
+		corpus->messages = messages;
+	}
+
+	// client clips message to APP_MESSAGE_LEN - 1 too
+	if (len > APP_MESSAGE_LEN - 1) {
+		len = APP_MESSAGE_LEN - 1;
+	}
+	memcpy(corpus->messages[corpus->count].data, data, len);
+	corpus->messages[corpus->count++].len = (uint8_t) len;
+
+	return true;
+}
+
+static bool read_corpus(struct corpus* corpus, const char* path) {
+	FILE* f;
+	char line[1024];
+	size_t len;
+
+	f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		len = strcspn(line, "\n");
+		if (!corpus_add(corpus, line, len)) {
+			break;
+		}
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	return true;
+}
+
+// telemetry-like messages with shared wording and varying numbers
+static bool generate_corpus(struct corpus* corpus, uint32_t count) {
+	static const char* places[] = { "kitchen", "hall", "garage", "roof", "basement", "office", "yard", "storage" };
+	static const char* states[] = { "ok", "warning", "critical", "offline", "maintenance" };
+	char line[APP_MESSAGE_LEN];
+	int32_t len;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		switch (rng_below(5)) {
+			case 0:
+				len = snprintf(line, sizeof(line), "temperature %u.%u C humidity %u%% in %s, sensor %u",
+					rng_below(40), rng_below(10), rng_below(100), places[rng_below(8)], rng_below(1000));
+				break;
+			case 1:
+				len = snprintf(line, sizeof(line), "status %s: battery %u%%, uptime %u s, last reboot reason %s",
+					states[rng_below(5)], rng_below(100), rng_below(1000000), rng_below(2) ? "watchdog" : "power loss");
+				break;
+			case 2:
+				len = snprintf(line, sizeof(line), "alarm: door %u in %s is open for %u minutes",
+					rng_below(20), places[rng_below(8)], rng_below(60));
+				break;
+			case 3:
+				len = snprintf(line, sizeof(line), "{\"node\":%u,\"app\":%u,\"value\":%u,\"unit\":\"kWh\",\"state\":\"%s\"}",
+					rng_below(NODE_COUNT), rng_below(APPS_COUNT), rng_below(100000), states[rng_below(5)]);
+				break;
+			default:
+				len = snprintf(line, sizeof(line), "ping %u from %s", rng_below(100000), places[rng_below(8)]);
+				break;
+		}
+		if (len < 0 || !corpus_add(corpus, line, (size_t) len)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct kgram {
+	const uint8_t* data;
+	uint32_t message;
+};
+
+static int compare_kgram(const void* a, const void* b) {
+	const struct kgram* ka;
+	const struct kgram* kb;
+	int res;
+
+	ka = (const struct kgram*) a;
+	kb = (const struct kgram*) b;
+	res = memcmp(ka->data, kb->data, KGRAM_LEN);
+	if (res != 0) {
+		return res;
+	}
+
+	return ka->message < kb->message ? -1 : ka->message > kb->message;
+}
+
+struct segment {
+	uint64_t score;
+	uint32_t message;
+	uint8_t start;
+};
+
+// max heap of segments by score
+static void heap_sift_down(struct segment* heap, size_t len, size_t i) {
+	struct segment tmp;
+	size_t child;
+
+	while ((child = 2 * i + 1) < len) {
+		if (child + 1 < len && heap[child + 1].score > heap[child].score) {
+			child++;
+		}
+		if (heap[i].score >= heap[child].score) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+// k-gram of every position of training messages (even ones) gets group of equal k-grams
+struct kgram_index {
+	uint32_t* group; // per position, UINT32_MAX where k-gram doesn't fit
+	uint32_t* frequency; // per group, messages that have it
+	bool* covered; // per group, already in dictionary
+	size_t* offset; // per message, first position
+};
+
+static uint64_t segment_score(const struct kgram_index* index, const struct corpus* corpus, const struct segment* seg) {
+	const struct message* msg;
+	uint64_t score;
+	uint32_t group;
+	size_t end;
+	size_t p;
+
+	msg = &corpus->messages[seg->message];
+	end = (size_t) seg->start + SEGMENT_LEN < msg->len ? (size_t) seg->start + SEGMENT_LEN : msg->len;
+
+	score = 0;
+	for (p = seg->start; p + KGRAM_LEN <= end; p++) {
+		group = index->group[index->offset[seg->message] + p];
+		// k-gram of one message only is no use for others
+		if (!index->covered[group] && index->frequency[group] > 1) {
+			score += index->frequency[group];
+		}
+	}
+
+	return score;
+}
+
+// greedy cover: best segment goes to the end of dictionary (deflate codes near distances shorter), its k-grams
+// don't count for other segments any more, scores only fall, so they are recomputed lazily when segment is on top
+static size_t train(const struct corpus* corpus, uint8_t* dict, size_t dict_len) {
+	struct kgram_index index;
+	struct kgram* kgrams;
+	struct segment* heap;
+	size_t kgram_count;
+	size_t heap_len;
+	size_t positions;
+	size_t groups;
+	size_t fill;
+	size_t seg_len;
+	size_t i;
+	uint32_t m;
+	uint8_t p;
+
+	positions = 0;
+	for (m = 0; m < corpus->count; m++) {
+		positions += corpus->messages[m].len;
+	}
+
+	index.group = malloc(positions * sizeof(*index.group) + 1);
+	index.offset = malloc(corpus->count * sizeof(*index.offset) + 1);
+	kgrams = malloc(positions * sizeof(*kgrams) + 1);
+	heap = malloc(positions * sizeof(*heap) + 1);
+	index.frequency = calloc(positions + 1, sizeof(*index.frequency));
+	index.covered = calloc(positions + 1, sizeof(*index.covered));
+
+	fill = 0;
+	if (!index.group || !index.offset || !kgrams || !heap || !index.frequency || !index.covered) {
+		fprintf(stderr, "Failed to allocate training index\n");
+		goto out;
+	}
+
+	positions = 0;
+	kgram_count = 0;
+	for (m = 0; m < corpus->count; m += 2) {
+		index.offset[m] = positions;
+		for (p = 0; p < corpus->messages[m].len; p++) {
+			index.group[positions + p] = UINT32_MAX;
+			if (p + KGRAM_LEN <= corpus->messages[m].len) {
+				kgrams[kgram_count].data = corpus->messages[m].data + p;
+				kgrams[kgram_count++].message = m;
+			}
+		}
+		positions += corpus->messages[m].len;
+	}
+
+	qsort(kgrams, kgram_count, sizeof(*kgrams), compare_kgram);
+
+	groups = 0;
+	for (i = 0; i < kgram_count; i++) {
+		if (i > 0 && memcmp(kgrams[i].data, kgrams[i - 1].data, KGRAM_LEN) == 0) {
+			if (kgrams[i].message != kgrams[i - 1].message) {
+				index.frequency[groups - 1]++;
+			}
+		} else {
+			index.frequency[groups++] = 1;
+		}
+		index.group[index.offset[kgrams[i].message] + (size_t) (kgrams[i].data - corpus->messages[kgrams[i].message].data)] =
+			(uint32_t) (groups - 1);
+	}
+
+	heap_len = 0;
+	for (m = 0; m < corpus->count; m += 2) {
+		for (p = 0; p + KGRAM_LEN <= corpus->messages[m].len; p++) {
+			heap[heap_len].message = m;
+			heap[heap_len].start = p;
+			heap[heap_len].score = segment_score(&index, corpus, &heap[heap_len]);
+			if (heap[heap_len].score > 0) {
+				heap_len++;
+			}
+		}
+	}
+	for (i = heap_len / 2; i-- > 0;) {
+		heap_sift_down(heap, heap_len, i);
+	}
+
+	while (heap_len > 0 && fill < dict_len) {
+		heap[0].score = segment_score(&index, corpus, &heap[0]);
+		if (heap[0].score == 0) {
+			heap[0] = heap[--heap_len];
+			heap_sift_down(heap, heap_len, 0);
+			continue;
+		}
+		if ((heap_len > 1 && heap[0].score < heap[1].score) || (heap_len > 2 && heap[0].score < heap[2].score)) {
+			heap_sift_down(heap, heap_len, 0);
+			continue;
+		}
+
+		seg_len = corpus->messages[heap[0].message].len - heap[0].start;
+		if (seg_len > SEGMENT_LEN) {
+			seg_len = SEGMENT_LEN;
+		}
+		if (seg_len > dict_len - fill) {
+			seg_len = dict_len - fill;
+		}
+		fill += seg_len;
+		memcpy(dict + dict_len - fill, corpus->messages[heap[0].message].data + heap[0].start, seg_len);
+
+		for (i = 0; i + KGRAM_LEN <= seg_len; i++) {
+			index.covered[index.group[index.offset[heap[0].message] + heap[0].start + i]] = true;
+		}
+	}
+
+	// dictionary is kept at the end of buffer, it is moved to its start
+	memmove(dict, dict + dict_len - fill, fill);
+
+out:
+	free(index.group);
+	free(index.offset);
+	free(index.frequency);
+	free(index.covered);
+	free(kgrams);
+	free(heap);
+
+	return fill;
+}
+
+// path that node had before: zlib stream with its header and trailer is created and freed for every message
+static void compress_old(uint8_t* msg, uint8_t* msg_len) {
+	z_stream defstream;
+	char b[APP_MESSAGE_LEN];
+
+	defstream.zalloc = Z_NULL;
+	defstream.zfree = Z_NULL;
+	defstream.opaque = Z_NULL;
+	defstream.avail_in = (uInt) *msg_len;
+	defstream.next_in = (Bytef *) msg;
+	defstream.avail_out = (uInt) sizeof(b);
+	defstream.next_out = (Bytef *)b;
+
+	deflateInit(&defstream, Z_DEFAULT_COMPRESSION);
+	deflate(&defstream, Z_FINISH);
+	deflateEnd(&defstream);
+
+	*msg_len = (uint8_t) ((char*)defstream.next_out - b);
+	memcpy(msg, b, APP_MESSAGE_LEN);
+}
+
+static void decompress_old(uint8_t* msg, uint8_t* msg_len) {
+	z_stream infstream;
+	char b[APP_MESSAGE_LEN];
+
+	infstream.zalloc = Z_NULL;
+	infstream.zfree = Z_NULL;
+	infstream.opaque = Z_NULL;
+	infstream.avail_in = (uInt) (*msg_len);
+	infstream.next_in = (Bytef*) msg;
+	infstream.avail_out = (uInt) sizeof(b);
+	infstream.next_out = (Bytef*) b;
+
+	inflateInit(&infstream);
+	inflate(&infstream, Z_NO_FLUSH);
+	inflateEnd(&infstream);
+
+	*msg_len = (uint8_t) infstream.total_out;
+	memcpy(msg, b, APP_MESSAGE_LEN);
+}
+
+static void encode_old(struct app_payload* app) {
+	compress_old(app->message, &app->message_len);
+	app->codec = APP_CODEC_ZLIB;
+}
+
+static bool decode_old(struct app_payload* app) {
+	decompress_old(app->message, &app->message_len);
+	app->codec = APP_CODEC_NONE;
+
+	return true;
+}
+
+static void encode_lz(struct app_payload* app) {
+	format_app_encode(app, APP_CODEC_LZ);
+}
+
+static void encode_zlib(struct app_payload* app) {
+	format_app_encode(app, APP_CODEC_ZLIB);
+}
+
+static void encode_picked(struct app_payload* app) {
+	format_app_encode(app, pick_codec(app));
+}
+
+// held out messages (odd ones, or all if there is one) are compressed and decompressed REPEATS times
+static void measure(const struct corpus* corpus, encode_fn encode, decode_fn decode, struct path_stats* stats) {
+	struct app_payload app;
+	bool decoded;
+	uint64_t start;
+	uint64_t compress_ns;
+	uint64_t decompress_ns;
+	uint32_t step;
+	uint32_t count;
+	uint32_t r;
+	uint32_t m;
+
+	memset(stats, 0, sizeof(*stats));
+	step = corpus->count > 1 ? 2 : 1;
+	count = 0;
+	compress_ns = 0;
+	decompress_ns = 0;
+
+	for (r = 0; r < REPEATS; r++) {
+		for (m = step - 1; m < corpus->count; m += step) {
+			memset(&app, 0, sizeof(app));
+			memcpy(app.message, corpus->messages[m].data, corpus->messages[m].len);
+			app.message_len = corpus->messages[m].len;
+
+			start = now_ns();
+			encode(&app);
+			compress_ns += now_ns() - start;
+
+			if (r == 0) {
+				stats->bytes += corpus->messages[m].len;
+				stats->compressed += app.message_len;
+				stats->grown += app.message_len > corpus->messages[m].len;
+				stats->bypassed += app.codec == APP_CODEC_NONE;
+			}
+
+			start = now_ns();
+			decoded = decode(&app);
+			decompress_ns += now_ns() - start;
+
+			if (r == 0) {
+				count++;
+				// message that doesn't fit into APP_MESSAGE_LEN after old compression is cut
+				stats->broken += !decoded || app.message_len != corpus->messages[m].len ||
+					memcmp(app.message, corpus->messages[m].data, app.message_len) != 0;
+			}
+		}
+	}
+
+	stats->compress_ns = count ? (double) compress_ns / REPEATS / count : 0;
+	stats->decompress_ns = count ? (double) decompress_ns / REPEATS / count : 0;
+}
+
+static void print_stats(const char* name, const struct path_stats* stats) {
+	printf("%-20s %6.3f %8u %8u %8u %12.0f %14.0f\n", name, stats->bytes ? (double) stats->compressed / (double) stats->bytes : 0,
+		stats->grown, stats->bypassed, stats->broken, stats->compress_ns, stats->decompress_ns);
+}
+
+static bool write_dict(const char* path, const uint8_t* dict, size_t len) {
+	FILE* f;
+	bool res;
+
+	f = fopen(path, "wb");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+	res = fwrite(dict, 1, len, f) == len;
+	fclose(f);
+
+	return res;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [options] [<messages file>]\n"
+		"  <messages file> recorded messages, one per line, - is stdin\n"
+		"  -g <messages>   generate telemetry-like messages when there is no file\n"
+		"  -s <bytes>      dictionary size (default and max %d)\n"
+		"  -o <file>       where dictionary is written, empty doesn't write it (default %s)\n"
+		"  -S <seed>       random seed of generated messages (default %" PRIu64 ")\n",
+		name, APP_DICT_MAX_LEN, APP_DICT_PATH, opts.seed);
+}
+
+static bool parse_args(int32_t argc, char** argv) {
+	int32_t opt;
+
+	while ((opt = getopt(argc, argv, "g:s:o:S:h")) != -1) {
+		switch (opt) {
+			case 'g':
+				opts.generate = (uint32_t) atoi(optarg);
+				break;
+			case 's':
+				opts.dict_len = (size_t) atoi(optarg);
+				break;
+			case 'o':
+				opts.output = optarg;
+				break;
+			case 'S':
+				opts.seed = (uint64_t) atoll(optarg);
+				break;
+			default:
+				return false;
+		}
+	}
+	if (optind < argc) {
+		opts.input = argv[optind];
+	}
+
+	return (opts.input != NULL) != (opts.generate > 0) && opts.dict_len > 0 && opts.dict_len <= APP_DICT_MAX_LEN;
+}
+
+int32_t main(int32_t argc, char** argv) {
+	struct corpus corpus;
+	struct path_stats stats;
+	uint8_t dict[APP_DICT_MAX_LEN];
+	size_t dict_len;
+
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&corpus, 0, sizeof(corpus));
+	rng_state = opts.seed;
+	if (opts.input ? !read_corpus(&corpus, opts.input) : !generate_corpus(&corpus, opts.generate)) {
+		free(corpus.messages);
+		return 1;
+	}
+	if (corpus.count == 0) {
+		fprintf(stderr, "No messages\n");
+		return 1;
+	}
+
+	dict_len = train(&corpus, dict, opts.dict_len);
+	printf("%zu messages, %zu for training\n", corpus.count, (corpus.count + 1) / 2);
+	printf("dictionary %zu bytes", dict_len);
+	if (opts.output[0] != '\0' && dict_len > 0) {
+		if (!write_dict(opts.output, dict, dict_len)) {
+			fprintf(stderr, "Failed to write dictionary\n");
+			free(corpus.messages);
+			return 1;
+		}
+		printf(" written to %s", opts.output);
+	}
+	printf("\n");
+
+	printf("%-20s %6s %8s %8s %8s %12s %14s\n", "path", "ratio", "grown", "bypassed", "broken", "compress ns", "decompress ns");
+
+	measure(&corpus, encode_old, decode_old, &stats);
+	print_stats("stream per message", &stats);
+
+	node_app_register_codecs();
+	app_dict_len = 0;
+	measure(&corpus, encode_lz, format_app_decode, &stats);
+	print_stats("lz", &stats);
+
+	measure(&corpus, encode_zlib, format_app_decode, &stats);
+	print_stats("reused stream", &stats);
+
+	measure(&corpus, encode_picked, format_app_decode, &stats);
+	print_stats("picked", &stats);
+
+	memcpy(app_dict, dict, dict_len);
+	app_dict_len = (uInt) dict_len;
+	measure(&corpus, encode_zlib, format_app_decode, &stats);
+	print_stats("reused + dictionary", &stats);
+
+	measure(&corpus, encode_picked, format_app_decode, &stats);
+	print_stats("picked + dictionary", &stats);
+
+	free(corpus.messages);
+
+	return 0;
+}
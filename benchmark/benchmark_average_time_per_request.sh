@@ -1,26 +1,12 @@
 cd ..
 
-count_time() {
-	START=$(($(gdate +%s%N) / 1000000))
-	make client TARGET_ARGS="send -s $1 -r $2 -a 'Lorem ipsum dolor sit amet, consectetuer adipiscing elit. Aenean commodo ligula eget dolor. Aenean massa. Cum sociis natoque penatibus et magnis dis' -as 2 -ar 3" > /dev/null 2>&1
-	END=$(($(gdate +%s%N) / 1000000))
-	DIFF=$(echo "$END - $START" | bc)
-	echo $DIFF
-}
-
-benchmark() {
-	sum=0
-	n=70
-	for i in $(seq 1 $n);
-	do
-		addr_s=$((0 + $RANDOM % 99))
-		addr_r=$((0 + $RANDOM % 99))
-		t=$(count_time $addr_r $addr_s)
-		sum=$((sum + t))
-	done
-
-	echo Average in miliseconds: $((sum / n))
-}
+# latency is measured by load generator from send to notify, so process spawn isn't counted
+meshload=$(pwd)/bin/release/benchmark/meshload
+
+if ! make build_benchmark > /dev/null 2>&1; then
+	echo "Failed to build"
+	exit 1
+fi
 
 echo "Average time per request benchmark"
 
@@ -28,10 +14,10 @@ make client TARGET_ARGS="reset" > /dev/null 2>&1
 
 echo "Benchmarking sending in reset network"
 
-benchmark
+$meshload -r 10 -c 1 -d 7
 
 echo "Benchmarking sending in path found network"
 
-benchmark
+$meshload -r 10 -c 1 -d 7
 
 make client TARGET_ARGS="reset" > /dev/null 2>&1
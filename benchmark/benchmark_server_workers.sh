@@ -0,0 +1,57 @@
+cd ..
+
+# server is started by this script for every worker count, so it must not be running
+WORKERS="1 2 4 8"
+# parallel client loops
+CLIENTS=8
+SECONDS_PER_RUN=10
+
+bin_dir=$(pwd)/bin/release
+
+if ! make build > /dev/null 2>&1; then
+	echo "Failed to build"
+	exit 1
+fi
+
+client_loop() {
+	cd $bin_dir/client
+	while true; do
+		addr_s=$(shuf -i 0-98 -n 1)
+		addr_r=$(shuf -i 0-98 -n 1)
+		./client send -s $addr_s -r $addr_r -a 'Lorem ipsum dolor sit amet, consectetuer adipiscing elit. Aenean commodo ligula eget dolor. Aenean massa. Cum sociis natoque penatibus et magnis dis' -as 2 -ar 3 > /dev/null 2>&1
+		echo >> $1
+	done
+}
+
+echo "Server throughput by worker count ($CLIENTS parallel clients, $SECONDS_PER_RUN seconds per run, $(nproc) CPUs)"
+
+for workers in $WORKERS; do
+	(cd $bin_dir/server && exec ./server -w $workers > /dev/null 2>&1) &
+	server_pid=$!
+	# nodes must connect to server before first request
+	sleep 3
+
+	(cd $bin_dir/client && ./client reset > /dev/null 2>&1)
+
+	counter=$(mktemp)
+	loops=""
+	for i in $(seq 1 $CLIENTS); do
+		client_loop $counter &
+		loops="$loops $!"
+	done
+
+	sleep $SECONDS_PER_RUN
+	kill $loops 2> /dev/null
+	wait $loops 2> /dev/null
+
+	requests=$(wc -l < $counter)
+	rm -f $counter
+	echo "$workers workers: $requests requests, $((requests / SECONDS_PER_RUN)) requests per second"
+
+	# server stops its nodes on SIGTERM, their ports are needed by next run
+	kill -TERM $server_pid
+	wait $server_pid 2> /dev/null
+	while pgrep -x mesh_node > /dev/null; do
+		sleep 1
+	done
+done
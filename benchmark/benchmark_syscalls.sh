@@ -0,0 +1,13 @@
+cd ..
+
+echo "Syscalls per forwarded frame"
+
+# every backend is built into its own directory, so regular build is kept
+for serving in poll epoll uring; do
+	build_dir=$(pwd)/bin/syscalls/$serving
+	if ! make SERVING=$serving BUILD_DIR=$build_dir build_benchmark > /dev/null 2>&1; then
+		echo "Failed to build $serving backend"
+		exit 1
+	fi
+	$build_dir/release/benchmark/serving_syscalls
+done
@@ -1,34 +1,21 @@
 cd ..
 
-timeout() {
-	local cmd_pid sleep_pid retval
-	(shift; "$@") &   # shift out sleep value and run rest as command in background job
-	cmd_pid=$!
-	(sleep "$1"; kill "$cmd_pid" 2>/dev/null) &
-	sleep_pid=$!
-	wait "$cmd_pid"
-	retval=$?
-	kill "$sleep_pid" 2>/dev/null
-	return "$retval"
-}
+# open loop: arrivals don't wait for answers, so throughput above server capacity shows up as latency and timeouts
+RATES="100 200 400 800"
+SECONDS_PER_RATE=5
+meshload=$(pwd)/bin/release/benchmark/meshload
 
-function benchmark() {
-	sum=0
-	while true; do
-		addr_s=$((0 + $RANDOM % 99))
-		addr_r=$((0 + $RANDOM % 99))
-		make client TARGET_ARGS="send -s $addr_s -r $addr_r -a 'Lorem ipsum dolor sit amet, consectetuer adipiscing elit. Aenean commodo ligula eget dolor. Aenean massa. Cum sociis natoque penatibus et magnis dis' -as 2 -ar 3" > /dev/null 2>&1
-		sum=$((sum + 1))
-		echo $sum 
-	done
-}
+if ! make build_benchmark > /dev/null 2>&1; then
+	echo "Failed to build"
+	exit 1
+fi
 
 echo "Throughput benchmark"
 
-echo "Requests per 10 seconds in reset network"
-
-make client TARGET_ARGS="reset" > /dev/null 2>&1
-
-timeout 10 benchmark
+for rate in $RATES; do
+	make client TARGET_ARGS="reset" > /dev/null 2>&1
+	echo "Offered $rate requests per second in reset network"
+	$meshload -r $rate -c 4 -d $SECONDS_PER_RATE
+done
 
 make client TARGET_ARGS="reset" > /dev/null 2>&1
@@ -0,0 +1,515 @@
+// open loop load generator: sends arrive at given rate no matter how fast server answers
+// every send goes through client session (REQUEST_SESSION), its latency is time from scheduled arrival to notify,
+// so queueing in front of busy server is counted too
+
+#include <inttypes.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "crc.h"
+#include "format.h"
+#include "io.h"
+#include "settings.h"
+
+#define MAX_CONNS 64
+// session seq is 16 bit, requests above this per connection are dropped (counted, not sent)
+#define MAX_OUTSTANDING 16384
+
+// log linear histogram of microseconds: 2^SUB_BITS buckets per power of two, relative error below 1/2^SUB_BITS
+#define SUB_BITS 5
+#define SUB_COUNT (1 << SUB_BITS)
+#define MAX_EXP 40
+#define BUCKETS ((MAX_EXP - SUB_BITS + 2) * SUB_COUNT)
+
+struct histogram {
+	uint64_t counts[BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+enum distribution {
+	DIST_UNIFORM,
+	DIST_ZIPF,
+	DIST_PAIRS
+};
+
+struct options {
+	double rate;
+	uint32_t conns;
+	uint32_t seconds;
+	uint32_t size;
+	enum distribution dist;
+	double zipf_s;
+	uint32_t pairs;
+	uint32_t timeout_ms;
+	uint32_t seed;
+};
+
+struct conn {
+	int32_t fd;
+	// seqs in [oldest, next) were sent, sent_ns is 0 for answered ones
+	uint16_t oldest;
+	uint16_t next;
+	size_t outstanding;
+	uint64_t sent_ns[UINT16_MAX + 1];
+	uint8_t rx[MAX_MSG_LEN * 4];
+	size_t rx_len;
+};
+
+struct stats {
+	uint64_t sent;
+	uint64_t ok;
+	uint64_t err;
+	uint64_t timeouts;
+	uint64_t dropped;
+};
+
+static struct options opts = {
+	.rate = 200.0,
+	.conns = 4,
+	.seconds = 10,
+	.size = 100,
+	.dist = DIST_UNIFORM,
+	.zipf_s = 1.0,
+	.pairs = 8,
+	.timeout_ms = 3000,
+	.seed = 1,
+};
+
+static struct histogram hist;
+static struct stats stats;
+
+// cumulative distribution of node ranks for zipf
+static double zipf_cdf[NODE_COUNT];
+// rank to address, hot nodes are spread over mesh
+static uint8_t rank_addr[NODE_COUNT];
+static uint8_t pair_addrs[NODE_COUNT][2];
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static double rand_unit(void) {
+	return ((double) rand() + 1.0) / ((double) RAND_MAX + 2.0);
+}
+
+static size_t hist_index(uint64_t v) {
+	uint32_t exp;
+	uint32_t shift;
+
+	if (v < 2 * SUB_COUNT) {
+		return (size_t) v;
+	}
+
+	exp = 63 - (uint32_t) __builtin_clzll(v);
+	if (exp > MAX_EXP) {
+		return BUCKETS - 1;
+	}
+	shift = exp - SUB_BITS;
+
+	return (size_t) shift * SUB_COUNT + (size_t) (v >> shift);
+}
+
+// lowest value of bucket
+static uint64_t hist_value(size_t index) {
+	uint64_t shift;
+
+	if (index < 2 * SUB_COUNT) {
+		return index;
+	}
+
+	shift = index / SUB_COUNT - 1;
+
+	return (index % SUB_COUNT + SUB_COUNT) << shift;
+}
+
+static void hist_record(struct histogram* h, uint64_t v) {
+	h->counts[hist_index(v)]++;
+	h->total++;
+	if (v > h->max) {
+		h->max = v;
+	}
+}
+
+static uint64_t hist_percentile(const struct histogram* h, double p) {
+	uint64_t rank;
+	uint64_t seen;
+	size_t i;
+
+	rank = (uint64_t) ceil(p / 100.0 * (double) h->total);
+	if (rank == 0) {
+		rank = 1;
+	}
+	seen = 0;
+	for (i = 0; i < BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank) {
+			return hist_value(i);
+		}
+	}
+
+	return h->max;
+}
+
+static void init_distribution(void) {
+	double sum;
+	size_t i;
+	size_t j;
+	uint8_t tmp;
+
+	for (i = 0; i < NODE_COUNT; i++) {
+		rank_addr[i] = (uint8_t) i;
+	}
+	for (i = NODE_COUNT - 1; i > 0; i--) {
+		j = (size_t) rand() % (i + 1);
+		tmp = rank_addr[i];
+		rank_addr[i] = rank_addr[j];
+		rank_addr[j] = tmp;
+	}
+
+	sum = 0;
+	for (i = 0; i < NODE_COUNT; i++) {
+		sum += 1.0 / pow((double) (i + 1), opts.zipf_s);
+		zipf_cdf[i] = sum;
+	}
+	for (i = 0; i < NODE_COUNT; i++) {
+		zipf_cdf[i] /= sum;
+	}
+
+	for (i = 0; i < opts.pairs; i++) {
+		pair_addrs[i][0] = (uint8_t) (rand() % NODE_COUNT);
+		do {
+			pair_addrs[i][1] = (uint8_t) (rand() % NODE_COUNT);
+		} while (pair_addrs[i][1] == pair_addrs[i][0]);
+	}
+}
+
+static uint8_t zipf_addr(void) {
+	double u;
+	size_t lo;
+	size_t hi;
+	size_t mid;
+
+	u = rand_unit();
+	lo = 0;
+	hi = NODE_COUNT - 1;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (zipf_cdf[mid] < u) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return rank_addr[lo];
+}
+
+static void pick_addrs(uint8_t* sender, uint8_t* receiver) {
+	size_t pair;
+
+	switch (opts.dist) {
+		case DIST_PAIRS:
+			pair = (size_t) rand() % opts.pairs;
+			*sender = pair_addrs[pair][0];
+			*receiver = pair_addrs[pair][1];
+			return;
+		case DIST_ZIPF:
+			*sender = zipf_addr();
+			do {
+				*receiver = zipf_addr();
+			} while (*receiver == *sender);
+			return;
+		case DIST_UNIFORM:
+		default:
+			*sender = (uint8_t) (rand() % NODE_COUNT);
+			do {
+				*receiver = (uint8_t) (rand() % NODE_COUNT);
+			} while (*receiver == *sender);
+			return;
+	}
+}
+
+static void send_request(struct conn* conn, uint64_t scheduled_ns) {
+	node_packet_t packet;
+	uint8_t frame[MAX_MSG_LEN];
+	uint8_t buf[MAX_MSG_LEN];
+	msg_len_type frame_len;
+	msg_len_type buf_len;
+
+	if ((uint16_t) (conn->next - conn->oldest) >= MAX_OUTSTANDING) {
+		stats.dropped++;
+		return;
+	}
+
+	memset(&packet, 0, sizeof(packet));
+	pick_addrs(&packet.sender_addr, &packet.receiver_addr);
+	packet.app_payload.req_type = APP_REQUEST_DELIVERY;
+	packet.app_payload.addr_from = 2;
+	packet.app_payload.addr_to = 3;
+	packet.app_payload.checksum = (uint8_t) crc_kind_preferred();
+	packet.app_payload.message_len = (uint8_t) opts.size;
+	memset(packet.app_payload.message, 'x', opts.size);
+	packet.crc = packet_crc(&packet);
+
+	format_create(REQUEST_SEND, &packet, frame, &frame_len, REQUEST_SENDER_CLIENT);
+	if (!format_create_session(conn->next, frame, buf, &buf_len) || !io_write_all(conn->fd, buf, buf_len)) {
+		stats.err++;
+		return;
+	}
+
+	// scheduled time is never 0, 0 marks answered request
+	conn->sent_ns[conn->next++] = scheduled_ns;
+	conn->outstanding++;
+	stats.sent++;
+}
+
+static void complete(struct conn* conn, const session_result_t* result) {
+	uint64_t sent_ns;
+
+	if ((uint16_t) (result->seq - conn->oldest) >= (uint16_t) (conn->next - conn->oldest)) {
+		return;
+	}
+	sent_ns = conn->sent_ns[result->seq];
+	if (sent_ns == 0) {
+		return;
+	}
+	conn->sent_ns[result->seq] = 0;
+	conn->outstanding--;
+
+	if (result->res == REQUEST_OK) {
+		stats.ok++;
+		hist_record(&hist, (now_ns() - sent_ns) / 1000);
+	} else {
+		stats.err++;
+	}
+}
+
+// returns false if server closed connection
+static bool receive(struct conn* conn) {
+	ssize_t n;
+	msg_len_type len;
+	enum request req;
+	union format_payload payload;
+
+	n = recv(conn->fd, conn->rx + conn->rx_len, sizeof(conn->rx) - conn->rx_len, 0);
+	if (n <= 0) {
+		return false;
+	}
+	conn->rx_len += (size_t) n;
+
+	while (conn->rx_len > 0 && conn->rx_len >= conn->rx[0]) {
+		len = conn->rx[0];
+		if (len <= MSG_BASE_LEN) {
+			fprintf(stderr, "Broken frame from server\n");
+			return false;
+		}
+
+		if (format_define_request(conn->rx + 1) == REQUEST_SESSION_RESULT) {
+			if (!format_parse(&req, &payload, conn->rx + 1, len - 1u)) {
+				fprintf(stderr, "Broken frame from server\n");
+				return false;
+			}
+			complete(conn, &payload.session_result);
+		}
+
+		memmove(conn->rx, conn->rx + len, conn->rx_len - len);
+		conn->rx_len -= len;
+	}
+
+	return true;
+}
+
+// requests are sent in order of deadline, so only oldest ones are checked
+static size_t expire(struct conn* conn, uint64_t now) {
+	uint64_t timeout_ns;
+
+	timeout_ns = (uint64_t) opts.timeout_ms * 1000000;
+	while (conn->oldest != conn->next) {
+		if (conn->sent_ns[conn->oldest] != 0) {
+			if (conn->sent_ns[conn->oldest] + timeout_ns > now) {
+				break;
+			}
+			conn->sent_ns[conn->oldest] = 0;
+			conn->outstanding--;
+			stats.timeouts++;
+		}
+		conn->oldest++;
+	}
+
+	return conn->outstanding;
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -r <rate>       arrivals per second (default %.0f)\n"
+		"  -c <conns>      client connections, arrivals are spread over them (default %u, max %d)\n"
+		"  -d <seconds>    duration of arrivals (default %u)\n"
+		"  -m <size>       message size, up to %d (default %u)\n"
+		"  -D <dist>       sender/receiver distribution: uniform, zipf or pairs (default uniform)\n"
+		"  -z <s>          zipf exponent (default %.1f)\n"
+		"  -p <pairs>      fixed sender/receiver pairs for pairs distribution (default %u)\n"
+		"  -t <ms>         time to wait for notify (default %u)\n"
+		"  -S <seed>       random seed (default %u)\n",
+		name, opts.rate, opts.conns, MAX_CONNS, opts.seconds, APP_MESSAGE_LEN - 1, opts.size, opts.zipf_s, opts.pairs,
+		opts.timeout_ms, opts.seed);
+}
+
+static bool parse_args(int32_t argc, char** argv) {
+	int32_t opt;
+
+	while ((opt = getopt(argc, argv, "r:c:d:m:D:z:p:t:S:h")) != -1) {
+		switch (opt) {
+			case 'r':
+				opts.rate = atof(optarg);
+				break;
+			case 'c':
+				opts.conns = (uint32_t) atoi(optarg);
+				break;
+			case 'd':
+				opts.seconds = (uint32_t) atoi(optarg);
+				break;
+			case 'm':
+				opts.size = (uint32_t) atoi(optarg);
+				break;
+			case 'D':
+				if (0 == strcmp(optarg, "uniform")) {
+					opts.dist = DIST_UNIFORM;
+				} else if (0 == strcmp(optarg, "zipf")) {
+					opts.dist = DIST_ZIPF;
+				} else if (0 == strcmp(optarg, "pairs")) {
+					opts.dist = DIST_PAIRS;
+				} else {
+					return false;
+				}
+				break;
+			case 'z':
+				opts.zipf_s = atof(optarg);
+				break;
+			case 'p':
+				opts.pairs = (uint32_t) atoi(optarg);
+				break;
+			case 't':
+				opts.timeout_ms = (uint32_t) atoi(optarg);
+				break;
+			case 'S':
+				opts.seed = (uint32_t) atoi(optarg);
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return opts.rate > 0 && opts.conns > 0 && opts.conns <= MAX_CONNS && opts.seconds > 0 &&
+		opts.size < APP_MESSAGE_LEN && opts.pairs > 0 && opts.pairs <= NODE_COUNT;
+}
+
+int32_t main(int32_t argc, char** argv) {
+	struct conn* conns;
+	struct pollfd pfds[MAX_CONNS];
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t next_ns;
+	uint64_t now;
+	uint64_t last_answer_ns;
+	size_t outstanding;
+	size_t turn;
+	int32_t timeout;
+	uint32_t i;
+	double elapsed;
+
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	srand(opts.seed);
+	init_distribution();
+
+	conns = calloc(opts.conns, sizeof(struct conn));
+	for (i = 0; i < opts.conns; i++) {
+		conns[i].fd = connection_socket_to_send(SERVER_PORT);
+		if (conns[i].fd < 0) {
+			fprintf(stderr, "Failed to connect to server\n");
+			return 1;
+		}
+	}
+
+	start_ns = now_ns();
+	end_ns = start_ns + (uint64_t) opts.seconds * 1000000000;
+	next_ns = start_ns;
+	last_answer_ns = start_ns;
+	turn = 0;
+	for (;;) {
+		now = now_ns();
+
+		// poisson arrivals, late ones are sent at once but keep their schedule
+		while (next_ns <= now && next_ns < end_ns) {
+			send_request(&conns[turn++ % opts.conns], next_ns);
+			next_ns += (uint64_t) (-log(rand_unit()) / opts.rate * 1e9);
+		}
+
+		outstanding = 0;
+		for (i = 0; i < opts.conns; i++) {
+			outstanding += expire(&conns[i], now);
+		}
+		if (next_ns >= end_ns && outstanding == 0) {
+			break;
+		}
+
+		if (next_ns < end_ns) {
+			timeout = (int32_t) ((next_ns - now) / 1000000);
+		} else {
+			timeout = 10;
+		}
+
+		for (i = 0; i < opts.conns; i++) {
+			pfds[i].fd = conns[i].fd;
+			pfds[i].events = POLLIN;
+		}
+		if (poll(pfds, opts.conns, timeout) < 0) {
+			perror("poll");
+			break;
+		}
+
+		for (i = 0; i < opts.conns; i++) {
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if (!receive(&conns[i])) {
+					fprintf(stderr, "Server closed connection\n");
+					goto out;
+				}
+				last_answer_ns = now_ns();
+			}
+		}
+	}
+
+out:
+	elapsed = (double) (last_answer_ns - start_ns) / 1e9;
+
+	printf("sent %" PRIu64 ", ok %" PRIu64 ", errors %" PRIu64 ", timeouts %" PRIu64 ", dropped %" PRIu64 "\n",
+		stats.sent, stats.ok, stats.err, stats.timeouts, stats.dropped);
+	printf("offered %.1f req/s, achieved %.1f req/s\n", opts.rate, elapsed > 0 ? (double) stats.ok / elapsed : 0.0);
+	printf("latency us: p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64 ", p999 %" PRIu64 ", max %" PRIu64 "\n",
+		hist_percentile(&hist, 50.0), hist_percentile(&hist, 90.0), hist_percentile(&hist, 99.0),
+		hist_percentile(&hist, 99.9), hist.max);
+
+	for (i = 0; i < opts.conns; i++) {
+		close(conns[i].fd);
+	}
+	free(conns);
+
+	return 0;
+}
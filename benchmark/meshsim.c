@@ -0,0 +1,1121 @@
+// deterministic discrete event simulator of mesh: real node request pipeline (node_listener.c, node_handler.c,
+// node_essentials.c, routing.c) runs for every node of grid in one process on virtual transport and clock
+// frames between nodes are events ordered by simulated time, so same trace and seed always give same report
+// node apps are stubs (messages are empty), server only injects sends of trace and collects notifies
+
+#include <inttypes.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "crc.h"
+#include "custom_logger.h"
+#include "format.h"
+#include "io.h"
+#include "node_app.h"
+#include "node_essentials.h"
+#include "node_handler.h"
+#include "node_host.h"
+#include "node_listener.h"
+#include "node_pool.h"
+#include "routing.h"
+#include "settings.h"
+
+// app message id is 16 bit and 0 is never used
+#define MAX_MESSAGES UINT16_MAX
+
+// events are allocated by chunks and reused
+#define EVENT_CHUNK 4096
+
+// destination of frames sent to server
+#define SERVER_ADDR NODE_COUNT
+
+enum trace_type {
+	TRACE_SEND,
+	TRACE_KILL,
+	TRACE_REVIVE
+};
+
+struct trace_entry {
+	uint64_t time_us;
+	enum trace_type type;
+	node_addr_t addr;
+	node_addr_t receiver;
+};
+
+// events of node without frame, every frame is longer
+#define EVENT_WAKE 0
+// sends of node that wait for route expire (see node_handler_expire)
+#define EVENT_EXPIRE 1
+
+// frame in flight, wake up of busy node and expiry have no frame (len is EVENT_WAKE or EVENT_EXPIRE)
+struct event {
+	uint64_t time_ns;
+	uint32_t to;
+	msg_len_type len;
+	uint8_t frame[MAX_MSG_LEN];
+	// free list or inbox of node
+	struct event* next;
+};
+
+// key is kept in heap next to event, so sifting doesn't touch events
+struct heap_entry {
+	uint64_t time_ns;
+	uint64_t seq;
+	struct event* ev;
+};
+
+struct sim_node {
+	// routing table is large, it is kept apart so scheduling state of nodes stays dense
+	node_server_t* server;
+	struct node_essentials* essentials;
+	struct node_messages* messages;
+	// frames that came while node was busy, handled in order of arrival
+	struct event* inbox_head;
+	struct event* inbox_tail;
+	uint64_t busy_until_ns;
+	// wake up event is queued for busy_until_ns
+	bool waking;
+	// expiry event is queued for this time, 0 if none
+	uint64_t expire_ns;
+	bool dead;
+};
+
+struct message {
+	uint64_t sent_ns;
+	uint64_t delivered_ns;
+	// frames between nodes that carried message
+	uint32_t frames;
+	uint32_t route_frames;
+	// bytes of route direct and route inverse frames
+	uint32_t route_bytes;
+	uint32_t notifies;
+	bool failed;
+};
+
+struct options {
+	const char* trace;
+	const char* output;
+	uint32_t generate;
+	uint32_t interval_us;
+	uint32_t kills;
+	uint32_t latency_us;
+	uint32_t jitter_us;
+	uint32_t process_us;
+	uint32_t message_len;
+	uint64_t seed;
+};
+
+struct stats {
+	uint64_t events;
+	uint64_t frames[REQUEST_UNDEFINED + 1];
+	uint64_t node_frames;
+	// sends to dead node, they fail like connect to closed port
+	uint64_t refused;
+	// frames that were in flight to node when it was killed
+	uint64_t dropped;
+	uint64_t log_errors;
+	uint64_t log_warnings;
+};
+
+static struct options opts = {
+	.trace = NULL,
+	.output = NULL,
+	.generate = 20,
+	.interval_us = 1000,
+	.kills = 0,
+	.latency_us = 100,
+	.jitter_us = 50,
+	.process_us = 10,
+	.message_len = 0,
+	.seed = 1,
+};
+
+static struct stats stats;
+
+static struct sim_node* nodes;
+static struct message messages[MAX_MESSAGES + 1];
+static uint16_t message_count;
+
+static struct trace_entry* trace;
+static size_t trace_len;
+
+// min heap of events by time, ties are broken by seq so order doesn't depend on heap layout
+static struct heap_entry* heap;
+static size_t heap_len;
+static size_t heap_capacity;
+static struct event* free_events;
+static struct event** chunks;
+static size_t chunk_count;
+static uint64_t next_seq;
+
+// simulated time when current node finishes handling, its frames leave at this time
+static uint64_t clock_ns;
+// node whose frame is handled, SERVER_ADDR while server injects trace
+static uint32_t current;
+
+// virtual connections: node_pool_get returns pointer into this array, serving_send tells port by position
+// it is never dereferenced
+static uint8_t conn_tokens[NODE_COUNT + 1];
+
+static struct serving_data* dummy_serving;
+
+static uint64_t rng_state;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t mix64(uint64_t x) {
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+	return x ^ (x >> 31);
+}
+
+static uint64_t rng_next(void) {
+	rng_state = mix64(rng_state);
+
+	return rng_state;
+}
+
+static double rng_unit(void) {
+	return ((double) (rng_next() >> 11) + 0.5) / (double) (1ULL << 53);
+}
+
+// jitter is fixed per directed link so frames of one link keep their order like over stream socket
+static uint64_t link_delay_ns(uint32_t from, uint32_t to) {
+	uint64_t jitter;
+
+	jitter = mix64(opts.seed ^ ((uint64_t) from << 32) ^ to) % ((uint64_t) opts.jitter_us * 1000 + 1);
+
+	return (uint64_t) opts.latency_us * 1000 + jitter;
+}
+
+static bool entry_before(const struct heap_entry* a, const struct heap_entry* b) {
+	return a->time_ns < b->time_ns || (a->time_ns == b->time_ns && a->seq < b->seq);
+}
+
+static struct event* event_alloc(void) {
+	struct event* chunk;
+	struct event* ev;
+	size_t i;
+
+	if (free_events == NULL) {
+		chunk = malloc(sizeof(struct event) * EVENT_CHUNK);
+		chunks = realloc(chunks, sizeof(*chunks) * (chunk_count + 1));
+		if (chunk == NULL || chunks == NULL) {
+			fprintf(stderr, "Out of memory for events\n");
+			exit(1);
+		}
+		chunks[chunk_count++] = chunk;
+		for (i = 0; i < EVENT_CHUNK; i++) {
+			chunk[i].next = free_events;
+			free_events = &chunk[i];
+		}
+	}
+
+	ev = free_events;
+	free_events = ev->next;
+
+	return ev;
+}
+
+static void event_free(struct event* ev) {
+	ev->next = free_events;
+	free_events = ev;
+}
+
+static void heap_push(struct event* ev) {
+	struct heap_entry entry;
+	size_t i;
+	size_t parent;
+
+	if (heap_len == heap_capacity) {
+		heap_capacity = heap_capacity ? heap_capacity * 2 : EVENT_CHUNK;
+		heap = realloc(heap, sizeof(*heap) * heap_capacity);
+		if (heap == NULL) {
+			fprintf(stderr, "Out of memory for event queue\n");
+			exit(1);
+		}
+	}
+
+	entry.time_ns = ev->time_ns;
+	entry.seq = next_seq++;
+	entry.ev = ev;
+	i = heap_len++;
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (!entry_before(&entry, &heap[parent])) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = entry;
+}
+
+static struct event* heap_pop(void) {
+	struct event* top;
+	struct heap_entry last;
+	size_t i;
+	size_t child;
+
+	top = heap[0].ev;
+	last = heap[--heap_len];
+	i = 0;
+	for (;;) {
+		child = 2 * i + 1;
+		if (child >= heap_len) {
+			break;
+		}
+		if (child + 1 < heap_len && entry_before(&heap[child + 1], &heap[child])) {
+			child++;
+		}
+		if (!entry_before(&heap[child], &last)) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (heap_len > 0) {
+		heap[i] = last;
+	}
+
+	return top;
+}
+
+static void schedule_frame(uint32_t to, const uint8_t* buf, msg_len_type len) {
+	struct event* ev;
+
+	ev = event_alloc();
+	ev->time_ns = clock_ns + link_delay_ns(current, to);
+	ev->to = to;
+	ev->len = len;
+	memcpy(ev->frame, buf, len);
+
+	heap_push(ev);
+}
+
+// app message id of frames that carry packet, 0 for others
+// packet is serialized field by field in order of packed node_packet_t, so id is read in place
+static uint16_t frame_message_id(const uint8_t* buf) {
+	uint16_t id;
+
+	switch (format_define_request(buf + 1)) {
+		case REQUEST_SEND:
+		case REQUEST_ROUTE_DIRECT:
+		case REQUEST_ROUTE_INVERSE:
+			memcpy(&id, buf + MSG_BASE_LEN + offsetof(node_packet_t, app_payload) + offsetof(struct app_payload, id), sizeof(id));
+			return id;
+		default:
+			return 0;
+	}
+}
+
+static void account_frame(const uint8_t* buf) {
+	enum request req;
+	uint16_t id;
+
+	req = format_define_request(buf + 1);
+	if (req > REQUEST_UNDEFINED) {
+		req = REQUEST_UNDEFINED;
+	}
+	stats.frames[req]++;
+	stats.node_frames++;
+
+	id = frame_message_id(buf);
+	if (id != 0 && id <= message_count) {
+		messages[id].frames++;
+		if (req == REQUEST_ROUTE_DIRECT) {
+			messages[id].route_frames++;
+		}
+		if (req == REQUEST_ROUTE_DIRECT || req == REQUEST_ROUTE_INVERSE) {
+			messages[id].route_bytes += buf[0];
+		}
+	}
+}
+
+// virtual transport and clock, all of them run on simulation thread
+
+void log_file_(enum log_type type, int32_t line, const char* file, const char* format, ...) {
+	(void) line;
+	(void) file;
+	(void) format;
+
+	if (type == LOG_TYPE_ERROR) {
+		stats.log_errors++;
+	} else if (type == LOG_TYPE_WARN) {
+		stats.log_warnings++;
+	}
+}
+
+void node_pool_init(struct serving_data* serving) {
+	(void) serving;
+}
+
+struct serving_conn* node_pool_get(uint16_t port) {
+	uint32_t addr;
+
+	addr = port == SERVER_PORT ? SERVER_ADDR : (uint32_t) node_addr(port);
+	if (addr > SERVER_ADDR) {
+		return NULL;
+	}
+	if (addr != SERVER_ADDR && nodes[addr].dead) {
+		stats.refused++;
+		return NULL;
+	}
+
+	return (struct serving_conn*) (void*) &conn_tokens[addr];
+}
+
+void node_pool_alive(uint16_t port) {
+	(void) port;
+}
+
+void node_pool_reset(void) {
+}
+
+const struct node_pool_stats* node_pool_stats(void) {
+	static struct node_pool_stats pool_stats;
+
+	return &pool_stats;
+}
+
+uint64_t node_pool_now_ms(void) {
+	return clock_ns / 1000000;
+}
+
+bool serving_send(struct serving_data* serving, struct serving_conn* conn, const uint8_t* buf, msg_len_type len) {
+	uint32_t to;
+
+	(void) serving;
+
+	to = (uint32_t) ((uint8_t*) (void*) conn - conn_tokens);
+	if (to != SERVER_ADDR) {
+		account_frame(buf);
+	}
+	schedule_frame(to, buf, len);
+
+	return true;
+}
+
+bool serving_send_body(struct serving_data* serving, struct serving_conn* conn, const uint8_t* body, msg_len_type len) {
+	uint8_t frame[MAX_MSG_LEN];
+
+	frame[0] = (msg_len_type) (len + sizeof(len));
+	memcpy(frame + sizeof(len), body, len);
+
+	return serving_send(serving, conn, frame, frame[0]);
+}
+
+// nodes don't create timers, their sends expire by events (see expire_at)
+struct serving_conn* serving_add_watch(struct serving_data* serving, int32_t fd, serving_readable_t on_readable, void* ctx) {
+	(void) serving;
+	(void) fd;
+	(void) on_readable;
+	(void) ctx;
+
+	return NULL;
+}
+
+bool node_host_has(uint16_t port) {
+	(void) port;
+
+	return false;
+}
+
+bool node_host_send(uint16_t port, const uint8_t* body, msg_len_type len) {
+	(void) port;
+	(void) body;
+	(void) len;
+
+	return false;
+}
+
+bool node_host_kill_current(void) {
+	return false;
+}
+
+int32_t connection_socket_to_send(uint16_t port) {
+	(void) port;
+
+	return -1;
+}
+
+bool io_write_all(int32_t fd, const uint8_t* buf, msg_len_type n) {
+	(void) fd;
+	(void) buf;
+	(void) n;
+
+	return false;
+}
+
+// apps take every delivery, messages of simulated sends are empty so there is nothing to compress
+
+void node_app_fill_default(app_t* apps, node_addr_t node_addr) {
+	uint8_t i;
+
+	for (i = 0; i < APPS_COUNT; i++) {
+		apps[i].app_addr = i;
+		apps[i].node_addr = node_addr;
+	}
+}
+
+bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, node_addr_t node_addr) {
+	(void) apps;
+	(void) app_payload;
+	(void) node_addr;
+
+	return true;
+}
+
+void node_app_setup_delivery(struct app_payload* app_payload) {
+	(void) app_payload;
+}
+
+static void switch_node(struct sim_node* node) {
+	node_essentials_switch(node ? node->essentials : NULL);
+	node_handler_switch(node ? node->messages : NULL);
+}
+
+static bool init_nodes(void) {
+	uint32_t i;
+
+	nodes = calloc(NODE_COUNT, sizeof(struct sim_node));
+	dummy_serving = calloc(1, sizeof(struct serving_data));
+	if (nodes == NULL || dummy_serving == NULL) {
+		return false;
+	}
+
+	for (i = 0; i < NODE_COUNT; i++) {
+		nodes[i].server = malloc(sizeof(node_server_t));
+		nodes[i].essentials = node_essentials_create();
+		nodes[i].messages = node_handler_create();
+		if (nodes[i].server == NULL || nodes[i].essentials == NULL || nodes[i].messages == NULL) {
+			return false;
+		}
+
+		switch_node(&nodes[i]);
+		nodes[i].server->addr = (node_addr_t) i;
+		routing_table_fill_default(&nodes[i].server->routing);
+		node_app_fill_default(nodes[i].server->apps, nodes[i].server->addr);
+		node_essentials_fill_neighbors_port(nodes[i].server->addr);
+		if (!node_essentials_init_connections(dummy_serving)) {
+			return false;
+		}
+	}
+	switch_node(NULL);
+
+	return true;
+}
+
+static void free_nodes(void) {
+	uint32_t i;
+
+	for (i = 0; i < NODE_COUNT; i++) {
+		node_essentials_destroy(nodes[i].essentials);
+		node_handler_destroy(nodes[i].messages);
+		free(nodes[i].server);
+	}
+	free(nodes);
+	free(dummy_serving);
+}
+
+static void handle_server_frame(const struct event* ev) {
+	enum request req;
+	union format_payload payload;
+	struct message* msg;
+
+	if (!format_parse(&req, &payload, ev->frame + 1, ev->len - 1u)) {
+		stats.frames[REQUEST_UNDEFINED]++;
+		return;
+	}
+	stats.frames[req <= REQUEST_UNDEFINED ? req : REQUEST_UNDEFINED]++;
+
+	if (req == REQUEST_NOTIFY && payload.notify.app_msg_id != 0 && payload.notify.app_msg_id <= message_count) {
+		msg = &messages[payload.notify.app_msg_id];
+		msg->notifies++;
+		if (payload.notify.type == NOTIFY_GOT_MESSAGE && msg->delivered_ns == 0) {
+			msg->delivered_ns = ev->time_ns;
+		} else if (payload.notify.type == NOTIFY_FAIL) {
+			msg->failed = true;
+		}
+	}
+}
+
+// called while node is switched in, at clock_ns
+static void expire_at(struct sim_node* node) {
+	struct event* expire;
+	int32_t expire_ms;
+	uint64_t time_ns;
+
+	expire_ms = node_handler_expire();
+	if (expire_ms < 0) {
+		return;
+	}
+
+	time_ns = clock_ns + (uint64_t) expire_ms * 1000000;
+	if (node->expire_ns != 0 && node->expire_ns <= time_ns) {
+		return;
+	}
+
+	expire = event_alloc();
+	expire->time_ns = time_ns;
+	expire->to = node->server->addr;
+	expire->len = EVENT_EXPIRE;
+	node->expire_ns = time_ns;
+
+	heap_push(expire);
+}
+
+static void handle_frame(struct sim_node* node, struct event* ev) {
+	node->busy_until_ns = ev->time_ns + (uint64_t) opts.process_us * 1000;
+	clock_ns = node->busy_until_ns;
+	current = node->server->addr;
+
+	switch_node(node);
+	(void) node_listener_handle_request(node->server, -1, ev->frame + 1, ev->len - 1, node);
+	expire_at(node);
+	switch_node(NULL);
+
+	event_free(ev);
+}
+
+static void handle_expire(struct sim_node* node, struct event* ev) {
+	if (node->expire_ns == ev->time_ns) {
+		node->expire_ns = 0;
+	}
+
+	if (!node->dead) {
+		clock_ns = ev->time_ns;
+		current = node->server->addr;
+
+		switch_node(node);
+		expire_at(node);
+		switch_node(NULL);
+	}
+
+	event_free(ev);
+}
+
+static void wake_at(struct sim_node* node, uint64_t time_ns) {
+	struct event* wake;
+
+	wake = event_alloc();
+	wake->time_ns = time_ns;
+	wake->to = node->server->addr;
+	wake->len = EVENT_WAKE;
+	node->waking = true;
+
+	heap_push(wake);
+}
+
+// node handles frames one by one, frame that comes while it is busy waits in inbox
+static void handle_node_event(struct event* ev) {
+	struct sim_node* node;
+	struct event* frame;
+
+	node = &nodes[ev->to];
+
+	if (ev->len == EVENT_EXPIRE) {
+		handle_expire(node, ev);
+		return;
+	}
+
+	if (ev->len == EVENT_WAKE) {
+		node->waking = false;
+		frame = node->inbox_head;
+		if (node->dead || frame == NULL) {
+			event_free(ev);
+			return;
+		}
+		node->inbox_head = frame->next;
+		frame->time_ns = ev->time_ns;
+		event_free(ev);
+		handle_frame(node, frame);
+		if (node->inbox_head) {
+			wake_at(node, node->busy_until_ns);
+		}
+		return;
+	}
+
+	if (node->dead) {
+		stats.dropped++;
+		event_free(ev);
+		return;
+	}
+
+	if (node->busy_until_ns > ev->time_ns || node->inbox_head) {
+		ev->next = NULL;
+		if (node->inbox_head) {
+			node->inbox_tail->next = ev;
+		} else {
+			node->inbox_head = ev;
+		}
+		node->inbox_tail = ev;
+		if (!node->waking) {
+			wake_at(node, node->busy_until_ns);
+		}
+		return;
+	}
+
+	handle_frame(node, ev);
+}
+
+static void inject_send(const struct trace_entry* entry) {
+	uint8_t buf[MAX_MSG_LEN];
+	msg_len_type len;
+	struct message* msg;
+	uint32_t i;
+
+	node_packet_t packet = {
+		.sender_addr = entry->addr,
+		.receiver_addr = entry->receiver,
+		.local_sender_addr = entry->addr,
+		.time_to_live = TTL,
+	};
+
+	packet.app_payload.req_type = APP_REQUEST_DELIVERY;
+	packet.app_payload.addr_from = 0;
+	packet.app_payload.addr_to = 0;
+	packet.app_payload.message_len = (uint8_t) opts.message_len;
+	packet.app_payload.id = ++message_count;
+	// apps of nodes are stubs, so content doesn't matter, only length on wire
+	for (i = 0; i < opts.message_len; i++) {
+		packet.app_payload.message[i] = (uint8_t) (i * 31 + message_count);
+	}
+	packet.crc = packet_crc(&packet);
+
+	msg = &messages[message_count];
+	msg->sent_ns = entry->time_us * 1000;
+
+	format_create(REQUEST_SEND, &packet, buf, &len, REQUEST_SENDER_SERVER);
+	schedule_frame(entry->addr, buf, len);
+}
+
+static void apply_trace(const struct trace_entry* entry) {
+	struct sim_node* node;
+	struct event* frame;
+
+	clock_ns = entry->time_us * 1000;
+	current = SERVER_ADDR;
+	node = &nodes[entry->addr];
+
+	switch (entry->type) {
+		case TRACE_SEND:
+			inject_send(entry);
+			break;
+		case TRACE_KILL:
+			node->dead = true;
+			while (node->inbox_head) {
+				frame = node->inbox_head;
+				node->inbox_head = frame->next;
+				event_free(frame);
+				stats.dropped++;
+			}
+			break;
+		case TRACE_REVIVE:
+			// revived node starts from scratch like new process
+			if (node->dead) {
+				node->dead = false;
+				node->busy_until_ns = 0;
+				switch_node(node);
+				handle_reset(&node->server->routing, node->server->apps, node->server->addr);
+				switch_node(NULL);
+			}
+			break;
+	}
+}
+
+static bool trace_add(uint64_t time_us, enum trace_type type, uint32_t addr, uint32_t receiver) {
+	static size_t capacity;
+	struct trace_entry* entry;
+
+	if (trace_len == capacity) {
+		capacity = capacity ? capacity * 2 : 1024;
+		trace = realloc(trace, sizeof(*trace) * capacity);
+		if (trace == NULL) {
+			return false;
+		}
+	}
+
+	entry = &trace[trace_len++];
+	entry->time_us = time_us;
+	entry->type = type;
+	entry->addr = (node_addr_t) addr;
+	entry->receiver = (node_addr_t) receiver;
+
+	return true;
+}
+
+// line is "<time us> send <sender> <receiver>", "<time us> kill <addr>" or "<time us> revive <addr>"
+static bool read_trace(const char* path) {
+	FILE* f;
+	char line[256];
+	char cmd[16];
+	uint64_t time_us;
+	uint64_t last_us;
+	uint32_t addr;
+	uint32_t receiver;
+	uint32_t sends;
+	size_t line_num;
+	int32_t n;
+	bool res;
+
+	f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open trace %s\n", path);
+		return false;
+	}
+
+	res = true;
+	last_us = 0;
+	sends = 0;
+	line_num = 0;
+	while (res && fgets(line, sizeof(line), f)) {
+		line_num++;
+		if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+
+		receiver = 0;
+		n = sscanf(line, "%" SCNu64 " %15s %u %u", &time_us, cmd, &addr, &receiver);
+		res = false;
+		if (n < 3 || addr >= NODE_COUNT || receiver >= NODE_COUNT || time_us < last_us) {
+			// invalid line
+		} else if (n == 4 && strcmp(cmd, "send") == 0 && addr != receiver && sends < MAX_MESSAGES) {
+			res = trace_add(time_us, TRACE_SEND, addr, receiver);
+			sends++;
+		} else if (n == 3 && strcmp(cmd, "kill") == 0) {
+			res = trace_add(time_us, TRACE_KILL, addr, 0);
+		} else if (n == 3 && strcmp(cmd, "revive") == 0) {
+			res = trace_add(time_us, TRACE_REVIVE, addr, 0);
+		}
+		if (!res) {
+			fprintf(stderr, "Bad trace line %zu: %s", line_num, line);
+		}
+		last_us = time_us;
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	return res;
+}
+
+// kills at start, then sends between random alive nodes with exponential gaps (poisson arrivals)
+static bool generate_trace(void) {
+	uint64_t time_us;
+	uint32_t sender;
+	uint32_t receiver;
+	uint32_t i;
+
+	for (i = 0; i < opts.kills; i++) {
+		do {
+			sender = (uint32_t) (rng_next() % NODE_COUNT);
+		} while (nodes[sender].dead);
+		nodes[sender].dead = true;
+		if (!trace_add(0, TRACE_KILL, sender, 0)) {
+			return false;
+		}
+	}
+
+	time_us = 0;
+	for (i = 0; i < opts.generate; i++) {
+		time_us += (uint64_t) (-log(rng_unit()) * opts.interval_us);
+		do {
+			sender = (uint32_t) (rng_next() % NODE_COUNT);
+		} while (nodes[sender].dead);
+		do {
+			receiver = (uint32_t) (rng_next() % NODE_COUNT);
+		} while (receiver == sender || nodes[receiver].dead);
+		if (!trace_add(time_us, TRACE_SEND, sender, receiver)) {
+			return false;
+		}
+	}
+
+	// kills are replayed from trace
+	for (i = 0; i < NODE_COUNT; i++) {
+		nodes[i].dead = false;
+	}
+
+	return true;
+}
+
+static bool write_trace(const char* path) {
+	FILE* f;
+	size_t i;
+	static const char* names[] = { "send", "kill", "revive" };
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+
+	for (i = 0; i < trace_len; i++) {
+		if (trace[i].type == TRACE_SEND) {
+			fprintf(f, "%" PRIu64 " send %u %u\n", trace[i].time_us, trace[i].addr, trace[i].receiver);
+		} else {
+			fprintf(f, "%" PRIu64 " %s %u\n", trace[i].time_us, names[trace[i].type], trace[i].addr);
+		}
+	}
+
+	fclose(f);
+
+	return true;
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t x;
+	uint64_t y;
+
+	x = *(const uint64_t*) a;
+	y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+static void report(double wall_s) {
+	static const char* names[REQUEST_UNDEFINED + 1] = {
+		"send", "update", "ping", "notify", "route_direct", "route_inverse", "kill", "revive", "reset",
+		"broadcast", "unicast", "unicast_contest", "unicast_first", "control", "control_result",
+		"session", "session_result", "send_batch", "send_batch_result", "undefined"
+	};
+	uint64_t* latencies;
+	uint64_t delivered;
+	uint64_t failed;
+	uint64_t duplicates;
+	uint64_t discovered;
+	uint64_t route_frames;
+	uint64_t max_route_frames;
+	uint64_t route_bytes;
+	uint64_t entries;
+	uint64_t min_entries;
+	uint64_t max_entries;
+	uint64_t node_entries;
+	struct node_messages_stats seen;
+	struct node_messages_stats node_seen;
+	uint32_t i;
+	uint32_t j;
+
+	latencies = malloc(sizeof(uint64_t) * (message_count + 1));
+	delivered = 0;
+	failed = 0;
+	duplicates = 0;
+	discovered = 0;
+	route_frames = 0;
+	max_route_frames = 0;
+	route_bytes = 0;
+	for (i = 1; i <= message_count; i++) {
+		if (messages[i].delivered_ns) {
+			if (latencies) {
+				latencies[delivered] = messages[i].delivered_ns - messages[i].sent_ns;
+			}
+			delivered++;
+			if (messages[i].notifies > 1) {
+				duplicates += messages[i].notifies - 1;
+			}
+		} else if (messages[i].failed) {
+			failed++;
+		}
+		if (messages[i].route_frames) {
+			discovered++;
+			route_frames += messages[i].route_frames;
+			route_bytes += messages[i].route_bytes;
+			if (messages[i].route_frames > max_route_frames) {
+				max_route_frames = messages[i].route_frames;
+			}
+		}
+	}
+
+	entries = 0;
+	min_entries = UINT64_MAX;
+	max_entries = 0;
+	memset(&seen, 0, sizeof(seen));
+	for (i = 0; i < NODE_COUNT; i++) {
+		node_handler_stats(nodes[i].messages, &node_seen);
+		seen.inserted += node_seen.inserted;
+		seen.evicted += node_seen.evicted;
+		seen.expired += node_seen.expired;
+		seen.collisions += node_seen.collisions;
+		seen.pending_sent += node_seen.pending_sent;
+		seen.pending_timed_out += node_seen.pending_timed_out;
+		seen.pending_dropped += node_seen.pending_dropped;
+
+		node_entries = 0;
+		for (j = 0; j < NODE_COUNT; j++) {
+			if (routing_next_addr(&nodes[i].server->routing, (node_addr_t) j) != NODE_ADDR_NONE) {
+				node_entries++;
+			}
+		}
+		entries += node_entries;
+		min_entries = node_entries < min_entries ? node_entries : min_entries;
+		max_entries = node_entries > max_entries ? node_entries : max_entries;
+	}
+
+	printf("grid %dx%d (%d nodes), ttl %d, broadcast radius %d\n", MATRIX_SIZE, MATRIX_SIZE, NODE_COUNT, TTL, BROADCAST_RADIUS);
+	printf("link %u us + jitter up to %u us, processing %u us per frame, seed %" PRIu64 "\n",
+		opts.latency_us, opts.jitter_us, opts.process_us, opts.seed);
+	printf("messages %u: delivered %" PRIu64 ", failed %" PRIu64 ", lost %" PRIu64 ", duplicate notifies %" PRIu64 "\n",
+		message_count, delivered, failed, message_count - delivered - failed, duplicates);
+	printf("frames between nodes %" PRIu64 ", %.1f per delivery, %" PRIu64 " refused by dead nodes, %" PRIu64 " dropped by killed nodes\n",
+		stats.node_frames, delivered ? (double) stats.node_frames / (double) delivered : 0.0, stats.refused, stats.dropped);
+	for (i = 0; i <= REQUEST_UNDEFINED; i++) {
+		if (stats.frames[i]) {
+			printf("  %-16s %" PRIu64 "\n", names[i], stats.frames[i]);
+		}
+	}
+	printf("route discovery: %" PRIu64 " messages, %.1f route direct frames per message (max %" PRIu64 "), %.1f bytes of route frames per message\n",
+		discovered, discovered ? (double) route_frames / (double) discovered : 0.0, max_route_frames,
+		discovered ? (double) route_bytes / (double) discovered : 0.0);
+	printf("sends after route discovery: %" PRIu64 " sent, %" PRIu64 " timed out, %" PRIu64 " dropped by full queue\n",
+		seen.pending_sent, seen.pending_timed_out, seen.pending_dropped);
+	printf("routing tables: %.1f entries per node (min %" PRIu64 ", max %" PRIu64 "), %zu bytes per node\n",
+		(double) entries / NODE_COUNT, min_entries, max_entries, sizeof(routing_table_t));
+	printf("seen messages: %" PRIu64 " remembered, %" PRIu64 " evicted, %" PRIu64 " expired and handled again, %" PRIu64 " collisions\n",
+		seen.inserted, seen.evicted, seen.expired, seen.collisions);
+
+	if (delivered && latencies) {
+		qsort(latencies, delivered, sizeof(uint64_t), compare_u64);
+		printf("simulated latency us: p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+			(double) latencies[(delivered - 1) * 50 / 100] / 1e3, (double) latencies[(delivered - 1) * 90 / 100] / 1e3,
+			(double) latencies[(delivered - 1) * 99 / 100] / 1e3, (double) latencies[delivered - 1] / 1e3);
+	}
+	printf("handler log: %" PRIu64 " errors, %" PRIu64 " warnings\n", stats.log_errors, stats.log_warnings);
+	// wall time is the only thing that differs between runs, it goes to stderr
+	fprintf(stderr, "%" PRIu64 " events in %.2f s (%.0f events/s)\n", stats.events, wall_s, (double) stats.events / wall_s);
+
+	free(latencies);
+}
+
+static void usage(const char* name) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -t <file>       trace to replay, - is stdin (lines: <us> send <from> <to>, <us> kill <addr>, <us> revive <addr>)\n"
+		"  -g <sends>      sends of generated trace when there is no -t (default %u, max %d)\n"
+		"  -i <us>         mean interval between generated sends (default %u)\n"
+		"  -k <nodes>      nodes killed at start of generated trace (default %u)\n"
+		"  -o <file>       write replayed trace to file\n"
+		"  -l <us>         link latency (default %u)\n"
+		"  -j <us>         max link jitter, fixed per link (default %u)\n"
+		"  -p <us>         time node handles one frame (default %u)\n"
+		"  -m <bytes>      length of app message of every send (default %u, max %d)\n"
+		"  -S <seed>       random seed (default %" PRIu64 ")\n",
+		name, opts.generate, MAX_MESSAGES, opts.interval_us, opts.kills, opts.latency_us, opts.jitter_us, opts.process_us,
+		opts.message_len, APP_MESSAGE_LEN, opts.seed);
+}
+
+static bool parse_args(int32_t argc, char** argv) {
+	int32_t opt;
+
+	while ((opt = getopt(argc, argv, "t:g:i:k:o:l:j:p:m:S:h")) != -1) {
+		switch (opt) {
+			case 't':
+				opts.trace = optarg;
+				break;
+			case 'g':
+				opts.generate = (uint32_t) atoi(optarg);
+				break;
+			case 'i':
+				opts.interval_us = (uint32_t) atoi(optarg);
+				break;
+			case 'k':
+				opts.kills = (uint32_t) atoi(optarg);
+				break;
+			case 'o':
+				opts.output = optarg;
+				break;
+			case 'l':
+				opts.latency_us = (uint32_t) atoi(optarg);
+				break;
+			case 'j':
+				opts.jitter_us = (uint32_t) atoi(optarg);
+				break;
+			case 'p':
+				opts.process_us = (uint32_t) atoi(optarg);
+				break;
+			case 'm':
+				opts.message_len = (uint32_t) atoi(optarg);
+				break;
+			case 'S':
+				opts.seed = (uint64_t) atoll(optarg);
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return opts.generate <= MAX_MESSAGES && opts.kills + 2 <= NODE_COUNT && opts.message_len <= APP_MESSAGE_LEN;
+}
+
+int32_t main(int32_t argc, char** argv) {
+	struct event* ev;
+	uint64_t start_ns;
+	size_t next_trace;
+
+	if (!parse_args(argc, argv)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	rng_state = opts.seed;
+
+	if (!init_nodes()) {
+		fprintf(stderr, "Failed to create %d nodes\n", NODE_COUNT);
+		return 1;
+	}
+
+	if (opts.trace ? !read_trace(opts.trace) : !generate_trace()) {
+		return 1;
+	}
+	if (opts.output && !write_trace(opts.output)) {
+		return 1;
+	}
+
+	start_ns = now_ns();
+
+	// trace entry goes before frames of the same time
+	next_trace = 0;
+	while (next_trace < trace_len || heap_len > 0) {
+		stats.events++;
+		if (next_trace < trace_len && (heap_len == 0 || trace[next_trace].time_us * 1000 <= heap[0].time_ns)) {
+			apply_trace(&trace[next_trace++]);
+			continue;
+		}
+
+		ev = heap_pop();
+		if (ev->to == SERVER_ADDR) {
+			handle_server_frame(ev);
+			event_free(ev);
+		} else {
+			handle_node_event(ev);
+		}
+	}
+
+	report((double) (now_ns() - start_ns) / 1e9);
+
+	free_nodes();
+	free(trace);
+	free(heap);
+	while (chunk_count > 0) {
+		free(chunks[--chunk_count]);
+	}
+	free(chunks);
+
+	return 0;
+}
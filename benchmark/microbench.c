@@ -0,0 +1,392 @@
+// microbenchmarks of hot path primitives, one CSV line per benchmark and size:
+// name,size,ns_per_op,bytes_per_s,allocs_per_op
+// every benchmark is repeated several times and the fastest repeat is reported, so numbers are comparable between runs
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// static functions of node are benchmarked in place
+#include "node_app.c"
+#include "node_handler.c"
+
+#include "alloc_count.h"
+#include "crc.h"
+#include "format.h"
+#include "format_app.h"
+#include "routing.h"
+
+#define REPEATS 5
+// repeat is at least this long, iterations are calibrated to it
+#define REPEAT_NS 20000000ull
+
+typedef void (*bench_fn)(void* ctx);
+
+struct bench_ctx {
+	uint8_t buf[MAX_MSG_LEN];
+	msg_len_type len;
+	enum request req;
+	uint8_t payload[sizeof(send_batch_t)];
+	struct app_payload app;
+	struct app_payload encoded;
+	enum app_codec codec;
+	uint8_t msg[APP_MESSAGE_LEN];
+	uint8_t msg_len;
+	routing_table_t routing;
+	uint16_t id;
+};
+
+static const char text[] =
+	"Lorem ipsum dolor sit amet, consectetuer adipiscing elit. Aenean commodo ligula eget dolor. Aenean massa. "
+	"Cum sociis natoque penatibus et magnis dis parturient montes, nascetur ridiculus mus.";
+
+static const size_t sizes[] = { 0, 16, 32, 64, 128, APP_MESSAGE_LEN - 1 };
+
+// keeps results alive, so compiler doesn't drop benchmarked code
+static volatile uint32_t sink;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t run_iters(bench_fn fn, void* ctx, uint64_t iters) {
+	uint64_t start;
+	uint64_t i;
+
+	start = now_ns();
+	for (i = 0; i < iters; i++) {
+		fn(ctx);
+	}
+
+	return now_ns() - start;
+}
+
+static void bench(const char* name, size_t size, size_t bytes, bench_fn fn, void* ctx) {
+	uint64_t iters;
+	uint64_t elapsed;
+	uint64_t allocs;
+	double best;
+	double ns;
+	size_t i;
+
+	iters = 1;
+	while ((elapsed = run_iters(fn, ctx, iters)) < REPEAT_NS / 10) {
+		iters *= 2;
+	}
+	iters = iters * REPEAT_NS / (elapsed + 1) + 1;
+
+	best = 0;
+	allocs = alloc_count();
+	for (i = 0; i < REPEATS; i++) {
+		ns = (double) run_iters(fn, ctx, iters) / (double) iters;
+		if (i == 0 || ns < best) {
+			best = ns;
+		}
+	}
+	allocs = alloc_count() - allocs;
+
+	printf("%s,%zu,%.2f,%.0f,%.2f\n", name, size, best, bytes ? (double) bytes / best * 1e9 : 0.0,
+		(double) allocs / (double) (iters * REPEATS));
+}
+
+static void fill_message(uint8_t* msg, size_t size) {
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		msg[i] = (uint8_t) text[i % (sizeof(text) - 1)];
+	}
+}
+
+static void bench_crc16(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	sink += crc16(ctx->msg, ctx->msg_len);
+}
+
+static void bench_crc32c(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	sink += crc32c_update(CRC32C_INIT, ctx->msg, ctx->msg_len);
+}
+
+static void bench_format_create(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	format_create(ctx->req, ctx->payload, ctx->buf, &ctx->len, REQUEST_SENDER_NODE);
+	sink += ctx->len;
+}
+
+static void bench_format_parse(void* arg) {
+	struct bench_ctx* ctx;
+	enum request req;
+	union format_payload payload;
+
+	ctx = (struct bench_ctx*) arg;
+	sink += format_parse(&req, &payload, ctx->buf + 1, ctx->len - 1u);
+	sink += req;
+}
+
+static void bench_format_app_create(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	format_app_create_message(&ctx->app, ctx->buf);
+	sink += ctx->buf[0];
+}
+
+static void bench_format_app_parse(void* arg) {
+	struct bench_ctx* ctx;
+	struct app_payload app;
+
+	ctx = (struct bench_ctx*) arg;
+	format_app_parse_message(&app, ctx->buf);
+	sink += app.message_len;
+}
+
+static void bench_codec_encode(void* arg) {
+	struct bench_ctx* ctx;
+	struct app_payload app;
+
+	ctx = (struct bench_ctx*) arg;
+	app = ctx->app;
+	format_app_encode(&app, ctx->codec);
+	sink += app.message_len;
+}
+
+static void bench_codec_decode(void* arg) {
+	struct bench_ctx* ctx;
+	struct app_payload app;
+
+	ctx = (struct bench_ctx*) arg;
+	app = ctx->encoded;
+	sink += format_app_decode(&app);
+	sink += app.message_len;
+}
+
+static void bench_pick_codec(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	sink += pick_codec(&ctx->app);
+}
+
+static void bench_routing_next_addr(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	sink += routing_next_addr(&ctx->routing, (uint8_t) (ctx->id++ % NODE_COUNT));
+}
+
+// messages of table are ids 0..MESSAGES_LIVE-1 from every origin in turn, all of them are live
+#define MESSAGES_LIVE (MESSAGE_GENERATION_LEN * (MESSAGE_GENERATIONS - 1))
+
+static void bench_messages_hit(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	ctx->id = (uint16_t) ((ctx->id + 1) % MESSAGES_LIVE);
+	sink += get_message((node_addr_t) (ctx->id % NODE_COUNT), ctx->id)->was_message;
+}
+
+// new message takes place of expired one, like every new message does
+static void bench_messages_miss(void* arg) {
+	struct bench_ctx* ctx;
+
+	ctx = (struct bench_ctx*) arg;
+	ctx->id++;
+	sink += get_message((node_addr_t) (ctx->id % NODE_COUNT), ctx->id)->was_message;
+}
+
+static void fill_packet(node_packet_t* packet, size_t size) {
+	memset(packet, 0, sizeof(*packet));
+	packet->sender_addr = 1;
+	packet->receiver_addr = 99;
+	packet->local_sender_addr = 2;
+	packet->time_to_live = TTL;
+	packet->face_addr = NODE_ADDR_NONE;
+	packet->app_payload.req_type = APP_REQUEST_DELIVERY;
+	packet->app_payload.addr_from = 2;
+	packet->app_payload.addr_to = 3;
+	packet->app_payload.checksum = (uint8_t) crc_kind_preferred();
+	packet->app_payload.message_len = (uint8_t) size;
+	fill_message(packet->app_payload.message, size);
+	packet->app_payload.crc = app_crc(&packet->app_payload);
+	packet->crc = packet_crc(packet);
+}
+
+static void fill_payload(struct bench_ctx* ctx, enum request req, size_t size) {
+	memset(ctx->payload, 0, sizeof(ctx->payload));
+
+	switch (req) {
+		case REQUEST_SEND:
+		case REQUEST_ROUTE_DIRECT:
+		case REQUEST_ROUTE_INVERSE:
+		case REQUEST_BROADCAST:
+		case REQUEST_UNICAST:
+			fill_packet((node_packet_t*) ctx->payload, size);
+			break;
+		case REQUEST_UNICAST_CONTEST:
+		case REQUEST_UNICAST_FIRST:
+			{
+				unicast_contest_t* unicast;
+				node_packet_t packet;
+
+				fill_packet(&packet, size);
+				unicast = (unicast_contest_t*) ctx->payload;
+				unicast->req = req;
+				unicast->node_addr = 5;
+				unicast->app_payload = packet.app_payload;
+			}
+			break;
+		case REQUEST_SEND_BATCH:
+			{
+				send_batch_t* batch;
+				node_packet_t packet;
+
+				// as many packets of this size as fit into frame
+				batch = (send_batch_t*) ctx->payload;
+				fill_packet(&packet, size);
+				while (format_batch_add(batch, &packet)) {
+				}
+			}
+			break;
+		case REQUEST_SEND_BATCH_RESULT:
+			((send_batch_result_t*) ctx->payload)->count = SEND_BATCH_MAX;
+			break;
+		case REQUEST_CONTROL:
+		case REQUEST_CONTROL_RESULT:
+			((control_t*) ctx->payload)->req = REQUEST_PING;
+			break;
+		default:
+			ctx->payload[0] = 5;
+			break;
+	}
+}
+
+// requests carrying app message are benchmarked over message sizes, others once
+static bool has_message(enum request req) {
+	switch (req) {
+		case REQUEST_SEND:
+		case REQUEST_ROUTE_DIRECT:
+		case REQUEST_ROUTE_INVERSE:
+		case REQUEST_BROADCAST:
+		case REQUEST_UNICAST:
+		case REQUEST_UNICAST_CONTEST:
+		case REQUEST_UNICAST_FIRST:
+		case REQUEST_SEND_BATCH:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static const char* request_name(enum request req) {
+	static const char* names[] = {
+		"send", "update", "ping", "notify", "route_direct", "route_inverse", "kill_node", "revive_node", "reset",
+		"broadcast", "unicast", "unicast_contest", "unicast_first", "control", "control_result", "session",
+		"session_result", "send_batch", "send_batch_result",
+	};
+
+	return (size_t) req < sizeof(names) / sizeof(names[0]) ? names[req] : "undefined";
+}
+
+static void bench_format(struct bench_ctx* ctx) {
+	char name[64];
+	enum request req;
+	size_t i;
+	size_t count;
+
+	for (req = REQUEST_SEND; req < REQUEST_UNDEFINED; req++) {
+		// session wraps ready frame, it has no payload of its own
+		if (req == REQUEST_SESSION) {
+			continue;
+		}
+
+		count = has_message(req) ? sizeof(sizes) / sizeof(sizes[0]) : 1;
+		for (i = 0; i < count; i++) {
+			ctx->req = req;
+			fill_payload(ctx, req, sizes[i]);
+			format_create(req, ctx->payload, ctx->buf, &ctx->len, REQUEST_SENDER_NODE);
+
+			snprintf(name, sizeof(name), "format_create_%s", request_name(req));
+			bench(name, sizes[i], ctx->len, bench_format_create, ctx);
+			snprintf(name, sizeof(name), "format_parse_%s", request_name(req));
+			bench(name, sizes[i], ctx->len, bench_format_parse, ctx);
+		}
+	}
+}
+
+int32_t main(void) {
+	struct bench_ctx* ctx;
+	size_t i;
+	node_packet_t packet;
+	uint8_t codec;
+	char name[64];
+
+	ctx = calloc(1, sizeof(*ctx));
+
+	printf("name,size,ns_per_op,bytes_per_s,allocs_per_op\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_message(ctx->msg, sizes[i]);
+		ctx->msg_len = (uint8_t) sizes[i];
+		bench("crc16", sizes[i], sizes[i], bench_crc16, ctx);
+		bench("crc32c", sizes[i], sizes[i], bench_crc32c, ctx);
+	}
+
+	bench_format(ctx);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_packet(&packet, sizes[i]);
+		ctx->app = packet.app_payload;
+		format_app_create_message(&ctx->app, ctx->buf);
+		bench("format_app_create_message", sizes[i], format_app_message_len(&ctx->app), bench_format_app_create, ctx);
+		bench("format_app_parse_message", sizes[i], format_app_message_len(&ctx->app), bench_format_app_parse, ctx);
+	}
+
+	// empty messages are never encoded (see node_app_setup_delivery), output that isn't smaller is bypassed,
+	// so decode of such size measures only check of codec
+	node_app_register_codecs();
+	for (i = 1; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		fill_packet(&packet, sizes[i]);
+		ctx->app = packet.app_payload;
+		bench("pick_codec", sizes[i], sizes[i], bench_pick_codec, ctx);
+		for (codec = APP_CODEC_ZLIB; codec < APP_CODEC_COUNT; codec++) {
+			ctx->codec = (enum app_codec) codec;
+			ctx->encoded = ctx->app;
+			format_app_encode(&ctx->encoded, codec);
+			snprintf(name, sizeof(name), "encode_%s", format_app_codec_name(codec));
+			bench(name, sizes[i], sizes[i], bench_codec_encode, ctx);
+			snprintf(name, sizeof(name), "decode_%s", format_app_codec_name(codec));
+			bench(name, sizes[i], sizes[i], bench_codec_decode, ctx);
+		}
+	}
+
+	routing_table_fill_default(&ctx->routing);
+	for (i = 0; i < NODE_COUNT; i++) {
+		routing_set_addr(&ctx->routing, (uint8_t) i, (uint8_t) ((i + 1) % NODE_COUNT), (int8_t) (i % TTL));
+	}
+	bench("routing_next_addr", NODE_COUNT, 0, bench_routing_next_addr, ctx);
+
+	fill_messages_default();
+	for (i = 0; i < MESSAGES_LIVE; i++) {
+		sink += get_message((node_addr_t) (i % NODE_COUNT), (uint16_t) i)->was_message;
+	}
+	ctx->id = 0;
+	bench("messages_lookup_hit", MESSAGES_LIVE, 0, bench_messages_hit, ctx);
+	ctx->id = UINT16_MAX / 2;
+	bench("messages_lookup_miss", MESSAGES_LIVE, 0, bench_messages_miss, ctx);
+
+	free(ctx);
+
+	return (int32_t) (sink & 0);
+}
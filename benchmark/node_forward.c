@@ -0,0 +1,530 @@
+// forwarding ceiling of one node: node request pipeline runs in this process on frames fed through socketpair
+// connections node opens to neighbors and server are socketpairs too (connection_socket_to_send is wrapped), their
+// other ends are drained between polls
+// time of node stages is taken by wrapping functions at link time (see Makefile), only serving_poll is measured
+// heap allocations of node are counted too, after first poll (it opens connections to peers) there should be none
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define TICKS_UNIT "tsc cycles"
+#else
+#define TICKS_UNIT "ns"
+#endif
+
+#include "alloc_count.h"
+#include "crc.h"
+#include "custom_logger.h"
+#include "format.h"
+#include "node_essentials.h"
+#include "node_listener.h"
+#include "routing.h"
+#include "serving.h"
+#include "settings.h"
+
+#define MAX_SINKS 64
+// distinct frames fed in turn, route requests need distinct ids
+#define FRAME_POOL 4096
+
+enum stage {
+	STAGE_RECEIVE,
+	STAGE_PARSE,
+	STAGE_CRC,
+	STAGE_ROUTING,
+	STAGE_SEND,
+	STAGE_FLUSH,
+	STAGE_LOG,
+	STAGE_COUNT
+};
+
+static const char* stage_names[STAGE_COUNT] = { "receive", "parse", "crc", "routing", "send", "flush", "log" };
+
+static uint64_t stage_ticks[STAGE_COUNT];
+// ticks of wrapped calls made inside current wrapped call, they are not counted twice
+static uint64_t inner_ticks;
+
+struct stage_timer {
+	uint64_t start;
+	uint64_t outer_inner;
+};
+
+static int32_t sinks[MAX_SINKS];
+// bytes left of frame that is being drained from sink
+static uint32_t sink_left[MAX_SINKS];
+static size_t sink_count;
+static uint64_t sink_frames;
+
+static int32_t sinks[MAX_SINKS];
+static size_t sink_count;
+
+struct options {
+	uint32_t packets;
+	uint32_t batch;
+	bool route;
+	uint8_t addr;
+};
+
+static struct options opts = {
+	.packets = 200000,
+	.batch = 16,
+	.route = false,
+	.addr = 44,
+};
+
+static uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static void stage_begin(struct stage_timer* t) {
+	t->outer_inner = inner_ticks;
+	inner_ticks = 0;
+	t->start = ticks();
+}
+
+static void stage_end(struct stage_timer* t, enum stage stage) {
+	uint64_t elapsed;
+
+	elapsed = ticks() - t->start;
+	stage_ticks[stage] += elapsed - inner_ticks;
+	inner_ticks = t->outer_inner + elapsed;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+int32_t __real_connection_socket_to_send(uint16_t port);
+int32_t __wrap_connection_socket_to_send(uint16_t port);
+ssize_t __real_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr* msg, int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags);
+bool __real_format_parse(enum request* req, union format_payload* payload, const void* buf, size_t len);
+bool __wrap_format_parse(enum request* req, union format_payload* payload, const void* buf, size_t len);
+uint16_t __real_crc16(const uint8_t* data, size_t length);
+uint16_t __wrap_crc16(const uint8_t* data, size_t length);
+uint16_t __real_crc16_update(uint16_t crc, const uint8_t* data, size_t length);
+uint16_t __wrap_crc16_update(uint16_t crc, const uint8_t* data, size_t length);
+bool __real_format_peek_packet(const uint8_t* buf, size_t len, packet_header_t* header);
+bool __wrap_format_peek_packet(const uint8_t* buf, size_t len, packet_header_t* header);
+node_addr_t __real_routing_next_addr(const routing_table_t* table, node_addr_t dest_addr);
+uint16_t __wrap_crc16_update(uint16_t crc, const uint8_t* data, size_t length) {
+	struct stage_timer t;
+
+	stage_begin(&t);
+	crc = __real_crc16_update(crc, data, length);
+	stage_end(&t, STAGE_CRC);
+
+	return crc;
+}
+
+// transit frame is checked in place instead of being parsed
+bool __wrap_format_peek_packet(const uint8_t* buf, size_t len, packet_header_t* header) {
+	struct stage_timer t;
+	bool res;
+
+	stage_begin(&t);
+	res = __real_format_peek_packet(buf, len, header);
+	stage_end(&t, STAGE_PARSE);
+
+	return res;
+}
+
+node_addr_t __wrap_routing_next_addr(const routing_table_t* table, node_addr_t dest_addr);
+bool __real_node_essentials_create_and_send(uint16_t port, enum request req, const void* payload);
+bool __wrap_node_essentials_create_and_send(uint16_t port, enum request req, const void* payload);
+void __real_node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_broadcast);
+void __wrap_node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_broadcast);
+bool __real_node_essentials_forward(uint16_t port, const uint8_t* buf, msg_len_type len);
+bool __wrap_node_essentials_forward(uint16_t port, const uint8_t* buf, msg_len_type len);
+void __real_node_essentials_broadcast_forward(const uint8_t* buf, msg_len_type len);
+void __wrap_node_essentials_broadcast_forward(const uint8_t* buf, msg_len_type len);
+void __real_log_file_(enum log_type type, int32_t line, const char* file, const char* format, ...);
+__attribute__((format(printf, 4, 5)))
+void __wrap_log_file_(enum log_type type, int32_t line, const char* file, const char* format, ...);
+
+// every peer is a sink
+int32_t __wrap_connection_socket_to_send(uint16_t port) {
+	int32_t fds[2];
+
+	(void) port;
+	if (sink_count == MAX_SINKS || socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+		return -1;
+	}
+	sinks[sink_count++] = fds[1];
+
+	return fds[0];
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags) {
+	struct stage_timer t;
+	ssize_t rv;
+
+	stage_begin(&t);
+	rv = __real_recvmsg(fd, msg, flags);
+	stage_end(&t, STAGE_RECEIVE);
+
+	return rv;
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags) {
+	struct stage_timer t;
+	ssize_t rv;
+
+	stage_begin(&t);
+	rv = __real_sendmsg(fd, msg, flags);
+	stage_end(&t, STAGE_FLUSH);
+
+	return rv;
+}
+
+bool __wrap_format_parse(enum request* req, union format_payload* payload, const void* buf, size_t len) {
+	struct stage_timer t;
+	bool res;
+
+	stage_begin(&t);
+	res = __real_format_parse(req, payload, buf, len);
+	stage_end(&t, STAGE_PARSE);
+
+	return res;
+}
+
+uint16_t __wrap_crc16(const uint8_t* data, size_t length) {
+	struct stage_timer t;
+	uint16_t crc;
+
+	stage_begin(&t);
+	crc = __real_crc16(data, length);
+	stage_end(&t, STAGE_CRC);
+
+	return crc;
+}
+
+node_addr_t __wrap_routing_next_addr(const routing_table_t* table, node_addr_t dest_addr) {
+	struct stage_timer t;
+	node_addr_t addr;
+
+	stage_begin(&t);
+	addr = __real_routing_next_addr(table, dest_addr);
+	stage_end(&t, STAGE_ROUTING);
+
+	return addr;
+}
+
+bool __wrap_node_essentials_create_and_send(uint16_t port, enum request req, const void* payload) {
+	struct stage_timer t;
+	bool res;
+
+	stage_begin(&t);
+	res = __real_node_essentials_create_and_send(port, req, payload);
+	stage_end(&t, STAGE_SEND);
+
+	return res;
+}
+
+// flood sends to neighbors from inside node_essentials, so it is timed as whole
+void __wrap_node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_broadcast) {
+	struct stage_timer t;
+
+	stage_begin(&t);
+	__real_node_essentials_broadcast_route(route_payload, stop_broadcast);
+	stage_end(&t, STAGE_SEND);
+}
+
+bool __wrap_node_essentials_forward(uint16_t port, const uint8_t* buf, msg_len_type len) {
+	struct stage_timer t;
+	bool res;
+
+	stage_begin(&t);
+	res = __real_node_essentials_forward(port, buf, len);
+	stage_end(&t, STAGE_SEND);
+
+	return res;
+}
+
+void __wrap_node_essentials_broadcast_forward(const uint8_t* buf, msg_len_type len) {
+	struct stage_timer t;
+
+	stage_begin(&t);
+	__real_node_essentials_broadcast_forward(buf, len);
+	stage_end(&t, STAGE_SEND);
+}
+
+// message is formatted here, so real logger gets it as one argument
+void __wrap_log_file_(enum log_type type, int32_t line, const char* file, const char* format, ...) {
+	struct stage_timer t;
+	va_list args;
+	char buf[1024];
+
+	stage_begin(&t);
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	__real_log_file_(type, line, file, "%s", buf);
+	stage_end(&t, STAGE_LOG);
+}
+
+static bool handle_request(int32_t conn_fd, uint8_t* buf, size_t len, void* data) {
+	node_server_t* server;
+
+	server = (node_server_t*) data;
+	node_listener_handle_request(server, conn_fd, buf, (ssize_t) len, server);
+
+	return true;
+}
+
+// counts frames node sent, frame can be split between reads
+static void drain_sinks(void) {
+	uint8_t buf[65536];
+	ssize_t n;
+	size_t pos;
+	size_t take;
+	size_t i;
+
+	for (i = 0; i < sink_count; i++) {
+		while ((n = recv(sinks[i], buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+			pos = 0;
+			while (pos < (size_t) n) {
+				if (sink_left[i] == 0) {
+					sink_left[i] = buf[pos];
+				}
+				take = (size_t) n - pos < sink_left[i] ? (size_t) n - pos : sink_left[i];
+				pos += take;
+				sink_left[i] -= (uint32_t) take;
+				if (sink_left[i] == 0) {
+					sink_frames++;
+				}
+			}
+		}
+	}
+}
+
+// next hops are grid neighbors of node, so packets spread over several links
+static void fill_routing(node_server_t* server) {
+	uint8_t neighbors[4];
+	size_t neighbor_num;
+	size_t i;
+	int32_t x;
+	int32_t y;
+
+	x = server->addr % MATRIX_SIZE;
+	y = server->addr / MATRIX_SIZE;
+	neighbor_num = 0;
+	if (x > 0) {
+		neighbors[neighbor_num++] = (uint8_t) (server->addr - 1);
+	}
+	if (x < MATRIX_SIZE - 1) {
+		neighbors[neighbor_num++] = (uint8_t) (server->addr + 1);
+	}
+	if (y > 0) {
+		neighbors[neighbor_num++] = (uint8_t) (server->addr - MATRIX_SIZE);
+	}
+	if (y < MATRIX_SIZE - 1) {
+		neighbors[neighbor_num++] = (uint8_t) (server->addr + MATRIX_SIZE);
+	}
+
+	routing_table_fill_default(&server->routing);
+	for (i = 0; i < NODE_COUNT; i++) {
+		if (i != server->addr) {
+			routing_set_addr(&server->routing, (uint8_t) i, neighbors[i % neighbor_num], 1);
+		}
+	}
+}
+
+// frames of node pool are laid out one after another
+static uint8_t* make_frames(size_t* total_len, size_t* offsets) {
+	uint8_t* frames;
+	node_packet_t packet;
+	msg_len_type len;
+	size_t i;
+
+	frames = malloc((size_t) FRAME_POOL * MAX_MSG_LEN);
+	*total_len = 0;
+	for (i = 0; i < FRAME_POOL; i++) {
+		memset(&packet, 0, sizeof(packet));
+		packet.sender_addr = (uint8_t) ((opts.addr + 1 + i) % NODE_COUNT);
+		do {
+			packet.receiver_addr = (uint8_t) (rand() % NODE_COUNT);
+		} while (packet.receiver_addr == opts.addr);
+		packet.local_sender_addr = (uint8_t) (opts.addr + 1);
+		packet.time_to_live = TTL - 1;
+		packet.face_addr = NODE_ADDR_NONE;
+		packet.app_payload.req_type = APP_REQUEST_DELIVERY;
+		packet.app_payload.addr_from = 2;
+		packet.app_payload.addr_to = 3;
+		packet.app_payload.id = (uint16_t) i;
+		packet.app_payload.checksum = (uint8_t) crc_kind_preferred();
+		packet.app_payload.message_len = 100;
+		memset(packet.app_payload.message, 'x', packet.app_payload.message_len);
+		packet.app_payload.crc = app_crc(&packet.app_payload);
+		packet.crc = packet_crc(&packet);
+
+		offsets[i] = *total_len;
+		format_create(opts.route ? REQUEST_ROUTE_DIRECT : REQUEST_SEND, &packet, frames + *total_len, &len, REQUEST_SENDER_NODE);
+		*total_len += len;
+	}
+	offsets[FRAME_POOL] = *total_len;
+
+	return frames;
+}
+
+static bool parse_args(int32_t argc, char** argv) {
+	int32_t opt;
+
+	while ((opt = getopt(argc, argv, "n:b:a:m:h")) != -1) {
+		switch (opt) {
+			case 'n':
+				opts.packets = (uint32_t) atoi(optarg);
+				break;
+			case 'b':
+				opts.batch = (uint32_t) atoi(optarg);
+				break;
+			case 'a':
+				opts.addr = (uint8_t) atoi(optarg);
+				break;
+			case 'm':
+				if (0 == strcmp(optarg, "route")) {
+					opts.route = true;
+				} else if (0 != strcmp(optarg, "send")) {
+					return false;
+				}
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return opts.packets > 0 && opts.batch > 0 && opts.batch < SERVING_TX_DEPTH && opts.addr < NODE_COUNT;
+}
+
+int32_t main(int32_t argc, char** argv) {
+	static node_server_t server;
+	struct serving_data serving;
+	int32_t idle[2];
+	int32_t feed[2];
+	uint8_t* frames;
+	size_t offsets[FRAME_POOL + 1];
+	size_t total_len;
+	size_t next;
+	size_t from;
+	uint32_t fed;
+	uint32_t n;
+	uint64_t start;
+	uint64_t poll_ticks;
+	uint64_t poll_ns;
+	uint64_t first_allocs;
+	uint32_t first_fed;
+	uint64_t allocs;
+	uint64_t stages;
+	size_t i;
+
+	if (!parse_args(argc, argv)) {
+		fprintf(stderr, "Usage: %s [-n packets] [-b frames per poll] [-a node addr] [-m send|route]\n", argv[0]);
+		return 1;
+	}
+
+	srand(1);
+	server.addr = opts.addr;
+	fill_routing(&server);
+	node_app_fill_default(server.apps, server.addr);
+	node_essentials_fill_neighbors_port(server.addr);
+
+	// serving needs listener, nobody connects to it
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, idle) < 0 || socketpair(AF_UNIX, SOCK_STREAM, 0, feed) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	serving_init(&serving, idle[0], handle_request);
+	if (!node_essentials_init_connections(&serving)) {
+		fprintf(stderr, "Failed to init connections\n");
+		return 1;
+	}
+	if (!serving_add_conn(&serving, feed[0], NULL, NULL)) {
+		fprintf(stderr, "Failed to add feed connection\n");
+		return 1;
+	}
+
+	frames = make_frames(&total_len, offsets);
+	// crc of prepared frames isn't node work
+	memset(stage_ticks, 0, sizeof(stage_ticks));
+
+	poll_ticks = 0;
+	poll_ns = 0;
+	first_allocs = 0;
+	first_fed = 0;
+	allocs = alloc_count();
+	next = 0;
+	fed = 0;
+	while (fed < opts.packets) {
+		n = opts.batch;
+		if (n > opts.packets - fed) {
+			n = opts.packets - fed;
+		}
+		if (next + n > FRAME_POOL) {
+			next = 0;
+		}
+		from = offsets[next];
+		if (write(feed[1], frames + from, offsets[next + n] - from) != (ssize_t) (offsets[next + n] - from)) {
+			perror("write");
+			return 1;
+		}
+		next += n;
+		fed += n;
+
+		start = now_ns();
+		poll_ticks -= ticks();
+		serving_poll(&serving, &server);
+		poll_ticks += ticks();
+		poll_ns += now_ns() - start;
+
+		drain_sinks();
+
+		if (first_fed == 0) {
+			first_fed = fed;
+			first_allocs = alloc_count() - allocs;
+			allocs = alloc_count();
+		}
+	}
+	allocs = alloc_count() - allocs;
+
+	printf("node %d, %s requests, %u packets, %u per poll\n", opts.addr, opts.route ? "route direct" : "send", opts.packets, opts.batch);
+	printf("forwarded %.0f packets/s, %" PRIu64 " frames sent to peers\n", (double) opts.packets / ((double) poll_ns / 1e9), sink_frames);
+	printf("%.0f %s per packet (%.0f ns)\n", (double) poll_ticks / opts.packets, TICKS_UNIT, (double) poll_ns / opts.packets);
+	printf("%" PRIu64 " heap allocations in first poll, %" PRIu64 " in the rest (%.3f per packet)\n", first_allocs, allocs,
+		opts.packets > first_fed ? (double) allocs / (double) (opts.packets - first_fed) : 0.0);
+
+	stages = 0;
+	for (i = 0; i < STAGE_COUNT; i++) {
+		printf("  %-8s %8.0f %s per packet (%4.1f%%)\n", stage_names[i], (double) stage_ticks[i] / opts.packets, TICKS_UNIT,
+			100.0 * (double) stage_ticks[i] / (double) poll_ticks);
+		stages += stage_ticks[i];
+	}
+	printf("  %-8s %8.0f %s per packet (%4.1f%%)\n", "other", (double) (poll_ticks - stages) / opts.packets, TICKS_UNIT,
+		100.0 * (double) (poll_ticks - stages) / (double) poll_ticks);
+
+	free(frames);
+	node_essentials_free_connections();
+	serving_free(&serving);
+
+	return 0;
+}
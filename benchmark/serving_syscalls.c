@@ -0,0 +1,273 @@
+// counts syscalls made by serving loop per forwarded frame
+// serving forwards frames from producer connection to sink connection like a node forwards packets,
+// its syscalls are counted by wrapping them at link time (see Makefile)
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serving.h"
+
+#ifdef SERVING_EPOLL
+#include <sys/epoll.h>
+#endif
+#include <poll.h>
+
+#define FRAMES 200000
+#define FRAME_LEN 100
+
+struct bench {
+	struct serving_data serving;
+	struct serving_conn* out;
+	uint32_t forwarded;
+	// frames producer may send ahead of sink
+	uint32_t window;
+	_Atomic uint32_t received;
+	int32_t producer_fd;
+	int32_t sink_fd;
+};
+
+// only serving thread is counted
+static _Thread_local bool counting = false;
+static uint64_t syscalls = 0;
+
+int __real_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+int __wrap_poll(struct pollfd* fds, nfds_t nfds, int timeout);
+#ifdef SERVING_EPOLL
+int __real_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
+int __wrap_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout);
+#endif
+int __real_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+int __wrap_accept(int fd, struct sockaddr* addr, socklen_t* addrlen);
+ssize_t __real_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags);
+ssize_t __real_sendmsg(int fd, const struct msghdr* msg, int flags);
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags);
+long __real_syscall(long number, ...);
+long __wrap_syscall(long number, ...);
+
+int __wrap_poll(struct pollfd* fds, nfds_t nfds, int timeout) {
+	syscalls += counting;
+	return __real_poll(fds, nfds, timeout);
+}
+
+#ifdef SERVING_EPOLL
+int __wrap_epoll_wait(int epfd, struct epoll_event* events, int maxevents, int timeout) {
+	syscalls += counting;
+	return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+#endif
+
+int __wrap_accept(int fd, struct sockaddr* addr, socklen_t* addrlen) {
+	syscalls += counting;
+	return __real_accept(fd, addr, addrlen);
+}
+
+ssize_t __wrap_recvmsg(int fd, struct msghdr* msg, int flags) {
+	syscalls += counting;
+	return __real_recvmsg(fd, msg, flags);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr* msg, int flags) {
+	syscalls += counting;
+	return __real_sendmsg(fd, msg, flags);
+}
+
+// io_uring is entered through syscall(2), it takes at most 6 arguments
+long __wrap_syscall(long number, ...) {
+	va_list ap;
+	long args[6];
+	size_t i;
+
+	va_start(ap, number);
+	for (i = 0; i < 6; i++) {
+		args[i] = va_arg(ap, long);
+	}
+	va_end(ap);
+
+	syscalls += counting;
+	return __real_syscall(number, args[0], args[1], args[2], args[3], args[4], args[5]);
+}
+
+static bool handle_request(int32_t sender_fd, uint8_t* buf, size_t len, void* data) {
+	struct bench* bench;
+	uint8_t frame[MAX_MSG_LEN];
+
+	(void) sender_fd;
+	bench = data;
+
+	frame[0] = (uint8_t) (len + 1);
+	memcpy(frame + 1, buf, len);
+	if (!serving_send(&bench->serving, bench->out, frame, (msg_len_type) (len + 1))) {
+		fprintf(stderr, "Failed to forward frame\n");
+		exit(1);
+	}
+	bench->forwarded++;
+
+	return true;
+}
+
+static void* produce(void* arg) {
+	struct bench* bench;
+	uint8_t frame[FRAME_LEN];
+	uint32_t i;
+
+	bench = arg;
+	memset(frame, 'x', sizeof(frame));
+	frame[0] = FRAME_LEN;
+
+	for (i = 0; i < FRAMES; i++) {
+		while (i - atomic_load(&bench->received) >= bench->window) {
+			sched_yield();
+		}
+		if (write(bench->producer_fd, frame, sizeof(frame)) != sizeof(frame)) {
+			perror("write");
+			exit(1);
+		}
+	}
+
+	return NULL;
+}
+
+static void* sink(void* arg) {
+	struct bench* bench;
+	uint8_t buf[FRAME_LEN * 64];
+	uint64_t total;
+	ssize_t rv;
+
+	bench = arg;
+	total = 0;
+	while (total < (uint64_t) FRAMES * FRAME_LEN) {
+		rv = read(bench->sink_fd, buf, sizeof(buf));
+		if (rv <= 0) {
+			perror("read");
+			exit(1);
+		}
+		total += (uint64_t) rv;
+		atomic_store(&bench->received, (uint32_t) (total / FRAME_LEN));
+	}
+
+	// wakes serving up with EOF
+	shutdown(bench->sink_fd, SHUT_RDWR);
+
+	return NULL;
+}
+
+static int32_t listen_any(uint16_t* port) {
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	int32_t fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addrlen = sizeof(addr);
+	if (fd < 0 || bind(fd, (struct sockaddr*) &addr, addrlen) < 0 || listen(fd, 4) < 0
+		|| getsockname(fd, (struct sockaddr*) &addr, &addrlen) < 0) {
+		perror("listen");
+		exit(1);
+	}
+	*port = ntohs(addr.sin_port);
+
+	return fd;
+}
+
+static int32_t connect_to(uint16_t port) {
+	struct sockaddr_in addr;
+	int32_t fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (fd < 0 || connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		perror("connect");
+		exit(1);
+	}
+
+	return fd;
+}
+
+static const char* backend_name(const struct serving_data* serving) {
+#ifdef SERVING_URING
+	return serving->uring ? "io_uring" : "io_uring (fallback to epoll)";
+#elif defined SERVING_EPOLL
+	(void) serving;
+	return "epoll";
+#else
+	(void) serving;
+	return "poll";
+#endif
+}
+
+static void run(uint32_t window) {
+	struct bench bench;
+	pthread_t producer;
+	pthread_t consumer;
+	struct timespec start;
+	struct timespec end;
+	uint16_t serving_port;
+	uint16_t sink_port;
+	int32_t serving_fd;
+	int32_t sink_listen_fd;
+	double elapsed;
+
+	bench.forwarded = 0;
+	bench.window = window;
+	atomic_store(&bench.received, 0);
+
+	serving_fd = listen_any(&serving_port);
+	sink_listen_fd = listen_any(&sink_port);
+
+	serving_init(&bench.serving, serving_fd, handle_request);
+	bench.out = serving_add_conn(&bench.serving, connect_to(sink_port), NULL, NULL);
+	bench.sink_fd = accept(sink_listen_fd, NULL, NULL);
+	bench.producer_fd = connect_to(serving_port);
+	if (!bench.out || bench.sink_fd < 0) {
+		fprintf(stderr, "Failed to set up connections\n");
+		exit(1);
+	}
+
+	syscalls = 0;
+	counting = true;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_create(&producer, NULL, produce, &bench);
+	pthread_create(&consumer, NULL, sink, &bench);
+
+	while (atomic_load(&bench.received) < FRAMES) {
+		serving_poll(&bench.serving, &bench);
+	}
+
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	counting = false;
+
+	elapsed = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%-28s window %-3u %6.3f syscalls per forwarded frame, %8.0f frames/s\n",
+		backend_name(&bench.serving), window, (double) syscalls / FRAMES, FRAMES / elapsed);
+
+	serving_free(&bench.serving);
+	close(bench.producer_fd);
+	close(bench.sink_fd);
+	close(sink_listen_fd);
+}
+
+int main(void) {
+	// one frame in flight shows per packet cost, wider window shows batching
+	run(1);
+	run(16);
+
+	return 0;
+}
@@ -1,9 +1,12 @@
+#include <poll.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "connection.h"
@@ -17,6 +20,16 @@
 __attribute__((warn_unused_result))
 static bool parse_args(int32_t argc, char** argv, enum request* cmd, void** payload);
 
+// reads requests from stdin (one per line, same syntax as arguments) and pipelines them over one connection
+// results are printed as they come: "<seq> <result>", seq counts requests from 0 in input order
+__attribute__((warn_unused_result))
+static int32_t run_session(void);
+
+// reads sends from file (one per line, same syntax as arguments), packs them into REQUEST_SEND_BATCH frames and pipelines them
+// results are printed when batch is answered: "<n> <result>", n counts sends from 0 in file order
+__attribute__((nonnull(1), warn_unused_result))
+static int32_t run_batch(const char* path);
+
 int32_t main(int32_t argc, char** argv) {
 	int32_t server_fd;
 	enum request req;
@@ -27,6 +40,14 @@ int32_t main(int32_t argc, char** argv) {
 	enum request_result status;
 	struct timeval tv;
 
+	if (argc == 2 && 0 == strcmp(argv[1], "session")) {
+		return run_session();
+	}
+
+	if (argc == 3 && 0 == strcmp(argv[1], "batch")) {
+		return run_batch(argv[2]);
+	}
+
 	payload = NULL;
 	if (!parse_args(argc, argv, &req, &payload)) {
 		custom_log_error("Failed to parse client args");
@@ -206,6 +227,8 @@ static bool parse_send_cmd(int32_t argc, char** argv, enum request* cmd, void**
 		send_payload->app_payload.message_len = 0;
 	}
 	send_payload->app_payload.req_type = APP_REQUEST_DELIVERY;
+	send_payload->app_payload.codec = APP_CODEC_NONE;
+	send_payload->app_payload.checksum = (uint8_t) crc_kind_preferred();
 	send_payload->crc = packet_crc(send_payload);
 	return true;
 }
@@ -259,8 +282,562 @@ static bool parse_broadcast_cmd(int32_t argc, char** argv, void** payload, enum
 	}
 
 	broadcast_payload->app_payload.req_type = app_req;
+	broadcast_payload->app_payload.codec = APP_CODEC_NONE;
+	broadcast_payload->app_payload.checksum = (uint8_t) crc_kind_preferred();
 	broadcast_payload->time_to_live = BROADCAST_RADIUS;
 	broadcast_payload->app_payload.crc = crc16(broadcast_payload->app_payload.message, broadcast_payload->app_payload.message_len);
 
 	return true;
 }
+
+// requests sent but not answered yet
+#define SESSION_WINDOW 64
+#define SESSION_TIMEOUT_MS 2000
+#define SESSION_MAX_ARGS 32
+#define SESSION_LINE_LEN 512
+
+struct session {
+	int32_t fd;
+	struct {
+		bool used;
+		uint16_t seq;
+		uint64_t deadline_ms;
+	} inflight[SESSION_WINDOW];
+	size_t outstanding;
+	uint16_t seq;
+	int32_t failed;
+	char line[SESSION_LINE_LEN];
+	size_t line_len;
+	bool input_done;
+	uint8_t rx[MAX_MSG_LEN * 4];
+	size_t rx_len;
+};
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+// splits line into arguments in place, quotes group words into one argument
+static int32_t split_line(char* line, char** argv) {
+	static char name[] = "session";
+	int32_t argc;
+	char* p;
+	char quote;
+
+	argc = 0;
+	argv[argc++] = name;
+	p = line;
+	while (*p) {
+		while (*p == ' ' || *p == '\t') {
+			p++;
+		}
+		if (*p == '\0') {
+			break;
+		}
+		if (argc == SESSION_MAX_ARGS - 1) {
+			return -1;
+		}
+
+		if (*p == '\'' || *p == '"') {
+			quote = *p++;
+			argv[argc++] = p;
+			while (*p && *p != quote) {
+				p++;
+			}
+		} else {
+			argv[argc++] = p;
+			while (*p && *p != ' ' && *p != '\t') {
+				p++;
+			}
+		}
+
+		if (*p) {
+			*p++ = '\0';
+		}
+	}
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+static void session_print(uint16_t seq, enum request_result res) {
+	char buf[32];
+
+	format_sprint_result(res, buf, sizeof(buf));
+	printf("%d %s\n", seq, buf);
+}
+
+static void session_send(struct session* session, char* line) {
+	char* argv[SESSION_MAX_ARGS];
+	int32_t argc;
+	enum request req;
+	void* payload;
+	uint8_t frame[MAX_MSG_LEN];
+	uint8_t buf[MAX_MSG_LEN];
+	msg_len_type frame_len;
+	msg_len_type buf_len;
+	size_t i;
+
+	argc = split_line(line, argv);
+	if (argc == 1) {
+		return;
+	}
+
+	req = REQUEST_UNDEFINED;
+	payload = NULL;
+	if (argc < 0 || !parse_args(argc, argv, &req, &payload) || req == REQUEST_UNDEFINED) {
+		custom_log_error("Failed to parse session request: %s", line);
+		session->failed++;
+		free(payload);
+		return;
+	}
+
+	format_create(req, payload, frame, &frame_len, REQUEST_SENDER_CLIENT);
+	free(payload);
+
+	if (!format_create_session(session->seq, frame, buf, &buf_len) || !io_write_all(session->fd, buf, buf_len)) {
+		custom_log_error("Failed to send session request %d", session->seq);
+		session_print(session->seq++, REQUEST_UNKNOWN);
+		session->failed++;
+		return;
+	}
+
+	for (i = 0; i < SESSION_WINDOW; i++) {
+		if (!session->inflight[i].used) {
+			session->inflight[i].used = true;
+			session->inflight[i].seq = session->seq;
+			session->inflight[i].deadline_ms = now_ms() + SESSION_TIMEOUT_MS;
+			break;
+		}
+	}
+	session->seq++;
+	session->outstanding++;
+}
+
+// sends complete lines from input buffer while window has room
+static void session_send_lines(struct session* session) {
+	char* end;
+	size_t len;
+
+	while (session->outstanding < SESSION_WINDOW) {
+		end = memchr(session->line, '\n', session->line_len);
+		if (end == NULL) {
+			if (session->input_done && session->line_len > 0) {
+				// last line without newline
+				end = session->line + session->line_len;
+			} else if (session->line_len == sizeof(session->line)) {
+				custom_log_error("Session request is too long");
+				session->failed++;
+				session->line_len = 0;
+				continue;
+			} else {
+				return;
+			}
+		}
+
+		len = (size_t) (end - session->line);
+		if (end < session->line + session->line_len) {
+			*end = '\0';
+			session_send(session, session->line);
+			len++;
+		} else {
+			char last[SESSION_LINE_LEN + 1];
+
+			memcpy(last, session->line, len);
+			last[len] = '\0';
+			session_send(session, last);
+		}
+
+		memmove(session->line, session->line + len, session->line_len - len);
+		session->line_len -= len;
+	}
+}
+
+static void session_complete(struct session* session, uint16_t seq, enum request_result res) {
+	size_t i;
+
+	for (i = 0; i < SESSION_WINDOW; i++) {
+		if (session->inflight[i].used && session->inflight[i].seq == seq) {
+			session->inflight[i].used = false;
+			session->outstanding--;
+			session_print(seq, res);
+			if (res != REQUEST_OK) {
+				session->failed++;
+			}
+			return;
+		}
+	}
+
+	custom_log_warn("Result of unknown session request %d (probably timed out)", seq);
+}
+
+// returns false if server closed connection
+static bool session_receive(struct session* session) {
+	ssize_t n;
+	msg_len_type len;
+	enum request req;
+	union format_payload payload;
+
+	n = recv(session->fd, session->rx + session->rx_len, sizeof(session->rx) - session->rx_len, 0);
+	if (n <= 0) {
+		return false;
+	}
+	session->rx_len += (size_t) n;
+
+	while (session->rx_len > 0 && session->rx_len >= session->rx[0]) {
+		len = session->rx[0];
+		if (len <= MSG_BASE_LEN) {
+			custom_log_error("Broken frame from server");
+			return false;
+		}
+
+		if (format_define_request(session->rx + 1) == REQUEST_SESSION_RESULT) {
+			if (!format_parse(&req, &payload, session->rx + 1, len - 1u)) {
+				custom_log_error("Broken frame from server");
+				return false;
+			}
+			session_complete(session, payload.session_result.seq, payload.session_result.res);
+		}
+
+		memmove(session->rx, session->rx + len, session->rx_len - len);
+		session->rx_len -= len;
+	}
+
+	return true;
+}
+
+// requests without result in time are counted as unknown
+static int32_t session_expire(struct session* session) {
+	uint64_t now;
+	uint64_t earliest;
+	size_t i;
+
+	now = now_ms();
+	earliest = UINT64_MAX;
+	for (i = 0; i < SESSION_WINDOW; i++) {
+		if (!session->inflight[i].used) {
+			continue;
+		}
+		if (session->inflight[i].deadline_ms <= now) {
+			session->inflight[i].used = false;
+			session->outstanding--;
+			session->failed++;
+			session_print(session->inflight[i].seq, REQUEST_UNKNOWN);
+		} else if (session->inflight[i].deadline_ms < earliest) {
+			earliest = session->inflight[i].deadline_ms;
+		}
+	}
+
+	return earliest == UINT64_MAX ? -1 : (int32_t) (earliest - now);
+}
+
+static int32_t run_session(void) {
+	struct session* session;
+	struct pollfd pfds[2];
+	ssize_t n;
+	int32_t timeout;
+	int32_t failed;
+
+	session = calloc(1, sizeof(*session));
+	session->fd = connection_socket_to_send(SERVER_PORT);
+	if (session->fd < 0) {
+		die("Failed to get socket");
+	}
+
+	for (;;) {
+		session_send_lines(session);
+		timeout = session_expire(session);
+
+		if (session->input_done && session->line_len == 0 && session->outstanding == 0) {
+			break;
+		}
+
+		// input is read only when window has room and buffer has no complete line
+		pfds[0].fd = !session->input_done && session->outstanding < SESSION_WINDOW ? STDIN_FILENO : -1;
+		pfds[0].events = POLLIN;
+		pfds[1].fd = session->fd;
+		pfds[1].events = POLLIN;
+		if (poll(pfds, 2, timeout) < 0) {
+			perror("poll");
+			break;
+		}
+
+		if ((pfds[1].revents & (POLLIN | POLLHUP | POLLERR)) && !session_receive(session)) {
+			custom_log_error("Server closed session");
+			break;
+		}
+
+		if (pfds[0].revents & (POLLIN | POLLHUP)) {
+			n = read(STDIN_FILENO, session->line + session->line_len, sizeof(session->line) - session->line_len);
+			if (n <= 0) {
+				session->input_done = true;
+			} else {
+				session->line_len += (size_t) n;
+			}
+		}
+	}
+
+	failed = session->failed + (int32_t) session->outstanding;
+	close(session->fd);
+	free(session);
+
+	return failed > 0 ? 1 : 0;
+}
+
+// batches sent but not answered yet
+#define BATCH_WINDOW 8
+// server answers unfinished batch itself after its timeout
+#define BATCH_TIMEOUT_MS 3000
+
+struct batch_run {
+	int32_t fd;
+	node_packet_t* packets;
+	size_t count;
+	size_t next;
+	struct {
+		bool used;
+		uint16_t tag;
+		size_t first;
+		uint8_t count;
+		uint64_t deadline_ms;
+	} inflight[BATCH_WINDOW];
+	size_t outstanding;
+	uint16_t tag;
+	int32_t failed;
+	uint8_t rx[MAX_MSG_LEN * 4];
+	size_t rx_len;
+};
+
+__attribute__((nonnull(1, 2), warn_unused_result))
+static bool batch_read(struct batch_run* run, const char* path) {
+	FILE* f;
+	char line[SESSION_LINE_LEN];
+	char* argv[SESSION_MAX_ARGS];
+	int32_t argc;
+	enum request req;
+	void* payload;
+	size_t cap;
+
+	f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+	if (f == NULL) {
+		perror("fopen");
+		return false;
+	}
+
+	cap = 0;
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+		argc = split_line(line, argv);
+		if (argc == 1) {
+			continue;
+		}
+
+		req = REQUEST_UNDEFINED;
+		payload = NULL;
+		if (argc < 0 || !parse_args(argc, argv, &req, &payload) || req != REQUEST_SEND) {
+			custom_log_error("Batch accepts only sends: %s", line);
+			run->failed++;
+			free(payload);
+			continue;
+		}
+
+		if (run->count == cap) {
+			cap = cap ? cap * 2 : 64;
+			run->packets = realloc(run->packets, cap * sizeof(node_packet_t));
+		}
+		run->packets[run->count++] = *((node_packet_t*) payload);
+		free(payload);
+	}
+
+	if (f != stdin) {
+		fclose(f);
+	}
+
+	return true;
+}
+
+static void batch_send(struct batch_run* run) {
+	send_batch_t* batch;
+	uint8_t buf[MAX_MSG_LEN];
+	msg_len_type buf_len;
+	size_t first;
+	size_t i;
+	uint8_t j;
+
+	batch = malloc(sizeof(send_batch_t));
+	while (run->outstanding < BATCH_WINDOW && run->next < run->count) {
+		first = run->next;
+		batch->tag = run->tag;
+		batch->count = 0;
+		while (run->next < run->count && format_batch_add(batch, &run->packets[run->next])) {
+			run->next++;
+		}
+		if (batch->count == 0) {
+			custom_log_error("Send %zu doesn't fit into frame", run->next);
+			session_print((uint16_t) run->next++, REQUEST_ERR);
+			run->failed++;
+			continue;
+		}
+
+		format_create(REQUEST_SEND_BATCH, batch, buf, &buf_len, REQUEST_SENDER_CLIENT);
+		if (!io_write_all(run->fd, buf, buf_len)) {
+			custom_log_error("Failed to send batch %d", run->tag);
+			for (j = 0; j < batch->count; j++) {
+				session_print((uint16_t) (first + j), REQUEST_UNKNOWN);
+			}
+			run->failed += batch->count;
+			run->tag++;
+			continue;
+		}
+
+		for (i = 0; i < BATCH_WINDOW; i++) {
+			if (!run->inflight[i].used) {
+				run->inflight[i].used = true;
+				run->inflight[i].tag = run->tag;
+				run->inflight[i].first = first;
+				run->inflight[i].count = batch->count;
+				run->inflight[i].deadline_ms = now_ms() + BATCH_TIMEOUT_MS;
+				break;
+			}
+		}
+		run->tag++;
+		run->outstanding++;
+	}
+	free(batch);
+}
+
+static void batch_complete(struct batch_run* run, const send_batch_result_t* result) {
+	size_t i;
+	uint8_t j;
+
+	for (i = 0; i < BATCH_WINDOW; i++) {
+		if (run->inflight[i].used && run->inflight[i].tag == result->tag) {
+			run->inflight[i].used = false;
+			run->outstanding--;
+			for (j = 0; j < run->inflight[i].count; j++) {
+				enum request_result res;
+
+				res = j < result->count ? result->res[j] : REQUEST_UNKNOWN;
+				session_print((uint16_t) (run->inflight[i].first + j), res);
+				if (res != REQUEST_OK) {
+					run->failed++;
+				}
+			}
+			return;
+		}
+	}
+
+	custom_log_warn("Result of unknown batch %d (probably timed out)", result->tag);
+}
+
+// returns false if server closed connection
+static bool batch_receive(struct batch_run* run) {
+	ssize_t n;
+	msg_len_type len;
+	enum request req;
+	union format_payload payload;
+
+	n = recv(run->fd, run->rx + run->rx_len, sizeof(run->rx) - run->rx_len, 0);
+	if (n <= 0) {
+		return false;
+	}
+	run->rx_len += (size_t) n;
+
+	while (run->rx_len > 0 && run->rx_len >= run->rx[0]) {
+		len = run->rx[0];
+		if (len <= MSG_BASE_LEN) {
+			custom_log_error("Broken frame from server");
+			return false;
+		}
+
+		if (format_define_request(run->rx + 1) == REQUEST_SEND_BATCH_RESULT) {
+			if (!format_parse(&req, &payload, run->rx + 1, len - 1u)) {
+				custom_log_error("Broken frame from server");
+				return false;
+			}
+			batch_complete(run, &payload.batch_result);
+		}
+
+		memmove(run->rx, run->rx + len, run->rx_len - len);
+		run->rx_len -= len;
+	}
+
+	return true;
+}
+
+static int32_t batch_expire(struct batch_run* run) {
+	uint64_t now;
+	uint64_t earliest;
+	size_t i;
+	uint8_t j;
+
+	now = now_ms();
+	earliest = UINT64_MAX;
+	for (i = 0; i < BATCH_WINDOW; i++) {
+		if (!run->inflight[i].used) {
+			continue;
+		}
+		if (run->inflight[i].deadline_ms <= now) {
+			run->inflight[i].used = false;
+			run->outstanding--;
+			for (j = 0; j < run->inflight[i].count; j++) {
+				session_print((uint16_t) (run->inflight[i].first + j), REQUEST_UNKNOWN);
+			}
+			run->failed += run->inflight[i].count;
+		} else if (run->inflight[i].deadline_ms < earliest) {
+			earliest = run->inflight[i].deadline_ms;
+		}
+	}
+
+	return earliest == UINT64_MAX ? -1 : (int32_t) (earliest - now);
+}
+
+static int32_t run_batch(const char* path) {
+	struct batch_run* run;
+	struct pollfd pfd;
+	int32_t timeout;
+	int32_t failed;
+
+	run = calloc(1, sizeof(*run));
+	if (!batch_read(run, path)) {
+		free(run);
+		return 1;
+	}
+
+	run->fd = connection_socket_to_send(SERVER_PORT);
+	if (run->fd < 0) {
+		die("Failed to get socket");
+	}
+
+	for (;;) {
+		batch_send(run);
+		timeout = batch_expire(run);
+
+		if (run->next == run->count && run->outstanding == 0) {
+			break;
+		}
+
+		pfd.fd = run->fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) < 0) {
+			perror("poll");
+			break;
+		}
+
+		if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !batch_receive(run)) {
+			custom_log_error("Server closed connection");
+			break;
+		}
+	}
+
+	failed = run->failed + (int32_t) run->outstanding;
+	close(run->fd);
+	free(run->packets);
+	free(run);
+
+	return failed > 0 ? 1 : 0;
+}
@@ -7,3 +7,8 @@ int32_t connection_socket_to_send(uint16_t port);
 
 __attribute__((warn_unused_result))
 int32_t connection_socket_to_listen(uint16_t port);
+
+// another listener on port that is already listened, kernel spreads incoming connections between them
+// returns -1 when transport can't share port (unix sockets)
+__attribute__((warn_unused_result))
+int32_t connection_socket_to_listen_shared(uint16_t port);
@@ -3,4 +3,32 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#define CRC16_INIT 0xFFFF
+
+#define CRC32C_INIT 0xFFFFFFFF
+
+// checksum of crc fields of packet, sender writes it next to them (see struct app_payload)
+enum crc_kind {
+	CRC_KIND_CRC16,
+	// crc32c folded into 16 bits: faster with sse4.2, but unlike crc16 it misses some bursts of up to 16 bits
+	CRC_KIND_CRC32C,
+	CRC_KIND_COUNT,
+};
+
 uint16_t crc16(const uint8_t* data, size_t length);
+
+// continues crc of previous chunks, so checksum of scattered fields is taken without copying them together
+uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t length);
+
+// continues crc32c register of previous chunks (starts from CRC32C_INIT), crc32 instruction is used when cpu has sse4.2
+uint32_t crc32c_update(uint32_t crc, const uint8_t* data, size_t length);
+
+// finishes crc32c register and folds it into 16 bit crc field
+uint16_t crc32c_fold(uint32_t crc);
+
+// checksum of data by kind (enum crc_kind of wire), unknown kind is rejected before (see format_parse)
+uint16_t crc_checksum(uint8_t kind, const uint8_t* data, size_t length);
+
+// crc16, crc32c in CHECKSUM=crc32c build when cpu computes it (cpuid)
+__attribute__((warn_unused_result))
+enum crc_kind crc_kind_preferred(void);
@@ -5,6 +5,7 @@
 #include <stdbool.h>
 
 #include <format_app.h>
+#include "settings.h"
 
 #define msg_len_type uint8_t
 
@@ -12,7 +13,9 @@
 
 #define sizeof_packet(packet_ptr) (sizeof(*packet_ptr) - sizeof(packet_ptr->app_payload) + format_app_message_len(&packet_ptr->app_payload))
 
-#define packet_crc(packet_ptr) crc16((uint8_t*) (packet_ptr), sizeof_packet((packet_ptr)) - sizeof((packet_ptr)->crc) - sizeof((packet_ptr)->app_payload.crc))
+// packet crc covers header and app crc but not message, message is covered end to end by app crc (checked by receiver app)
+// so transit node checks and updates packet crc in O(header)
+#define packet_crc(packet_ptr) format_packet_crc((packet_ptr))
 
 enum __attribute__((packed, aligned(1))) request_result {
 	REQUEST_OK,
@@ -41,22 +44,43 @@ enum __attribute__((packed, aligned(1))) request {
 	REQUEST_UNICAST,
 	REQUEST_UNICAST_CONTEST,
 	REQUEST_UNICAST_FIRST,
+	REQUEST_CONTROL,
+	REQUEST_CONTROL_RESULT,
+	REQUEST_SESSION,
+	REQUEST_SESSION_RESULT,
+	REQUEST_SEND_BATCH,
+	REQUEST_SEND_BATCH_RESULT,
 	REQUEST_UNDEFINED
 };
 
 typedef struct __attribute__((__packed__)) node_packet {
-	uint8_t sender_addr;
-	uint8_t receiver_addr;
-	uint8_t local_sender_addr; // from which node request retransmitted
-	int8_t time_to_live;
+	node_addr_t sender_addr;
+	node_addr_t receiver_addr;
+	node_addr_t local_sender_addr; // from which node request retransmitted
+	ttl_t time_to_live;
+	// node where packet started to go around dead nodes (see node_geo.h), NODE_ADDR_NONE otherwise
+	node_addr_t face_addr;
 	struct app_payload app_payload;
 	uint16_t crc;
 } node_packet_t;
 
+// bytes of packet before message: hop fields and fixed part of app payload, laid out same way in struct and in frame
+#define PACKET_HEADER_LEN (offsetof(node_packet_t, app_payload) + offsetof(struct app_payload, message))
+
+// header of packet frame read in place, transit node forwards frame without parsing its message
+typedef struct packet_header {
+	node_addr_t sender_addr;
+	node_addr_t receiver_addr;
+	node_addr_t local_sender_addr;
+	ttl_t time_to_live;
+	node_addr_t face_addr;
+	uint16_t app_id;
+} packet_header_t;
+
 typedef struct __attribute__((__packed__)) node_update_payload {
 	int32_t pid;
 	uint16_t port;
-	uint8_t addr;
+	node_addr_t addr;
 } node_update_t;
 
 enum __attribute__((packed, aligned(1))) notify_type {
@@ -69,21 +93,102 @@ typedef struct __attribute__((__packed__)) notify {
 	uint16_t app_msg_id;
 } notify_t;
 
+// server to node request answered asynchronously by REQUEST_CONTROL_RESULT with same id
+typedef struct __attribute__((__packed__)) control {
+	enum request req; // REQUEST_PING, REQUEST_RESET or REQUEST_KILL_NODE (hosted node only, not answered)
+	uint16_t id;
+	enum request_result res; // set by node in result
+} control_t;
+
+// bytes of packet with empty message on wire: header, app crc and packet crc
+#define PACKET_EMPTY_LEN (PACKET_HEADER_LEN + sizeof(uint16_t) + sizeof(uint16_t))
+
+_Static_assert(sizeof(node_packet_t) - APP_MESSAGE_LEN == PACKET_EMPTY_LEN, "PACKET_EMPTY_LEN must count every field of packet");
+
+// packets of empty messages that fit into one frame after tag and count of batch
+#define SEND_BATCH_MAX ((UINT8_MAX - MSG_BASE_LEN - sizeof(uint16_t) - sizeof(uint8_t)) / PACKET_EMPTY_LEN)
+
+_Static_assert(SEND_BATCH_MAX > 0 && MSG_BASE_LEN + sizeof(uint16_t) + sizeof(uint8_t) + SEND_BATCH_MAX * PACKET_EMPTY_LEN <= UINT8_MAX,
+	"batch of SEND_BATCH_MAX empty packets must fit into frame");
+
+// several sends in one frame, filled by format_batch_add so it fits into frame
+typedef struct send_batch {
+	uint16_t tag; // set by client, returned in result
+	uint8_t count;
+	node_packet_t packets[SEND_BATCH_MAX];
+} send_batch_t;
+
+// status of every send of batch in order of packets
+typedef struct __attribute__((__packed__)) send_batch_result {
+	uint16_t tag;
+	uint8_t count;
+	enum request_result res[SEND_BATCH_MAX];
+} send_batch_result_t;
+
+// result of client request sent in session, seq is set by client (see format_create_session)
+typedef struct __attribute__((__packed__)) session_result {
+	uint16_t seq;
+	enum request_result res;
+} session_result_t;
+
 typedef struct __attribute__((__packed__)) unicast_contest {
 	enum request req; // either REQUEST_UNICAST_FIRST or REQUEST_UNICAST_CONTEST
-	uint8_t node_addr;
+	node_addr_t node_addr;
 	struct app_payload app_payload;
 } unicast_contest_t;
 
+// parsed payload of any request, usually lives on stack of handler
+union format_payload {
+	uint8_t addr; // REQUEST_PING, REQUEST_KILL_NODE and REQUEST_REVIVE_NODE
+	node_packet_t packet;
+	node_update_t update;
+	notify_t notify;
+	unicast_contest_t unicast;
+	control_t control;
+	session_result_t session_result;
+	send_batch_t batch;
+	send_batch_result_t batch_result;
+};
+
 __attribute__((nonnull(2)))
 void format_sprint_result(enum request_result res, char buf[], size_t len);
 
 __attribute__((warn_unused_result))
 enum request_sender format_define_sender(const uint8_t* buf);
 
+__attribute__((warn_unused_result))
+enum request format_define_request(const uint8_t* buf);
+
 __attribute__((warn_unused_result))
 bool format_is_message_correct(size_t buf_len, msg_len_type msg_len);
 
-void format_parse(enum request* req, void** payload, const void* buf);
+// decodes frame (after its length) of len bytes into storage of caller, member of payload is chosen by req
+// false (req is REQUEST_UNDEFINED) if request is unknown or doesn't fit into frame, then payload must not be used
+__attribute__((nonnull(1, 2, 3), warn_unused_result))
+bool format_parse(enum request* req, union format_payload* payload, const void* buf, size_t len);
 
 void format_create(enum request req, const void* payload, uint8_t* buf, msg_len_type* len, enum request_sender sender);
+
+__attribute__((nonnull(1), warn_unused_result))
+uint16_t format_packet_crc(const node_packet_t* packet);
+
+// reads header of packet frame (REQUEST_SEND, REQUEST_ROUTE_*) after its length, false if frame is short or packet crc is wrong
+__attribute__((nonnull(1, 3), warn_unused_result))
+bool format_peek_packet(const uint8_t* buf, size_t len, packet_header_t* header);
+
+// sets hop fields of packet frame (after its length) in place and updates its crc, frame must be checked by format_peek_packet
+__attribute__((nonnull(1)))
+void format_patch_packet(uint8_t* buf, node_addr_t local_sender_addr, ttl_t time_to_live);
+
+// wraps complete client frame (starting with its length) into REQUEST_SESSION tagged with seq
+__attribute__((nonnull(2, 3, 4), warn_unused_result))
+bool format_create_session(uint16_t seq, const uint8_t* frame, uint8_t* buf, msg_len_type* len);
+
+// returns wrapped frame of REQUEST_SESSION after its length, as serving passes frames
+// len of session frame is replaced by len of wrapped one, NULL if wrapped frame doesn't fill session frame
+__attribute__((nonnull(1, 2, 3), warn_unused_result))
+const uint8_t* format_parse_session(const uint8_t* buf, size_t* len, uint16_t* seq);
+
+// appends packet to batch, false if it doesn't fit into frame
+__attribute__((nonnull(1, 2), warn_unused_result))
+bool format_batch_add(send_batch_t* batch, const node_packet_t* packet);
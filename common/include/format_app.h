@@ -6,9 +6,9 @@
 
 #include "settings.h"
 
-#define MAX_APP_LEN (sizeof_enum(req_type) + sizeof(uint8_t) * 3 + sizeof(uint16_t) * 2 + APP_MESSAGE_LEN)
+#define MAX_APP_LEN (sizeof_enum(req_type) + sizeof(uint8_t) * 5 + sizeof(uint16_t) * 2 + APP_MESSAGE_LEN)
 
-#define app_crc(app_ptr) crc16((uint8_t*) (app_ptr), format_app_message_len((app_ptr)) - sizeof((app_ptr)->crc))
+#define app_crc(app_ptr) crc_checksum((app_ptr)->checksum, (uint8_t*) (app_ptr), format_app_message_len((app_ptr)) - sizeof((app_ptr)->crc))
 
 enum __attribute__((packed, aligned(1))) app_request {
 	APP_REQUEST_DELIVERY,
@@ -16,11 +16,21 @@ enum __attribute__((packed, aligned(1))) app_request {
 	APP_REQUEST_UNICAST,
 };
 
+// how message is encoded on its way, it is decoded to APP_CODEC_NONE before app crc is checked
+enum app_codec {
+	APP_CODEC_NONE,
+	APP_CODEC_ZLIB,
+	APP_CODEC_LZ,
+	APP_CODEC_COUNT,
+};
+
 struct __attribute__((__packed__)) app_payload {
 	enum app_request req_type;
 	uint8_t addr_from;
 	uint8_t addr_to;
 	uint16_t id;
+	uint8_t codec; // enum app_codec
+	uint8_t checksum; // enum crc_kind of app crc and packet crc, chosen by sender
 	uint8_t message_len;
 	uint8_t message[APP_MESSAGE_LEN];
 	uint16_t crc;
@@ -34,3 +44,42 @@ void format_app_parse_message(void* payload, const uint8_t* p);
 
 __attribute__((nonnull(1)))
 uint8_t format_app_message_len(struct app_payload* payload);
+
+// codec writes at most APP_MESSAGE_LEN bytes to out, false if it can't
+typedef bool (*app_codec_fn)(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len);
+
+struct app_codec_ops {
+	const char* name;
+	app_codec_fn encode;
+	app_codec_fn decode;
+};
+
+// none and lz are built in, codecs with dependencies (zlib of node) are registered by their users
+__attribute__((nonnull(2)))
+void format_app_register_codec(enum app_codec codec, const struct app_codec_ops* ops);
+
+__attribute__((warn_unused_result))
+const char* format_app_codec_name(enum app_codec codec);
+
+// encodes message in place by codec, message stays as is (APP_CODEC_NONE) if codec isn't registered,
+// fails or its output isn't smaller
+__attribute__((nonnull(1)))
+void format_app_encode(struct app_payload* payload, enum app_codec codec);
+
+// decodes message in place, false if codec isn't registered or message is damaged
+__attribute__((nonnull(1), warn_unused_result))
+bool format_app_decode(struct app_payload* payload);
+
+// counters of process, bytes saved by codec are weighed against time it spent
+struct app_codec_stats {
+	uint64_t encoded;
+	uint64_t bypassed; // output wasn't smaller, so message went as is
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t encode_ns;
+	uint64_t decoded;
+	uint64_t decode_ns;
+};
+
+__attribute__((nonnull(2)))
+void format_app_codec_stats(enum app_codec codec, struct app_codec_stats* stats);
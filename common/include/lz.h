@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// byte oriented LZ77 for app messages (up to UINT8_MAX bytes): sequences of literals followed by match of earlier bytes,
+// there is no entropy coding, so it is much faster than deflate but gains only on repeated strings
+// sequence is token (literal count << 4 | match length - LZ_MIN_MATCH, 15 is continued by bytes until one is below 255),
+// literals, offset of match (1 byte) and rest of match length, last sequence has literals only
+
+#define LZ_MIN_MATCH 4
+
+// returns length of compressed data, 0 if input is too long or output doesn't fit into out_cap
+__attribute__((nonnull(1, 3), warn_unused_result))
+size_t lz_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap);
+
+// returns length of decompressed data, 0 if data is damaged or output doesn't fit into out_cap
+__attribute__((nonnull(1, 3), warn_unused_result))
+size_t lz_decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap);
@@ -9,8 +9,8 @@
 
 typedef struct routing_node {
 	// how to get to
-	uint8_t addr;
-	int8_t metric;
+	node_addr_t addr;
+	ttl_t metric;
 } routing_node_t;
 
 typedef struct routing_table {
@@ -22,13 +22,13 @@ __attribute__((nonnull(1)))
 void routing_table_fill_default(routing_table_t* table);
 
 __attribute__((nonnull(1), warn_unused_result))
-uint8_t routing_next_addr(const routing_table_t* table, uint8_t dest_addr);
+node_addr_t routing_next_addr(const routing_table_t* table, node_addr_t dest_addr);
 
 __attribute__((nonnull(1), warn_unused_result))
-routing_node_t routing_get(const routing_table_t* table, uint8_t dest_addr);
+routing_node_t routing_get(const routing_table_t* table, node_addr_t dest_addr);
 
 __attribute__((nonnull(1)))
-void routing_del(routing_table_t* table, uint8_t dest_addr);
+void routing_del(routing_table_t* table, node_addr_t dest_addr);
 
 __attribute__((nonnull(1)))
-void routing_set_addr(routing_table_t* table, uint8_t dest_addr, uint8_t next_addr, int8_t metric);
+void routing_set_addr(routing_table_t* table, node_addr_t dest_addr, node_addr_t next_addr, ttl_t metric);
@@ -6,27 +6,162 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include "format.h"
+#include "settings.h"
+
+// backend is selected at build time: SERVING_EPOLL (linux only) or poll by default
+// SERVING_URING (linux only, requires SERVING_EPOLL) uses io_uring and falls back to epoll when kernel can't provide it
+
 struct node {
 	pid_t pid;
 	int32_t write_fd;
 	uint8_t addr;
 	uint16_t port;
+	// node runs in process shared with other nodes (pid is pid of host), so it is killed by request
+	bool hosted;
+};
+
+// must be power of two and hold at least one frame of max length
+#ifndef SERVING_RX_CAPACITY
+#define SERVING_RX_CAPACITY 4096
+#endif
+
+// max frames waiting to be sent on one connection, must be power of two
+#ifndef SERVING_TX_DEPTH
+#define SERVING_TX_DEPTH 32
+#endif
+
+enum serving_overflow {
+	SERVING_OVERFLOW_DROP_NEW, // frame that doesn't fit is rejected
+	SERVING_OVERFLOW_DROP_OLD, // oldest unsent frame is dropped
+	SERVING_OVERFLOW_CLOSE     // slow peer is disconnected
+};
+
+#ifndef SERVING_TX_OVERFLOW
+#define SERVING_TX_OVERFLOW SERVING_OVERFLOW_DROP_NEW
+#endif
+
+// bytes received but not yet assembled into frames
+// head and tail run freely and are masked on access
+struct serving_rx {
+	uint8_t buf[SERVING_RX_CAPACITY];
+	uint32_t head;
+	uint32_t tail;
+};
+
+// frames waiting for socket to become writable, each slot starts with frame length byte
+struct serving_tx {
+	uint8_t frames[SERVING_TX_DEPTH][MAX_MSG_LEN];
+	uint32_t head;
+	uint32_t tail;
+	// bytes of head frame already sent
+	uint32_t offset;
+	uint32_t dropped;
 };
 
+struct serving_conn;
+
+struct serving_data;
+
+// called when serving closes connection it doesn't own (see serving_add_conn)
+typedef void (*serving_close_t)(struct serving_conn* conn, void* ctx);
+
+// called instead of frame reassembly for fds added by serving_add_watch
+typedef bool (*serving_readable_t)(struct serving_data* serving, struct serving_conn* conn, void* data);
+
+// per connection data (epoll_event.data.ptr points to it)
+struct serving_conn {
+	int32_t fd;
+	struct serving_rx rx;
+	struct serving_tx tx;
+	serving_close_t on_close;
+	serving_readable_t on_readable;
+	void* ctx;
+	// position in serving pending list or SIZE_MAX
+	size_t pending;
+	// closed connections are freed at the end of serving_poll
+	struct serving_conn* next_closed;
+	// closed as soon as send queue is empty (see serving_finish_conn)
+	bool finishing;
+#ifdef SERVING_EPOLL
+	struct serving_conn* prev;
+	struct serving_conn* next;
+#else
+	// position in pfds
+	size_t index;
+#endif
+#ifdef SERVING_URING
+	// io_uring requests that haven't completed yet, conn is freed only after all of them
+	uint32_t uring_ops;
+	// sends in flight, rest of queue is submitted when they complete
+	uint32_t uring_sends;
+#endif
+};
+
+// called for each complete frame, buf points after length byte
+typedef bool (*serving_handler_t)(int32_t sender_fd, uint8_t* buf, size_t len, void* data);
+
+struct serving_uring;
+
 struct serving_data {
 	int32_t server_fd;
+#ifdef SERVING_EPOLL
+	int32_t epoll_fd;
+	struct serving_conn listener;
+	struct serving_conn* conns;
+#ifdef SERVING_URING
+	// NULL if io_uring is unavailable and epoll is used
+	struct serving_uring* uring;
+#endif
+#else
 	struct pollfd* pfds;
+	// conns[i] belongs to pfds[i], listener has NULL
+	struct serving_conn** conns;
 	uint32_t pfd_count;
 	size_t pfd_capacity;
+#endif
+	// connections with queued frames, flushed at the end of serving_poll
+	struct serving_conn** pending;
+	size_t pending_count;
+	size_t pending_capacity;
+	struct serving_conn* closed;
+	enum serving_overflow tx_overflow;
+	// serving_poll returns after this time even without events, so owner can check its timers
+	int32_t timeout_ms;
 	socklen_t addrlen;
 	struct sockaddr_storage remoteaddr;
-	bool (*handle_request)(int32_t sender_fd, void* data);
+	serving_handler_t handle_request;
 };
 
 __attribute__((nonnull(1, 3)))
-void serving_init(struct serving_data* serving, int32_t server_fd, bool (*handle_request)(int32_t sender_fd, void* data));
+void serving_init(struct serving_data* serving, int32_t server_fd, serving_handler_t handle_request);
 
 void serving_free(struct serving_data* serving);
 
 __attribute__((nonnull(1, 2)))
 void serving_poll(struct serving_data* serving, void* data);
+
+// serves socket that wasn't accepted by serving (e.g. connected to other node)
+// fd is owned by serving after the call, on_close is called before it is closed
+__attribute__((nonnull(1), warn_unused_result))
+struct serving_conn* serving_add_conn(struct serving_data* serving, int32_t fd, serving_close_t on_close, void* ctx);
+
+// watches fd that is not a frame stream (e.g. doorbell of shared memory ring)
+__attribute__((nonnull(1, 3), warn_unused_result))
+struct serving_conn* serving_add_watch(struct serving_data* serving, int32_t fd, serving_readable_t on_readable, void* ctx);
+
+// closes connection without calling its on_close
+__attribute__((nonnull(1, 2)))
+void serving_close_conn(struct serving_data* serving, struct serving_conn* conn);
+
+// closes connection without calling its on_close once queued frames are sent
+__attribute__((nonnull(1, 2)))
+void serving_finish_conn(struct serving_data* serving, struct serving_conn* conn);
+
+// queues frame to be sent without blocking, frames queued in one serving_poll are coalesced into one syscall
+__attribute__((nonnull(1, 2, 3), warn_unused_result))
+bool serving_send(struct serving_data* serving, struct serving_conn* conn, const uint8_t* buf, msg_len_type len);
+
+// queues body of frame (received frame after its length byte), length is put in front of it right in send queue
+__attribute__((nonnull(1, 2, 3), warn_unused_result))
+bool serving_send_body(struct serving_data* serving, struct serving_conn* conn, const uint8_t* body, msg_len_type len);
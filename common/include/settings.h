@@ -6,6 +6,16 @@
 #define SERVER_PORT 999
 #endif
 
+// directory for socket files when built with TRANSPORT=unix
+#ifndef CONNECTION_UNIX_DIR
+#define CONNECTION_UNIX_DIR "/tmp"
+#endif
+
+// server event loop threads, can be overridden by server -w argument
+#ifndef SERVER_WORKERS
+#define SERVER_WORKERS 1
+#endif
+
 #ifndef MATRIX_SIZE
 #define MATRIX_SIZE 10
 #endif
@@ -35,6 +45,22 @@
 #define BROADCAST_RADIUS 3
 #endif
 
+// node address is byte unless grid is too large for it (e.g. simulator builds)
+#if NODE_COUNT < UINT8_MAX
+typedef uint8_t node_addr_t;
+#define NODE_ADDR_NONE UINT8_MAX
+#else
+typedef uint16_t node_addr_t;
+#define NODE_ADDR_NONE UINT16_MAX
+#endif
+
+// time to live and route metric grow with TTL
+#if TTL <= INT8_MAX
+typedef int8_t ttl_t;
+#else
+typedef int16_t ttl_t;
+#endif
+
 #define node_port(addr) (uint16_t) (SERVER_PORT + (addr) + 1)
 
 #define node_addr(port) (port - SERVER_PORT - 1)
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "format.h"
+
+// single producer single consumer ring of frames in shared memory
+// one ring per directed link, consumer creates it and producer opens it
+
+// must be power of two
+#ifndef SHM_RING_SLOTS
+#define SHM_RING_SLOTS 32
+#endif
+
+struct shm_ring;
+
+__attribute__((nonnull(1), warn_unused_result))
+struct shm_ring* shm_ring_create(const char* name);
+
+__attribute__((nonnull(1), warn_unused_result))
+struct shm_ring* shm_ring_open(const char* name);
+
+// consumer marks ring closed and removes its name, producer only unmaps it
+__attribute__((nonnull(1, 2)))
+void shm_ring_close(struct shm_ring* ring, const char* name, bool consumer);
+
+// producer: slot to serialize frame into, NULL if ring is full
+__attribute__((nonnull(1), warn_unused_result))
+uint8_t* shm_ring_reserve(struct shm_ring* ring);
+
+// producer: publishes reserved slot, returns true if consumer sleeps and must be woken up
+__attribute__((nonnull(1), warn_unused_result))
+bool shm_ring_commit(struct shm_ring* ring);
+
+// producer: consumer is gone and ring won't be read anymore
+__attribute__((nonnull(1), warn_unused_result))
+bool shm_ring_is_closed(const struct shm_ring* ring);
+
+// consumer: oldest frame or NULL if ring is empty, frame starts with its length byte
+__attribute__((nonnull(1), warn_unused_result))
+const uint8_t* shm_ring_peek(struct shm_ring* ring);
+
+// consumer: frees slot returned by shm_ring_peek
+__attribute__((nonnull(1)))
+void shm_ring_release(struct shm_ring* ring);
+
+// consumer: asks producer to wake it up on next commit, returns false if ring is not empty anymore
+__attribute__((nonnull(1), warn_unused_result))
+bool shm_ring_sleep(struct shm_ring* ring);
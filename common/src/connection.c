@@ -1,12 +1,90 @@
 #include "connection.h"
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 #include <netinet/in.h>
+#include <stdio.h>
 #include <sys/errno.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "custom_logger.h"
+#include "settings.h"
+
+#ifdef CONNECTION_UNIX
+
+// all processes are on one host so port is mapped to socket file
+static void fill_addr(struct sockaddr_un* addr, uint16_t port) {
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, sizeof(addr->sun_path), CONNECTION_UNIX_DIR "/mesh-net.%d.sock", port);
+}
+
+int32_t connection_socket_to_send(uint16_t port) {
+	int32_t server_fd;
+	int32_t status;
+	struct sockaddr_un addr;
+
+	server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server_fd < 0) {
+		custom_log_error("Failed to create socket");
+		return -1;
+	}
+
+	fill_addr(&addr, port);
+
+	status = connect(server_fd, (const struct sockaddr*) &addr, sizeof(addr));
+	if (status) {
+		/* custom_log_error("Failed to connect to server socket on %s", addr.sun_path); */
+		close(server_fd);
+		return -1;
+	}
+
+	return server_fd;
+}
+
+int32_t connection_socket_to_listen(uint16_t port) {
+	int32_t fd;
+	int32_t rv;
+	struct sockaddr_un addr;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0) {
+		custom_log_error("Failed to create socket");
+		return -1;
+	}
+
+	fill_addr(&addr, port);
+	// file is left by previous process on this port
+	unlink(addr.sun_path);
+
+	rv = bind(fd, (const struct sockaddr*) &addr, sizeof(addr));
+	if (rv < 0) {
+		custom_log_error("Failed to bind() on %s: %d", addr.sun_path, errno);
+		close(fd);
+		return -1;
+	}
+
+	rv = listen(fd, SOMAXCONN);
+	if (rv < 0) {
+		custom_log_error("Failed to listen() on %s: %d", addr.sun_path, errno);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int32_t connection_socket_to_listen_shared(uint16_t port) {
+	(void) port;
+
+	// socket file can be bound only once
+	return -1;
+}
+
+#else
 
 int32_t connection_socket_to_send(uint16_t port) {
 	int32_t server_fd;
@@ -28,13 +106,14 @@ int32_t connection_socket_to_send(uint16_t port) {
 	if (status) {
 		inet_ntop(AF_INET, &addr.sin_addr, buffer, sizeof(buffer));
 		/* custom_log_error("Failed to connect to server socket on %s:%d", buffer, port); */
+		close(server_fd);
 		return -1;
 	}
 
 	return server_fd;
 }
 
-int32_t connection_socket_to_listen(uint16_t port) {
+static int32_t listen_inet(uint16_t port, bool shared) {
 	int32_t fd;
 	int32_t rv;
 	struct sockaddr_in addr;
@@ -47,7 +126,13 @@ int32_t connection_socket_to_listen(uint16_t port) {
 		return -1;
 	}
 
+	val = 1;
 	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	if (shared && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) < 0) {
+		custom_log_error("Failed to set SO_REUSEPORT on port %d: %d", port, errno);
+		close(fd);
+		return -1;
+	}
 
 	addr.sin_family = AF_INET;
 	addr.sin_port = ntohs(port);
@@ -66,3 +151,13 @@ int32_t connection_socket_to_listen(uint16_t port) {
 
 	return fd;
 }
+
+int32_t connection_socket_to_listen(uint16_t port) {
+	return listen_inet(port, false);
+}
+
+int32_t connection_socket_to_listen_shared(uint16_t port) {
+	return listen_inet(port, true);
+}
+
+#endif
@@ -1,41 +1,224 @@
 #include "crc.h"
 
+#include <memory.h>
 #include <stdbool.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
 
-uint16_t crc16_table[UINT8_MAX + 1];
+// crc16 (reflected polynomial 0xA001) is taken 8 bytes at a time (slicing by 8): crc of every byte of block
+// is looked up in table of its distance to block end, so lookups don't wait for each other
+// tables are built by compiler from polynomial, there is nothing to init on hot path
 
-static void init_crc16_table(void) {
-    uint16_t crc;
-    const uint16_t polynomial = 0xA001;
-	uint16_t i;
-	uint16_t j;
+#define CRC16_POLY 0xA001
 
-    for (i = 0; i < 256; i++) {
-        crc = i;
-        for (j = 0; j < 8; j++) {
-            if (crc & 1)
-                crc = (crc >> 1) ^ polynomial;
-            else
-                crc >>= 1;
-        }
-        crc16_table[i] = crc;
-    }
-}
+#define CRC16_SLICES 8
+
+// one bit of crc register
+#define CRC16_STEP(c) ((((c) >> 1) ^ (((c) & 1) ? CRC16_POLY : 0)))
+
+// crc register that started as 1 after n zero bits: crc of byte with only bit b set followed by k zero bytes
+// is P(8 * (k + 1) - b), since bit is shifted down to 1 without feedback first
+enum crc16_power {
+	P0 = 1,           P1 = CRC16_STEP(P0),   P2 = CRC16_STEP(P1),   P3 = CRC16_STEP(P2),
+	P4 = CRC16_STEP(P3),   P5 = CRC16_STEP(P4),   P6 = CRC16_STEP(P5),   P7 = CRC16_STEP(P6),
+	P8 = CRC16_STEP(P7),   P9 = CRC16_STEP(P8),   P10 = CRC16_STEP(P9),  P11 = CRC16_STEP(P10),
+	P12 = CRC16_STEP(P11), P13 = CRC16_STEP(P12), P14 = CRC16_STEP(P13), P15 = CRC16_STEP(P14),
+	P16 = CRC16_STEP(P15), P17 = CRC16_STEP(P16), P18 = CRC16_STEP(P17), P19 = CRC16_STEP(P18),
+	P20 = CRC16_STEP(P19), P21 = CRC16_STEP(P20), P22 = CRC16_STEP(P21), P23 = CRC16_STEP(P22),
+	P24 = CRC16_STEP(P23), P25 = CRC16_STEP(P24), P26 = CRC16_STEP(P25), P27 = CRC16_STEP(P26),
+	P28 = CRC16_STEP(P27), P29 = CRC16_STEP(P28), P30 = CRC16_STEP(P29), P31 = CRC16_STEP(P30),
+	P32 = CRC16_STEP(P31), P33 = CRC16_STEP(P32), P34 = CRC16_STEP(P33), P35 = CRC16_STEP(P34),
+	P36 = CRC16_STEP(P35), P37 = CRC16_STEP(P36), P38 = CRC16_STEP(P37), P39 = CRC16_STEP(P38),
+	P40 = CRC16_STEP(P39), P41 = CRC16_STEP(P40), P42 = CRC16_STEP(P41), P43 = CRC16_STEP(P42),
+	P44 = CRC16_STEP(P43), P45 = CRC16_STEP(P44), P46 = CRC16_STEP(P45), P47 = CRC16_STEP(P46),
+	P48 = CRC16_STEP(P47), P49 = CRC16_STEP(P48), P50 = CRC16_STEP(P49), P51 = CRC16_STEP(P50),
+	P52 = CRC16_STEP(P51), P53 = CRC16_STEP(P52), P54 = CRC16_STEP(P53), P55 = CRC16_STEP(P54),
+	P56 = CRC16_STEP(P55), P57 = CRC16_STEP(P56), P58 = CRC16_STEP(P57), P59 = CRC16_STEP(P58),
+	P60 = CRC16_STEP(P59), P61 = CRC16_STEP(P60), P62 = CRC16_STEP(P61), P63 = CRC16_STEP(P62),
+	P64 = CRC16_STEP(P63),
+};
+
+// crc is linear, so crc of byte is xor of crcs of its bits
+#define CRC_BIT(i, b, p) ((((i) >> (b)) & 1) ? (p) : 0)
+#define CRC_XOR_BITS(i, p0, p1, p2, p3, p4, p5, p6, p7) (CRC_BIT(i, 0, p0) ^ CRC_BIT(i, 1, p1) \
+	^ CRC_BIT(i, 2, p2) ^ CRC_BIT(i, 3, p3) ^ CRC_BIT(i, 4, p4) ^ CRC_BIT(i, 5, p5) ^ CRC_BIT(i, 6, p6) ^ CRC_BIT(i, 7, p7))
+#define CRC16_ENTRY(i, ...) (uint16_t) CRC_XOR_BITS(i, __VA_ARGS__)
+
+// table of 256 entries, entry macro e gets byte and powers of its bits
+#define CRC_ENTRIES_4(e, i, ...) e((i), __VA_ARGS__), e((i) + 1, __VA_ARGS__), \
+	e((i) + 2, __VA_ARGS__), e((i) + 3, __VA_ARGS__)
+#define CRC_ENTRIES_16(e, i, ...) CRC_ENTRIES_4(e, (i), __VA_ARGS__), CRC_ENTRIES_4(e, (i) + 4, __VA_ARGS__), \
+	CRC_ENTRIES_4(e, (i) + 8, __VA_ARGS__), CRC_ENTRIES_4(e, (i) + 12, __VA_ARGS__)
+#define CRC_ENTRIES_64(e, i, ...) CRC_ENTRIES_16(e, (i), __VA_ARGS__), CRC_ENTRIES_16(e, (i) + 16, __VA_ARGS__), \
+	CRC_ENTRIES_16(e, (i) + 32, __VA_ARGS__), CRC_ENTRIES_16(e, (i) + 48, __VA_ARGS__)
+#define CRC_TABLE(e, ...) { CRC_ENTRIES_64(e, 0, __VA_ARGS__), CRC_ENTRIES_64(e, 64, __VA_ARGS__), \
+	CRC_ENTRIES_64(e, 128, __VA_ARGS__), CRC_ENTRIES_64(e, 192, __VA_ARGS__) }
+#define CRC16_TABLE(...) CRC_TABLE(CRC16_ENTRY, __VA_ARGS__)
+
+// table k is crc of byte followed by k zero bytes, table 0 is usual byte table
+static const uint16_t crc16_table[CRC16_SLICES][UINT8_MAX + 1] = {
+	CRC16_TABLE(P8, P7, P6, P5, P4, P3, P2, P1),
+	CRC16_TABLE(P16, P15, P14, P13, P12, P11, P10, P9),
+	CRC16_TABLE(P24, P23, P22, P21, P20, P19, P18, P17),
+	CRC16_TABLE(P32, P31, P30, P29, P28, P27, P26, P25),
+	CRC16_TABLE(P40, P39, P38, P37, P36, P35, P34, P33),
+	CRC16_TABLE(P48, P47, P46, P45, P44, P43, P42, P41),
+	CRC16_TABLE(P56, P55, P54, P53, P52, P51, P50, P49),
+	CRC16_TABLE(P64, P63, P62, P61, P60, P59, P58, P57),
+};
 
 uint16_t crc16(const uint8_t *data, size_t length) {
-    uint16_t crc;
-	size_t i;
-	static bool init = false;
+	return crc16_update(CRC16_INIT, data, length);
+}
+
+uint16_t crc16_update(uint16_t crc, const uint8_t* data, size_t length) {
+	const uint8_t* end;
+
+	end = data + length;
+
+	// register is 16 bit, so it is mixed into first two bytes of block
+	while (end - data >= CRC16_SLICES) {
+		crc = crc16_table[7][data[0] ^ (crc & 0xFF)] ^ crc16_table[6][data[1] ^ (crc >> 8)]
+			^ crc16_table[5][data[2]] ^ crc16_table[4][data[3]]
+			^ crc16_table[3][data[4]] ^ crc16_table[2][data[5]]
+			^ crc16_table[1][data[6]] ^ crc16_table[0][data[7]];
+		data += CRC16_SLICES;
+	}
+
+	while (data < end) {
+		crc = (crc >> 8) ^ crc16_table[0][(crc ^ *data++) & 0xFF];
+	}
+
+	return crc;
+}
+
+// crc32c (reflected polynomial 0x82F63B78, castagnoli) is computed by crc32 instruction of sse4.2 when cpu has it
+// (cpuid), otherwise by slicing by 8 like crc16 with tables built by compiler the same way
+
+#define CRC32C_POLY 0x82F63B78u
+
+#define CRC32C_SLICES 8
+
+// powers don't fit into int of enum, so they are kept as its bits
+#define CRC32C_STEP(c) ((int32_t) ((((uint32_t) (c)) >> 1) ^ ((((uint32_t) (c)) & 1) ? CRC32C_POLY : 0)))
+
+// same powers as crc16_power for crc32c register
+enum crc32c_power {
+	Q0 = 1,           Q1 = CRC32C_STEP(Q0),   Q2 = CRC32C_STEP(Q1),   Q3 = CRC32C_STEP(Q2),
+	Q4 = CRC32C_STEP(Q3),   Q5 = CRC32C_STEP(Q4),   Q6 = CRC32C_STEP(Q5),   Q7 = CRC32C_STEP(Q6),
+	Q8 = CRC32C_STEP(Q7),   Q9 = CRC32C_STEP(Q8),   Q10 = CRC32C_STEP(Q9),  Q11 = CRC32C_STEP(Q10),
+	Q12 = CRC32C_STEP(Q11), Q13 = CRC32C_STEP(Q12), Q14 = CRC32C_STEP(Q13), Q15 = CRC32C_STEP(Q14),
+	Q16 = CRC32C_STEP(Q15), Q17 = CRC32C_STEP(Q16), Q18 = CRC32C_STEP(Q17), Q19 = CRC32C_STEP(Q18),
+	Q20 = CRC32C_STEP(Q19), Q21 = CRC32C_STEP(Q20), Q22 = CRC32C_STEP(Q21), Q23 = CRC32C_STEP(Q22),
+	Q24 = CRC32C_STEP(Q23), Q25 = CRC32C_STEP(Q24), Q26 = CRC32C_STEP(Q25), Q27 = CRC32C_STEP(Q26),
+	Q28 = CRC32C_STEP(Q27), Q29 = CRC32C_STEP(Q28), Q30 = CRC32C_STEP(Q29), Q31 = CRC32C_STEP(Q30),
+	Q32 = CRC32C_STEP(Q31), Q33 = CRC32C_STEP(Q32), Q34 = CRC32C_STEP(Q33), Q35 = CRC32C_STEP(Q34),
+	Q36 = CRC32C_STEP(Q35), Q37 = CRC32C_STEP(Q36), Q38 = CRC32C_STEP(Q37), Q39 = CRC32C_STEP(Q38),
+	Q40 = CRC32C_STEP(Q39), Q41 = CRC32C_STEP(Q40), Q42 = CRC32C_STEP(Q41), Q43 = CRC32C_STEP(Q42),
+	Q44 = CRC32C_STEP(Q43), Q45 = CRC32C_STEP(Q44), Q46 = CRC32C_STEP(Q45), Q47 = CRC32C_STEP(Q46),
+	Q48 = CRC32C_STEP(Q47), Q49 = CRC32C_STEP(Q48), Q50 = CRC32C_STEP(Q49), Q51 = CRC32C_STEP(Q50),
+	Q52 = CRC32C_STEP(Q51), Q53 = CRC32C_STEP(Q52), Q54 = CRC32C_STEP(Q53), Q55 = CRC32C_STEP(Q54),
+	Q56 = CRC32C_STEP(Q55), Q57 = CRC32C_STEP(Q56), Q58 = CRC32C_STEP(Q57), Q59 = CRC32C_STEP(Q58),
+	Q60 = CRC32C_STEP(Q59), Q61 = CRC32C_STEP(Q60), Q62 = CRC32C_STEP(Q61), Q63 = CRC32C_STEP(Q62),
+	Q64 = CRC32C_STEP(Q63),
+};
+
+#define CRC32C_ENTRY(i, ...) (uint32_t) CRC_XOR_BITS(i, __VA_ARGS__)
+#define CRC32C_TABLE(...) CRC_TABLE(CRC32C_ENTRY, __VA_ARGS__)
+
+static const uint32_t crc32c_table[CRC32C_SLICES][UINT8_MAX + 1] = {
+	CRC32C_TABLE(Q8, Q7, Q6, Q5, Q4, Q3, Q2, Q1),
+	CRC32C_TABLE(Q16, Q15, Q14, Q13, Q12, Q11, Q10, Q9),
+	CRC32C_TABLE(Q24, Q23, Q22, Q21, Q20, Q19, Q18, Q17),
+	CRC32C_TABLE(Q32, Q31, Q30, Q29, Q28, Q27, Q26, Q25),
+	CRC32C_TABLE(Q40, Q39, Q38, Q37, Q36, Q35, Q34, Q33),
+	CRC32C_TABLE(Q48, Q47, Q46, Q45, Q44, Q43, Q42, Q41),
+	CRC32C_TABLE(Q56, Q55, Q54, Q53, Q52, Q51, Q50, Q49),
+	CRC32C_TABLE(Q64, Q63, Q62, Q61, Q60, Q59, Q58, Q57),
+};
+
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t* data, size_t length) {
+	const uint8_t* end;
+
+	end = data + length;
 
-	if (!init) {
-		init = true;
-		init_crc16_table();
+	// register is 32 bit, so it is mixed into first four bytes of block
+	while (end - data >= CRC32C_SLICES) {
+		crc = crc32c_table[7][data[0] ^ (crc & 0xFF)] ^ crc32c_table[6][data[1] ^ ((crc >> 8) & 0xFF)]
+			^ crc32c_table[5][data[2] ^ ((crc >> 16) & 0xFF)] ^ crc32c_table[4][data[3] ^ (crc >> 24)]
+			^ crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]]
+			^ crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+		data += CRC32C_SLICES;
 	}
 
-	crc = 0xFFFF;
-    for (i = 0; i < length; i++) {
-        crc = (crc >> 8) ^ crc16_table[(crc ^ data[i]) & 0xFF];
-    }
+	while (data < end) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xFF];
+	}
+
+	return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t* data, size_t length) {
+	uint64_t c;
+	uint64_t block;
+
+	c = crc;
+	while (length >= sizeof(block)) {
+		memcpy(&block, data, sizeof(block));
+		c = _mm_crc32_u64(c, block);
+		data += sizeof(block);
+		length -= sizeof(block);
+	}
+
+	while (length-- > 0) {
+		c = _mm_crc32_u8((uint32_t) c, *data++);
+	}
+
+	return (uint32_t) c;
+}
+
+static bool has_sse42(void) {
+	// cpuid is read once by libgcc before main, so check is a load
+	return __builtin_cpu_supports("sse4.2");
+}
+#else
+static bool has_sse42(void) {
+	return false;
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const uint8_t* data, size_t length) {
+#ifdef __x86_64__
+	if (has_sse42()) {
+		return crc32c_sse42(crc, data, length);
+	}
+#endif
+
+	return crc32c_soft(crc, data, length);
+}
+
+uint16_t crc32c_fold(uint32_t crc) {
+	crc = ~crc;
+
+	return (uint16_t) (crc ^ (crc >> 16));
+}
+
+uint16_t crc_checksum(uint8_t kind, const uint8_t* data, size_t length) {
+	if (kind == CRC_KIND_CRC32C) {
+		return crc32c_fold(crc32c_update(CRC32C_INIT, data, length));
+	}
+
+	return crc16(data, length);
+}
 
-    return crc;
+enum crc_kind crc_kind_preferred(void) {
+#ifdef CRC_SEND_CRC32C
+	// software crc32c is slower than crc16, so crc16 is kept without sse4.2
+	return has_sse42() ? CRC_KIND_CRC32C : CRC_KIND_CRC16;
+#else
+	return CRC_KIND_CRC16;
+#endif
 }
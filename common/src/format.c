@@ -3,6 +3,7 @@
 #include "settings.h"
 #include "custom_logger.h"
 #include "control_utils.h"
+#include "crc.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -37,6 +38,14 @@ enum request_sender format_define_sender(const uint8_t* buf) {
 	return sender;
 }
 
+enum request format_define_request(const uint8_t* buf) {
+	enum request req;
+
+	memcpy(&req, buf, sizeof(req));
+
+	return req;
+}
+
 bool format_is_message_correct(size_t buf_len, msg_len_type msg_len) {
 
 	if (buf_len > sizeof(msg_len)) {
@@ -56,6 +65,12 @@ static uint8_t* create_base(uint8_t* message, msg_len_type msg_len, enum request
 
 static uint8_t* skip_base(const uint8_t* message);
 
+static uint8_t* create_packet(uint8_t* p, node_packet_t* packet);
+
+static const uint8_t* parse_packet(const uint8_t* p, node_packet_t* packet);
+
+static size_t batch_len(send_batch_t* batch);
+
 void format_create(enum request req, const void* payload, uint8_t* buf, msg_len_type* len, enum request_sender sender) {
 	uint8_t* p;
 
@@ -128,17 +143,73 @@ void format_create(enum request req, const void* payload, uint8_t* buf, msg_len_
 
 				p = create_base(buf, *len, req, sender);
 
-				memcpy(p, &route_payload->sender_addr, sizeof(route_payload->sender_addr));
-				p += sizeof(route_payload->sender_addr);
-				memcpy(p, &route_payload->receiver_addr, sizeof(route_payload->receiver_addr));
-				p += sizeof(route_payload->receiver_addr);
-				memcpy(p, &route_payload->local_sender_addr, sizeof(route_payload->local_sender_addr));
-				p += sizeof(route_payload->local_sender_addr);
-				memcpy(p, &route_payload->time_to_live, sizeof(route_payload->time_to_live));
-				p += sizeof(route_payload->time_to_live);
-				format_app_create_message(&route_payload->app_payload, p);
-				p += format_app_message_len(&route_payload->app_payload);
-				memcpy(p, &route_payload->crc, sizeof(route_payload->crc));
+				create_packet(p, route_payload);
+			}
+			break;
+		case REQUEST_SEND_BATCH:
+			{
+				send_batch_t* batch;
+				uint8_t i;
+
+				batch = (send_batch_t*) payload;
+
+				*len = (msg_len_type) batch_len(batch);
+
+				p = create_base(buf, *len, req, sender);
+				memcpy(p, &batch->tag, sizeof(batch->tag));
+				p += sizeof(batch->tag);
+				memcpy(p, &batch->count, sizeof(batch->count));
+				p += sizeof(batch->count);
+				for (i = 0; i < batch->count; i++) {
+					p = create_packet(p, &batch->packets[i]);
+				}
+			}
+			break;
+		case REQUEST_SEND_BATCH_RESULT:
+			{
+				send_batch_result_t* result;
+
+				result = (send_batch_result_t*) payload;
+
+				*len = (msg_len_type) (MSG_BASE_LEN + sizeof(result->tag) + sizeof(result->count) + result->count * sizeof(result->res[0]));
+
+				p = create_base(buf, *len, req, sender);
+				memcpy(p, &result->tag, sizeof(result->tag));
+				p += sizeof(result->tag);
+				memcpy(p, &result->count, sizeof(result->count));
+				p += sizeof(result->count);
+				memcpy(p, result->res, result->count * sizeof(result->res[0]));
+			}
+			break;
+		case REQUEST_CONTROL:
+		case REQUEST_CONTROL_RESULT:
+			{
+				control_t* control;
+
+				control = (control_t*) payload;
+
+				*len = sizeof(control_t) + MSG_BASE_LEN;
+
+				p = create_base(buf, *len, req, sender);
+				memcpy(p, &control->req, sizeof(control->req));
+				p += sizeof(control->req);
+				memcpy(p, &control->id, sizeof(control->id));
+				p += sizeof(control->id);
+				memcpy(p, &control->res, sizeof(control->res));
+			}
+			break;
+		case REQUEST_SESSION_RESULT:
+			{
+				session_result_t* result;
+
+				result = (session_result_t*) payload;
+
+				*len = sizeof(session_result_t) + MSG_BASE_LEN;
+
+				p = create_base(buf, *len, req, sender);
+				memcpy(p, &result->seq, sizeof(result->seq));
+				p += sizeof(result->seq);
+				memcpy(p, &result->res, sizeof(result->res));
 			}
 			break;
 		case REQUEST_UNICAST_CONTEST:
@@ -165,101 +236,364 @@ void format_create(enum request req, const void* payload, uint8_t* buf, msg_len_
 	}
 }
 
-static void parse_addr_payload(const uint8_t* buf, void* ret_payload);
+// frame is checked before it is copied into payload: every field and message must fit into received bytes
+
+static bool parse_addr_payload(const uint8_t* buf, const uint8_t* end, void* ret_payload);
+
+static bool parse_route_payload(const uint8_t* buf, const uint8_t* end, node_packet_t* payload);
+
+static bool parse_node_update_payload(const uint8_t* buf, const uint8_t* end, node_update_t* payload);
 
-static void parse_route_payload(const uint8_t* buf, node_packet_t* payload);
+static bool parse_notify_payload(const uint8_t* buf, const uint8_t* end, notify_t* payload);
 
-static void parse_node_update_payload(const uint8_t* buf, node_update_t* payload);
+static bool parse_unicast_contest_payload(const uint8_t* buf, const uint8_t* end, unicast_contest_t* payload);
 
-static void parse_notify_payload(const uint8_t* buf, notify_t* payload);
+static bool parse_control_payload(const uint8_t* buf, const uint8_t* end, control_t* payload);
 
-static void parse_unicast_contest_payload(const uint8_t* buf, unicast_contest_t* payload);
+static bool parse_session_result_payload(const uint8_t* buf, const uint8_t* end, session_result_t* payload);
 
-void format_parse(enum request* req, void** payload, const void* buf) {
+static bool parse_send_batch_payload(const uint8_t* buf, const uint8_t* end, send_batch_t* payload);
+
+static bool parse_send_batch_result_payload(const uint8_t* buf, const uint8_t* end, send_batch_result_t* payload);
+
+bool format_parse(enum request* req, union format_payload* payload, const void* buf, size_t len) {
 	const uint8_t* p;
+	const uint8_t* end;
 	enum request cmd;
+	bool res;
 
 	*req = REQUEST_UNDEFINED;
 	p = buf;
+	end = p + len;
+
+	if (len < (size_t) (skip_base(p) - p)) {
+		custom_log_error("Frame of length %zu is too short", len);
+		return false;
+	}
 
 	memcpy(&cmd, p, sizeof(cmd));
 
-	*req = cmd;
 	switch (cmd) {
 		case REQUEST_PING:
 		case REQUEST_REVIVE_NODE:
 		case REQUEST_KILL_NODE:
-			*payload = malloc(sizeof(uint8_t));
-			parse_addr_payload(buf, *payload);
+			res = parse_addr_payload(buf, end, &payload->addr);
 			break;
 		case REQUEST_RESET:
+			res = true;
 			break;
 		case REQUEST_SEND:
 		case REQUEST_ROUTE_DIRECT:
 		case REQUEST_ROUTE_INVERSE:
 		case REQUEST_BROADCAST:
 		case REQUEST_UNICAST:
-			*payload = malloc(sizeof(node_packet_t));
-			parse_route_payload(buf, (node_packet_t*) *payload);
+			res = parse_route_payload(buf, end, &payload->packet);
 			break;
 		case REQUEST_UPDATE:
-			*payload = malloc(sizeof(node_update_t));
-			parse_node_update_payload(buf, *payload);
+			res = parse_node_update_payload(buf, end, &payload->update);
 			break;
 		case REQUEST_NOTIFY:
-			*payload = malloc(sizeof(notify_t));
-			parse_notify_payload(buf, *payload);
+			res = parse_notify_payload(buf, end, &payload->notify);
 			break;
 		case REQUEST_UNICAST_CONTEST:
 		case REQUEST_UNICAST_FIRST:
-			*payload = malloc(sizeof(unicast_contest_t));
-			parse_unicast_contest_payload(buf, *payload);
+			res = parse_unicast_contest_payload(buf, end, &payload->unicast);
+			break;
+		case REQUEST_CONTROL:
+		case REQUEST_CONTROL_RESULT:
+			res = parse_control_payload(buf, end, &payload->control);
+			break;
+		case REQUEST_SESSION_RESULT:
+			res = parse_session_result_payload(buf, end, &payload->session_result);
+			break;
+		case REQUEST_SEND_BATCH:
+			res = parse_send_batch_payload(buf, end, &payload->batch);
+			break;
+		case REQUEST_SEND_BATCH_RESULT:
+			res = parse_send_batch_result_payload(buf, end, &payload->batch_result);
 			break;
 		case REQUEST_UNDEFINED:
 			custom_log_error("Unknown client-server request");
-			break;
+			return false;
 		default:
 			not_implemented();
-			break;
+			return false;
+	}
+
+	if (!res) {
+		custom_log_error("Request %d doesn't fit into frame of length %zu", cmd, len);
+		return false;
+	}
+
+	*req = cmd;
+
+	return true;
+}
+
+static bool fits(const uint8_t* p, const uint8_t* end, size_t len) {
+	return p <= end && (size_t) (end - p) >= len;
+}
+
+// length of app payload at p on wire, 0 if it doesn't fit, its message is longer than APP_MESSAGE_LEN
+// or its checksum is unknown
+static size_t app_len(const uint8_t* p, const uint8_t* end) {
+	uint8_t message_len;
+	uint8_t checksum;
+	size_t len;
+
+	if (!fits(p, end, offsetof(struct app_payload, message))) {
+		return 0;
 	}
+	memcpy(&message_len, p + offsetof(struct app_payload, message_len), sizeof(message_len));
+	memcpy(&checksum, p + offsetof(struct app_payload, checksum), sizeof(checksum));
+	if (message_len > APP_MESSAGE_LEN || checksum >= CRC_KIND_COUNT) {
+		return 0;
+	}
+
+	len = offsetof(struct app_payload, message) + message_len + sizeof(uint16_t);
+
+	return fits(p, end, len) ? len : 0;
 }
 
-static void parse_addr_payload(const uint8_t* buf, void* ret_payload) {
+// length of packet at p on wire, 0 if it doesn't fit (see app_len)
+static size_t packet_len(const uint8_t* p, const uint8_t* end) {
+	size_t len;
+
+	if (!fits(p, end, offsetof(node_packet_t, app_payload))) {
+		return 0;
+	}
+	len = app_len(p + offsetof(node_packet_t, app_payload), end);
+	if (len == 0) {
+		return 0;
+	}
+
+	len += offsetof(node_packet_t, app_payload) + sizeof(uint16_t);
+
+	return fits(p, end, len) ? len : 0;
+}
+
+static bool parse_addr_payload(const uint8_t* buf, const uint8_t* end, void* ret_payload) {
 	const uint8_t* p;
 	uint8_t* payload;
 
 	payload = (uint8_t*) ret_payload;
 
 	p = skip_base(buf);
+	if (!fits(p, end, sizeof(*payload))) {
+		return false;
+	}
 
 	memcpy(payload, p, sizeof(*payload));
-	p += sizeof(payload);
+
+	return true;
+}
+
+static bool parse_route_payload(const uint8_t* buf, const uint8_t* end, node_packet_t* payload) {
+	const uint8_t* p;
+
+	p = skip_base(buf);
+	if (packet_len(p, end) == 0) {
+		return false;
+	}
+
+	parse_packet(p, payload);
+
+	return true;
 }
 
-static void parse_route_payload(const uint8_t* buf, node_packet_t* payload) {
+static bool parse_send_batch_payload(const uint8_t* buf, const uint8_t* end, send_batch_t* payload) {
 	const uint8_t* p;
+	uint8_t i;
 
 	p = skip_base(buf);
+	if (!fits(p, end, sizeof(payload->tag) + sizeof(payload->count))) {
+		return false;
+	}
 
 	// parse payload
-	memcpy(&payload->sender_addr, p, sizeof(payload->sender_addr));
-	p += sizeof(payload->sender_addr);
-	memcpy(&payload->receiver_addr, p, sizeof(payload->receiver_addr));
-	p += sizeof(payload->receiver_addr);
-	memcpy(&payload->local_sender_addr, p, sizeof(payload->local_sender_addr));
-	p += sizeof(payload->local_sender_addr);
-	memcpy(&payload->time_to_live, p, sizeof(payload->time_to_live));
-	p += sizeof(payload->time_to_live);
+	memcpy(&payload->tag, p, sizeof(payload->tag));
+	p += sizeof(payload->tag);
+	memcpy(&payload->count, p, sizeof(payload->count));
+	p += sizeof(payload->count);
+	if (payload->count > SEND_BATCH_MAX) {
+		custom_log_error("Batch of %d sends is too big", payload->count);
+		payload->count = 0;
+		return false;
+	}
+	for (i = 0; i < payload->count; i++) {
+		if (packet_len(p, end) == 0) {
+			payload->count = 0;
+			return false;
+		}
+		p = parse_packet(p, &payload->packets[i]);
+	}
 
-	format_app_parse_message(&payload->app_payload, p);
-	p += format_app_message_len(&payload->app_payload);
-	memcpy(&payload->crc, p, sizeof(payload->crc));
+	return true;
+}
+
+static bool parse_send_batch_result_payload(const uint8_t* buf, const uint8_t* end, send_batch_result_t* payload) {
+	const uint8_t* p;
+
+	p = skip_base(buf);
+	if (!fits(p, end, sizeof(payload->tag) + sizeof(payload->count))) {
+		return false;
+	}
+
+	// parse payload
+	memcpy(&payload->tag, p, sizeof(payload->tag));
+	p += sizeof(payload->tag);
+	memcpy(&payload->count, p, sizeof(payload->count));
+	p += sizeof(payload->count);
+	if (payload->count > SEND_BATCH_MAX || !fits(p, end, payload->count * sizeof(payload->res[0]))) {
+		payload->count = 0;
+		return false;
+	}
+	memcpy(payload->res, p, payload->count * sizeof(payload->res[0]));
+
+	return true;
+}
+
+bool format_batch_add(send_batch_t* batch, const node_packet_t* packet) {
+	if (batch->count == SEND_BATCH_MAX) {
+		return false;
+	}
+
+	batch->packets[batch->count++] = *packet;
+	if (batch_len(batch) > UINT8_MAX) {
+		batch->count--;
+		return false;
+	}
+
+	return true;
+}
+
+static size_t batch_len(send_batch_t* batch) {
+	size_t len;
+	uint8_t i;
+	node_packet_t* packet;
+
+	len = MSG_BASE_LEN + sizeof(batch->tag) + sizeof(batch->count);
+	for (i = 0; i < batch->count; i++) {
+		packet = &batch->packets[i];
+		len += sizeof_packet(packet);
+	}
+
+	return len;
+}
+
+static uint8_t* create_packet(uint8_t* p, node_packet_t* packet) {
+	memcpy(p, &packet->sender_addr, sizeof(packet->sender_addr));
+	p += sizeof(packet->sender_addr);
+	memcpy(p, &packet->receiver_addr, sizeof(packet->receiver_addr));
+	p += sizeof(packet->receiver_addr);
+	memcpy(p, &packet->local_sender_addr, sizeof(packet->local_sender_addr));
+	p += sizeof(packet->local_sender_addr);
+	memcpy(p, &packet->time_to_live, sizeof(packet->time_to_live));
+	p += sizeof(packet->time_to_live);
+	memcpy(p, &packet->face_addr, sizeof(packet->face_addr));
+	p += sizeof(packet->face_addr);
+	format_app_create_message(&packet->app_payload, p);
+	p += format_app_message_len(&packet->app_payload);
+	memcpy(p, &packet->crc, sizeof(packet->crc));
+	p += sizeof(packet->crc);
+
+	return p;
+}
+
+static const uint8_t* parse_packet(const uint8_t* p, node_packet_t* packet) {
+	memcpy(&packet->sender_addr, p, sizeof(packet->sender_addr));
+	p += sizeof(packet->sender_addr);
+	memcpy(&packet->receiver_addr, p, sizeof(packet->receiver_addr));
+	p += sizeof(packet->receiver_addr);
+	memcpy(&packet->local_sender_addr, p, sizeof(packet->local_sender_addr));
+	p += sizeof(packet->local_sender_addr);
+	memcpy(&packet->time_to_live, p, sizeof(packet->time_to_live));
+	p += sizeof(packet->time_to_live);
+	memcpy(&packet->face_addr, p, sizeof(packet->face_addr));
+	p += sizeof(packet->face_addr);
+
+	format_app_parse_message(&packet->app_payload, p);
+	p += format_app_message_len(&packet->app_payload);
+	memcpy(&packet->crc, p, sizeof(packet->crc));
+	p += sizeof(packet->crc);
+
+	return p;
+}
+
+// packet crc covers header and app crc, header tells its kind
+static uint16_t header_crc(const uint8_t* header, const uint8_t* app_crc) {
+	uint8_t kind;
+	uint32_t crc32c;
+	uint16_t crc;
+
+	memcpy(&kind, header + offsetof(node_packet_t, app_payload.checksum), sizeof(kind));
+	if (kind == CRC_KIND_CRC32C) {
+		crc32c = crc32c_update(CRC32C_INIT, header, PACKET_HEADER_LEN);
+		return crc32c_fold(crc32c_update(crc32c, app_crc, sizeof(uint16_t)));
+	}
+
+	crc = crc16(header, PACKET_HEADER_LEN);
+
+	return crc16_update(crc, app_crc, sizeof(uint16_t));
+}
+
+uint16_t format_packet_crc(const node_packet_t* packet) {
+	return header_crc((const uint8_t*) packet, (const uint8_t*) &packet->app_payload.crc);
+}
+
+bool format_peek_packet(const uint8_t* buf, size_t len, packet_header_t* header) {
+	const uint8_t* p;
+	const node_packet_t* packet;
+	uint8_t message_len;
+	uint16_t crc;
+	uint16_t frame_crc;
+
+	p = skip_base(buf);
+	packet = (const node_packet_t*) p; // only offsets are taken, header is laid out same way in frame
+
+	if (packet_len(p, buf + len) == 0) {
+		return false;
+	}
+	memcpy(&message_len, p + offsetof(node_packet_t, app_payload.message_len), sizeof(message_len));
+
+	crc = header_crc(p, p + PACKET_HEADER_LEN + message_len);
+	memcpy(&frame_crc, p + PACKET_HEADER_LEN + message_len + sizeof(packet->app_payload.crc), sizeof(frame_crc));
+	if (crc != frame_crc) {
+		return false;
+	}
+
+	memcpy(&header->sender_addr, p + offsetof(node_packet_t, sender_addr), sizeof(header->sender_addr));
+	memcpy(&header->receiver_addr, p + offsetof(node_packet_t, receiver_addr), sizeof(header->receiver_addr));
+	memcpy(&header->local_sender_addr, p + offsetof(node_packet_t, local_sender_addr), sizeof(header->local_sender_addr));
+	memcpy(&header->time_to_live, p + offsetof(node_packet_t, time_to_live), sizeof(header->time_to_live));
+	memcpy(&header->face_addr, p + offsetof(node_packet_t, face_addr), sizeof(header->face_addr));
+	memcpy(&header->app_id, p + offsetof(node_packet_t, app_payload.id), sizeof(header->app_id));
+
+	return true;
+}
+
+void format_patch_packet(uint8_t* buf, node_addr_t local_sender_addr, ttl_t time_to_live) {
+	uint8_t* p;
+	uint8_t message_len;
+	uint16_t crc;
+
+	p = skip_base(buf);
+
+	memcpy(p + offsetof(node_packet_t, local_sender_addr), &local_sender_addr, sizeof(local_sender_addr));
+	memcpy(p + offsetof(node_packet_t, time_to_live), &time_to_live, sizeof(time_to_live));
+
+	memcpy(&message_len, p + offsetof(node_packet_t, app_payload.message_len), sizeof(message_len));
+	crc = header_crc(p, p + PACKET_HEADER_LEN + message_len);
+	memcpy(p + PACKET_HEADER_LEN + message_len + sizeof(uint16_t), &crc, sizeof(crc));
 }
 
-static void parse_node_update_payload(const uint8_t* buf, node_update_t* payload) {
+static bool parse_node_update_payload(const uint8_t* buf, const uint8_t* end, node_update_t* payload) {
 	const uint8_t* p;
 
 	p = skip_base(buf);
+	if (!fits(p, end, sizeof(*payload))) {
+		return false;
+	}
 
 	// parse payload
 	memcpy(&payload->port, p, sizeof(payload->port));
@@ -267,13 +601,18 @@ static void parse_node_update_payload(const uint8_t* buf, node_update_t* payload
 	memcpy(&payload->addr, p, sizeof(payload->addr));
 	p += sizeof(payload->addr);
 	memcpy(&payload->pid, p, sizeof(payload->pid));
-	p += sizeof(payload->pid);
+
+	return true;
 }
 
-static void parse_unicast_contest_payload(const uint8_t* buf, unicast_contest_t* payload) {
+static bool parse_unicast_contest_payload(const uint8_t* buf, const uint8_t* end, unicast_contest_t* payload) {
 	const uint8_t* p;
 
 	p = skip_base(buf);
+	if (!fits(p, end, sizeof(payload->req) + sizeof(payload->node_addr))
+		|| app_len(p + sizeof(payload->req) + sizeof(payload->node_addr), end) == 0) {
+		return false;
+	}
 
 	// parse payload
 	memcpy(&payload->req, p, sizeof(payload->req));
@@ -281,18 +620,99 @@ static void parse_unicast_contest_payload(const uint8_t* buf, unicast_contest_t*
 	memcpy(&payload->node_addr, p, sizeof(payload->node_addr));
 	p += sizeof(payload->node_addr);
 	format_app_parse_message(&payload->app_payload, p);
+
+	return true;
 }
 
-static void parse_notify_payload(const uint8_t* buf, notify_t* payload) {
+static bool parse_notify_payload(const uint8_t* buf, const uint8_t* end, notify_t* payload) {
 	const uint8_t* p;
 
 	p = skip_base(buf);
+	if (!fits(p, end, sizeof(*payload))) {
+		return false;
+	}
 
 	// parse payload
 	memcpy(&payload->type, p, sizeof(payload->type));
 	p += sizeof(payload->type);
 	memcpy(&payload->app_msg_id, p, sizeof(payload->app_msg_id));
-	p += sizeof(payload->app_msg_id);
+
+	return true;
+}
+
+static bool parse_control_payload(const uint8_t* buf, const uint8_t* end, control_t* payload) {
+	const uint8_t* p;
+
+	p = skip_base(buf);
+	if (!fits(p, end, sizeof(*payload))) {
+		return false;
+	}
+
+	// parse payload
+	memcpy(&payload->req, p, sizeof(payload->req));
+	p += sizeof(payload->req);
+	memcpy(&payload->id, p, sizeof(payload->id));
+	p += sizeof(payload->id);
+	memcpy(&payload->res, p, sizeof(payload->res));
+
+	return true;
+}
+
+static bool parse_session_result_payload(const uint8_t* buf, const uint8_t* end, session_result_t* payload) {
+	const uint8_t* p;
+
+	p = skip_base(buf);
+	if (!fits(p, end, sizeof(*payload))) {
+		return false;
+	}
+
+	// parse payload
+	memcpy(&payload->seq, p, sizeof(payload->seq));
+	p += sizeof(payload->seq);
+	memcpy(&payload->res, p, sizeof(payload->res));
+
+	return true;
+}
+
+bool format_create_session(uint16_t seq, const uint8_t* frame, uint8_t* buf, msg_len_type* len) {
+	uint8_t* p;
+	size_t total;
+
+	total = MSG_BASE_LEN + sizeof(seq) + frame[0];
+	if (total > MAX_MSG_LEN) {
+		custom_log_error("Request of length %d doesn't fit into session frame", frame[0]);
+		return false;
+	}
+
+	*len = (msg_len_type) total;
+	p = create_base(buf, *len, REQUEST_SESSION, REQUEST_SENDER_CLIENT);
+	memcpy(p, &seq, sizeof(seq));
+	p += sizeof(seq);
+	memcpy(p, frame, frame[0]);
+
+	return true;
+}
+
+const uint8_t* format_parse_session(const uint8_t* buf, size_t* len, uint16_t* seq) {
+	const uint8_t* p;
+	msg_len_type frame_len;
+
+	p = skip_base(buf);
+	if (!fits(p, buf + *len, sizeof(*seq) + sizeof(frame_len))) {
+		return NULL;
+	}
+	memcpy(seq, p, sizeof(*seq));
+	p += sizeof(*seq);
+
+	// wrapped frame must end where session frame ends
+	memcpy(&frame_len, p, sizeof(frame_len));
+	if (frame_len <= sizeof(frame_len) || (size_t) (p - buf) + frame_len != *len) {
+		return NULL;
+	}
+	*len = frame_len - sizeof(frame_len);
+
+	// skip length of wrapped frame
+	return p + sizeof(msg_len_type);
 }
 
 static uint8_t* create_base(uint8_t* message, msg_len_type msg_len, enum request cmd, enum request_sender sender) { // NOLINT
@@ -1,8 +1,39 @@
 #include "format_app.h"
 
 #include "settings.h"
+#include "lz.h"
 
 #include <memory.h>
+#include <stdatomic.h>
+#include <time.h>
+
+static bool none_encode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len);
+
+static bool lz_encode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len);
+
+static bool lz_decode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len);
+
+static const struct app_codec_ops none_ops = { .name = "none", .encode = none_encode, .decode = none_encode };
+
+static const struct app_codec_ops lz_ops = { .name = "lz", .encode = lz_encode, .decode = lz_decode };
+
+// registered before nodes start and read only after
+static const struct app_codec_ops* codecs[APP_CODEC_COUNT] = {
+	[APP_CODEC_NONE] = &none_ops,
+	[APP_CODEC_LZ] = &lz_ops,
+};
+
+struct codec_counters {
+	atomic_uint_fast64_t encoded;
+	atomic_uint_fast64_t bypassed;
+	atomic_uint_fast64_t bytes_in;
+	atomic_uint_fast64_t bytes_out;
+	atomic_uint_fast64_t encode_ns;
+	atomic_uint_fast64_t decoded;
+	atomic_uint_fast64_t decode_ns;
+};
+
+static struct codec_counters counters[APP_CODEC_COUNT];
 
 void format_app_create_message(const struct app_payload* app_payload, uint8_t* p) {
 	memcpy(p, &app_payload->req_type, sizeof(app_payload->req_type));
@@ -13,6 +44,10 @@ void format_app_create_message(const struct app_payload* app_payload, uint8_t* p
 	p += sizeof(app_payload->addr_to);
 	memcpy(p, &app_payload->id, sizeof(app_payload->id));
 	p += sizeof(app_payload->id);
+	memcpy(p, &app_payload->codec, sizeof(app_payload->codec));
+	p += sizeof(app_payload->codec);
+	memcpy(p, &app_payload->checksum, sizeof(app_payload->checksum));
+	p += sizeof(app_payload->checksum);
 	memcpy(p, &app_payload->message_len, sizeof(app_payload->message_len));
 	p += sizeof(app_payload->message_len);
 	if (app_payload->message_len) {
@@ -36,6 +71,10 @@ void format_app_parse_message(void* payload, const uint8_t* p) {
 	p += sizeof(app_payload->addr_to);
 	memcpy(&app_payload->id, p, sizeof(app_payload->id));
 	p += sizeof(app_payload->id);
+	memcpy(&app_payload->codec, p, sizeof(app_payload->codec));
+	p += sizeof(app_payload->codec);
+	memcpy(&app_payload->checksum, p, sizeof(app_payload->checksum));
+	p += sizeof(app_payload->checksum);
 	memcpy(&app_payload->message_len, p, sizeof(app_payload->message_len));
 	p += sizeof(app_payload->message_len);
 	if (app_payload->message_len) {
@@ -48,6 +87,129 @@ void format_app_parse_message(void* payload, const uint8_t* p) {
 }
 
 uint8_t format_app_message_len(struct app_payload* payload) {
-	return sizeof(payload->addr_from) + sizeof(payload->addr_to) + sizeof(payload->id) +
-		sizeof(payload->message_len) + payload->message_len + sizeof(payload->req_type) + sizeof(payload->crc);
+	return sizeof(payload->addr_from) + sizeof(payload->addr_to) + sizeof(payload->id) + sizeof(payload->codec) +
+		sizeof(payload->checksum) + sizeof(payload->message_len) + payload->message_len + sizeof(payload->req_type) + sizeof(payload->crc);
+}
+
+void format_app_register_codec(enum app_codec codec, const struct app_codec_ops* ops) {
+	if (codec < APP_CODEC_COUNT) {
+		codecs[codec] = ops;
+	}
+}
+
+const char* format_app_codec_name(enum app_codec codec) {
+	return codec < APP_CODEC_COUNT && codecs[codec] ? codecs[codec]->name : "unknown";
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+void format_app_encode(struct app_payload* payload, enum app_codec codec) {
+	struct codec_counters* c;
+	uint8_t b[APP_MESSAGE_LEN];
+	uint8_t len;
+	uint64_t start;
+	bool res;
+
+	payload->codec = APP_CODEC_NONE;
+	if (codec == APP_CODEC_NONE || codec >= APP_CODEC_COUNT || codecs[codec] == NULL || payload->message_len == 0) {
+		return;
+	}
+
+	c = &counters[codec];
+	start = now_ns();
+	res = codecs[codec]->encode(payload->message, payload->message_len, b, &len);
+	atomic_fetch_add_explicit(&c->encode_ns, now_ns() - start, memory_order_relaxed);
+	atomic_fetch_add_explicit(&c->bytes_in, payload->message_len, memory_order_relaxed);
+
+	// codec that doesn't pay off costs only its time
+	if (!res || len >= payload->message_len) {
+		atomic_fetch_add_explicit(&c->bypassed, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&c->bytes_out, payload->message_len, memory_order_relaxed);
+		return;
+	}
+
+	atomic_fetch_add_explicit(&c->encoded, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&c->bytes_out, len, memory_order_relaxed);
+	memcpy(payload->message, b, len);
+	payload->message_len = len;
+	payload->codec = (uint8_t) codec;
+}
+
+bool format_app_decode(struct app_payload* payload) {
+	struct codec_counters* c;
+	uint8_t b[APP_MESSAGE_LEN];
+	uint8_t len;
+	uint64_t start;
+	bool res;
+
+	if (payload->codec == APP_CODEC_NONE) {
+		return true;
+	}
+	if (payload->codec >= APP_CODEC_COUNT || codecs[payload->codec] == NULL || payload->message_len > APP_MESSAGE_LEN) {
+		return false;
+	}
+
+	c = &counters[payload->codec];
+	start = now_ns();
+	res = codecs[payload->codec]->decode(payload->message, payload->message_len, b, &len);
+	atomic_fetch_add_explicit(&c->decode_ns, now_ns() - start, memory_order_relaxed);
+	if (!res) {
+		return false;
+	}
+
+	atomic_fetch_add_explicit(&c->decoded, 1, memory_order_relaxed);
+	memcpy(payload->message, b, len);
+	payload->message_len = len;
+	payload->codec = APP_CODEC_NONE;
+
+	return true;
+}
+
+void format_app_codec_stats(enum app_codec codec, struct app_codec_stats* stats) {
+	struct codec_counters* c;
+
+	memset(stats, 0, sizeof(*stats));
+	if (codec >= APP_CODEC_COUNT) {
+		return;
+	}
+
+	c = &counters[codec];
+	stats->encoded = atomic_load_explicit(&c->encoded, memory_order_relaxed);
+	stats->bypassed = atomic_load_explicit(&c->bypassed, memory_order_relaxed);
+	stats->bytes_in = atomic_load_explicit(&c->bytes_in, memory_order_relaxed);
+	stats->bytes_out = atomic_load_explicit(&c->bytes_out, memory_order_relaxed);
+	stats->encode_ns = atomic_load_explicit(&c->encode_ns, memory_order_relaxed);
+	stats->decoded = atomic_load_explicit(&c->decoded, memory_order_relaxed);
+	stats->decode_ns = atomic_load_explicit(&c->decode_ns, memory_order_relaxed);
+}
+
+static bool none_encode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len) {
+	memcpy(out, in, in_len);
+	*out_len = in_len;
+
+	return true;
+}
+
+static bool lz_encode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len) {
+	size_t len;
+
+	len = lz_compress(in, in_len, out, APP_MESSAGE_LEN);
+	*out_len = (uint8_t) len;
+
+	return len > 0;
+}
+
+static bool lz_decode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len) {
+	size_t len;
+
+	len = lz_decompress(in, in_len, out, APP_MESSAGE_LEN);
+	*out_len = (uint8_t) len;
+
+	return len > 0;
 }
@@ -0,0 +1,173 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_HASH_BITS 8
+#define LZ_NIBBLE_MAX 15
+#define LZ_NO_POS -1
+
+static uint32_t hash4(const uint8_t* p) {
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static size_t length_bytes(size_t len) {
+	return len < LZ_NIBBLE_MAX ? 0 : (len - LZ_NIBBLE_MAX) / UINT8_MAX + 1;
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len) {
+	if (len < LZ_NIBBLE_MAX) {
+		return op;
+	}
+	for (len -= LZ_NIBBLE_MAX; len >= UINT8_MAX; len -= UINT8_MAX) {
+		*op++ = UINT8_MAX;
+	}
+	*op++ = (uint8_t) len;
+
+	return op;
+}
+
+// match_len is 0 for last sequence
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* out_end, const uint8_t* literals, size_t literal_len, size_t offset, size_t match_len) {
+	size_t need;
+	size_t match_code;
+
+	match_code = match_len ? match_len - LZ_MIN_MATCH : 0;
+	need = 1 + length_bytes(literal_len) + literal_len + (match_len ? 1 + length_bytes(match_code) : 0);
+	if (need > (size_t) (out_end - op)) {
+		return NULL;
+	}
+
+	*op++ = (uint8_t) ((literal_len < LZ_NIBBLE_MAX ? literal_len : LZ_NIBBLE_MAX) << 4
+		| (match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX));
+	op = put_length(op, literal_len);
+	memcpy(op, literals, literal_len);
+	op += literal_len;
+
+	if (match_len) {
+		*op++ = (uint8_t) offset;
+		op = put_length(op, match_code);
+	}
+
+	return op;
+}
+
+size_t lz_compress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap) {
+	int16_t table[1 << LZ_HASH_BITS];
+	const uint8_t* out_end;
+	uint8_t* op;
+	size_t anchor;
+	size_t match_len;
+	size_t i;
+	int16_t candidate;
+	uint32_t h;
+
+	// offset is one byte
+	if (in_len > UINT8_MAX) {
+		return 0;
+	}
+
+	memset(table, 0xFF, sizeof(table));
+	op = out;
+	out_end = out + out_cap;
+	anchor = 0;
+	i = 0;
+
+	while (i + LZ_MIN_MATCH <= in_len) {
+		h = hash4(in + i);
+		candidate = table[h];
+		table[h] = (int16_t) i;
+
+		if (candidate == LZ_NO_POS || memcmp(in + candidate, in + i, LZ_MIN_MATCH) != 0) {
+			i++;
+			continue;
+		}
+
+		match_len = LZ_MIN_MATCH;
+		while (i + match_len < in_len && in[(size_t) candidate + match_len] == in[i + match_len]) {
+			match_len++;
+		}
+
+		op = put_sequence(op, out_end, in + anchor, i - anchor, i - (size_t) candidate, match_len);
+		if (op == NULL) {
+			return 0;
+		}
+		i += match_len;
+		anchor = i;
+	}
+
+	op = put_sequence(op, out_end, in + anchor, in_len - anchor, 0, 0);
+	if (op == NULL) {
+		return 0;
+	}
+
+	return (size_t) (op - out);
+}
+
+// returns NULL if length runs past input
+static const uint8_t* get_length(const uint8_t* ip, const uint8_t* in_end, size_t* len) {
+	uint8_t b;
+
+	if (*len != LZ_NIBBLE_MAX) {
+		return ip;
+	}
+	do {
+		if (ip == in_end) {
+			return NULL;
+		}
+		b = *ip++;
+		*len += b;
+	} while (b == UINT8_MAX);
+
+	return ip;
+}
+
+size_t lz_decompress(const uint8_t* in, size_t in_len, uint8_t* out, size_t out_cap) {
+	const uint8_t* ip;
+	const uint8_t* in_end;
+	uint8_t* op;
+	uint8_t* out_end;
+	size_t literal_len;
+	size_t match_len;
+	size_t offset;
+
+	ip = in;
+	in_end = in + in_len;
+	op = out;
+	out_end = out + out_cap;
+
+	while (ip < in_end) {
+		literal_len = *ip >> 4;
+		match_len = *ip & LZ_NIBBLE_MAX;
+		ip++;
+
+		ip = get_length(ip, in_end, &literal_len);
+		if (ip == NULL || literal_len > (size_t) (in_end - ip) || literal_len > (size_t) (out_end - op)) {
+			return 0;
+		}
+		memcpy(op, ip, literal_len);
+		ip += literal_len;
+		op += literal_len;
+
+		// last sequence
+		if (ip == in_end) {
+			break;
+		}
+
+		offset = *ip++;
+		ip = get_length(ip, in_end, &match_len);
+		match_len += LZ_MIN_MATCH;
+		if (ip == NULL || offset == 0 || offset > (size_t) (op - out) || match_len > (size_t) (out_end - op)) {
+			return 0;
+		}
+		// match can overlap bytes it produces
+		for (; match_len > 0; match_len--, op++) {
+			*op = *(op - offset);
+		}
+	}
+
+	return (size_t) (op - out);
+}
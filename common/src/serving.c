@@ -1,90 +1,1326 @@
 #include "serving.h"
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
-#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-static void add_to_pfds(struct pollfd* pfds[], int newfd, uint32_t* fd_count, size_t* fd_size);
+#include "custom_logger.h"
+#include "format.h"
+
+#ifdef SERVING_EPOLL
+#include <sys/epoll.h>
+#else
+#include <poll.h>
+#endif
+
+#ifdef SERVING_URING
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define POLL_TIMEOUT_MS 5000
+
+#define RX_MASK (SERVING_RX_CAPACITY - 1)
+
+#define TX_MASK (SERVING_TX_DEPTH - 1)
+
+_Static_assert((SERVING_RX_CAPACITY & RX_MASK) == 0, "SERVING_RX_CAPACITY must be power of two");
+_Static_assert(SERVING_RX_CAPACITY >= MAX_MSG_LEN, "SERVING_RX_CAPACITY must fit max message");
+_Static_assert((SERVING_TX_DEPTH & TX_MASK) == 0 && SERVING_TX_DEPTH > 1, "SERVING_TX_DEPTH must be power of two");
+
+__attribute__((warn_unused_result))
+static bool read_conn(struct serving_data* serving, struct serving_conn* conn, void* data);
+
+static void flush_conn(struct serving_data* serving, struct serving_conn* conn);
+
+static void flush_pending(struct serving_data* serving);
+
+static void free_closed(struct serving_data* serving);
+
+static void drop_conn(struct serving_data* serving, struct serving_conn* conn);
+
+static struct serving_conn* new_conn(int32_t fd, serving_close_t on_close, void* ctx);
+
+static void mark_pending(struct serving_data* serving, struct serving_conn* conn);
+
+// free slot at tail of send queue, NULL if frame is rejected by overflow policy
+__attribute__((warn_unused_result))
+static uint8_t* tx_reserve(struct serving_data* serving, struct serving_conn* conn);
+
+__attribute__((warn_unused_result))
+static bool rx_dispatch(struct serving_data* serving, struct serving_conn* conn, void* data);
+
+static void init_common(struct serving_data* serving, int32_t server_fd, serving_handler_t handle_request);
+
+static void free_common(struct serving_data* serving);
+
+// backend specific
+
+__attribute__((warn_unused_result))
+static bool register_conn(struct serving_data* serving, struct serving_conn* conn);
+
+static void unregister_conn(struct serving_data* serving, struct serving_conn* conn);
+
+static void want_write(struct serving_data* serving, struct serving_conn* conn, bool enable);
+
+#ifdef SERVING_EPOLL
+
+#define MAX_EVENTS 64
 
-static void del_from_pfds(struct pollfd pfds[], size_t i, uint32_t* fd_count);
+static void accept_all(struct serving_data* serving);
+
+static void link_conn(struct serving_data* serving, struct serving_conn* conn);
+
+#ifdef SERVING_URING
+
+__attribute__((warn_unused_result))
+static bool uring_init(struct serving_data* serving);
+
+static void uring_free(struct serving_data* serving);
+
+static void uring_poll(struct serving_data* serving, void* data);
+
+__attribute__((warn_unused_result))
+static bool uring_arm(struct serving_data* serving, struct serving_conn* conn);
+
+static void uring_cancel(struct serving_data* serving, struct serving_conn* conn);
+
+static void uring_send_queue(struct serving_data* serving, struct serving_conn* conn);
+
+#endif
+
+void serving_poll(struct serving_data* serving, void* data) {
+	struct epoll_event events[MAX_EVENTS];
+	int32_t event_count;
+	int32_t i;
+
+#ifdef SERVING_URING
+	if (serving->uring) {
+		uring_poll(serving, data);
+		return;
+	}
+#endif
+
+	event_count = epoll_wait(serving->epoll_fd, events, MAX_EVENTS, serving->timeout_ms);
+
+	if (event_count == -1) {
+		if (errno == EINTR) {
+			return;
+		}
+		perror("epoll_wait");
+		exit(1);
+	}
+
+	for (i = 0; i < event_count; i++) {
+		struct serving_conn* conn;
+
+		conn = events[i].data.ptr;
+		if (conn == &serving->listener) {
+			accept_all(serving);
+			continue;
+		}
+
+		// edge triggered: read_conn reads until EAGAIN so no readiness is lost
+		if (conn->fd >= 0 && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+			if (!read_conn(serving, conn, data)) {
+				drop_conn(serving, conn);
+			}
+		}
+
+		if (conn->fd >= 0 && (events[i].events & EPOLLOUT) && conn->tx.head != conn->tx.tail) {
+			flush_conn(serving, conn);
+		}
+	}
+
+	flush_pending(serving);
+	free_closed(serving);
+}
+
+void serving_init(struct serving_data* serving, int32_t server_fd, serving_handler_t handle_request) {
+	struct epoll_event ev;
+
+	init_common(serving, server_fd, handle_request);
+	serving->conns = NULL;
+	serving->listener.fd = server_fd;
+	serving->epoll_fd = -1;
+
+#ifdef SERVING_URING
+	if (uring_init(serving)) {
+		return;
+	}
+#endif
+
+	serving->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (serving->epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	// edge triggered listener must be drained until EAGAIN so it can't block
+	fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.ptr = &serving->listener;
+	if (epoll_ctl(serving->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+}
+
+void serving_free(struct serving_data* serving) {
+	while (serving->conns) {
+		serving_close_conn(serving, serving->conns);
+	}
+
+#ifdef SERVING_URING
+	// requests still referencing closed connections are canceled with ring
+	uring_free(serving);
+#endif
+
+	free_common(serving);
+	close(serving->server_fd);
+	if (serving->epoll_fd >= 0) {
+		close(serving->epoll_fd);
+	}
+}
+
+static void accept_all(struct serving_data* serving) {
+	int32_t newfd;
+	struct serving_conn* conn;
+
+	for (;;) {
+		serving->addrlen = sizeof(serving->remoteaddr);
+		newfd = accept(serving->server_fd, (struct sockaddr *) &serving->remoteaddr, &serving->addrlen);
+
+		if (newfd == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("accept");
+			}
+			if (errno != EINTR) {
+				return;
+			}
+		} else {
+			conn = new_conn(newfd, NULL, NULL);
+			if (conn && !register_conn(serving, conn)) {
+				close(newfd);
+				free(conn);
+			}
+		}
+	}
+}
+
+static bool register_conn(struct serving_data* serving, struct serving_conn* conn) {
+	struct epoll_event ev;
+
+#ifdef SERVING_URING
+	if (serving->uring) {
+		if (!uring_arm(serving, conn)) {
+			return false;
+		}
+		link_conn(serving, conn);
+		return true;
+	}
+#endif
+
+	// write readiness is edge triggered too, so it is reported only when queue can move on
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = conn;
+	if (epoll_ctl(serving->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return false;
+	}
+
+	link_conn(serving, conn);
+
+	return true;
+}
+
+static void link_conn(struct serving_data* serving, struct serving_conn* conn) {
+	conn->prev = NULL;
+	conn->next = serving->conns;
+	if (serving->conns) {
+		serving->conns->prev = conn;
+	}
+	serving->conns = conn;
+}
+
+static void unregister_conn(struct serving_data* serving, struct serving_conn* conn) {
+	// closing fd removes it from epoll set
+	if (conn->prev) {
+		conn->prev->next = conn->next;
+	} else {
+		serving->conns = conn->next;
+	}
+	if (conn->next) {
+		conn->next->prev = conn->prev;
+	}
+}
+
+static void want_write(struct serving_data* serving, struct serving_conn* conn, bool enable) {
+	// EPOLLOUT is always registered
+	(void) serving;
+	(void) conn;
+	(void) enable;
+}
+
+#ifdef SERVING_URING
+
+// sqes are prepared during serving_poll and submitted by the single io_uring_enter that waits for next completions
+
+#define URING_ENTRIES 256
+
+// receive buffers shared by all connections, kernel picks one per completion
+#define URING_BUFS 256
+#define URING_BUF_SIZE 1024
+#define URING_BGID 0
+
+#define URING_OP_MASK 7
+
+_Static_assert(URING_BUF_SIZE + MAX_MSG_LEN <= SERVING_RX_CAPACITY, "receive buffer must fit into rx ring beside unfinished frame");
+_Static_assert(SERVING_TX_DEPTH < URING_ENTRIES, "send queue must fit into submission queue");
+
+// stored in low bits of user_data next to connection pointer
+enum uring_op {
+	URING_OP_NONE,
+	URING_OP_ACCEPT,
+	URING_OP_RECV,
+	URING_OP_POLL,
+	URING_OP_SEND
+};
+
+struct serving_uring {
+	int32_t fd;
+	void* ring;
+	size_t ring_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+	uint32_t* sq_head;
+	uint32_t* sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	// sqes prepared since last submit
+	uint32_t sq_local_tail;
+	uint32_t* cq_head;
+	uint32_t* cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe* cqes;
+	struct io_uring_buf_ring* br;
+	uint8_t* bufs;
+	uint16_t br_tail;
+	// wait limit of submit that waits for completions (see serving_data timeout_ms)
+	int32_t timeout_ms;
+};
+
+static long uring_enter(const struct serving_uring* uring, uint32_t min_complete, uint32_t flags) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	uint32_t to_submit;
+
+	to_submit = uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+	ts.tv_sec = uring->timeout_ms / 1000;
+	ts.tv_nsec = (uring->timeout_ms % 1000) * 1000000LL;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t) (uintptr_t) &ts;
+
+	return syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+// returns NULL only if kernel doesn't take prepared sqes
+static struct io_uring_sqe* uring_sqe(struct serving_uring* uring, struct serving_conn* conn, enum uring_op op) {
+	struct io_uring_sqe* sqe;
+
+	if (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) == uring->sq_entries) {
+		if (uring_enter(uring, 0, 0) < 0) {
+			perror("io_uring_enter");
+			return NULL;
+		}
+	}
+
+	sqe = &uring->sqes[uring->sq_local_tail & uring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uint64_t) (uintptr_t) conn | op;
+
+	uring->sq_local_tail++;
+	__atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+static uint32_t uring_sq_space(const struct serving_uring* uring) {
+	return uring->sq_entries - (uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static void uring_give_buf(struct serving_uring* uring, uint16_t bid) {
+	struct io_uring_buf* buf;
+
+	buf = &uring->br->bufs[uring->br_tail & (URING_BUFS - 1)];
+	buf->addr = (uint64_t) (uintptr_t) (uring->bufs + (size_t) bid * URING_BUF_SIZE);
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+
+	uring->br_tail++;
+	__atomic_store_n(&uring->br->tail, uring->br_tail, __ATOMIC_RELEASE);
+}
+
+__attribute__((warn_unused_result))
+static bool uring_arm_accept(struct serving_data* serving) {
+	struct io_uring_sqe* sqe;
+
+	sqe = uring_sqe(serving->uring, &serving->listener, URING_OP_ACCEPT);
+	if (!sqe) {
+		return false;
+	}
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = serving->server_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+
+	return true;
+}
+
+static bool uring_arm(struct serving_data* serving, struct serving_conn* conn) {
+	struct io_uring_sqe* sqe;
+
+	sqe = uring_sqe(serving->uring, conn, conn->on_readable ? URING_OP_POLL : URING_OP_RECV);
+	if (!sqe) {
+		return false;
+	}
+
+	sqe->fd = conn->fd;
+	if (conn->on_readable) {
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+		sqe->len = IORING_POLL_ADD_MULTI;
+	} else {
+		// one request keeps receiving into provided buffers until it fails
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+	}
+	conn->uring_ops++;
+
+	return true;
+}
+
+static void uring_cancel(struct serving_data* serving, struct serving_conn* conn) {
+	struct io_uring_sqe* sqe;
+
+	if (!conn->uring_ops) {
+		return;
+	}
+
+	sqe = uring_sqe(serving->uring, NULL, URING_OP_NONE);
+	if (!sqe) {
+		return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = conn->fd;
+	sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+
+	// fd is closed right after, so cancel can't wait for next serving_poll
+	if (uring_enter(serving->uring, 0, 0) < 0) {
+		perror("io_uring_enter");
+	}
+}
+
+// frames are sent by linked requests, so they leave in order and one failure cancels the rest
+static void uring_send_queue(struct serving_data* serving, struct serving_conn* conn) {
+	struct serving_tx* tx;
+	struct io_uring_sqe* sqe;
+	uint8_t* frame;
+	uint32_t i;
+
+	tx = &conn->tx;
+	if (conn->uring_sends || tx->head == tx->tail) {
+		// rest of queue is submitted when sends in flight complete
+		return;
+	}
+
+	// chain must not be split between submissions
+	if (uring_sq_space(serving->uring) < tx->tail - tx->head && uring_enter(serving->uring, 0, 0) < 0) {
+		perror("io_uring_enter");
+		drop_conn(serving, conn);
+		return;
+	}
+
+	for (i = tx->head; i != tx->tail; i++) {
+		sqe = uring_sqe(serving->uring, conn, URING_OP_SEND);
+		if (!sqe) {
+			drop_conn(serving, conn);
+			return;
+		}
+		frame = tx->frames[i & TX_MASK];
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->fd;
+		sqe->addr = (uint64_t) (uintptr_t) (frame + (i == tx->head ? tx->offset : 0));
+		sqe->len = frame[0] - (i == tx->head ? tx->offset : 0);
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		if (i + 1 != tx->tail) {
+			sqe->flags = IOSQE_IO_LINK;
+		}
+
+		conn->uring_sends++;
+		conn->uring_ops++;
+	}
+}
+
+static void uring_complete_accept(struct serving_data* serving, const struct io_uring_cqe* cqe) {
+	struct serving_conn* conn;
+
+	if (cqe->res >= 0) {
+		conn = new_conn(cqe->res, NULL, NULL);
+		if (conn && !register_conn(serving, conn)) {
+			close(cqe->res);
+			free(conn);
+		}
+	} else if (cqe->res != -ECANCELED) {
+		custom_log_error("Failed to accept connection: %d", -cqe->res);
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ECANCELED && !uring_arm_accept(serving)) {
+		custom_log_error("Failed to accept connections");
+	}
+}
+
+__attribute__((warn_unused_result))
+static bool uring_complete_recv(struct serving_data* serving, struct serving_conn* conn, const struct io_uring_cqe* cqe, void* data) {
+	struct serving_rx* rx;
+	uint8_t* buf;
+	uint32_t tail;
+	uint32_t first_len;
+	uint16_t bid;
+
+	if (cqe->res == -ENOBUFS) {
+		// all buffers are in use, they come back as other completions are handled
+		return true;
+	}
+	if (cqe->res <= 0) {
+		// EOF or error
+		return false;
+	}
+
+	bid = (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+	buf = serving->uring->bufs + (size_t) bid * URING_BUF_SIZE;
+
+	rx = &conn->rx;
+	tail = rx->tail & RX_MASK;
+	first_len = SERVING_RX_CAPACITY - tail;
+	if (first_len > (uint32_t) cqe->res) {
+		first_len = (uint32_t) cqe->res;
+	}
+	memcpy(rx->buf + tail, buf, first_len);
+	memcpy(rx->buf, buf + first_len, (uint32_t) cqe->res - first_len);
+	rx->tail += (uint32_t) cqe->res;
+
+	uring_give_buf(serving->uring, bid);
+
+	return rx_dispatch(serving, conn, data);
+}
+
+static void uring_complete_send(struct serving_data* serving, struct serving_conn* conn, const struct io_uring_cqe* cqe) {
+	struct serving_tx* tx;
+
+	conn->uring_sends--;
+	if (conn->fd < 0) {
+		return;
+	}
+
+	tx = &conn->tx;
+	if (cqe->res < 0 && cqe->res != -ECANCELED) {
+		custom_log_error("Failed to send queued frames to fd %d", conn->fd);
+		drop_conn(serving, conn);
+		return;
+	}
+
+	if (cqe->res > 0) {
+		// short send breaks link chain: frames after it are canceled and submitted again
+		tx->offset += (uint32_t) cqe->res;
+		if (tx->offset >= tx->frames[tx->head & TX_MASK][0]) {
+			tx->head++;
+			tx->offset = 0;
+		}
+	}
+
+	if (!conn->uring_sends && tx->head != tx->tail) {
+		mark_pending(serving, conn);
+	} else if (!conn->uring_sends && conn->finishing) {
+		serving_close_conn(serving, conn);
+	}
+}
+
+static void uring_complete(struct serving_data* serving, const struct io_uring_cqe* cqe, void* data) {
+	struct serving_conn* conn;
+	enum uring_op op;
+	bool more;
+
+	op = (enum uring_op) (cqe->user_data & URING_OP_MASK);
+	conn = (struct serving_conn*) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+	more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+
+	switch (op) {
+		case URING_OP_NONE:
+			return;
+		case URING_OP_ACCEPT:
+			uring_complete_accept(serving, cqe);
+			return;
+		case URING_OP_SEND:
+			conn->uring_ops--;
+			uring_complete_send(serving, conn, cqe);
+			return;
+		case URING_OP_RECV:
+		case URING_OP_POLL:
+			break;
+	}
+
+	if (!more) {
+		conn->uring_ops--;
+	}
+
+	if (conn->fd < 0) {
+		if (cqe->flags & IORING_CQE_F_BUFFER) {
+			uring_give_buf(serving->uring, (uint16_t) (cqe->flags >> IORING_CQE_BUFFER_SHIFT));
+		}
+		return;
+	}
+
+	if (op == URING_OP_POLL) {
+		if (cqe->res < 0 || !conn->on_readable(serving, conn, data)) {
+			drop_conn(serving, conn);
+			return;
+		}
+	} else if (!uring_complete_recv(serving, conn, cqe, data)) {
+		drop_conn(serving, conn);
+		return;
+	}
+
+	// multishot request ends e.g. when buffers run out
+	if (conn->fd >= 0 && !more && !uring_arm(serving, conn)) {
+		drop_conn(serving, conn);
+	}
+}
+
+static void uring_poll(struct serving_data* serving, void* data) {
+	struct serving_uring* uring;
+	struct io_uring_cqe cqe;
+	uint32_t head;
+	long rv;
+
+	uring = serving->uring;
+	uring->timeout_ms = serving->timeout_ms;
+
+	// submits everything queued by previous iteration and waits for completions in one syscall
+	rv = uring_enter(uring, 1, IORING_ENTER_GETEVENTS);
+	if (rv < 0 && errno != ETIME && errno != EINTR) {
+		perror("io_uring_enter");
+		exit(1);
+	}
+
+	head = *uring->cq_head;
+	while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+		cqe = uring->cqes[head & uring->cq_mask];
+		head++;
+		// slot is released before handling, handlers can enter ring
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		uring_complete(serving, &cqe, data);
+	}
+
+	flush_pending(serving);
+	free_closed(serving);
+}
+
+static bool uring_init(struct serving_data* serving) {
+	struct serving_uring* uring;
+	struct io_uring_params params;
+	struct io_uring_buf_reg reg;
+	size_t sq_size;
+	size_t cq_size;
+	int32_t fd;
+	uint16_t i;
+
+	serving->uring = NULL;
+
+	memset(&params, 0, sizeof(params));
+	// only serving thread uses ring, completions are processed when it waits for them
+	params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+	params.cq_entries = URING_ENTRIES * 4;
+
+	fd = (int32_t) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (fd < 0) {
+		custom_log_info("io_uring is unavailable (%d): using epoll", errno);
+		return false;
+	}
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+		custom_log_info("io_uring is too old: using epoll");
+		close(fd);
+		return false;
+	}
+
+	uring = calloc(1, sizeof(*uring));
+	uring->fd = fd;
+	uring->timeout_ms = serving->timeout_ms;
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+	uring->ring = mmap(NULL, uring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	// registered ring of provided buffers must be page aligned
+	uring->br = mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uring->bufs = malloc((size_t) URING_BUFS * URING_BUF_SIZE);
+
+	if (uring->ring == MAP_FAILED || uring->sqes == MAP_FAILED || uring->br == MAP_FAILED || !uring->bufs) {
+		custom_log_error("Failed to map io_uring: using epoll");
+		serving->uring = uring;
+		uring_free(serving);
+		return false;
+	}
+
+	uring->sq_head = (uint32_t*) ((uint8_t*) uring->ring + params.sq_off.head);
+	uring->sq_tail = (uint32_t*) ((uint8_t*) uring->ring + params.sq_off.tail);
+	uring->sq_mask = *(uint32_t*) ((uint8_t*) uring->ring + params.sq_off.ring_mask);
+	uring->sq_entries = params.sq_entries;
+	uring->sq_local_tail = *uring->sq_tail;
+	uring->cq_head = (uint32_t*) ((uint8_t*) uring->ring + params.cq_off.head);
+	uring->cq_tail = (uint32_t*) ((uint8_t*) uring->ring + params.cq_off.tail);
+	uring->cq_mask = *(uint32_t*) ((uint8_t*) uring->ring + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe*) ((uint8_t*) uring->ring + params.cq_off.cqes);
+
+	// sqes are taken in order, so submission array is identity
+	for (i = 0; i < params.sq_entries; i++) {
+		((uint32_t*) ((uint8_t*) uring->ring + params.sq_off.array))[i] = i;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t) (uintptr_t) uring->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		custom_log_info("io_uring provided buffers are unavailable (%d): using epoll", errno);
+		serving->uring = uring;
+		uring_free(serving);
+		return false;
+	}
+
+	for (i = 0; i < URING_BUFS; i++) {
+		uring_give_buf(uring, i);
+	}
+
+	serving->uring = uring;
+	if (!uring_arm_accept(serving)) {
+		uring_free(serving);
+		return false;
+	}
+
+	return true;
+}
+
+static void uring_free(struct serving_data* serving) {
+	struct serving_uring* uring;
+
+	uring = serving->uring;
+	if (!uring) {
+		return;
+	}
+
+	close(uring->fd);
+	if (uring->ring != MAP_FAILED) {
+		munmap(uring->ring, uring->ring_size);
+	}
+	if (uring->sqes != MAP_FAILED) {
+		munmap(uring->sqes, uring->sqes_size);
+	}
+	if (uring->br != MAP_FAILED) {
+		munmap(uring->br, URING_BUFS * sizeof(struct io_uring_buf));
+	}
+	free(uring->bufs);
+	free(uring);
+
+	serving->uring = NULL;
+}
+
+#endif
+
+#else
 
 void serving_poll(struct serving_data* serving, void* data) {
 	size_t i;
 	int32_t newfd;
 	int32_t poll_count;
+	struct serving_conn* conn;
+	int16_t revents;
 
-	poll_count = poll(serving->pfds, serving->pfd_count, 5000);
+	poll_count = poll(serving->pfds, serving->pfd_count, serving->timeout_ms);
 
 	if (poll_count == -1) {
+		if (errno == EINTR) {
+			return;
+		}
 		perror("poll");
 		exit(1);
 	}
 
 	for (i = 0; i < serving->pfd_count; i++) {
+		conn = serving->conns[i];
+		revents = serving->pfds[i].revents;
+		serving->pfds[i].revents = 0;
 
-		if (serving->pfds[i].revents & POLLIN) {
-			if (serving->pfds[i].fd == serving->server_fd) {
+		if (conn == NULL) {
+			if (revents & POLLIN) {
 				serving->addrlen = sizeof(serving->remoteaddr);
 				newfd = accept(serving->server_fd, (struct sockaddr *) &serving->remoteaddr, &serving->addrlen);
 
 				if (newfd == -1) {
-					perror("accept");
+					// listener shared with other loops could be drained by them
+					if (errno != EAGAIN && errno != EWOULDBLOCK) {
+						perror("accept");
+					}
 				} else {
-					add_to_pfds(&serving->pfds, newfd, &serving->pfd_count, &serving->pfd_capacity);
+					conn = new_conn(newfd, NULL, NULL);
+					if (conn && !register_conn(serving, conn)) {
+						close(newfd);
+						free(conn);
+					}
 				}
-			} else {
-				int32_t sender_fd;
+			}
+			continue;
+		}
 
-				sender_fd = serving->pfds[i].fd;
-				if (!serving->handle_request(sender_fd, data)) {
-					close(sender_fd);
-					del_from_pfds(serving->pfds, i, &serving->pfd_count);
-				}
+		if (revents & (POLLIN | POLLHUP | POLLERR)) {
+			if (!read_conn(serving, conn, data)) {
+				drop_conn(serving, conn);
 			}
 		}
+
+		if (conn->fd >= 0 && (revents & POLLOUT)) {
+			flush_conn(serving, conn);
+		}
+
+		if (i < serving->pfd_count && serving->conns[i] != conn) {
+			// last entry was swapped into i so it must be checked too
+			i--;
+		}
 	}
+
+	flush_pending(serving);
+	free_closed(serving);
 }
 
-void serving_init(struct serving_data* serving, int32_t server_fd, bool (*handle_request)(int32_t sender_fd, void* data)) {
-	serving->server_fd = server_fd;
-	serving->handle_request = handle_request;
+void serving_init(struct serving_data* serving, int32_t server_fd, serving_handler_t handle_request) {
+	init_common(serving, server_fd, handle_request);
 
 	serving->pfd_count = 0;
 	serving->pfd_capacity = 5;
 	serving->pfds = malloc(sizeof(struct pollfd) * serving->pfd_capacity);
+	serving->conns = malloc(sizeof(struct serving_conn*) * serving->pfd_capacity);
 
 	serving->pfds[0].fd = serving->server_fd;
-    serving->pfds[0].events = POLLIN;
+	serving->pfds[0].events = POLLIN;
+	serving->pfds[0].revents = 0;
+	serving->conns[0] = NULL;
 	serving->pfd_count++;
 }
 
 void serving_free(struct serving_data* serving) {
-	size_t i;
-
-	for (i = 0; i < serving->pfd_count; i++) {
-		close(serving->pfds[i].fd);
+	while (serving->pfd_count > 1) {
+		serving_close_conn(serving, serving->conns[serving->pfd_count - 1]);
 	}
+
+	free_common(serving);
+	close(serving->server_fd);
 	free(serving->pfds);
+	free(serving->conns);
+}
+
+static bool register_conn(struct serving_data* serving, struct serving_conn* conn) {
+	if (serving->pfd_count == serving->pfd_capacity) {
+		serving->pfd_capacity *= 2;
+
+		serving->pfds = realloc(serving->pfds, sizeof(*serving->pfds) * serving->pfd_capacity);
+		serving->conns = realloc(serving->conns, sizeof(*serving->conns) * serving->pfd_capacity);
+	}
+
+	conn->index = serving->pfd_count;
+	serving->pfds[conn->index].fd = conn->fd;
+	serving->pfds[conn->index].events = POLLIN;
+	// new entry is visited in the current iteration, so it must not look ready
+	serving->pfds[conn->index].revents = 0;
+	serving->conns[conn->index] = conn;
+
+	serving->pfd_count++;
+
+	return true;
+}
+
+static void unregister_conn(struct serving_data* serving, struct serving_conn* conn) {
+	size_t last;
+
+	last = serving->pfd_count - 1;
+	serving->pfds[conn->index] = serving->pfds[last];
+	serving->conns[conn->index] = serving->conns[last];
+	serving->conns[conn->index]->index = conn->index;
+
+	serving->pfd_count--;
+}
+
+static void want_write(struct serving_data* serving, struct serving_conn* conn, bool enable) {
+	if (enable) {
+		serving->pfds[conn->index].events |= POLLOUT;
+	} else {
+		serving->pfds[conn->index].events = (int16_t) (serving->pfds[conn->index].events & ~POLLOUT);
+	}
+}
+
+#endif
+
+static struct serving_conn* add_conn(struct serving_data* serving, int32_t fd, serving_close_t on_close, serving_readable_t on_readable, void* ctx) {
+	struct serving_conn* conn;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	conn = new_conn(fd, on_close, ctx);
+	if (!conn) {
+		return NULL;
+	}
+	// backend registers watch differently from frame stream
+	conn->on_readable = on_readable;
+
+	if (!register_conn(serving, conn)) {
+		close(fd);
+		free(conn);
+		return NULL;
+	}
+
+	return conn;
+}
+
+struct serving_conn* serving_add_conn(struct serving_data* serving, int32_t fd, serving_close_t on_close, void* ctx) {
+	return add_conn(serving, fd, on_close, NULL, ctx);
+}
+
+struct serving_conn* serving_add_watch(struct serving_data* serving, int32_t fd, serving_readable_t on_readable, void* ctx) {
+	return add_conn(serving, fd, NULL, on_readable, ctx);
+}
+
+void serving_close_conn(struct serving_data* serving, struct serving_conn* conn) {
+	if (conn->fd < 0) {
+		return;
+	}
+
+	unregister_conn(serving, conn);
+#ifdef SERVING_URING
+	if (serving->uring) {
+		// requests must be canceled while fd still refers to this connection
+		uring_cancel(serving, conn);
+	}
+#endif
+	close(conn->fd);
+	conn->fd = -1;
+
+	if (conn->pending != SIZE_MAX) {
+		serving->pending[conn->pending] = NULL;
+		conn->pending = SIZE_MAX;
+	}
+
+	// events of current serving_poll can still point to conn
+	conn->next_closed = serving->closed;
+	serving->closed = conn;
+}
+
+void serving_finish_conn(struct serving_data* serving, struct serving_conn* conn) {
+	if (conn->fd < 0) {
+		return;
+	}
+
+	conn->on_close = NULL;
+	conn->finishing = true;
+
+	if (conn->tx.head == conn->tx.tail
+#ifdef SERVING_URING
+		&& !conn->uring_sends
+#endif
+	) {
+		serving_close_conn(serving, conn);
+	}
+}
+
+bool serving_send(struct serving_data* serving, struct serving_conn* conn, const uint8_t* buf, msg_len_type len) {
+	uint8_t* slot;
+
+	if (conn->fd < 0 || len <= sizeof(len) || buf[0] != len) {
+		return false;
+	}
+
+	slot = tx_reserve(serving, conn);
+	if (!slot) {
+		return false;
+	}
+
+	memcpy(slot, buf, len);
+	conn->tx.tail++;
+
+	mark_pending(serving, conn);
+
+	return true;
+}
+
+bool serving_send_body(struct serving_data* serving, struct serving_conn* conn, const uint8_t* body, msg_len_type len) {
+	uint8_t* slot;
+
+	if (conn->fd < 0 || len == 0 || len > MAX_MSG_LEN - 1 - sizeof(len)) {
+		return false;
+	}
+
+	slot = tx_reserve(serving, conn);
+	if (!slot) {
+		return false;
+	}
+
+	slot[0] = (msg_len_type) (len + sizeof(len));
+	memcpy(slot + sizeof(len), body, len);
+	conn->tx.tail++;
+
+	mark_pending(serving, conn);
+
+	return true;
+}
+
+static uint8_t* tx_reserve(struct serving_data* serving, struct serving_conn* conn) {
+	struct serving_tx* tx;
+
+	tx = &conn->tx;
+	if (tx->tail - tx->head == SERVING_TX_DEPTH) {
+		tx->dropped++;
+
+		switch (serving->tx_overflow) {
+			case SERVING_OVERFLOW_DROP_NEW:
+				custom_log_warn("Send queue of fd %d is full: dropped %d frames", conn->fd, tx->dropped);
+				return NULL;
+			case SERVING_OVERFLOW_DROP_OLD:
+#ifdef SERVING_URING
+				if (conn->uring_sends) {
+					// oldest frames are being sent by kernel and can't be replaced
+					custom_log_warn("Send queue of fd %d is full: dropped %d frames", conn->fd, tx->dropped);
+					return NULL;
+				}
+#endif
+				if (tx->offset) {
+					// partially sent frame can't be dropped, so it replaces the next one
+					memcpy(tx->frames[(tx->head + 1) & TX_MASK], tx->frames[tx->head & TX_MASK], tx->frames[tx->head & TX_MASK][0]);
+				}
+				tx->head++;
+				break;
+			case SERVING_OVERFLOW_CLOSE:
+				custom_log_warn("Send queue of fd %d is full: closing connection", conn->fd);
+				drop_conn(serving, conn);
+				return NULL;
+		}
+	}
+
+	return tx->frames[tx->tail & TX_MASK];
+}
+
+static void mark_pending(struct serving_data* serving, struct serving_conn* conn) {
+	if (conn->pending != SIZE_MAX) {
+		return;
+	}
+
+	if (serving->pending_count == serving->pending_capacity) {
+		serving->pending_capacity *= 2;
+		serving->pending = realloc(serving->pending, sizeof(*serving->pending) * serving->pending_capacity);
+	}
+	conn->pending = serving->pending_count;
+	serving->pending[serving->pending_count++] = conn;
+}
+
+static void init_common(struct serving_data* serving, int32_t server_fd, serving_handler_t handle_request) {
+	serving->server_fd = server_fd;
+	serving->handle_request = handle_request;
+	serving->tx_overflow = SERVING_TX_OVERFLOW;
+	serving->timeout_ms = POLL_TIMEOUT_MS;
+	serving->closed = NULL;
+
+	serving->pending_count = 0;
+	serving->pending_capacity = 8;
+	serving->pending = malloc(sizeof(*serving->pending) * serving->pending_capacity);
+}
+
+static void free_common(struct serving_data* serving) {
+	free_closed(serving);
+	free(serving->pending);
+	serving->pending = NULL;
+	serving->pending_count = 0;
+}
+
+static struct serving_conn* new_conn(int32_t fd, serving_close_t on_close, void* ctx) {
+	struct serving_conn* conn;
+
+	conn = malloc(sizeof(*conn));
+	if (!conn) {
+		perror("malloc");
+		close(fd);
+		return NULL;
+	}
+
+	conn->fd = fd;
+	conn->rx.head = 0;
+	conn->rx.tail = 0;
+	conn->tx.head = 0;
+	conn->tx.tail = 0;
+	conn->tx.offset = 0;
+	conn->tx.dropped = 0;
+	conn->on_close = on_close;
+	conn->on_readable = NULL;
+	conn->ctx = ctx;
+	conn->pending = SIZE_MAX;
+	conn->next_closed = NULL;
+	conn->finishing = false;
+#ifdef SERVING_URING
+	conn->uring_ops = 0;
+	conn->uring_sends = 0;
+#endif
+
+	return conn;
+}
+
+// connection is closed by serving: owner has to forget it
+static void drop_conn(struct serving_data* serving, struct serving_conn* conn) {
+	if (conn->fd < 0) {
+		return;
+	}
+
+	if (conn->on_close) {
+		conn->on_close(conn, conn->ctx);
+	}
+
+	serving_close_conn(serving, conn);
+}
+
+static void free_closed(struct serving_data* serving) {
+	struct serving_conn* conn;
+	struct serving_conn* busy;
+
+	busy = NULL;
+	while (serving->closed) {
+		conn = serving->closed;
+		serving->closed = conn->next_closed;
+#ifdef SERVING_URING
+		if (serving->uring && conn->uring_ops) {
+			// canceled requests still complete into conn
+			conn->next_closed = busy;
+			busy = conn;
+			continue;
+		}
+#endif
+		free(conn);
+	}
+	serving->closed = busy;
+}
+
+// receives into free space of ring without blocking, free space may wrap around
+static ssize_t rx_recv(int32_t fd, struct serving_rx* rx) {
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint32_t free_len;
+	uint32_t tail;
+	uint32_t first_len;
+
+	free_len = SERVING_RX_CAPACITY - (rx->tail - rx->head);
+	tail = rx->tail & RX_MASK;
+	first_len = SERVING_RX_CAPACITY - tail;
+	if (first_len > free_len) {
+		first_len = free_len;
+	}
+
+	iov[0].iov_base = rx->buf + tail;
+	iov[0].iov_len = first_len;
+	iov[1].iov_base = rx->buf;
+	iov[1].iov_len = free_len - first_len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+	return recvmsg(fd, &msg, MSG_DONTWAIT);
+}
+
+// passes every complete frame in ring to handler
+__attribute__((warn_unused_result))
+static bool rx_dispatch(struct serving_data* serving, struct serving_conn* conn, void* data) {
+	struct serving_rx* rx;
+	uint8_t frame[MAX_MSG_LEN];
+	msg_len_type msg_len;
+	uint32_t start;
+	uint32_t body_len;
+
+	rx = &conn->rx;
+	while (rx->tail != rx->head && conn->fd >= 0) {
+		msg_len = rx->buf[rx->head & RX_MASK];
+		if (msg_len <= sizeof(msg_len)) {
+			// stream can't be resynchronized after broken length
+			custom_log_error("Incorrect message format: declared length %d", msg_len);
+			return false;
+		}
+
+		if (rx->tail - rx->head < msg_len) {
+			break;
+		}
+
+		start = (rx->head + (uint32_t) sizeof(msg_len)) & RX_MASK;
+		body_len = msg_len - (uint32_t) sizeof(msg_len);
+		rx->head += msg_len;
+
+		if (start + body_len <= SERVING_RX_CAPACITY) {
+			// frame is contiguous and is not overwritten until next rx_recv
+			if (!serving->handle_request(conn->fd, rx->buf + start, body_len, data)) {
+				return false;
+			}
+		} else {
+			uint32_t first_len;
+
+			first_len = SERVING_RX_CAPACITY - start;
+			memcpy(frame, rx->buf + start, first_len);
+			memcpy(frame + first_len, rx->buf, body_len - first_len);
+			if (!serving->handle_request(conn->fd, frame, body_len, data)) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+static bool read_conn(struct serving_data* serving, struct serving_conn* conn, void* data) {
+	ssize_t rv;
+
+	if (conn->on_readable) {
+		return conn->on_readable(serving, conn, data);
+	}
+
+	for (;;) {
+		rv = rx_recv(conn->fd, &conn->rx);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		conn->rx.tail += (uint32_t) rv;
+		if (!rx_dispatch(serving, conn, data)) {
+			return false;
+		}
+
+		if (conn->fd < 0) {
+			// handler closed connection
+			return true;
+		}
+
+		if (rv == 0) {
+			// EOF: unfinished frame is dropped with connection
+			return false;
+		}
+	}
+}
+
+// sends as many queued frames as socket accepts with one syscall per attempt
+__attribute__((warn_unused_result))
+static bool tx_flush(struct serving_conn* conn) {
+	struct iovec iov[SERVING_TX_DEPTH];
+	struct msghdr msg;
+	struct serving_tx* tx;
+	uint32_t i;
+	size_t iov_count;
+	size_t sent;
+	ssize_t rv;
+
+	tx = &conn->tx;
+	while (tx->head != tx->tail) {
+		iov_count = 0;
+		for (i = tx->head; i != tx->tail; i++) {
+			iov[iov_count].iov_base = tx->frames[i & TX_MASK];
+			iov[iov_count].iov_len = tx->frames[i & TX_MASK][0];
+			iov_count++;
+		}
+		iov[0].iov_base = (uint8_t*) iov[0].iov_base + tx->offset;
+		iov[0].iov_len -= tx->offset;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov_count;
+
+		rv = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rv < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		sent = (size_t) rv + tx->offset;
+		while (tx->head != tx->tail && sent >= tx->frames[tx->head & TX_MASK][0]) {
+			sent -= tx->frames[tx->head & TX_MASK][0];
+			tx->head++;
+		}
+		tx->offset = (uint32_t) sent;
+	}
+
+	return true;
 }
 
-static void add_to_pfds(struct pollfd* pfds[], int newfd, uint32_t* fd_count, size_t* fd_size) {
-    if (*fd_count == *fd_size) {
-        *fd_size *= 2;
+static void flush_conn(struct serving_data* serving, struct serving_conn* conn) {
+#ifdef SERVING_URING
+	if (serving->uring) {
+		uring_send_queue(serving, conn);
+		return;
+	}
+#endif
 
-        *pfds = realloc(*pfds, sizeof(**pfds) * (*fd_size));
-    }
+	if (!tx_flush(conn)) {
+		custom_log_error("Failed to send queued frames to fd %d", conn->fd);
+		drop_conn(serving, conn);
+		return;
+	}
 
-    (*pfds)[*fd_count].fd = newfd;
-    (*pfds)[*fd_count].events = POLLIN;
+	if (conn->finishing && conn->tx.head == conn->tx.tail) {
+		serving_close_conn(serving, conn);
+		return;
+	}
 
-    (*fd_count)++;
+	want_write(serving, conn, conn->tx.head != conn->tx.tail);
 }
 
-static void del_from_pfds(struct pollfd pfds[], size_t i, uint32_t* fd_count) {
-    pfds[i] = pfds[*fd_count-1];
+static void flush_pending(struct serving_data* serving) {
+	size_t i;
+	struct serving_conn* conn;
 
-    (*fd_count)--;
+	// list can't grow while flushing: only handlers queue frames
+	for (i = 0; i < serving->pending_count; i++) {
+		conn = serving->pending[i];
+		if (conn) {
+			conn->pending = SIZE_MAX;
+			flush_conn(serving, conn);
+		}
+	}
+	serving->pending_count = 0;
 }
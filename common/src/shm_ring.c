@@ -0,0 +1,144 @@
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "custom_logger.h"
+
+#define SLOT_MASK (SHM_RING_SLOTS - 1)
+
+#define CACHE_LINE 64
+
+_Static_assert((SHM_RING_SLOTS & SLOT_MASK) == 0, "SHM_RING_SLOTS must be power of two");
+
+// producer and consumer indices are on different cache lines
+struct shm_ring {
+	_Alignas(CACHE_LINE) _Atomic uint32_t tail;
+	_Alignas(CACHE_LINE) _Atomic uint32_t head;
+	_Atomic uint32_t waiting;
+	_Atomic uint32_t closed;
+	_Alignas(CACHE_LINE) uint8_t slots[SHM_RING_SLOTS][MAX_MSG_LEN];
+};
+
+static struct shm_ring* map_ring(int32_t fd) {
+	void* p;
+
+	p = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (p == MAP_FAILED) {
+		custom_log_error("Failed to map shared memory ring");
+		return NULL;
+	}
+
+	return (struct shm_ring*) p;
+}
+
+struct shm_ring* shm_ring_create(const char* name) {
+	int32_t fd;
+	struct shm_ring* ring;
+
+	// previous consumer on this link could leave its ring
+	shm_unlink(name);
+
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		custom_log_error("Failed to create shared memory ring %s", name);
+		return NULL;
+	}
+
+	// new object is zero filled: empty ring
+	if (ftruncate(fd, sizeof(struct shm_ring)) < 0) {
+		custom_log_error("Failed to resize shared memory ring %s", name);
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	ring = map_ring(fd);
+	if (ring) {
+		// consumer waits for first frame
+		atomic_store(&ring->waiting, 1);
+	}
+
+	return ring;
+}
+
+struct shm_ring* shm_ring_open(const char* name) {
+	int32_t fd;
+	struct stat st;
+
+	fd = shm_open(name, O_RDWR, 0600);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	// consumer could be between shm_open and ftruncate
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct shm_ring)) {
+		close(fd);
+		return NULL;
+	}
+
+	return map_ring(fd);
+}
+
+void shm_ring_close(struct shm_ring* ring, const char* name, bool consumer) {
+	if (consumer) {
+		atomic_store(&ring->closed, 1);
+		shm_unlink(name);
+	}
+
+	munmap(ring, sizeof(*ring));
+}
+
+uint8_t* shm_ring_reserve(struct shm_ring* ring) {
+	uint32_t tail;
+
+	tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == SHM_RING_SLOTS) {
+		return NULL;
+	}
+
+	return ring->slots[tail & SLOT_MASK];
+}
+
+bool shm_ring_commit(struct shm_ring* ring) {
+	atomic_fetch_add(&ring->tail, 1);
+
+	// pairs with shm_ring_sleep: either consumer sees new tail or producer sees waiting
+	return atomic_exchange(&ring->waiting, 0) != 0;
+}
+
+bool shm_ring_is_closed(const struct shm_ring* ring) {
+	return atomic_load_explicit(&ring->closed, memory_order_relaxed) != 0;
+}
+
+const uint8_t* shm_ring_peek(struct shm_ring* ring) {
+	uint32_t head;
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+		return NULL;
+	}
+
+	return ring->slots[head & SLOT_MASK];
+}
+
+void shm_ring_release(struct shm_ring* ring) {
+	atomic_fetch_add_explicit(&ring->head, 1, memory_order_release);
+}
+
+bool shm_ring_sleep(struct shm_ring* ring) {
+	atomic_store(&ring->waiting, 1);
+
+	if (atomic_load(&ring->head) != atomic_load(&ring->tail)) {
+		atomic_store(&ring->waiting, 0);
+		return false;
+	}
+
+	return true;
+}
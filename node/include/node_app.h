@@ -6,16 +6,61 @@
 #include "format_app.h"
 #include "settings.h"
 
+// ingress node picks codec of every message (see format_app.h) by its length and entropy, zlib codec is raw deflate
+// with preset dictionary (if it is loaded), its streams are kept by every thread and reset between messages
+
+// window of deflate, preset dictionary isn't longer than it
+#ifndef APP_COMPRESS_WINDOW_BITS
+#define APP_COMPRESS_WINDOW_BITS 10
+#endif
+
+// deflate clears its hash on every reset, small hash is enough for messages of APP_MESSAGE_LEN
+#ifndef APP_COMPRESS_MEM_LEVEL
+#define APP_COMPRESS_MEM_LEVEL 2
+#endif
+
+#define APP_DICT_MAX_LEN (1 << APP_COMPRESS_WINDOW_BITS)
+
+#ifndef APP_CODEC_ZLIB_LEVEL
+#define APP_CODEC_ZLIB_LEVEL 6
+#endif
+
+// share of maximal entropy of message of its length (bits per byte) above which it looks random or compressed
+#ifndef APP_CODEC_MAX_ENTROPY_PERCENT
+#define APP_CODEC_MAX_ENTROPY_PERCENT 90
+#endif
+
+// shorter messages don't pay for huffman tables of zlib unless it has dictionary, lz is tried on them
+#ifndef APP_CODEC_ZLIB_MIN_LEN
+#define APP_CODEC_ZLIB_MIN_LEN 64
+#endif
+
+// relative to working directory of node (server directory), every node must load same dictionary
+#ifndef APP_DICT_PATH
+#define APP_DICT_PATH "../node/app.dict"
+#endif
+
 typedef struct app {
-	uint8_t node_addr;
+	node_addr_t node_addr;
 	uint8_t app_addr;
 } app_t;
 
 __attribute__((nonnull(1)))
-void node_app_fill_default(app_t* apps, uint8_t node_addr);
+void node_app_fill_default(app_t* apps, node_addr_t node_addr);
 
 __attribute__((nonnull(1, 2), warn_unused_result))
-bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, uint8_t node_addr);
+bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, node_addr_t node_addr);
+
+// loads preset dictionary trained from recorded messages (see benchmark/appdict.c) before nodes start,
+// false if there is no dictionary, then messages are compressed without it
+__attribute__((nonnull(1), warn_unused_result))
+bool node_app_load_dict(const char* path);
+
+// adds zlib to codecs of format_app, before nodes start
+void node_app_register_codecs(void);
+
+// logs counters of every codec used by process
+void node_app_log_stats(void);
 
 __attribute__((nonnull(1)))
 void node_app_setup_delivery(struct app_payload* app_payload);
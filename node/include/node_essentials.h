@@ -5,6 +5,7 @@
 #include <format.h>
 
 #include "custom_logger.h"
+#include "serving.h"
 
 #ifdef __clang__
 #pragma clang diagnostic push
@@ -22,9 +23,28 @@
 
 bool node_essentials_get_conn_and_send(uint16_t port, uint8_t* buf, msg_len_type buf_len);
 
+// formats frame straight into send buffer of link to port
+__attribute__((nonnull(3)))
+bool node_essentials_create_and_send(uint16_t port, enum request req, const void* payload);
+
+// sends received frame (after its length) to port as is, so transit node doesn't parse and create it again
+__attribute__((nonnull(2)))
+bool node_essentials_forward(uint16_t port, const uint8_t* buf, msg_len_type len);
+
+// sends received route request frame (after its length) to every broadcast neighbor as is
+__attribute__((nonnull(1)))
+void node_essentials_broadcast_forward(const uint8_t* buf, msg_len_type len);
+
+// tells server that node with addr listens on port, so server connects to it
+__attribute__((warn_unused_result))
+bool node_essentials_announce(node_addr_t addr, uint16_t port);
+
 __attribute__((warn_unused_result))
 bool node_essentials_notify_server(notify_t* notify);
 
+__attribute__((nonnull(1), warn_unused_result))
+bool node_essentials_answer_control(control_t* control);
+
 __attribute__((nonnull(1)))
 void node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_broadcast);
 
@@ -34,10 +54,33 @@ void node_essentials_broadcast(node_packet_t* broadcast_payload);
 __attribute__((nonnull(1)))
 void node_essentials_unicast(node_packet_t* broadcast_payload);
 
+__attribute__((nonnull(1), warn_unused_result))
+bool node_essentials_init_connections(struct serving_data* node_serving);
+
 void node_essentials_reset_connections(void);
 
-void node_essentials_fill_neighbors_port(uint8_t addr);
+void node_essentials_free_connections(void);
+
+// node with addr sent request so connects to it are not skipped anymore
+void node_essentials_peer_alive(node_addr_t addr);
+
+void node_essentials_fill_neighbors_port(node_addr_t addr);
+
+// ports of broadcast neighbors filled by node_essentials_fill_neighbors_port, returns their count
+__attribute__((nonnull(1)))
+uint8_t node_essentials_neighbors(const uint16_t** ports);
 
 void node_essentials_send_unicast_contest(unicast_contest_t* unicast);
 
-void node_essentials_send_unicast_first(unicast_contest_t* unicast, uint8_t addr);
+void node_essentials_send_unicast_first(unicast_contest_t* unicast, node_addr_t addr);
+
+// state of virtual nodes hosted by one process (see node_host.h), single node uses default one
+struct node_essentials;
+
+__attribute__((warn_unused_result))
+struct node_essentials* node_essentials_create(void);
+
+void node_essentials_destroy(struct node_essentials* essentials);
+
+// next node_essentials_* calls of this thread use essentials, NULL selects default state
+void node_essentials_switch(struct node_essentials* essentials);
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "format.h"
+#include "settings.h"
+
+// geographic routing (make ROUTING=geo): address of node is its position on grid, so next hop of send is found
+// without routing table and route discovery
+// greedy mode: packet goes to reachable broadcast neighbor that is closest to receiver and closer than this node
+// face mode: where no neighbor is closer (dead nodes around), packet goes along edges of grid around them by right hand
+// rule, starting from first edge counterclockwise from line to receiver, until it gets to node closer to receiver than
+// node where face started (face_addr of packet), then it goes greedy again
+// face mode fails when packet comes back to face_addr or it walked NODE_GEO_FACE_HOPS (receiver is dead or cut off),
+// then node floods route request like on send without route, routing table isn't used
+
+// hops of face are counted in time to live of packet, walk around whole grid takes 4 * MATRIX_SIZE of them
+#ifndef NODE_GEO_FACE_HOPS
+#if 4 * MATRIX_SIZE <= INT8_MAX || TTL > INT8_MAX
+#define NODE_GEO_FACE_HOPS (4 * MATRIX_SIZE)
+#else
+#define NODE_GEO_FACE_HOPS INT8_MAX
+#endif
+#endif
+
+// sends packet of REQUEST_SEND to next hop, crc and hop fields are set here
+// false if there is no next hop, packet is left in greedy mode
+__attribute__((nonnull(1), warn_unused_result))
+bool node_geo_send(node_packet_t* packet, node_addr_t addr);
+
+// greedy hop of received send frame (after its length) that is forwarded as is, see handle_node_forward
+// false if packet is in face mode or no neighbor is closer and reachable, then frame goes to node_geo_send
+__attribute__((nonnull(1, 3), warn_unused_result))
+bool node_geo_forward(uint8_t* buf, size_t len, const packet_header_t* header, node_addr_t addr);
@@ -5,33 +5,111 @@
 #include "format.h"
 #include "routing.h"
 #include "node_app.h"
+#include "serving.h"
 
-__attribute__((warn_unused_result))
-bool handle_ping(int32_t conn_fd);
+// seen messages of node are kept by (origin, id) in table of this size (power of two)
+#ifndef MESSAGE_TABLE_SIZE
+#define MESSAGE_TABLE_SIZE 1024
+#endif
+
+// message is forgotten after this many generations of new messages (see node_handler.c)
+#ifndef MESSAGE_GENERATIONS
+#define MESSAGE_GENERATIONS 4
+#endif
+
+#ifndef MESSAGE_MAX_PROBE
+#define MESSAGE_MAX_PROBE 8
+#endif
+
+// sends without route wait at node that started route discovery (flood carries packet header only) until route
+// inverse comes back, then they go along found route
+#ifndef PENDING_SENDS_MAX
+#define PENDING_SENDS_MAX 8
+#endif
+
+// pending send fails when route isn't found in this time, send that doesn't fit into queue fails at once
+// server is notified of fail, so it must be shorter than time client waits for result (see client.c)
+#ifndef PENDING_SEND_TIMEOUT_MS
+#define PENDING_SEND_TIMEOUT_MS 500
+#endif
+
+// answers ping or reset of server by REQUEST_CONTROL_RESULT with id of request
+__attribute__((nonnull(1, 2, 3), warn_unused_result))
+bool handle_control(control_t* control, routing_table_t* table, app_t apps[APPS_COUNT], node_addr_t addr);
 
 __attribute__((nonnull(3, 4), warn_unused_result))
-bool handle_server_send(enum request cmd_type, uint8_t addr, const void* payload, const routing_table_t* routing, app_t apps[APPS_COUNT]);
+bool handle_server_send(enum request cmd_type, node_addr_t addr, const void* payload, routing_table_t* routing, app_t apps[APPS_COUNT]);
+
+// routes every packet of batch like separate send
+__attribute__((nonnull(2, 3, 4), warn_unused_result))
+bool handle_server_send_batch(node_addr_t addr, send_batch_t* batch, routing_table_t* routing, app_t apps[APPS_COUNT]);
 
 __attribute__((nonnull(2, 3), warn_unused_result))
-bool handle_node_send(uint8_t addr, const void* payload, const routing_table_t* routing, app_t apps[APPS_COUNT]);
+bool handle_node_send(node_addr_t addr, const void* payload, const routing_table_t* routing, app_t apps[APPS_COUNT]);
 
 __attribute__((nonnull(1, 3), warn_unused_result))
-bool handle_node_route_direct(routing_table_t* routing, uint8_t server_addr, void* payload, app_t apps[APPS_COUNT]);
+bool handle_node_route_direct(routing_table_t* routing, node_addr_t server_addr, void* payload, app_t apps[APPS_COUNT]);
 
 __attribute__((nonnull(1), warn_unused_result))
-bool handle_node_route_inverse(routing_table_t* routing, void* payload, uint8_t server_addr);
+bool handle_node_route_inverse(routing_table_t* routing, void* payload, node_addr_t server_addr);
+
+// transit node forwards REQUEST_SEND and REQUEST_ROUTE_DIRECT frame (after its length) without parsing it:
+// header is checked and patched in place, so cost doesn't depend on message length
+// false if frame must be handled by handle_node_* (it is for this node, damaged or has no route yet)
+__attribute__((nonnull(2, 4), warn_unused_result))
+bool handle_node_forward(enum request cmd_type, routing_table_t* routing, node_addr_t addr, uint8_t* buf, size_t len);
 
 __attribute__((nonnull(1)))
 void handle_broadcast(node_packet_t* broadcast_payload);
 
 __attribute__((nonnull(1)))
-void handle_server_unicast(node_packet_t* unicast_payload, uint8_t cur_node_addr);
+void handle_server_unicast(node_packet_t* unicast_payload, node_addr_t cur_node_addr);
 
 __attribute__((nonnull(1)))
-void handle_unicast_contest(unicast_contest_t* unicast, uint8_t cur_node_addr);
+void handle_unicast_contest(unicast_contest_t* unicast, node_addr_t cur_node_addr);
 
 __attribute__((nonnull(1)))
-void handle_unicast_first(unicast_contest_t* unicast, uint8_t cur_node_addr);
+void handle_unicast_first(unicast_contest_t* unicast, node_addr_t cur_node_addr);
 
 __attribute__((nonnull(1, 2)))
-void handle_reset(routing_table_t* table, app_t apps[APPS_COUNT], uint8_t addr);
+void handle_reset(routing_table_t* table, app_t apps[APPS_COUNT], node_addr_t addr);
+
+// duplicate tables of virtual nodes hosted by one process (see node_host.h), single node uses default one
+struct node_messages;
+
+__attribute__((warn_unused_result))
+struct node_messages* node_handler_create(void);
+
+void node_handler_destroy(struct node_messages* messages);
+
+// next handle_* calls of this thread use messages, NULL selects default table
+void node_handler_switch(struct node_messages* messages);
+
+// whole keys are stored, so seen message is never taken for other one: duplicate is missed only when its entry
+// was evicted (probe window was full of live entries) or expired before it came back
+struct node_messages_stats {
+	uint64_t inserted;
+	uint64_t evicted;
+	uint64_t expired;
+	// probes that passed live entry of other key, they grow when hash spreads keys badly
+	uint64_t collisions;
+	// sends that waited for route
+	uint64_t pending_sent;
+	uint64_t pending_timed_out;
+	uint64_t pending_dropped;
+};
+
+// timer of current node watched by serving: sends that wait for route fail on time even if no frame comes
+// node without timer (simulator) calls node_handler_expire by itself
+__attribute__((nonnull(1), warn_unused_result))
+bool node_handler_init_timer(struct serving_data* serving);
+
+// fails sends of current node that wait for route longer than PENDING_SEND_TIMEOUT_MS, server is notified of them
+// returns time in ms until next one expires, -1 if no send waits
+int32_t node_handler_expire(void);
+
+// counters of messages, NULL selects default table
+__attribute__((nonnull(2)))
+void node_handler_stats(const struct node_messages* messages, struct node_messages_stats* stats);
+
+void node_handler_log_stats(const struct node_messages* messages, node_addr_t addr);
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "format.h"
+
+// one process runs many virtual nodes: every node keeps its own listener, serving and state
+// nodes are spread over shard threads (one per cpu), shard without ready nodes steals them from others
+// frames between nodes of one process are passed through memory instead of sockets
+
+#ifndef NODE_HOST_MAX_SHARDS
+#define NODE_HOST_MAX_SHARDS 64
+#endif
+
+// frames waiting in inbox of virtual node, must be power of two
+#ifndef NODE_HOST_INBOX_DEPTH
+#define NODE_HOST_INBOX_DEPTH 128
+#endif
+
+// frames of inbox handled at once, rest is handled on next turn of node so it can't starve others
+#ifndef NODE_HOST_DRAIN_BATCH
+#define NODE_HOST_DRAIN_BATCH 32
+#endif
+
+// idle shard checks keeprunning after this time
+#ifndef NODE_HOST_TICK_MS
+#define NODE_HOST_TICK_MS 100
+#endif
+
+// runs nodes first..first + count - 1 until keeprunning is reset, requires epoll serving
+__attribute__((nonnull(3), warn_unused_result))
+bool node_host_run(uint8_t first, uint8_t count, volatile bool* keeprunning);
+
+// node on port is hosted by this process and alive
+__attribute__((warn_unused_result))
+bool node_host_has(uint16_t port);
+
+// queues body of frame (after its length byte) to inbox of co-hosted node, false if inbox is full or node died
+__attribute__((nonnull(2), warn_unused_result))
+bool node_host_send(uint16_t port, const uint8_t* body, msg_len_type len);
+
+// stops node running on this thread after its current turn, false if it is not hosted
+__attribute__((warn_unused_result))
+bool node_host_kill_current(void);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "format.h"
+#include "serving.h"
+
+// shared memory links between node and its broadcast neighbors (built with NODE_LINK=shm)
+// every directed link is a ring written by one node and read by another, frames never go through kernel
+// node is woken up through its doorbell fifo only when it sleeps
+
+__attribute__((nonnull(1, 3), warn_unused_result))
+bool node_link_init(struct serving_data* serving, uint8_t addr, const uint16_t* neighbors, uint8_t neighbor_num);
+
+void node_link_free(void);
+
+// closes outgoing links, they are reopened on next send
+void node_link_reset(void);
+
+__attribute__((warn_unused_result))
+bool node_link_has(uint16_t port);
+
+// slot to create frame in, NULL if link is down or full
+__attribute__((warn_unused_result))
+uint8_t* node_link_reserve(uint16_t port);
+
+// sends frame created in slot returned by node_link_reserve
+__attribute__((warn_unused_result))
+bool node_link_commit(uint16_t port);
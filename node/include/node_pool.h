@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "serving.h"
+
+// outgoing connections of node: looked up by port, least recently used one is evicted when pool is full
+// connection closed by serving (peer hang up, write error) leaves pool and is reconnected on next use
+
+// connections to other nodes, server connection is kept aside and never evicted
+// default fits all broadcast neighbors of node with BROADCAST_RADIUS 3
+#ifndef NODE_POOL_SIZE
+#define NODE_POOL_SIZE 28
+#endif
+
+// failed connect to port skips it for backoff time that doubles on every failure up to max
+#ifndef NODE_POOL_BACKOFF_MIN_MS
+#define NODE_POOL_BACKOFF_MIN_MS 100
+#endif
+
+#ifndef NODE_POOL_BACKOFF_MAX_MS
+#define NODE_POOL_BACKOFF_MAX_MS 5000
+#endif
+
+struct node_pool_stats {
+	uint64_t hits;
+	uint64_t misses;
+	// misses for ports that were connected before
+	uint64_t reconnects;
+	uint64_t evictions;
+	// connections closed by serving
+	uint64_t dead;
+	uint64_t failed_connects;
+	// connects not tried because port is in backoff
+	uint64_t skipped_connects;
+};
+
+__attribute__((nonnull(1)))
+void node_pool_init(struct serving_data* serving);
+
+// cached connection or new one, NULL if peer can't be reached or is in backoff
+__attribute__((warn_unused_result))
+struct serving_conn* node_pool_get(uint16_t port);
+
+// hint that peer on port is alive (it sent something), its backoff is dropped
+void node_pool_alive(uint16_t port);
+
+// closes all connections except server one and forgets backoffs
+void node_pool_reset(void);
+
+__attribute__((warn_unused_result))
+const struct node_pool_stats* node_pool_stats(void);
+
+// monotonic clock of node in ms, simulator replaces it with virtual one together with connections
+__attribute__((warn_unused_result))
+uint64_t node_pool_now_ms(void);
+
+// pools of virtual nodes hosted by one process (see node_host.h), single node uses default one
+struct node_pool;
+
+__attribute__((warn_unused_result))
+struct node_pool* node_pool_create(void);
+
+void node_pool_destroy(struct node_pool* node_pool);
+
+// next node_pool_* calls of this thread use node_pool, NULL selects default pool
+void node_pool_switch(struct node_pool* node_pool);
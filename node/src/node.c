@@ -17,6 +17,8 @@
 #include "settings.h"
 #include "node_essentials.h"
 #include "node_app.h"
+#include "node_host.h"
+#include "node_handler.h"
 
 static node_server_t server;
 static struct node children[NODE_COUNT];
@@ -27,27 +29,42 @@ static void int_handler(int32_t dummy);
 
 static void term_handler(int32_t dummy);
 
+// mesh_node <addr> runs one node, mesh_node -n <count> <first addr> hosts count nodes starting from first addr
 __attribute__((warn_unused_result))
-static bool parse_args(char** args, size_t argc, uint16_t* port);
+static bool parse_args(char** args, size_t argc, uint16_t* port, uint8_t* host_count);
 
 __attribute__((warn_unused_result))
-static bool update_node_state(uint16_t port);
-
-__attribute__((warn_unused_result))
-static bool handle_request(int32_t conn_fd, void* data);
+static bool handle_request(int32_t conn_fd, uint8_t* buf, size_t len, void* data);
 
 int32_t main(int32_t argc, char** argv) {
 	int32_t node_server_fd;
 	struct serving_data serving;
 	uint16_t port;
+	uint8_t host_count;
 
 	signal(SIGINT, int_handler);
 	signal(SIGTERM, term_handler);
+	// peer that left is detected by failed send
+	signal(SIGPIPE, SIG_IGN);
 
-	if (!parse_args(argv, (size_t) argc, &port)) {
+	if (!parse_args(argv, (size_t) argc, &port, &host_count)) {
 		die("Failed to parse args");
 	}
 
+	// nodes hosted by this process share codecs and dictionary
+	node_app_register_codecs();
+	if (node_app_load_dict(APP_DICT_PATH)) {
+		node_log_info("Loaded app dictionary %s", APP_DICT_PATH);
+	}
+
+	if (host_count > 0) {
+		if (!node_host_run(server.addr, host_count, &keeprunning)) {
+			die("Failed to host nodes %d..%d", server.addr, server.addr + host_count - 1);
+		}
+		node_app_log_stats();
+		return 0;
+	}
+
 	routing_table_fill_default(&server.routing);
 	node_app_fill_default(server.apps, server.addr);
 	node_essentials_fill_neighbors_port(server.addr);
@@ -58,20 +75,29 @@ int32_t main(int32_t argc, char** argv) {
 		die("Failed to start server on node %d", server.addr);
 	}
 
-	if (!update_node_state(port)) {
-		die("Failed to init node");
+	// links must be ready before server announces node to others
+	serving_init(&serving, node_server_fd, handle_request);
+	if (!node_essentials_init_connections(&serving)) {
+		die("Failed to init connections on node %d", server.addr);
+	}
+	if (!node_handler_init_timer(&serving)) {
+		die("Failed to create timer on node %d", server.addr);
 	}
 
-	serving_init(&serving, node_server_fd, handle_request);
+	if (!node_essentials_announce(server.addr, port)) {
+		die("Failed to init node");
+	}
 
 	while (keeprunning) {
 		serving_poll(&serving, children);
 	}
 
+	node_essentials_free_connections();
 	serving_free(&serving);
 	close(node_server_fd);
-	node_essentials_reset_connections();
 
+	node_app_log_stats();
+	node_handler_log_stats(NULL, server.addr);
 	node_log_debug("Killed node process %d", getpid());
 
 	return 0;
@@ -86,8 +112,21 @@ static void term_handler(int32_t dummy) {
 	int_handler(dummy);
 }
 
-static bool parse_args(char** args, size_t argc, uint16_t* port) {
+static bool parse_args(char** args, size_t argc, uint16_t* port, uint8_t* host_count) {
 	char* endptr;
+	long count;
+
+	*port = 0;
+	*host_count = 0;
+	if (argc == 4 && strcmp(args[1], "-n") == 0) {
+		count = strtol(args[2], &endptr, 10);
+		if (*endptr != '\0' || count < 1 || count > NODE_COUNT) {
+			return false;
+		}
+		*host_count = (uint8_t) count;
+		args += 2;
+		argc -= 2;
+	}
 
 	if (argc != 2) {
 		return false;
@@ -98,70 +137,18 @@ static bool parse_args(char** args, size_t argc, uint16_t* port) {
 	if (args[1]  == endptr) {
 		return false;
 	}
+	if (*host_count > 0 && server.addr + *host_count > NODE_COUNT) {
+		return false;
+	}
 	*port = node_port(server.addr);
 
 	return true;
 }
 
-static bool update_node_state(uint16_t port) {
-	uint8_t buf[sizeof(node_update_t) + MSG_BASE_LEN];
-	msg_len_type buf_len;
-	int32_t server_fd;
-	bool status;
-
-	status = true;
-	server_fd = connection_socket_to_send(SERVER_PORT);
-
-	if (server_fd < 0) {
-		die("Failed to get socket");
-	}
-
-	node_update_t payload = {
-		.addr = server.addr,
-		.pid = getpid(),
-		.port = port,
-	};
-
-	format_create(REQUEST_UPDATE, &payload, buf, &buf_len, REQUEST_SENDER_NODE);
-
-	if (!io_write_all(server_fd, buf, buf_len)) {
-		node_log_error("Failed to send node init data");
-		status = false;
-	}
-
-	close(server_fd);
-
-	return status;
-}
-
-static bool handle_request(int32_t conn_fd, void* data) {
-	int16_t received_bytes;
-	uint8_t buf[MAX_MSG_LEN];
-	uint8_t msg_len;
-
-	if (!io_read_all(conn_fd, &msg_len, sizeof(msg_len), &received_bytes)) {
-		node_log_error("Failed to read message length");
-	}
-
-	if (received_bytes > 0) {
-		if (!io_read_all(conn_fd, buf, msg_len - sizeof(msg_len), &received_bytes)) {
-			node_log_error("Failed to read message");
-			return false;
-		}
-		if (!format_is_message_correct((size_t) received_bytes, msg_len - sizeof(msg_len))) {
-			node_log_error("Incorrect message");
-			return false;
-		}
-	} else {
-		return false;
-	}
-
-	if (received_bytes > 0) {
-		node_listener_handle_request(&server, conn_fd, (uint8_t*) buf, received_bytes, data);
-	} else {
-		node_log_error("Failed to read %d bytes", msg_len);
-		return false;
-	}
+static bool handle_request(int32_t conn_fd, uint8_t* buf, size_t len, void* data) {
+	// serving passes only complete frames
+	// failed request doesn't break connection
+	node_listener_handle_request(&server, conn_fd, buf, (ssize_t) len, data);
 
 	return true;
 }
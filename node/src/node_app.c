@@ -1,6 +1,9 @@
 #include "node_app.h"
 
+#include <inttypes.h>
+#include <math.h>
 #include <memory.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
@@ -10,8 +13,41 @@
 #include "settings.h"
 #include "crc.h"
 
+// read before nodes start and not changed after, so threads of node host share it
+static uint8_t app_dict[APP_DICT_MAX_LEN];
+static uInt app_dict_len;
 
-void node_app_fill_default(app_t apps[APPS_COUNT], uint8_t node_addr) {
+struct app_streams {
+	z_stream deflate;
+	z_stream inflate;
+	bool deflate_ready;
+	bool inflate_ready;
+};
+
+// nodes hosted by one thread (see node_host.c) share its streams
+static _Thread_local struct app_streams streams;
+
+bool node_app_load_dict(const char* path) {
+	FILE* f;
+	size_t len;
+
+	f = fopen(path, "rb");
+	if (f == NULL) {
+		return false;
+	}
+
+	len = fread(app_dict, 1, sizeof(app_dict), f);
+	if (len == sizeof(app_dict) && fgetc(f) != EOF) {
+		node_log_warn("Dictionary %s is longer than window, only first %zu bytes are used", path, len);
+	}
+	fclose(f);
+
+	app_dict_len = (uInt) len;
+
+	return len > 0;
+}
+
+void node_app_fill_default(app_t apps[APPS_COUNT], node_addr_t node_addr) {
 	uint8_t i;
 
 	srandom((uint32_t) time(NULL));
@@ -22,13 +58,35 @@ void node_app_fill_default(app_t apps[APPS_COUNT], uint8_t node_addr) {
 	}
 }
 
-__attribute__((nonnull(1, 2)))
-static void compress_message(uint8_t* msg, uint8_t* msg_len);
+__attribute__((nonnull(1, 3, 4)))
+static bool zlib_encode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len);
+
+__attribute__((nonnull(1, 3, 4)))
+static bool zlib_decode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len);
+
+static const struct app_codec_ops zlib_ops = { .name = "zlib", .encode = zlib_encode, .decode = zlib_decode };
+
+void node_app_register_codecs(void) {
+	format_app_register_codec(APP_CODEC_ZLIB, &zlib_ops);
+}
+
+void node_app_log_stats(void) {
+	struct app_codec_stats stats;
+	uint8_t codec;
 
-__attribute__((nonnull(1, 2)))
-static void decompress_message(uint8_t* msg, uint8_t* msg_len);
+	for (codec = APP_CODEC_ZLIB; codec < APP_CODEC_COUNT; codec++) {
+		format_app_codec_stats(codec, &stats);
+		if (stats.encoded + stats.bypassed + stats.decoded == 0) {
+			continue;
+		}
+		node_log_info("Codec %s: %" PRIu64 " encoded, %" PRIu64 " bypassed, %" PRId64 " bytes saved of %" PRIu64 " in %" PRIu64 " us, "
+			"%" PRIu64 " decoded in %" PRIu64 " us",
+			format_app_codec_name(codec), stats.encoded, stats.bypassed, (int64_t) (stats.bytes_in - stats.bytes_out), stats.bytes_in,
+			stats.encode_ns / 1000, stats.decoded, stats.decode_ns / 1000);
+	}
+}
 
-bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, uint8_t node_addr) {
+bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, node_addr_t node_addr) {
 	size_t i;
 
 	switch (app_payload->req_type) {
@@ -39,14 +97,15 @@ bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, uint8
 					if (app_payload->message_len) {
 						uint16_t calc_crc;
 
-						if (app_payload->message_len != 0) {
-							decompress_message(app_payload->message, &app_payload->message_len);
-							calc_crc = app_crc(app_payload);
-							if (calc_crc != app_payload->crc) {
-								node_log_error("App message damaged: got CRC %d, calculated %d. Message: %.*s",
-									app_payload->crc, calc_crc, app_payload->message_len, app_payload->message);
-								return false;
-							}
+						if (!format_app_decode(app_payload)) {
+							node_log_error("App message damaged: can't decode by codec %s", format_app_codec_name(app_payload->codec));
+							return false;
+						}
+						calc_crc = app_crc(app_payload);
+						if (calc_crc != app_payload->crc) {
+							node_log_error("App message damaged: got CRC %d, calculated %d. Message: %.*s",
+								app_payload->crc, calc_crc, app_payload->message_len, app_payload->message);
+							return false;
 						}
 						node_log_info("App got message (length %d, id %d): %.*s",
 							app_payload->message_len, app_payload->id, app_payload->message_len, app_payload->message);
@@ -62,7 +121,10 @@ bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, uint8
 			if (app_payload->message_len != 0) {
 				uint16_t calc_crc;
 
-				decompress_message(app_payload->message, &app_payload->message_len);
+				if (!format_app_decode(app_payload)) {
+					node_log_error("App message damaged: can't decode by codec %s", format_app_codec_name(app_payload->codec));
+					return false;
+				}
 				calc_crc = app_crc(app_payload);
 				if (calc_crc != app_payload->crc) {
 					node_log_error("App message damaged: got CRC %d, calculated %d", app_payload->crc, calc_crc);
@@ -81,53 +143,120 @@ bool node_app_handle_request(app_t* apps, struct app_payload* app_payload, uint8
 	return false;
 }
 
+// shannon entropy of byte histogram compared to log2 of length, which is the most message of this length can have
+static bool looks_random(const uint8_t* msg, uint8_t len) {
+	uint16_t counts[UINT8_MAX + 1];
+	double entropy;
+	double p;
+	uint8_t i;
+
+	if (len < 2) {
+		return true;
+	}
+
+	memset(counts, 0, sizeof(counts));
+	for (i = 0; i < len; i++) {
+		counts[msg[i]]++;
+	}
+
+	entropy = 0;
+	for (i = 0; i < len; i++) {
+		if (counts[msg[i]] == 0) {
+			continue;
+		}
+		p = (double) counts[msg[i]] / len;
+		entropy -= p * log2(p);
+		// every distinct byte is counted once
+		counts[msg[i]] = 0;
+	}
+
+	return entropy * 100 >= log2(len) * APP_CODEC_MAX_ENTROPY_PERCENT;
+}
+
+static enum app_codec pick_codec(const struct app_payload* app_payload) {
+	if (looks_random(app_payload->message, app_payload->message_len)) {
+		return APP_CODEC_NONE;
+	}
+	if (app_dict_len || app_payload->message_len >= APP_CODEC_ZLIB_MIN_LEN) {
+		return APP_CODEC_ZLIB;
+	}
+
+	return APP_CODEC_LZ;
+}
+
 void node_app_setup_delivery(struct app_payload* app_payload) {
-	if (app_payload->message_len) {
-		uint8_t before_compress_len;
+	uint8_t before_len;
 
-		before_compress_len = app_payload->message_len;
-		// little messages can become bigger after compress but for big ones works fine
-		compress_message(app_payload->message, &app_payload->message_len);
-		custom_log_debug("Before compress: %d, after %d", before_compress_len, app_payload->message_len);
+	// codec byte isn't trusted: server computed app crc of message as is
+	app_payload->codec = APP_CODEC_NONE;
+	if (app_payload->message_len) {
+		before_len = app_payload->message_len;
+		// codec that doesn't make message smaller is bypassed (see format_app_encode)
+		format_app_encode(app_payload, pick_codec(app_payload));
+		node_log_debug("Codec %s: before %d, after %d", format_app_codec_name(app_payload->codec), before_len, app_payload->message_len);
 	}
 }
 
-static void compress_message(uint8_t* msg, uint8_t* msg_len) { // NOLINT
-	z_stream defstream;
-	char b[APP_MESSAGE_LEN];
+static bool zlib_encode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len) { // NOLINT
+	z_stream* stream;
+
+	stream = &streams.deflate;
+	if (!streams.deflate_ready) {
+		// raw deflate: zlib header and adler32 would take 6 bytes of short message, app crc checks it anyway
+		if (deflateInit2(stream, APP_CODEC_ZLIB_LEVEL, Z_DEFLATED, -APP_COMPRESS_WINDOW_BITS, APP_COMPRESS_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+			node_log_error("Failed to init deflate");
+			return false;
+		}
+		streams.deflate_ready = true;
+	} else {
+		deflateReset(stream);
+	}
+	if (app_dict_len) {
+		deflateSetDictionary(stream, app_dict, app_dict_len);
+	}
+
+	stream->avail_in = (uInt) in_len;
+	stream->next_in = (Bytef*) in;
+	stream->avail_out = (uInt) APP_MESSAGE_LEN;
+	stream->next_out = (Bytef*) out;
 
-	defstream.zalloc = Z_NULL;
-	defstream.zfree = Z_NULL;
-	defstream.opaque = Z_NULL;
-	defstream.avail_in = (uInt) *msg_len;
-	defstream.next_in = (Bytef *) msg;
-	defstream.avail_out = (uInt) sizeof(b);
-	defstream.next_out = (Bytef *)b;
+	// output that doesn't fit into message is not finished
+	if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+		return false;
+	}
 
-	deflateInit(&defstream, Z_DEFAULT_COMPRESSION);
-	deflate(&defstream, Z_FINISH);
-	deflateEnd(&defstream);
+	*out_len = (uint8_t) (stream->next_out - out);
 
-	*msg_len = (uint8_t) ((char*)defstream.next_out - b);
-	memcpy(msg, b, APP_MESSAGE_LEN);
+	return true;
 }
 
-static void decompress_message(uint8_t* msg, uint8_t* msg_len) { // NOLINT
-	z_stream infstream;
-	char b[APP_MESSAGE_LEN];
+static bool zlib_decode(const uint8_t* in, uint8_t in_len, uint8_t* out, uint8_t* out_len) { // NOLINT
+	z_stream* stream;
 
-	infstream.zalloc = Z_NULL;
-	infstream.zfree = Z_NULL;
-	infstream.opaque = Z_NULL;
-	infstream.avail_in = (uInt) (*msg_len);
-	infstream.next_in = (Bytef*) msg;
-	infstream.avail_out = (uInt) sizeof(b);
-	infstream.next_out = (Bytef*) b;
+	stream = &streams.inflate;
+	if (!streams.inflate_ready) {
+		if (inflateInit2(stream, -APP_COMPRESS_WINDOW_BITS) != Z_OK) {
+			node_log_error("Failed to init inflate");
+			return false;
+		}
+		streams.inflate_ready = true;
+	} else {
+		inflateReset(stream);
+	}
+	if (app_dict_len) {
+		inflateSetDictionary(stream, app_dict, app_dict_len);
+	}
+
+	stream->avail_in = (uInt) in_len;
+	stream->next_in = (Bytef*) in;
+	stream->avail_out = (uInt) APP_MESSAGE_LEN;
+	stream->next_out = (Bytef*) out;
+
+	if (inflate(stream, Z_FINISH) != Z_STREAM_END) {
+		return false;
+	}
 
-	inflateInit(&infstream);
-	inflate(&infstream, Z_NO_FLUSH);
-	inflateEnd(&infstream);
+	*out_len = (uint8_t) (stream->next_out - out);
 
-	*msg_len = (uint8_t) infstream.total_out;
-	memcpy(msg, b, APP_MESSAGE_LEN);
+	return true;
 }
@@ -1,78 +1,121 @@
 #include "node_essentials.h"
 
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include "connection.h"
-#include "io.h"
 #include "crc.h"
-
-struct conn {
-	int32_t fd;
-	uint16_t port;
+#include "io.h"
+#include "node_host.h"
+#include "node_pool.h"
+#ifdef NODE_LINK_SHM
+#include "node_link.h"
+#endif
+
+#define MAX_NEIGHBORS 28
+
+struct node_essentials {
+	uint16_t broadcast_neighbors[MAX_NEIGHBORS];
+	uint8_t neighbor_num;
+	node_addr_t self_addr;
+	// outgoing connections are served by node event loop so sends never block it
+	struct serving_data* serving;
 };
 
-// server also counted
-#define CONNECTIONS 29
-static struct conn connections[CONNECTIONS];
+static struct node_essentials default_essentials;
 
-static uint16_t broadcast_neighbors[CONNECTIONS];
-static uint8_t neighbor_num = 0;
+// state of node that runs on this thread (see node_host.c)
+static _Thread_local struct node_essentials* ess = &default_essentials;
 
-void node_essentials_reset_connections(void) {
-	for (size_t i = 0; i < CONNECTIONS; i++) {
-		if (connections[i].port != SERVER_PORT && connections[i].fd > 0 && connections[i].port < UINT16_MAX) {
-			close(connections[i].fd);
-			connections[i].fd = -1;
-			connections[i].port = UINT16_MAX;
-		}
+bool node_essentials_init_connections(struct serving_data* node_serving) {
+	ess->serving = node_serving;
+	node_pool_init(ess->serving);
+
+#ifdef NODE_LINK_SHM
+	// neighbors are reached through shared memory, other ports (server) through sockets
+	if (!node_link_init(ess->serving, ess->self_addr, ess->broadcast_neighbors, ess->neighbor_num)) {
+		node_log_error("Failed to create shared memory links");
+		return false;
 	}
+#endif
+
+	return true;
 }
 
-static int32_t get_conn(uint16_t port) {
-	static bool init = false;
-	size_t i;
+void node_essentials_reset_connections(void) {
+	node_pool_reset();
 
-	if (!init) {
-		for (i = 0; i < CONNECTIONS; i++) {
-			connections[i].fd = -1;
-			connections[i].port = UINT16_MAX;
-		}
-		init = true;
-	}
+#ifdef NODE_LINK_SHM
+	node_link_reset();
+#endif
+}
 
-	for (i = 0; i < CONNECTIONS; i++) {
-		if (connections[i].fd > 0 && connections[i].port == port) {
-			return connections[i].fd;
-		}
+void node_essentials_free_connections(void) {
+	const struct node_pool_stats* stats;
+
+	stats = node_pool_stats();
+	node_log_info("Connection pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " reconnects, %" PRIu64 " evictions, %" PRIu64 " dead",
+		stats->hits, stats->misses, stats->reconnects, stats->evictions, stats->dead);
+	node_log_info("Connection pool: %" PRIu64 " failed connects, %" PRIu64 " skipped connects",
+		stats->failed_connects, stats->skipped_connects);
+
+	node_essentials_reset_connections();
+
+#ifdef NODE_LINK_SHM
+	node_link_free();
+#endif
+}
+
+void node_essentials_peer_alive(node_addr_t addr) {
+	node_pool_alive(node_port(addr));
+}
+
+bool node_essentials_announce(node_addr_t addr, uint16_t port) {
+	uint8_t buf[sizeof(node_update_t) + MSG_BASE_LEN];
+	msg_len_type buf_len;
+	int32_t server_fd;
+	bool status;
+
+	status = true;
+	server_fd = connection_socket_to_send(SERVER_PORT);
+
+	if (server_fd < 0) {
+		node_log_error("Failed to get socket");
+		return false;
 	}
 
-	for (i = 0; i < CONNECTIONS; i++) {
-		if (connections[i].fd == -1) {
-			connections[i].fd = connection_socket_to_send(port);
-			if (connections[i].fd < 0) {
-				break;
-			}
-			connections[i].port = port;
+	node_update_t payload = {
+		.addr = addr,
+		.pid = getpid(),
+		.port = port,
+	};
 
-			return connections[i].fd;
-		}
+	format_create(REQUEST_UPDATE, &payload, buf, &buf_len, REQUEST_SENDER_NODE);
+
+	if (!io_write_all(server_fd, buf, buf_len)) {
+		node_log_error("Failed to send node init data");
+		status = false;
 	}
 
-	return -1;
+	close(server_fd);
+
+	return status;
 }
 
 bool node_essentials_notify_server(notify_t* notify) {
 	uint8_t b[sizeof(notify_t) + MSG_BASE_LEN];
 	msg_len_type buf_len;
-	int32_t server_fd;
+	struct serving_conn* server_conn;
 
 	format_create(REQUEST_NOTIFY, notify, b, &buf_len, REQUEST_SENDER_NODE);
 
-	server_fd = get_conn(SERVER_PORT);
-	if (server_fd < 0) {
+	server_conn = node_pool_get(SERVER_PORT);
+	if (server_conn == NULL) {
 		node_log_error("Failed to connect to server");
 		return false;
 	} else {
-		if (!io_write_all(server_fd, b, buf_len)) {
+		if (!serving_send(ess->serving, server_conn, b, buf_len)) {
 			node_log_error("Failed to send notify request to server");
 			return false;
 		}
@@ -81,9 +124,23 @@ bool node_essentials_notify_server(notify_t* notify) {
 	return true;
 }
 
-void node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_broadcast) {
-	uint8_t b[MAX_MSG_LEN];
+bool node_essentials_answer_control(control_t* control) {
+	uint8_t b[sizeof(control_t) + MSG_BASE_LEN];
 	msg_len_type buf_len;
+	struct serving_conn* server_conn;
+
+	format_create(REQUEST_CONTROL_RESULT, control, b, &buf_len, REQUEST_SENDER_NODE);
+
+	server_conn = node_pool_get(SERVER_PORT);
+	if (server_conn == NULL) {
+		node_log_error("Failed to connect to server");
+		return false;
+	}
+
+	return serving_send(ess->serving, server_conn, b, buf_len);
+}
+
+void node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_broadcast) {
 	size_t i;
 
 	if (!stop_broadcast) {
@@ -91,79 +148,103 @@ void node_essentials_broadcast_route(node_packet_t* route_payload, bool stop_bro
 		route_payload->time_to_live--;
 
 		route_payload->crc = packet_crc(route_payload);
-		format_create(REQUEST_ROUTE_DIRECT, route_payload, b, &buf_len, REQUEST_SENDER_NODE);
 
-		for (i = 0; i < neighbor_num; i++) {
-			node_essentials_get_conn_and_send(broadcast_neighbors[i], b, buf_len);
+		for (i = 0; i < ess->neighbor_num; i++) {
+			node_essentials_create_and_send(ess->broadcast_neighbors[i], REQUEST_ROUTE_DIRECT, route_payload);
 		}
 	}
 }
 
+// received frame lacks its length (serving may copy it out of ring), so every link puts it back in front of body
+// while copying body into its queue, and transit frame is copied once per hop
+static bool send_body(uint16_t port, const uint8_t* body, msg_len_type len);
+
+bool node_essentials_forward(uint16_t port, const uint8_t* buf, msg_len_type len) {
+	return send_body(port, buf, len);
+}
+
+void node_essentials_broadcast_forward(const uint8_t* buf, msg_len_type len) {
+	size_t i;
+
+	for (i = 0; i < ess->neighbor_num; i++) {
+		send_body(ess->broadcast_neighbors[i], buf, len);
+	}
+}
+
 void node_essentials_broadcast(node_packet_t* broadcast_payload) {
-	uint8_t b[MAX_MSG_LEN];
-	msg_len_type buf_len;
 	size_t i;
 
-	for (i = 0; i < neighbor_num; i++) {
-		broadcast_payload->receiver_addr = (uint8_t) node_addr(broadcast_neighbors[i]);
+	for (i = 0; i < ess->neighbor_num; i++) {
+		broadcast_payload->receiver_addr = (node_addr_t) node_addr(ess->broadcast_neighbors[i]);
 		broadcast_payload->crc = packet_crc(broadcast_payload);
 
-		format_create(REQUEST_SEND, broadcast_payload, b, &buf_len, REQUEST_SENDER_NODE);
-
-		node_essentials_get_conn_and_send(broadcast_neighbors[i], b, buf_len);
+		node_essentials_create_and_send(ess->broadcast_neighbors[i], REQUEST_SEND, broadcast_payload);
 	}
 }
 
 void node_essentials_send_unicast_contest(unicast_contest_t* unicast) {
 	uint8_t i;
-	uint8_t b[sizeof(unicast_contest_t) + MSG_BASE_LEN];
-	uint8_t buf_len;
 
-	format_create(REQUEST_UNICAST_CONTEST, unicast, b, &buf_len, REQUEST_SENDER_NODE);
-	for (i = 0; i < neighbor_num; i++) {
-		node_essentials_get_conn_and_send(broadcast_neighbors[i], b, buf_len);
+	for (i = 0; i < ess->neighbor_num; i++) {
+		node_essentials_create_and_send(ess->broadcast_neighbors[i], REQUEST_UNICAST_CONTEST, unicast);
 	}
 }
 
-void node_essentials_send_unicast_first(unicast_contest_t* unicast, uint8_t addr) {
-	uint8_t b[sizeof(unicast_contest_t) + MSG_BASE_LEN];
-	uint8_t buf_len;
-	uint8_t prev_addr;
+void node_essentials_send_unicast_first(unicast_contest_t* unicast, node_addr_t addr) {
+	node_addr_t prev_addr;
 
 	prev_addr = unicast->node_addr;
 	unicast->node_addr = addr;
-	format_create(REQUEST_UNICAST_FIRST, unicast, b, &buf_len, REQUEST_SENDER_NODE);
-	node_essentials_get_conn_and_send(node_port(prev_addr), b, buf_len);
+	node_essentials_create_and_send(node_port(prev_addr), REQUEST_UNICAST_FIRST, unicast);
+}
+
+struct node_essentials* node_essentials_create(void) {
+	return calloc(1, sizeof(struct node_essentials));
 }
 
-static inline uint8_t from_pos(const int8_t pos[2]) {
-	return (uint8_t) (pos[0] * MATRIX_SIZE + pos[1]);
+void node_essentials_destroy(struct node_essentials* essentials) {
+	free(essentials);
 }
 
-static void fill_broadcast_neighbors(uint8_t addr, uint8_t radius);
+void node_essentials_switch(struct node_essentials* essentials) {
+	ess = essentials ? essentials : &default_essentials;
+}
+
+static inline node_addr_t from_pos(const int8_t pos[2]) {
+	return (node_addr_t) (pos[0] * MATRIX_SIZE + pos[1]);
+}
 
-void node_essentials_fill_neighbors_port(uint8_t addr) {
+static void fill_broadcast_neighbors(node_addr_t addr, uint8_t radius);
+
+void node_essentials_fill_neighbors_port(node_addr_t addr) {
+	ess->self_addr = addr;
 	fill_broadcast_neighbors(addr, BROADCAST_RADIUS);
 }
 
+uint8_t node_essentials_neighbors(const uint16_t** ports) {
+	*ports = ess->broadcast_neighbors;
+
+	return ess->neighbor_num;
+}
+
 static void left_right_neighbours(int8_t col, uint8_t radius, int8_t i, int8_t row) {
 	int8_t j;
 
 	j = (int8_t) (col - 1);
 	if (i != row - radius && i != row + radius) {
 		for (; j > (col - radius) && j >= 0; j--) {
-			broadcast_neighbors[neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
+			ess->broadcast_neighbors[ess->neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
 		}
 	}
 	j = (int8_t) (col + 1);
 	if (i != row - radius && i != row + radius) {
 		for (; j < (col + radius) && j < MATRIX_SIZE; j++) {
-			broadcast_neighbors[neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
+			ess->broadcast_neighbors[ess->neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
 		}
 	}
 }
 
-static void fill_broadcast_neighbors(uint8_t addr, uint8_t radius) { // NOLINT
+static void fill_broadcast_neighbors(node_addr_t addr, uint8_t radius) { // NOLINT
 	int8_t i;
 	int8_t j;
 	int8_t row;
@@ -181,7 +262,7 @@ static void fill_broadcast_neighbors(uint8_t addr, uint8_t radius) { // NOLINT
 	for (i = (int8_t) (row - 1); i >= row - radius && i>= 0; i--) {
 		if (i >= 0) {
 			j = col;
-			broadcast_neighbors[neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
+			ess->broadcast_neighbors[ess->neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
 			left_right_neighbours(col, radius, i, row);
 		}
 	}
@@ -189,7 +270,7 @@ static void fill_broadcast_neighbors(uint8_t addr, uint8_t radius) { // NOLINT
 	for (i = (int8_t) (row + 1); i <= row + radius && i < MATRIX_SIZE; i++) {
 		if (i < MATRIX_SIZE) {
 			j = col;
-			broadcast_neighbors[neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
+			ess->broadcast_neighbors[ess->neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
 			left_right_neighbours(col, radius, i, row);
 		}
 	}
@@ -197,30 +278,77 @@ static void fill_broadcast_neighbors(uint8_t addr, uint8_t radius) { // NOLINT
 	//left
 	i = row;
 	for (j = (int8_t) (col - 1); j >= 0 && j >= col - radius; j--) {
-		broadcast_neighbors[neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
+		ess->broadcast_neighbors[ess->neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
 
 	}
 	//right
 	for (j = (int8_t) (col + 1); j < MATRIX_SIZE && j <= col + radius; j++) {
-		broadcast_neighbors[neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
+		ess->broadcast_neighbors[ess->neighbor_num++] = node_port(from_pos((int8_t[]) { i, j }));
 	}
 }
 
 bool node_essentials_get_conn_and_send(uint16_t port, uint8_t* buf, msg_len_type buf_len) {
-	int32_t conn_fd;
+	return send_body(port, buf + sizeof(buf_len), (msg_len_type) (buf_len - sizeof(buf_len)));
+}
 
-	conn_fd = get_conn(port);
+static bool send_body(uint16_t port, const uint8_t* body, msg_len_type len) {
+	struct serving_conn* conn;
 
-	if (conn_fd < 0) {
-		return false;
+#ifdef NODE_LINK_SHM
+	uint8_t* slot;
+
+	if (node_link_has(port)) {
+		slot = node_link_reserve(port);
+		if (slot == NULL) {
+			return false;
+		}
+		slot[0] = (msg_len_type) (len + sizeof(len));
+		memcpy(slot + sizeof(len), body, len);
+
+		return node_link_commit(port);
 	}
+#endif
 
-	// TODO: healthcheck connection
+	// co-hosted node gets frame through memory, through socket when flood fills its inbox
+	if (node_host_has(port) && node_host_send(port, body, len)) {
+		return true;
+	}
 
-	if (!io_write_all(conn_fd, buf, buf_len)) {
+	// connection to dead peer is closed by serving and reconnected here
+	conn = node_pool_get(port);
+	if (conn == NULL) {
+		return false;
+	}
+
+	// frame is only queued: it is sent when socket is writable, coalesced with other frames to same node
+	if (!serving_send_body(ess->serving, conn, body, len)) {
 		node_log_error("Failed to send route direct request: address %d", node_addr(port));
 		return false;
 	}
 
 	return true;
 }
+
+bool node_essentials_create_and_send(uint16_t port, enum request req, const void* payload) {
+	uint8_t b[MAX_MSG_LEN];
+	msg_len_type buf_len;
+
+#ifdef NODE_LINK_SHM
+	uint8_t* slot;
+
+	// frame is created right in the ring slot of neighbor
+	if (node_link_has(port)) {
+		slot = node_link_reserve(port);
+		if (slot == NULL) {
+			return false;
+		}
+		format_create(req, payload, slot, &buf_len, REQUEST_SENDER_NODE);
+
+		return node_link_commit(port);
+	}
+#endif
+
+	format_create(req, payload, b, &buf_len, REQUEST_SENDER_NODE);
+
+	return node_essentials_get_conn_and_send(port, b, buf_len);
+}
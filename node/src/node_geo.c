@@ -0,0 +1,198 @@
+#include "node_geo.h"
+
+#include <math.h>
+
+#include "node_essentials.h"
+#include "settings.h"
+
+#define FACE_DIRS 4
+
+// grid edges of node in counterclockwise order as { row, col } steps: column is x and rows grow down, so up is -1
+static const int8_t face_dirs[FACE_DIRS][2] = { { 0, 1 }, { -1, 0 }, { 0, -1 }, { 1, 0 } };
+
+static int32_t row_of(node_addr_t addr) {
+	return (int32_t) (addr / MATRIX_SIZE);
+}
+
+static int32_t col_of(node_addr_t addr) {
+	return (int32_t) (addr % MATRIX_SIZE);
+}
+
+static uint32_t dist2(node_addr_t a, node_addr_t b) {
+	int32_t dr;
+	int32_t dc;
+
+	dr = row_of(a) - row_of(b);
+	dc = col_of(a) - col_of(b);
+
+	return (uint32_t) (dr * dr + dc * dc);
+}
+
+// closest to receiver neighbor that wasn't tried yet and is closer than node, tried ones are marked in mask
+static node_addr_t next_greedy(node_addr_t addr, node_addr_t receiver_addr, uint64_t* tried) {
+	const uint16_t* ports;
+	uint32_t best_dist;
+	uint32_t d;
+	uint8_t count;
+	uint8_t best;
+	uint8_t i;
+
+	count = node_essentials_neighbors(&ports);
+	best_dist = dist2(addr, receiver_addr);
+	best = count;
+	for (i = 0; i < count; i++) {
+		if (*tried & (1ull << i)) {
+			continue;
+		}
+		d = dist2((node_addr_t) node_addr(ports[i]), receiver_addr);
+		if (d < best_dist) {
+			best_dist = d;
+			best = i;
+		}
+	}
+
+	if (best == count) {
+		return NODE_ADDR_NONE;
+	}
+	*tried |= 1ull << best;
+
+	return (node_addr_t) node_addr(ports[best]);
+}
+
+// dead neighbor refuses frame (see node_pool_get), so next one is tried
+static bool send_greedy(node_packet_t* packet, node_addr_t addr) {
+	node_addr_t next_addr;
+	uint64_t tried;
+
+	tried = 0;
+	while ((next_addr = next_greedy(addr, packet->receiver_addr, &tried)) != NODE_ADDR_NONE) {
+		if (node_essentials_create_and_send(node_port(next_addr), REQUEST_SEND, packet)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// first edge counterclockwise from line to receiver
+static uint8_t face_entry_dir(node_addr_t addr, node_addr_t receiver_addr) {
+	double line;
+	double angle;
+	double best_angle;
+	uint8_t best;
+	uint8_t i;
+
+	line = atan2((double) (row_of(addr) - row_of(receiver_addr)), (double) (col_of(receiver_addr) - col_of(addr)));
+	best = 0;
+	best_angle = 2 * M_PI + 1;
+	for (i = 0; i < FACE_DIRS; i++) {
+		angle = fmod(i * M_PI / 2 - line + 4 * M_PI, 2 * M_PI);
+		if (angle <= 0) {
+			angle = 2 * M_PI;
+		}
+		if (angle < best_angle) {
+			best_angle = angle;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+// edge to previous hop, FACE_DIRS if it isn't grid neighbor
+static uint8_t face_dir_to(node_addr_t addr, node_addr_t neighbor_addr) {
+	uint8_t i;
+
+	for (i = 0; i < FACE_DIRS; i++) {
+		if (row_of(neighbor_addr) - row_of(addr) == face_dirs[i][0] && col_of(neighbor_addr) - col_of(addr) == face_dirs[i][1]) {
+			return i;
+		}
+	}
+
+	return FACE_DIRS;
+}
+
+// edges are tried counterclockwise from first one, dead neighbors are skipped like missing edges
+static bool send_face(node_packet_t* packet, node_addr_t addr, uint8_t first_dir) {
+	int32_t row;
+	int32_t col;
+	uint8_t dir;
+	uint8_t i;
+
+	for (i = 0; i < FACE_DIRS; i++) {
+		dir = (uint8_t) ((first_dir + i) % FACE_DIRS);
+		row = row_of(addr) + face_dirs[dir][0];
+		col = col_of(addr) + face_dirs[dir][1];
+		if (row < 0 || row >= MATRIX_SIZE || col < 0 || col >= MATRIX_SIZE) {
+			continue;
+		}
+		if (node_essentials_create_and_send(node_port((node_addr_t) (row * MATRIX_SIZE + col)), REQUEST_SEND, packet)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool node_geo_send(node_packet_t* packet, node_addr_t addr) {
+	node_addr_t prev_addr;
+	uint8_t dir;
+
+	if (packet->face_addr != NODE_ADDR_NONE) {
+		if (dist2(addr, packet->receiver_addr) < dist2(packet->face_addr, packet->receiver_addr)) {
+			packet->face_addr = NODE_ADDR_NONE;
+		} else if (packet->face_addr == addr || packet->time_to_live <= 0) {
+			packet->face_addr = NODE_ADDR_NONE;
+			return false;
+		}
+	}
+
+	prev_addr = packet->local_sender_addr;
+	packet->local_sender_addr = addr;
+
+	if (packet->face_addr == NODE_ADDR_NONE) {
+		packet->crc = packet_crc(packet);
+		if (send_greedy(packet, addr)) {
+			return true;
+		}
+
+		packet->face_addr = addr;
+		packet->time_to_live = NODE_GEO_FACE_HOPS;
+		dir = face_entry_dir(addr, packet->receiver_addr);
+	} else {
+		packet->time_to_live--;
+		// right hand rule: next edge is first one counterclockwise from edge packet came by
+		dir = face_dir_to(addr, prev_addr);
+		dir = dir < FACE_DIRS ? (uint8_t) (dir + 1) : face_entry_dir(addr, packet->receiver_addr);
+	}
+
+	packet->crc = packet_crc(packet);
+	if (send_face(packet, addr, dir)) {
+		return true;
+	}
+
+	packet->face_addr = NODE_ADDR_NONE;
+
+	return false;
+}
+
+bool node_geo_forward(uint8_t* buf, size_t len, const packet_header_t* header, node_addr_t addr) {
+	node_addr_t next_addr;
+	uint64_t tried;
+
+	if (header->face_addr != NODE_ADDR_NONE) {
+		return false;
+	}
+
+	// next node knows where packet came from
+	format_patch_packet(buf, addr, header->time_to_live);
+
+	tried = 0;
+	while ((next_addr = next_greedy(addr, header->receiver_addr, &tried)) != NODE_ADDR_NONE) {
+		if (node_essentials_forward(node_port(next_addr), buf, (msg_len_type) len)) {
+			return true;
+		}
+	}
+
+	return false;
+}
@@ -1,16 +1,38 @@
 #include "node_handler.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <memory.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "node_essentials.h"
-#include "io.h"
 #include "node_app.h"
+#include "node_host.h"
+#include "node_pool.h"
 #include "crc.h"
+#ifdef NODE_ROUTING_GEO
+#include "node_geo.h"
+#endif
 
-#define MAX_MESSAGE_DATA 100
+// entry is live for MESSAGE_GENERATIONS generations, generation passes every MESSAGE_GENERATION_LEN new messages,
+// so at most half of table is live and probe window rarely has no free slot
+#define MESSAGE_GENERATION_LEN (MESSAGE_TABLE_SIZE / MESSAGE_GENERATIONS / 2)
+
+// hash keeps this many high bits of product
+#define MESSAGE_TABLE_BITS __builtin_ctz(MESSAGE_TABLE_SIZE)
+
+_Static_assert((MESSAGE_TABLE_SIZE & (MESSAGE_TABLE_SIZE - 1)) == 0, "MESSAGE_TABLE_SIZE must be power of two");
+_Static_assert(MESSAGE_TABLE_BITS > 0 && MESSAGE_TABLE_BITS < 32, "MESSAGE_TABLE_SIZE must fit into hash of 32 bit key");
+_Static_assert(MESSAGE_GENERATION_LEN > 0, "MESSAGE_TABLE_SIZE is too small for MESSAGE_GENERATIONS");
 
 struct message_data {
+	// generation + 1 when message was seen, 0 if slot was never used
+	uint32_t generation;
 	uint16_t id;
+	// node that started message, so ids of different origins don't collide
+	node_addr_t origin;
 	// if message was delivered by some route direct packet
 	// and route inverse is already sent
 	bool stop_inverse;
@@ -19,34 +41,62 @@ struct message_data {
 	bool unicast_first;
 };
 
-static uint8_t message_num = 0;
-static bool init = false;
-struct message_data messages[MAX_MESSAGE_DATA];
-
-static bool is_id_set(uint16_t id);
-
-static void init_messages_data(void);
-
-static bool get_inverse_by_id(uint16_t id, bool* stop_inverse);
-
-static bool get_was_message_by_id(uint16_t id, bool* was_message);
+// send that waits for route inverse at node that started route discovery
+struct pending_send {
+	uint64_t queued_ms;
+	node_packet_t packet;
+};
 
-static void set_inverse_by_id(uint16_t id, bool stop_inverse);
+// open addressing table keyed by (origin, id), lookup and insert look at MESSAGE_MAX_PROBE slots at most
+struct node_messages {
+	struct message_data messages[MESSAGE_TABLE_SIZE];
+	uint32_t generation;
+	uint32_t generation_inserted;
+	// in order of arrival, so sends to one receiver leave in order
+	struct pending_send pending[PENDING_SENDS_MAX];
+	uint8_t pending_count;
+	// fires when first pending send expires, -1 if node has no timer
+	int32_t timer_fd;
+	struct node_messages_stats stats;
+};
 
-static void set_was_message_by_id(uint16_t id, bool was_message);
+static struct node_messages default_messages = {.timer_fd = -1};
 
-static bool get_unicast_status_by_id(uint16_t id, bool* unicast_first);
+// messages of node that runs on this thread (see node_host.c)
+static _Thread_local struct node_messages* msgs = &default_messages;
 
-static void set_unicast_status_by_id(uint16_t id, bool unicast_first);
+__attribute__((warn_unused_result))
+static struct message_data* get_message(node_addr_t origin, uint16_t id);
 
 static void fill_messages_default(void);
 
-bool handle_ping(int32_t conn_fd) {
-	enum request_result req_res;
+bool handle_control(control_t* control, routing_table_t* table, app_t apps[APPS_COUNT], node_addr_t addr) {
+	switch (control->req) {
+		case REQUEST_PING:
+			node_log_info("Ping node %d", addr);
+			control->res = REQUEST_OK;
+			break;
+		case REQUEST_RESET:
+			handle_reset(table, apps, addr);
+			control->res = REQUEST_OK;
+			break;
+		case REQUEST_KILL_NODE:
+			// hosted node can't be killed by signal, server doesn't wait for answer
+			if (node_host_kill_current()) {
+				node_log_info("Killed hosted node %d", addr);
+				return true;
+			}
+			node_log_error("Node %d is not hosted and must be killed by signal", addr);
+			control->res = REQUEST_ERR;
+			break;
+		default:
+			node_log_error("Unsupported control request %d", control->req);
+			control->res = REQUEST_ERR;
+			break;
+	}
 
-	req_res = REQUEST_OK;
-	if (!io_write_all(conn_fd, (uint8_t*) &req_res, sizeof(req_res))) {
-		node_log_error("Failed to response to ping");
+	if (!node_essentials_answer_control(control)) {
+		node_log_error("Failed to answer control request %d", control->id);
 		return false;
 	}
 
@@ -56,11 +106,21 @@ bool handle_ping(int32_t conn_fd) {
 __attribute__((warn_unused_result))
 static bool is_valid_crc(node_packet_t* packet);
 
-bool handle_server_send(enum request cmd_type, uint8_t addr, const void* payload, const routing_table_t* routing, app_t apps[APPS_COUNT]) { // NOLINT
+// starts route discovery to receiver of packet that has no route, false if packet is dropped
+static bool discover_route(node_packet_t* packet, node_addr_t addr);
+
+#ifndef NODE_ROUTING_GEO
+static void expire_pending(void);
+
+// returns time in ms until first pending send expires, -1 if no send waits
+static int32_t set_timer(void);
+
+static void flush_pending(const routing_table_t* routing, node_addr_t addr, node_addr_t receiver_addr);
+#endif
+
+bool handle_server_send(enum request cmd_type, node_addr_t addr, const void* payload, routing_table_t* routing, app_t apps[APPS_COUNT]) { // NOLINT
 	node_packet_t* packet;
-	uint8_t b[MAX_MSG_LEN];
-	msg_len_type buf_len;
-	uint8_t next_addr;
+	node_addr_t next_addr;
 	bool res;
 	notify_t notify;
 
@@ -95,24 +155,50 @@ bool handle_server_send(enum request cmd_type, uint8_t addr, const void* payload
 	}
 
 	node_log_debug("Finding route to %d", packet->receiver_addr);
+#ifdef NODE_ROUTING_GEO
+	packet->face_addr = NODE_ADDR_NONE;
+	if (node_geo_send(packet, addr)) {
+		node_log_info("Sent message (length %d) from %d:%d to %d:%d",
+			packet->app_payload.message_len, packet->sender_addr, packet->app_payload.addr_from,
+			packet->receiver_addr, packet->app_payload.addr_to);
+		return res;
+	}
+	// table isn't used: its next hop would route packet back by position, so flood is the only fallback
+	(void) routing;
+	next_addr = NODE_ADDR_NONE;
+#else
 	next_addr = routing_next_addr(routing, packet->receiver_addr);
-	if (next_addr == UINT8_MAX) {
+#endif
+	if (next_addr == NODE_ADDR_NONE) {
 		node_log_debug("Failed to find route");
 
-		packet->local_sender_addr = addr;
-		packet->time_to_live = TTL;
-		node_essentials_broadcast_route(packet, false);
-
-		return false;
+		return discover_route(packet, addr);
 	}
 
 	packet->crc = packet_crc(packet);
-	format_create(cmd_type, packet, b, &buf_len, REQUEST_SENDER_NODE);
+	if (!node_essentials_create_and_send(node_port(next_addr), cmd_type, packet)) {
+		// next hop died after route was learned, so route is discovered again
+		node_log_warn("Next node %d to %d is dead", next_addr, packet->receiver_addr);
+		routing_del(routing, packet->receiver_addr);
 
-	if (node_essentials_get_conn_and_send(node_port(next_addr), b, buf_len)) {
-		node_log_info("Sent message (length %d) from %d:%d to %d:%d",
-			packet->app_payload.message_len, packet->sender_addr, packet->app_payload.addr_from,
-			packet->receiver_addr, packet->app_payload.addr_to);
+		return discover_route(packet, addr);
+	}
+	node_log_info("Sent message (length %d) from %d:%d to %d:%d",
+		packet->app_payload.message_len, packet->sender_addr, packet->app_payload.addr_from,
+		packet->receiver_addr, packet->app_payload.addr_to);
+
+	return res;
+}
+
+bool handle_server_send_batch(node_addr_t addr, send_batch_t* batch, routing_table_t* routing, app_t apps[APPS_COUNT]) {
+	uint8_t i;
+	bool res;
+
+	res = true;
+	for (i = 0; i < batch->count; i++) {
+		if (!handle_server_send(REQUEST_SEND, addr, &batch->packets[i], routing, apps)) {
+			res = false;
+		}
 	}
 
 	return res;
@@ -123,7 +209,7 @@ void handle_broadcast(node_packet_t* broadcast_payload) {
 	node_essentials_broadcast(broadcast_payload);
 }
 
-void handle_server_unicast(node_packet_t* unicast_payload, uint8_t cur_node_addr) {
+void handle_server_unicast(node_packet_t* unicast_payload, node_addr_t cur_node_addr) {
 	node_app_setup_delivery(&unicast_payload->app_payload);
 	unicast_contest_t unicast = {
 		.node_addr = cur_node_addr,
@@ -135,13 +221,13 @@ void handle_server_unicast(node_packet_t* unicast_payload, uint8_t cur_node_addr
 }
 
 __attribute__((warn_unused_result))
-static bool node_handle_app_request(app_t apps[APPS_COUNT], node_packet_t* send_payload, uint8_t addr);
+static bool node_handle_app_request(app_t apps[APPS_COUNT], node_packet_t* send_payload, node_addr_t addr);
 
 __attribute__((warn_unused_result))
-static bool send_next(const routing_table_t* routing, node_packet_t* ret_payload, uint8_t addr);
+static bool send_next(const routing_table_t* routing, node_packet_t* ret_payload, node_addr_t addr);
 
-bool handle_node_send(uint8_t addr, const void* payload, const routing_table_t* routing, app_t apps[APPS_COUNT]) {
-	uint8_t addr_to;
+bool handle_node_send(node_addr_t addr, const void* payload, const routing_table_t* routing, app_t apps[APPS_COUNT]) {
+	node_addr_t addr_to;
 	bool res;
 	node_packet_t* packet;
 
@@ -171,12 +257,43 @@ bool handle_node_send(uint8_t addr, const void* payload, const routing_table_t*
 	return res;
 }
 
-bool route_direct_handle_delivered(routing_table_t* routing, node_packet_t* route_payload, uint8_t server_addr, app_t apps[APPS_COUNT]);
+bool route_direct_handle_delivered(routing_table_t* routing, node_packet_t* route_payload, node_addr_t server_addr, app_t apps[APPS_COUNT]);
+
+// route back to sender of route request goes through node that passed request here
+static void learn_route(routing_table_t* routing, node_addr_t sender_addr, node_addr_t local_sender_addr, ttl_t time_to_live) {
+	ttl_t new_metric;
 
-bool handle_node_route_direct(routing_table_t* routing, uint8_t server_addr, void* payload, app_t apps[APPS_COUNT]) {
+	new_metric = TTL - time_to_live + 1;
+	if (new_metric > 0) {
+		if (routing_next_addr(routing, sender_addr) == NODE_ADDR_NONE) {
+			routing_set_addr(routing, sender_addr, local_sender_addr, new_metric);
+		} else {
+			ttl_t old_metric;
+
+			old_metric = routing_get(routing, sender_addr).metric;
+			if (old_metric > new_metric) {
+				routing_set_addr(routing, sender_addr, local_sender_addr, new_metric);
+				/* node_log_debug("Replaced old path with metric %d to new path with metric %d", old_metric, new_metric); */
+			}
+		}
+	}
+}
+
+// route request is flooded once by every node
+static bool is_duplicate(node_addr_t origin, uint16_t id) {
+	struct message_data* message;
+
+	message = get_message(origin, id);
+	if (message->was_message) {
+		return true;
+	}
+	message->was_message = true;
+
+	return false;
+}
+
+bool handle_node_route_direct(routing_table_t* routing, node_addr_t server_addr, void* payload, app_t apps[APPS_COUNT]) {
 	node_packet_t* route_payload;
-	bool was_message;
-	int8_t new_metric;
 
 	route_payload = (node_packet_t*) payload;
 
@@ -189,30 +306,11 @@ bool handle_node_route_direct(routing_table_t* routing, uint8_t server_addr, voi
 		return false;
 	}
 
-	if (get_was_message_by_id(route_payload->app_payload.id, &was_message)) {
-		if (was_message) {
-			return 0;
-		} else {
-			set_was_message_by_id(route_payload->app_payload.id, true);
-		}
-	} else {
-		set_was_message_by_id(route_payload->app_payload.id, true);
+	if (is_duplicate(route_payload->sender_addr, route_payload->app_payload.id)) {
+		return 0;
 	}
 
-	new_metric = TTL - route_payload->time_to_live + 1;
-	if (new_metric > 0) {
-		if (routing_next_addr(routing, route_payload->sender_addr) == UINT8_MAX) {
-			routing_set_addr(routing, route_payload->sender_addr, route_payload->local_sender_addr, new_metric);
-		} else {
-			int8_t old_metric;
-
-			old_metric = routing_get(routing, route_payload->sender_addr).metric;
-			if (old_metric > new_metric) {
-				routing_set_addr(routing, route_payload->sender_addr, route_payload->local_sender_addr, new_metric);
-				/* node_log_debug("Replaced old path with metric %d to new path with metric %d", old_metric, new_metric); */
-			}
-		}
-	}
+	learn_route(routing, route_payload->sender_addr, route_payload->local_sender_addr, route_payload->time_to_live);
 
 	if (route_payload->receiver_addr == server_addr) {
 		route_direct_handle_delivered(routing, route_payload, server_addr, apps);
@@ -226,25 +324,66 @@ bool handle_node_route_direct(routing_table_t* routing, uint8_t server_addr, voi
 	return true;
 }
 
-void handle_unicast_contest(unicast_contest_t* unicast, uint8_t cur_node_addr) {
+bool handle_node_forward(enum request cmd_type, routing_table_t* routing, node_addr_t addr, uint8_t* buf, size_t len) {
+	packet_header_t header;
+#ifndef NODE_ROUTING_GEO
+	node_addr_t next_addr;
+#endif
+
+	if (cmd_type != REQUEST_SEND && cmd_type != REQUEST_ROUTE_DIRECT) {
+		return false;
+	}
+
+	// damaged frame is reported by full handler
+	if (!format_peek_packet(buf, len, &header) || header.receiver_addr == addr) {
+		return false;
+	}
+
+	if (cmd_type == REQUEST_SEND) {
+#ifdef NODE_ROUTING_GEO
+		// packet going around dead nodes is handled by full handler
+		node_essentials_peer_alive(header.local_sender_addr);
+		return node_geo_forward(buf, len, &header, addr);
+#else
+		next_addr = routing_next_addr(routing, header.receiver_addr);
+		if (next_addr == NODE_ADDR_NONE) {
+			// full handler starts route discovery from here
+			return false;
+		}
+
+		node_essentials_peer_alive(header.local_sender_addr);
+		node_essentials_forward(node_port(next_addr), buf, (msg_len_type) len);
+
+		return true;
+#endif
+	}
+
+	node_essentials_peer_alive(header.local_sender_addr);
+
+	if (header.time_to_live <= 0 || is_duplicate(header.sender_addr, header.app_id)) {
+		return true;
+	}
+
+	learn_route(routing, header.sender_addr, header.local_sender_addr, header.time_to_live);
+
+	format_patch_packet(buf, addr, (ttl_t) (header.time_to_live - 1));
+	node_essentials_broadcast_forward(buf, (msg_len_type) len);
+
+	return true;
+}
+
+void handle_unicast_contest(unicast_contest_t* unicast, node_addr_t cur_node_addr) {
 	node_log_debug("Unicast contest request on node %d", cur_node_addr);
 	node_essentials_send_unicast_first(unicast, cur_node_addr);
 }
 
-void handle_unicast_first(unicast_contest_t* unicast, uint8_t cur_node_addr) {
-	bool unicast_first;
-
-	if (get_unicast_status_by_id(unicast->app_payload.id, &unicast_first)) {
-		if (!unicast_first) {
-			set_unicast_status_by_id(unicast->app_payload.id, true);
-		} else {
-			return;
-		}
-	} else {
-		uint8_t b[MAX_MSG_LEN];
-		uint8_t buf_len;
+void handle_unicast_first(unicast_contest_t* unicast, node_addr_t cur_node_addr) {
+	struct message_data* message;
 
-		set_unicast_status_by_id(unicast->app_payload.id, true);
+	// answers come to node that started contest
+	message = get_message(cur_node_addr, unicast->app_payload.id);
+	if (!message->unicast_first) {
+		message->unicast_first = true;
 		node_log_warn("Node %d won unicast contest", unicast->node_addr);
 
 		node_packet_t send_payload = {
@@ -253,20 +392,16 @@ void handle_unicast_first(unicast_contest_t* unicast, uint8_t cur_node_addr) {
 			.receiver_addr = unicast->node_addr
 		};
 		send_payload.crc = packet_crc(&send_payload);
-		format_create(REQUEST_SEND, &send_payload, b, &buf_len, REQUEST_SENDER_NODE);
-
-		if (!node_essentials_get_conn_and_send(node_port(unicast->node_addr), b, buf_len)) {
+		if (!node_essentials_create_and_send(node_port(unicast->node_addr), REQUEST_SEND, &send_payload)) {
 			node_log_error("Failed to send response to unicast first");
 		}
 	}
 }
 
-bool handle_node_route_inverse(routing_table_t* routing, void* payload, uint8_t server_addr) {
+bool handle_node_route_inverse(routing_table_t* routing, void* payload, node_addr_t server_addr) {
 	node_packet_t* route_payload;
-	uint8_t next_addr;
-	uint8_t b[sizeof(node_packet_t)];
-	msg_len_type buf_len;
-	int8_t new_metric;
+	node_addr_t next_addr;
+	ttl_t new_metric;
 
 	route_payload = (node_packet_t*) payload;
 
@@ -277,20 +412,28 @@ bool handle_node_route_inverse(routing_table_t* routing, void* payload, uint8_t
 
 	node_log_debug("Inverse node %d", server_addr);
 
+	if (route_payload->time_to_live <= 0) {
+		node_log_warn("Route inverse to %d is too long", route_payload->sender_addr);
+		return false;
+	}
+
 	new_metric = TTL - route_payload->time_to_live + 1;
 	if (new_metric > 0) {
-		if (routing_next_addr(routing, route_payload->receiver_addr) == UINT8_MAX) {
+		if (routing_next_addr(routing, route_payload->receiver_addr) == NODE_ADDR_NONE) {
 			routing_set_addr(routing, route_payload->receiver_addr, route_payload->local_sender_addr, new_metric);
 		}
 	}
 
 	if (route_payload->sender_addr == server_addr) {
 		node_log_debug("Route inverse request came back");
+#ifndef NODE_ROUTING_GEO
+		flush_pending(routing, server_addr, route_payload->receiver_addr);
+#endif
 		return true;
 	}
 
 	next_addr = routing_next_addr(routing, route_payload->sender_addr);
-	if (next_addr == UINT8_MAX) {
+	if (next_addr == NODE_ADDR_NONE) {
 		node_log_error("Failed to get next addr to %d", route_payload->sender_addr);
 		return false;
 	}
@@ -299,9 +442,7 @@ bool handle_node_route_inverse(routing_table_t* routing, void* payload, uint8_t
 	route_payload->time_to_live--;
 	route_payload->crc = packet_crc(route_payload);
 
-	format_create(REQUEST_ROUTE_INVERSE, route_payload, b, &buf_len, REQUEST_SENDER_NODE);
-
-	if (!node_essentials_get_conn_and_send(node_port(next_addr), b, buf_len)) {
+	if (!node_essentials_create_and_send(node_port(next_addr), REQUEST_ROUTE_INVERSE, route_payload)) {
 		node_log_error("Failed to connect to node %d while travel back", next_addr);
 		routing_del(routing, route_payload->sender_addr);
 		return false;
@@ -311,7 +452,7 @@ bool handle_node_route_inverse(routing_table_t* routing, void* payload, uint8_t
 }
 
 __attribute__((warn_unused_result))
-static bool node_handle_app_request(app_t apps[APPS_COUNT], node_packet_t* send_payload, uint8_t addr) {
+static bool node_handle_app_request(app_t apps[APPS_COUNT], node_packet_t* send_payload, node_addr_t addr) {
 	enum app_request app_req;
 	bool res;
 	notify_t notify;
@@ -346,24 +487,27 @@ static bool node_handle_app_request(app_t apps[APPS_COUNT], node_packet_t* send_
 }
 
 __attribute__((warn_unused_result))
-static bool send_next(const routing_table_t* routing, node_packet_t* ret_payload, uint8_t addr) {
-	uint8_t next_addr;
-	uint8_t b[MAX_MSG_LEN];
-	msg_len_type buf_len;
+static bool send_next(const routing_table_t* routing, node_packet_t* ret_payload, node_addr_t addr) {
+	node_addr_t next_addr;
 
+#ifdef NODE_ROUTING_GEO
+	if (node_geo_send(ret_payload, addr)) {
+		return true;
+	}
+	(void) routing;
+	next_addr = NODE_ADDR_NONE;
+#else
 	next_addr = routing_next_addr(routing, ret_payload->receiver_addr);
-	if (next_addr == UINT8_MAX) {
+#endif
+	if (next_addr == NODE_ADDR_NONE) {
 		// TODO: this may happen if node died after path was found
-		// start broadcast from here
+		// route is discovered again from here
 		node_log_error("Failed to find path in table");
-		ret_payload->local_sender_addr = addr;
-		ret_payload->time_to_live = TTL;
-		node_essentials_broadcast_route(ret_payload, false);
+		(void) discover_route(ret_payload, addr);
 		return false;
 	}
 
-	format_create(REQUEST_SEND, ret_payload, b, &buf_len, REQUEST_SENDER_NODE);
-	if (!node_essentials_get_conn_and_send(node_port(next_addr), b, buf_len)) {
+	if (!node_essentials_create_and_send(node_port(next_addr), REQUEST_SEND, ret_payload)) {
 		// TODO: this may happen if next addr from routing table is died
 		// delete old addr from routing and start broadcast from here
 
@@ -376,14 +520,184 @@ static bool send_next(const routing_table_t* routing, node_packet_t* ret_payload
 	return true;
 }
 
-bool route_direct_handle_delivered(routing_table_t* routing, node_packet_t* route_payload, uint8_t server_addr, app_t apps[APPS_COUNT]) {
-	uint8_t b[MAX_MSG_LEN];
-	msg_len_type buf_len;
-	uint8_t next_addr_to_back;
-	bool stop_inverse;
+#ifdef NODE_ROUTING_GEO
+// geo sends don't follow routing table (see node_geo.h), so flood carries packet to receiver itself
+// flood may be started on behalf of sender by transit node: its echoes must not teach this node route back to sender
+// through neighbor that learned it from this node, or route inverse would loop between them
+static bool discover_route(node_packet_t* packet, node_addr_t addr) {
+	if (is_duplicate(packet->sender_addr, packet->app_payload.id)) {
+		return false;
+	}
+
+	packet->local_sender_addr = addr;
+	packet->time_to_live = TTL;
+	packet->face_addr = NODE_ADDR_NONE;
+	node_essentials_broadcast_route(packet, false);
+
+	return true;
+}
+#else
+static void notify_fail(const node_packet_t* packet) {
 	notify_t notify;
 
-	notify.app_msg_id = route_payload->app_payload.id;
+	notify.type = NOTIFY_FAIL;
+	notify.app_msg_id = packet->app_payload.id;
+	if (!node_essentials_notify_server(&notify)) {
+		node_log_error("Failed to notify fail");
+	}
+}
+
+// flood carries route request (header of packet with empty message) from this node, packet waits here until
+// route inverse comes back (see flush_pending), so message isn't copied to every node within TTL
+static bool discover_route(node_packet_t* packet, node_addr_t addr) {
+	node_packet_t request;
+	struct pending_send* pending;
+	bool discovering;
+	uint8_t i;
+
+	expire_pending();
+
+	if (msgs->pending_count == PENDING_SENDS_MAX) {
+		node_log_warn("Too many sends wait for route, send to %d failed", packet->receiver_addr);
+		msgs->stats.pending_dropped++;
+		notify_fail(packet);
+		return false;
+	}
+
+	discovering = false;
+	for (i = 0; i < msgs->pending_count; i++) {
+		if (msgs->pending[i].packet.receiver_addr == packet->receiver_addr) {
+			discovering = true;
+		}
+	}
+
+	pending = &msgs->pending[msgs->pending_count++];
+	pending->queued_ms = node_pool_now_ms();
+	pending->packet = *packet;
+	if (msgs->pending_count == 1) {
+		(void) set_timer();
+	}
+
+	if (discovering) {
+		return true;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.sender_addr = addr;
+	request.receiver_addr = packet->receiver_addr;
+	request.local_sender_addr = addr;
+	request.time_to_live = TTL;
+	request.face_addr = NODE_ADDR_NONE;
+	request.app_payload.id = packet->app_payload.id;
+	// echoes of own request aren't flooded again
+	(void) is_duplicate(addr, request.app_payload.id);
+	node_essentials_broadcast_route(&request, false);
+
+	return true;
+}
+
+// route inverse is lost when receiver is dead or cut off, so sends don't wait for it forever
+// timer of node checks expiry (see node_handler_expire), so client gets fail before it stops waiting
+static void expire_pending(void) {
+	uint64_t now;
+	uint8_t kept;
+	uint8_t i;
+
+	now = node_pool_now_ms();
+	kept = 0;
+	for (i = 0; i < msgs->pending_count; i++) {
+		if (now - msgs->pending[i].queued_ms >= PENDING_SEND_TIMEOUT_MS) {
+			node_log_warn("Route to %d isn't found in time, send failed", msgs->pending[i].packet.receiver_addr);
+			msgs->stats.pending_timed_out++;
+			notify_fail(&msgs->pending[i].packet);
+		} else {
+			if (kept != i) {
+				msgs->pending[kept] = msgs->pending[i];
+			}
+			kept++;
+		}
+	}
+	msgs->pending_count = kept;
+}
+
+static int32_t set_timer(void) {
+	struct itimerspec spec;
+	int32_t expire_ms;
+
+	expire_ms = -1;
+	memset(&spec, 0, sizeof(spec));
+	// queue is in order of arrival, so first send expires first
+	if (msgs->pending_count > 0) {
+		expire_ms = (int32_t) (PENDING_SEND_TIMEOUT_MS - (node_pool_now_ms() - msgs->pending[0].queued_ms));
+		spec.it_value.tv_sec = expire_ms / 1000;
+		// zero value would disarm timer
+		spec.it_value.tv_nsec = (expire_ms % 1000) * 1000000L + 1;
+	}
+
+	if (msgs->timer_fd >= 0 && timerfd_settime(msgs->timer_fd, 0, &spec, NULL) < 0) {
+		node_log_error("Failed to set timer of pending sends: %d", errno);
+	}
+
+	return expire_ms;
+}
+
+// sends are failed inside serving poll, so their notifies are flushed with other frames
+static bool on_timer(struct serving_data* serving, struct serving_conn* conn, void* data) {
+	uint64_t count;
+	(void) serving;
+	(void) data;
+
+	if (read(conn->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		return false;
+	}
+	(void) node_handler_expire();
+
+	return true;
+}
+
+static void flush_pending(const routing_table_t* routing, node_addr_t addr, node_addr_t receiver_addr) {
+	node_packet_t* packet;
+	node_addr_t next_addr;
+	uint8_t kept;
+	uint8_t i;
+
+	expire_pending();
+
+	next_addr = routing_next_addr(routing, receiver_addr);
+	if (next_addr == NODE_ADDR_NONE) {
+		return;
+	}
+
+	kept = 0;
+	for (i = 0; i < msgs->pending_count; i++) {
+		packet = &msgs->pending[i].packet;
+		if (packet->receiver_addr != receiver_addr) {
+			if (kept != i) {
+				msgs->pending[kept] = msgs->pending[i];
+			}
+			kept++;
+			continue;
+		}
+
+		packet->local_sender_addr = addr;
+		packet->crc = packet_crc(packet);
+		if (node_essentials_create_and_send(node_port(next_addr), REQUEST_SEND, packet)) {
+			msgs->stats.pending_sent++;
+			node_log_info("Sent message (length %d) from %d:%d to %d:%d after route discovery",
+				packet->app_payload.message_len, packet->sender_addr, packet->app_payload.addr_from,
+				packet->receiver_addr, packet->app_payload.addr_to);
+		} else {
+			node_log_error("Failed to send message to %d after route discovery", receiver_addr);
+			notify_fail(packet);
+		}
+	}
+	msgs->pending_count = kept;
+}
+#endif
+
+bool route_direct_handle_delivered(routing_table_t* routing, node_packet_t* route_payload, node_addr_t server_addr, app_t apps[APPS_COUNT]) {
+	node_addr_t next_addr_to_back;
+	struct message_data* message;
 
 	if (!is_valid_crc(route_payload)) {
 		node_log_warn("Message damaged and won't be answered");
@@ -392,217 +706,198 @@ bool route_direct_handle_delivered(routing_table_t* routing, node_packet_t* rout
 
 	node_log_debug("Reached the recevier addr %d", route_payload->receiver_addr);
 
-	if (get_inverse_by_id(route_payload->app_payload.id, &stop_inverse)) {
-		if (!stop_inverse) {
-			set_inverse_by_id(route_payload->app_payload.id, true);
-		} else {
-			return true;
-		}
-	} else {
-		set_inverse_by_id(route_payload->app_payload.id, true);
+	message = get_message(route_payload->sender_addr, route_payload->app_payload.id);
+	if (message->stop_inverse) {
+		return true;
 	}
+	message->stop_inverse = true;
 
 	route_payload->time_to_live = TTL;
 	route_payload->local_sender_addr = server_addr;
 	route_payload->crc = packet_crc(route_payload);
 
-	format_create(REQUEST_ROUTE_INVERSE, route_payload, b, &buf_len, REQUEST_SENDER_NODE);
-
 	next_addr_to_back = routing_next_addr(routing, route_payload->sender_addr);
-	if (next_addr_to_back == UINT8_MAX) {
+	if (next_addr_to_back == NODE_ADDR_NONE) {
 		node_log_error("Failed to get next addr to %d", route_payload->sender_addr);
 		return false;
 	}
 
-	if (!node_essentials_get_conn_and_send(node_port(next_addr_to_back), b, buf_len)) {
+	if (!node_essentials_create_and_send(node_port(next_addr_to_back), REQUEST_ROUTE_INVERSE, route_payload)) {
 		routing_del(routing, route_payload->sender_addr);
 		return false;
 	}
 
-	if (node_app_handle_request(apps, &route_payload->app_payload, server_addr)) {
-		notify.type = NOTIFY_GOT_MESSAGE;
-		if (!node_essentials_notify_server(&notify)) {
-			node_log_error("Failed to notify server");
-		}
-	} else {
+#ifdef NODE_ROUTING_GEO
+	// flood of geo mode carries message (see discover_route)
+	if (!node_handle_app_request(apps, route_payload, server_addr)) {
 		node_log_error("Failed to handle app request");
-		notify.type = NOTIFY_FAIL;
-		if (!node_essentials_notify_server(&notify)) {
-			node_log_error("Failed to notify fail");
-		}
 	}
+#else
+	// message comes by REQUEST_SEND when node that started discovery gets route inverse
+	(void) apps;
+#endif
 
 	return true;
 }
 
-void handle_reset(routing_table_t* table, app_t apps[APPS_COUNT], uint8_t addr) {
+void handle_reset(routing_table_t* table, app_t apps[APPS_COUNT], node_addr_t addr) {
 	routing_table_fill_default(table);
 	node_essentials_reset_connections();
 	node_app_fill_default(apps, addr);
 	fill_messages_default();
 }
 
-static bool is_id_set(uint16_t id) {
-	uint8_t i;
+struct node_messages* node_handler_create(void) {
+	struct node_messages* messages;
 
-	for (i = 0; i < message_num; i++) {
-		if (messages[i].id == id) {
-			return true;
-		}
+	messages = calloc(1, sizeof(struct node_messages));
+	if (messages) {
+		messages->timer_fd = -1;
 	}
 
-	return false;
+	return messages;
 }
 
-static void set_new_id(uint16_t id) {
-	if (message_num == MAX_MESSAGE_DATA) {
-		message_num = 0;
-		messages[message_num].id = id;
-		messages[message_num].stop_inverse = false;
-		messages[message_num].was_message = false;
-		messages[message_num].unicast_first = false;
-		message_num++;
-	} else {
-		messages[message_num++].id = id;
-	}
+void node_handler_destroy(struct node_messages* messages) {
+	free(messages);
 }
 
-static void fill_messages_default(void) {
-	size_t i;
-
-	for (i = 0; i < MAX_MESSAGE_DATA; i++) {
-		messages[i].id = 0;
-		messages[i].was_message = false;
-		messages[i].stop_inverse = false;
-		messages[i].unicast_first = false;
-	}
+void node_handler_switch(struct node_messages* messages) {
+	msgs = messages ? messages : &default_messages;
 }
 
-static void init_messages_data(void) {
-	if (!init) {
-		fill_messages_default();
-		init = true;
+bool node_handler_init_timer(struct serving_data* serving) {
+#ifdef NODE_ROUTING_GEO
+	// geo sends don't wait for route (see discover_route)
+	(void) serving;
+#else
+	msgs->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (msgs->timer_fd < 0) {
+		return false;
 	}
-}
-
-static bool get_inverse_by_id(uint16_t id, bool* stop_inverse) {
-	uint8_t i;
-
-	init_messages_data();
-
-	for (i = 0; i < message_num; i++) {
-		if (messages[i].id == id) {
-			*stop_inverse = messages[i].stop_inverse;
-			return true;
-		}
+	// serving closes timer with its connections
+	if (!serving_add_watch(serving, msgs->timer_fd, on_timer, NULL)) {
+		msgs->timer_fd = -1;
+		return false;
 	}
+#endif
 
-	set_new_id(id);
-
-	return false;
+	return true;
 }
 
-static bool get_was_message_by_id(uint16_t id, bool* was_message) {
-	uint8_t i;
+int32_t node_handler_expire(void) {
+#ifdef NODE_ROUTING_GEO
+	return -1;
+#else
+	expire_pending();
 
-	init_messages_data();
+	return set_timer();
+#endif
+}
 
-	for (i = 0; i < message_num; i++) {
-		if (messages[i].id == id) {
-			*was_message = messages[i].was_message;
-			return true;
-		}
-	}
+void node_handler_stats(const struct node_messages* messages, struct node_messages_stats* stats) {
+	*stats = (messages ? messages : &default_messages)->stats;
+}
 
-	set_new_id(id);
+void node_handler_log_stats(const struct node_messages* messages, node_addr_t addr) {
+	const struct node_messages_stats* stats;
 
-	return false;
+	stats = &(messages ? messages : &default_messages)->stats;
+	node_log_info("Node %d seen messages: %" PRIu64 " remembered, %" PRIu64 " evicted, %" PRIu64 " expired and handled again, %" PRIu64 " collisions",
+		addr, stats->inserted, stats->evicted, stats->expired, stats->collisions);
+	node_log_info("Node %d sends after route discovery: %" PRIu64 " sent, %" PRIu64 " timed out, %" PRIu64 " dropped by full queue",
+		addr, stats->pending_sent, stats->pending_timed_out, stats->pending_dropped);
 }
 
-static void set_inverse_by_id(uint16_t id, bool stop_inverse) {
-	uint8_t i;
+static uint32_t message_hash(node_addr_t origin, uint16_t id) {
+	uint32_t key;
 
-	init_messages_data();
+	// consecutive ids of one origin land farther apart when id is upper half of key (fewer collisions in meshsim)
+	key = ((uint32_t) id << 16) | origin;
 
-	if (!is_id_set(id)) {
-		if (message_num == MAX_MESSAGE_DATA) {
-			message_num = 0;
-			messages[message_num].id = id;
-			messages[message_num].stop_inverse = stop_inverse;
-			messages[message_num].was_message = false;
-			messages[message_num].unicast_first = false;
-			message_num++;
-		}
-	} else {
-		for (i = 0; i < message_num; i++) {
-			if (messages[i].id == id) {
-				messages[i].stop_inverse = stop_inverse;
-			}
-		}
-	}
+	// fibonacci hashing, high bits are mixed best, so slot is taken from them
+	return (key * 2654435769u) >> (32 - MESSAGE_TABLE_BITS);
 }
 
-static void set_was_message_by_id(uint16_t id, bool was_message) {
-	uint8_t i;
-
-	init_messages_data();
+static bool is_live(const struct message_data* message) {
+	return message->generation != 0 && msgs->generation + 1 - message->generation < MESSAGE_GENERATIONS;
+}
 
-	if (!is_id_set(id)) {
-		if (message_num == MAX_MESSAGE_DATA) {
-			message_num = 0;
-			messages[message_num].id = id;
-			messages[message_num].stop_inverse = false;
-			messages[message_num].was_message = was_message;
-			messages[message_num].unicast_first = false;
-			message_num++;
+static struct message_data* get_message(node_addr_t origin, uint16_t id) {
+	struct message_data* message;
+	struct message_data* free_slot;
+	struct message_data* oldest;
+	uint32_t slot;
+	uint32_t i;
+
+	slot = message_hash(origin, id);
+	free_slot = NULL;
+	oldest = NULL;
+	for (i = 0; i < MESSAGE_MAX_PROBE; i++) {
+		message = &msgs->messages[(slot + i) & (MESSAGE_TABLE_SIZE - 1)];
+		if (message->generation != 0 && message->origin == origin && message->id == id) {
+			if (is_live(message)) {
+				return message;
+			}
+			// it came back after its window, so it is handled again
+			msgs->stats.expired++;
+			free_slot = message;
+			break;
 		}
-	} else {
-		for (i = 0; i < message_num; i++) {
-			if (messages[i].id == id) {
-				messages[i].was_message = was_message;
+		if (!is_live(message)) {
+			if (free_slot == NULL) {
+				free_slot = message;
+			}
+			// slot was never used, so key isn't further
+			if (message->generation == 0) {
+				break;
+			}
+		} else {
+			// live entry of other key
+			msgs->stats.collisions++;
+			if (oldest == NULL || message->generation < oldest->generation) {
+				oldest = message;
 			}
 		}
 	}
-}
-
-static bool get_unicast_status_by_id(uint16_t id, bool* unicast_first) {
-	uint8_t i;
 
-	init_messages_data();
+	if (free_slot == NULL) {
+		// every slot of window is live, message that is seen again after it is handled again
+		msgs->stats.evicted++;
+		free_slot = oldest;
+	}
 
-	for (i = 0; i < message_num; i++) {
-		if (messages[i].id == id) {
-			*unicast_first = messages[i].unicast_first;
-			return true;
-		}
+	if (++msgs->generation_inserted == MESSAGE_GENERATION_LEN) {
+		msgs->generation_inserted = 0;
+		msgs->generation++;
 	}
+	msgs->stats.inserted++;
 
-	set_new_id(id);
+	memset(free_slot, 0, sizeof(*free_slot));
+	free_slot->generation = msgs->generation + 1;
+	free_slot->origin = origin;
+	free_slot->id = id;
 
-	return false;
+	return free_slot;
 }
 
-static void set_unicast_status_by_id(uint16_t id, bool unicast_first) {
+static void fill_messages_default(void) {
+#ifndef NODE_ROUTING_GEO
 	uint8_t i;
 
-	init_messages_data();
-
-	if (!is_id_set(id)) {
-		if (message_num == MAX_MESSAGE_DATA) {
-			message_num = 0;
-			messages[message_num].id = id;
-			messages[message_num].stop_inverse = false;
-			messages[message_num].unicast_first = unicast_first;
-			messages[message_num].unicast_first = false;
-			message_num++;
-		}
-	} else {
-		for (i = 0; i < message_num; i++) {
-			if (messages[i].id == id) {
-				messages[i].unicast_first = unicast_first;
-			}
-		}
+	// clients of held sends get fail instead of waiting for their timeout
+	for (i = 0; i < msgs->pending_count; i++) {
+		notify_fail(&msgs->pending[i].packet);
 	}
+#endif
+
+	memset(msgs->messages, 0, sizeof(msgs->messages));
+	msgs->generation = 0;
+	msgs->generation_inserted = 0;
+	msgs->pending_count = 0;
+#ifndef NODE_ROUTING_GEO
+	(void) set_timer();
+#endif
 }
 
 static bool is_valid_crc(node_packet_t* packet) {
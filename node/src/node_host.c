@@ -0,0 +1,554 @@
+#include "node_host.h"
+
+#include <errno.h>
+#include <memory.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#ifdef SERVING_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "connection.h"
+#include "node_app.h"
+#include "node_essentials.h"
+#include "node_handler.h"
+#include "node_listener.h"
+#include "node_pool.h"
+#include "routing.h"
+#include "serving.h"
+#include "settings.h"
+
+#define MAX_SHARD_EVENTS 64
+
+struct shard;
+
+struct vnode {
+	node_server_t server;
+	struct serving_data serving;
+	struct node_pool* pool;
+	struct node_essentials* essentials;
+	struct node_messages* messages;
+	// shard whose epoll watches serving of node, node may run on other shard that stole it
+	struct shard* home;
+	// set by kill request, node is stopped at the end of its turn
+	bool killed;
+	// frames from co-hosted nodes, each slot starts with frame length byte
+	pthread_mutex_t inbox_lock;
+	uint8_t inbox[NODE_HOST_INBOX_DEPTH][MAX_MSG_LEN];
+	uint32_t head;
+	uint32_t tail;
+	// inbox doorbell, written when inbox becomes non-empty
+	int32_t bell_fd;
+	// reset under inbox_lock when node is stopped, so no frame is queued to dead node
+	bool alive;
+};
+
+// nodes ready to run, owner takes them from head and thieves from tail
+// every node is in at most one queue since its serving is watched as oneshot
+struct shard {
+	pthread_t thread;
+	int32_t epoll_fd;
+	// wakes idle shard up when other shard has nodes to steal
+	int32_t wake_fd;
+	bool idle;
+	pthread_mutex_t lock;
+	struct vnode* ready[NODE_COUNT];
+	uint32_t head;
+	uint32_t ready_count;
+};
+
+// filled before shards start and never changed, liveness is checked by alive
+static struct vnode* hosted[NODE_COUNT];
+
+// node that runs on this thread
+static _Thread_local struct vnode* current = NULL;
+
+static struct vnode* get_vnode(uint16_t port) {
+	int32_t addr;
+
+	addr = node_addr(port);
+	if (addr < 0 || addr >= NODE_COUNT) {
+		return NULL;
+	}
+
+	return hosted[addr];
+}
+
+bool node_host_has(uint16_t port) {
+	struct vnode* v;
+
+	v = get_vnode(port);
+
+	return v && __atomic_load_n(&v->alive, __ATOMIC_ACQUIRE);
+}
+
+bool node_host_send(uint16_t port, const uint8_t* body, msg_len_type len) {
+	struct vnode* v;
+	uint8_t* frame;
+	uint64_t one;
+	bool res;
+
+	v = get_vnode(port);
+	if (!v) {
+		return false;
+	}
+
+	res = false;
+	pthread_mutex_lock(&v->inbox_lock);
+	if (v->alive && v->tail - v->head < NODE_HOST_INBOX_DEPTH) {
+		frame = v->inbox[v->tail & (NODE_HOST_INBOX_DEPTH - 1)];
+		frame[0] = (msg_len_type) (len + sizeof(len));
+		memcpy(frame + sizeof(len), body, len);
+		// receiver empties inbox after reading doorbell, so only first frame has to ring
+		if (v->tail++ == v->head) {
+			one = 1;
+			// under lock: doorbell is closed when node stops
+			if (write(v->bell_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+				node_log_error("Failed to ring doorbell of node %d", v->server.addr);
+			}
+		}
+		res = true;
+	} else if (v->alive) {
+		node_log_debug("Inbox of node %d is full: frame goes through socket", v->server.addr);
+	}
+	pthread_mutex_unlock(&v->inbox_lock);
+
+	return res;
+}
+
+bool node_host_kill_current(void) {
+	if (!current) {
+		return false;
+	}
+
+	current->killed = true;
+
+	return true;
+}
+
+#ifdef SERVING_EPOLL
+
+static struct shard shards[NODE_HOST_MAX_SHARDS];
+static size_t shard_count;
+
+static volatile bool* running;
+
+static void enter(struct vnode* v) {
+	current = v;
+	node_pool_switch(v->pool);
+	node_essentials_switch(v->essentials);
+	node_handler_switch(v->messages);
+}
+
+static void leave(void) {
+	current = NULL;
+	node_pool_switch(NULL);
+	node_essentials_switch(NULL);
+	node_handler_switch(NULL);
+}
+
+static bool handle_request(int32_t conn_fd, uint8_t* buf, size_t len, void* data) {
+	struct vnode* v;
+
+	v = (struct vnode*) data;
+	// serving passes only complete frames
+	// failed request doesn't break connection
+	node_listener_handle_request(&v->server, conn_fd, buf, (ssize_t) len, data);
+
+	return true;
+}
+
+static bool on_bell(struct serving_data* serving, struct serving_conn* conn, void* data) {
+	uint8_t frame[MAX_MSG_LEN];
+	struct vnode* v;
+	uint64_t count;
+	uint32_t handled;
+	bool more;
+
+	v = (struct vnode*) data;
+
+	if (read(conn->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+		return false;
+	}
+
+	more = false;
+	for (handled = 0; handled < NODE_HOST_DRAIN_BATCH; handled++) {
+		pthread_mutex_lock(&v->inbox_lock);
+		if (v->head == v->tail) {
+			pthread_mutex_unlock(&v->inbox_lock);
+			break;
+		}
+		// frame is copied out so handler can send to this inbox again
+		memcpy(frame, v->inbox[v->head & (NODE_HOST_INBOX_DEPTH - 1)], MAX_MSG_LEN);
+		v->head++;
+		pthread_mutex_unlock(&v->inbox_lock);
+
+		if (frame[0] > sizeof(msg_len_type)) {
+			serving->handle_request(-1, frame + sizeof(msg_len_type), frame[0] - sizeof(msg_len_type), data);
+		} else {
+			node_log_error("Incorrect message in inbox: declared length %d", frame[0]);
+		}
+	}
+
+	if (handled == NODE_HOST_DRAIN_BATCH) {
+		pthread_mutex_lock(&v->inbox_lock);
+		more = v->head != v->tail;
+		pthread_mutex_unlock(&v->inbox_lock);
+	}
+
+	// rest of inbox waits for next turn of node
+	if (more) {
+		count = 1;
+		if (write(conn->fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+__attribute__((warn_unused_result))
+static bool start_vnode(struct vnode* v, uint8_t addr) {
+	int32_t server_fd;
+
+	v->server.addr = addr;
+	v->pool = node_pool_create();
+	v->essentials = node_essentials_create();
+	v->messages = node_handler_create();
+	if (!v->pool || !v->essentials || !v->messages) {
+		return false;
+	}
+	pthread_mutex_init(&v->inbox_lock, NULL);
+
+	enter(v);
+
+	routing_table_fill_default(&v->server.routing);
+	node_app_fill_default(v->server.apps, addr);
+	node_essentials_fill_neighbors_port(addr);
+
+	server_fd = connection_socket_to_listen(node_port(addr));
+	if (server_fd < 0) {
+		node_log_error("Failed to start server on node %d", addr);
+		return false;
+	}
+
+	serving_init(&v->serving, server_fd, handle_request);
+#ifdef SERVING_URING
+	if (v->serving.uring) {
+		node_log_error("Hosted nodes require epoll serving");
+		return false;
+	}
+#endif
+	// node gives its shard back after handling what is ready
+	v->serving.timeout_ms = 0;
+
+	if (!node_essentials_init_connections(&v->serving)) {
+		node_log_error("Failed to init connections on node %d", addr);
+		return false;
+	}
+	if (!node_handler_init_timer(&v->serving)) {
+		node_log_error("Failed to create timer on node %d", addr);
+		return false;
+	}
+
+	v->bell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (v->bell_fd < 0 || !serving_add_watch(&v->serving, v->bell_fd, on_bell, v)) {
+		node_log_error("Failed to create inbox of node %d", addr);
+		return false;
+	}
+
+	v->alive = true;
+	hosted[addr] = v;
+
+	leave();
+
+	return node_essentials_announce(addr, node_port(addr));
+}
+
+// called on thread that runs node
+static void stop_vnode(struct vnode* v) {
+	pthread_mutex_lock(&v->inbox_lock);
+	__atomic_store_n(&v->alive, false, __ATOMIC_RELEASE);
+	v->head = v->tail;
+	pthread_mutex_unlock(&v->inbox_lock);
+
+	// closes listener, inbox doorbell, timer and all connections, so peers see node as dead
+	node_essentials_free_connections();
+	serving_free(&v->serving);
+
+	node_log_debug("Stopped hosted node %d", v->server.addr);
+}
+
+__attribute__((warn_unused_result))
+static bool arm(struct vnode* v) {
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.ptr = v;
+
+	return epoll_ctl(v->home->epoll_fd, EPOLL_CTL_MOD, v->serving.epoll_fd, &ev) == 0;
+}
+
+static void push(struct shard* shard, struct vnode* v) {
+	pthread_mutex_lock(&shard->lock);
+	shard->ready[(shard->head + shard->ready_count++) % NODE_COUNT] = v;
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static struct vnode* pop(struct shard* shard) {
+	struct vnode* v;
+
+	v = NULL;
+	pthread_mutex_lock(&shard->lock);
+	if (shard->ready_count > 0) {
+		v = shard->ready[shard->head];
+		shard->head = (shard->head + 1) % NODE_COUNT;
+		shard->ready_count--;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return v;
+}
+
+static struct vnode* steal(struct shard* thief) {
+	struct shard* victim;
+	struct vnode* v;
+	size_t i;
+
+	for (i = 1; i < shard_count; i++) {
+		victim = &shards[((size_t) (thief - shards) + i) % shard_count];
+		// busy victim is skipped, next one is tried
+		if (pthread_mutex_trylock(&victim->lock)) {
+			continue;
+		}
+		v = NULL;
+		if (victim->ready_count > 0) {
+			v = victim->ready[(victim->head + --victim->ready_count) % NODE_COUNT];
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (v) {
+			return v;
+		}
+	}
+
+	return NULL;
+}
+
+static void wake_idle(const struct shard* busy) {
+	uint64_t one;
+	size_t i;
+
+	one = 1;
+	for (i = 0; i < shard_count; i++) {
+		if (&shards[i] != busy && __atomic_load_n(&shards[i].idle, __ATOMIC_ACQUIRE)) {
+			if (write(shards[i].wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+				node_log_error("Failed to wake shard %zu", i);
+			}
+			return;
+		}
+	}
+}
+
+// queues nodes of shard that have events, returns their count
+static int32_t collect(struct shard* shard, int32_t timeout_ms) {
+	struct epoll_event events[MAX_SHARD_EVENTS];
+	int32_t event_count;
+	int32_t ready;
+	int32_t i;
+	uint64_t count;
+
+	event_count = epoll_wait(shard->epoll_fd, events, MAX_SHARD_EVENTS, timeout_ms);
+	if (event_count == -1) {
+		if (errno != EINTR) {
+			node_log_error("Failed to wait for nodes: %d", errno);
+		}
+		return 0;
+	}
+
+	ready = 0;
+	for (i = 0; i < event_count; i++) {
+		if (events[i].data.ptr == NULL) {
+			if (read(shard->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+				node_log_error("Failed to read shard wake up");
+			}
+			continue;
+		}
+		push(shard, events[i].data.ptr);
+		ready++;
+	}
+
+	// one node is run by this shard, others can be taken by idle ones
+	if (ready > 1) {
+		wake_idle(shard);
+	}
+
+	return ready;
+}
+
+static void run_vnode(struct vnode* v) {
+	enter(v);
+	serving_poll(&v->serving, v);
+
+	if (v->killed) {
+		stop_vnode(v);
+	} else if (!arm(v)) {
+		node_log_error("Failed to watch node %d: %d", v->server.addr, errno);
+	}
+
+	leave();
+}
+
+static void* run_shard(void* arg) {
+	struct shard* shard;
+	struct vnode* v;
+
+	shard = (struct shard*) arg;
+
+	while (*running) {
+		v = pop(shard);
+		if (!v && collect(shard, 0) > 0) {
+			continue;
+		}
+		if (!v) {
+			v = steal(shard);
+		}
+		if (v) {
+			run_vnode(v);
+			continue;
+		}
+
+		__atomic_store_n(&shard->idle, true, __ATOMIC_RELEASE);
+		(void) collect(shard, NODE_HOST_TICK_MS);
+		__atomic_store_n(&shard->idle, false, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+__attribute__((warn_unused_result))
+static bool init_shard(struct shard* shard) {
+	struct epoll_event ev;
+
+	pthread_mutex_init(&shard->lock, NULL);
+	shard->head = 0;
+	shard->ready_count = 0;
+	shard->idle = false;
+	shard->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	shard->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (shard->epoll_fd < 0 || shard->wake_fd < 0) {
+		return false;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	return epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, shard->wake_fd, &ev) == 0;
+}
+
+bool node_host_run(uint8_t first, uint8_t count, volatile bool* keeprunning) {
+	struct vnode* vnodes;
+	struct epoll_event ev;
+	long cpus;
+	size_t i;
+	bool res;
+
+#ifdef NODE_LINK_SHM
+	node_log_error("Hosted nodes don't support shared memory links");
+	return false;
+#endif
+
+	running = keeprunning;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	shard_count = cpus > 0 ? (size_t) cpus : 1;
+	if (shard_count > count) {
+		shard_count = count;
+	}
+	if (shard_count > NODE_HOST_MAX_SHARDS) {
+		shard_count = NODE_HOST_MAX_SHARDS;
+	}
+
+	for (i = 0; i < shard_count; i++) {
+		if (!init_shard(&shards[i])) {
+			node_log_error("Failed to create shard %zu", i);
+			return false;
+		}
+	}
+
+	vnodes = calloc(count, sizeof(struct vnode));
+	if (!vnodes) {
+		return false;
+	}
+
+	res = true;
+	for (i = 0; i < count && res; i++) {
+		vnodes[i].home = &shards[i % shard_count];
+		if (!start_vnode(&vnodes[i], (uint8_t) (first + i))) {
+			res = false;
+			break;
+		}
+
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.ptr = &vnodes[i];
+		if (epoll_ctl(vnodes[i].home->epoll_fd, EPOLL_CTL_ADD, vnodes[i].serving.epoll_fd, &ev) == -1) {
+			res = false;
+		}
+	}
+
+	if (res) {
+		node_log_debug("Hosting nodes %d..%d on %zu shards (process %d)", first, first + count - 1, shard_count, getpid());
+
+		// first shard runs on main thread
+		for (i = 1; i < shard_count; i++) {
+			if (pthread_create(&shards[i].thread, NULL, run_shard, &shards[i])) {
+				node_log_error("Failed to start shard %zu", i);
+				*keeprunning = false;
+				shard_count = i;
+				break;
+			}
+		}
+		run_shard(&shards[0]);
+
+		for (i = 1; i < shard_count; i++) {
+			pthread_join(shards[i].thread, NULL);
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (vnodes[i].alive) {
+			enter(&vnodes[i]);
+			stop_vnode(&vnodes[i]);
+			leave();
+		}
+		hosted[first + i] = NULL;
+		node_pool_destroy(vnodes[i].pool);
+		node_essentials_destroy(vnodes[i].essentials);
+		node_handler_log_stats(vnodes[i].messages, (node_addr_t) (first + i));
+		node_handler_destroy(vnodes[i].messages);
+	}
+	free(vnodes);
+
+	for (i = 0; i < shard_count; i++) {
+		close(shards[i].epoll_fd);
+		close(shards[i].wake_fd);
+	}
+
+	node_log_debug("Killed host process %d", getpid());
+
+	return res;
+}
+
+#else
+
+bool node_host_run(uint8_t first, uint8_t count, volatile bool* keeprunning) {
+	(void) keeprunning;
+
+	node_log_error("Hosting nodes %d..%d requires epoll serving", first, first + count - 1);
+
+	return false;
+}
+
+#endif
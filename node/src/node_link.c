@@ -0,0 +1,262 @@
+#include "node_link.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "node_essentials.h"
+#include "settings.h"
+#include "shm_ring.h"
+
+#define MAX_LINKS 28
+
+#define NAME_LEN 64
+
+struct link {
+	uint16_t port;
+	// neighbor -> this node
+	struct shm_ring* in;
+	// this node -> neighbor, opened on first send
+	struct shm_ring* out;
+	// neighbor doorbell
+	int32_t bell_fd;
+};
+
+static struct link links[MAX_LINKS];
+static uint8_t link_num = 0;
+static struct link* links_by_addr[NODE_COUNT];
+static uint16_t self_port;
+
+static int32_t bell_fd = -1;
+// keeps fifo open for writing so it never reports hang up
+static int32_t bell_keep_fd = -1;
+
+static void ring_name(char* name, uint16_t from_port, uint16_t to_port) {
+	snprintf(name, NAME_LEN, "/mesh-net.%d.%d", from_port, to_port);
+}
+
+static void bell_name(char* name, uint16_t port) {
+	snprintf(name, NAME_LEN, CONNECTION_UNIX_DIR "/mesh-net.%d.bell", port);
+}
+
+static struct link* get_link(uint16_t port) {
+	int32_t addr;
+
+	addr = node_addr(port);
+	if (addr < 0 || addr >= NODE_COUNT) {
+		return NULL;
+	}
+
+	return links_by_addr[addr];
+}
+
+static void close_out(struct link* link) {
+	char name[NAME_LEN];
+
+	if (link->out) {
+		ring_name(name, self_port, link->port);
+		shm_ring_close(link->out, name, false);
+		link->out = NULL;
+	}
+	if (link->bell_fd >= 0) {
+		close(link->bell_fd);
+		link->bell_fd = -1;
+	}
+}
+
+__attribute__((warn_unused_result))
+static bool open_out(struct link* link) {
+	char name[NAME_LEN];
+
+	if (link->out && shm_ring_is_closed(link->out)) {
+		// neighbor restarted or died
+		close_out(link);
+	}
+
+	if (link->out) {
+		return true;
+	}
+
+	ring_name(name, self_port, link->port);
+	link->out = shm_ring_open(name);
+	if (!link->out) {
+		return false;
+	}
+
+	// fails with ENXIO until neighbor reads its doorbell, so neighbor always sees committed frames
+	bell_name(name, link->port);
+	link->bell_fd = open(name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (link->bell_fd < 0) {
+		close_out(link);
+		return false;
+	}
+
+	return true;
+}
+
+static bool on_bell(struct serving_data* serving, struct serving_conn* conn, void* data);
+
+bool node_link_init(struct serving_data* serving, uint8_t addr, const uint16_t* neighbors, uint8_t neighbor_num) {
+	char name[NAME_LEN];
+	uint8_t i;
+
+	self_port = node_port(addr);
+	link_num = 0;
+	for (i = 0; i < neighbor_num && link_num < MAX_LINKS; i++) {
+		struct link* link;
+
+		link = &links[link_num++];
+		link->port = neighbors[i];
+		link->out = NULL;
+		link->bell_fd = -1;
+
+		ring_name(name, link->port, self_port);
+		link->in = shm_ring_create(name);
+		if (!link->in) {
+			return false;
+		}
+
+		links_by_addr[node_addr(link->port)] = link;
+	}
+
+	// doorbell is opened last: neighbors can send only after all rings are ready
+	bell_name(name, self_port);
+	unlink(name);
+	if (mkfifo(name, 0600) < 0) {
+		node_log_error("Failed to create doorbell %s: %d", name, errno);
+		return false;
+	}
+
+	bell_fd = open(name, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	bell_keep_fd = open(name, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	if (bell_fd < 0 || bell_keep_fd < 0) {
+		node_log_error("Failed to open doorbell %s: %d", name, errno);
+		return false;
+	}
+
+	if (!serving_add_watch(serving, bell_fd, on_bell, NULL)) {
+		return false;
+	}
+
+	return true;
+}
+
+void node_link_free(void) {
+	char name[NAME_LEN];
+	uint8_t i;
+
+	for (i = 0; i < link_num; i++) {
+		close_out(&links[i]);
+		if (links[i].in) {
+			ring_name(name, links[i].port, self_port);
+			shm_ring_close(links[i].in, name, true);
+			links[i].in = NULL;
+		}
+		links_by_addr[node_addr(links[i].port)] = NULL;
+	}
+	link_num = 0;
+
+	// bell_fd is closed by serving
+	bell_name(name, self_port);
+	unlink(name);
+	if (bell_keep_fd >= 0) {
+		close(bell_keep_fd);
+		bell_keep_fd = -1;
+	}
+}
+
+void node_link_reset(void) {
+	uint8_t i;
+
+	for (i = 0; i < link_num; i++) {
+		close_out(&links[i]);
+	}
+}
+
+bool node_link_has(uint16_t port) {
+	return get_link(port) != NULL;
+}
+
+uint8_t* node_link_reserve(uint16_t port) {
+	struct link* link;
+	uint8_t* slot;
+
+	link = get_link(port);
+	if (!link || !open_out(link)) {
+		return NULL;
+	}
+
+	slot = shm_ring_reserve(link->out);
+	if (!slot) {
+		node_log_warn("Link to %d is full: frame dropped", node_addr(port));
+	}
+
+	return slot;
+}
+
+bool node_link_commit(uint16_t port) {
+	struct link* link;
+	uint8_t b;
+
+	link = get_link(port);
+	if (!link || !link->out) {
+		return false;
+	}
+
+	if (shm_ring_commit(link->out)) {
+		b = 1;
+		// full fifo already wakes neighbor up
+		if (write(link->bell_fd, &b, sizeof(b)) < 0 && errno != EAGAIN) {
+			close_out(link);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// returns true if any frame was handled
+static bool drain(struct serving_data* serving, struct link* link, void* data) {
+	const uint8_t* frame;
+	bool handled;
+
+	handled = false;
+	while ((frame = shm_ring_peek(link->in)) != NULL) {
+		if (frame[0] > sizeof(msg_len_type)) {
+			// slot belongs to this node until release, so handler can use it as receive buffer
+			serving->handle_request(-1, (uint8_t*) frame + sizeof(msg_len_type), frame[0] - sizeof(msg_len_type), data);
+		} else {
+			node_log_error("Incorrect message from link %d: declared length %d", node_addr(link->port), frame[0]);
+		}
+		shm_ring_release(link->in);
+		handled = true;
+	}
+
+	return handled;
+}
+
+static bool on_bell(struct serving_data* serving, struct serving_conn* conn, void* data) {
+	uint8_t b[64];
+	uint8_t i;
+	bool again;
+
+	while (read(conn->fd, b, sizeof(b)) > 0) {
+		// doorbell carries no data
+	}
+
+	do {
+		again = false;
+		for (i = 0; i < link_num; i++) {
+			drain(serving, &links[i], data);
+		}
+		for (i = 0; i < link_num; i++) {
+			if (!shm_ring_sleep(links[i].in)) {
+				again = true;
+			}
+		}
+	} while (again);
+
+	return true;
+}
@@ -1,7 +1,6 @@
 #include "node_listener.h"
 
 #include <stdbool.h>
-#include <stdlib.h>
 #include <unistd.h>
 #include <memory.h>
 
@@ -11,14 +10,15 @@
 #include "node_handler.h"
 
 __attribute__((warn_unused_result))
-static bool handle_server(node_server_t* server, int32_t conn_fd, enum request* cmd_type, void** payload, uint8_t* buf, void* data);
+static bool handle_server(node_server_t* server, int32_t conn_fd, enum request* cmd_type, union format_payload* payload, uint8_t* buf, size_t received_bytes, void* data);
 
 __attribute__((warn_unused_result))
-static bool handle_node(node_server_t* server, enum request* cmd_type, void** payload, uint8_t* buf, size_t received_bytes, void* data);
+static bool handle_node(node_server_t* server, enum request* cmd_type, union format_payload* payload, uint8_t* buf, size_t received_bytes, void* data);
 
 bool node_listener_handle_request(node_server_t* server, int32_t conn_fd, uint8_t* buf, ssize_t received_bytes, void* data) {
 	enum request request;
-	void* payload;
+	// frame is decoded on stack, handling it doesn't allocate
+	union format_payload payload;
 	enum request_sender sender;
 	bool res;
 
@@ -26,7 +26,7 @@ bool node_listener_handle_request(node_server_t* server, int32_t conn_fd, uint8_
 
 	switch (sender) {
 		case REQUEST_SENDER_SERVER:
-			res = handle_server(server, conn_fd, &request, &payload, buf, data);
+			res = handle_server(server, conn_fd, &request, &payload, buf, (size_t) received_bytes, data);
 			break;
 		case REQUEST_SENDER_NODE:
 			res = handle_node(server, &request, &payload,  buf, (size_t) received_bytes, data);
@@ -39,30 +39,33 @@ bool node_listener_handle_request(node_server_t* server, int32_t conn_fd, uint8_
 	return res;
 }
 
-static bool handle_server(node_server_t* server, int32_t conn_fd, enum request* cmd_type, void** payload, uint8_t* buf, void* data) {
+static bool handle_server(node_server_t* server, int32_t conn_fd, enum request* cmd_type, union format_payload* payload, uint8_t* buf, size_t received_bytes, void* data) {
 	(void) data;
+	// answers go through connection to server port (see handle_control)
+	(void) conn_fd;
 	bool res;
 
-	*payload = NULL;
-	format_parse(cmd_type, payload, buf);
+	if (!format_parse(cmd_type, payload, buf, received_bytes)) {
+		node_log_error("Broken server-node request");
+		return false;
+	}
 
 	res = true;
 	switch (*cmd_type) {
-		case REQUEST_PING:
-			node_log_info("Ping node %d", server->addr);
-			res = handle_ping(conn_fd);
+		case REQUEST_CONTROL:
+			res = handle_control(&payload->control, &server->routing, server->apps, server->addr);
 			break;
 		case REQUEST_SEND:
-			res = handle_server_send(*cmd_type, server->addr, *payload, &server->routing, server->apps);
+			res = handle_server_send(*cmd_type, server->addr, &payload->packet, &server->routing, server->apps);
 			break;
-		case REQUEST_RESET:
-			handle_reset(&server->routing, server->apps, server->addr);
+		case REQUEST_SEND_BATCH:
+			res = handle_server_send_batch(server->addr, &payload->batch, &server->routing, server->apps);
 			break;
 		case REQUEST_UNICAST:
-			handle_server_unicast(*payload, server->addr);
+			handle_server_unicast(&payload->packet, server->addr);
 			break;
 		case REQUEST_BROADCAST:
-			handle_broadcast(*payload);
+			handle_broadcast(&payload->packet);
 			break;
 		case REQUEST_UNDEFINED:
 			node_log_error("Undefined server-node request type");
@@ -73,34 +76,43 @@ static bool handle_server(node_server_t* server, int32_t conn_fd, enum request*
 			res = false;
 	}
 
-	free(*payload);
-
 	return res;
 }
 
-static bool handle_node(node_server_t* server, enum request* cmd_type, void** payload, uint8_t* buf, size_t received_bytes, void* data) {
+static bool handle_node(node_server_t* server, enum request* cmd_type, union format_payload* payload, uint8_t* buf, size_t received_bytes, void* data) {
 	(void) data;
 	bool res;
 
-	*payload = NULL;
-	format_parse(cmd_type, payload, buf);
+	*cmd_type = format_define_request(buf);
+	if (handle_node_forward(*cmd_type, &server->routing, server->addr, buf, received_bytes)) {
+		return true;
+	}
+
+	if (!format_parse(cmd_type, payload, buf, received_bytes)) {
+		node_log_error("Broken node-node request");
+		return false;
+	}
+
+	if (*cmd_type == REQUEST_SEND || *cmd_type == REQUEST_ROUTE_DIRECT || *cmd_type == REQUEST_ROUTE_INVERSE) {
+		node_essentials_peer_alive(payload->packet.local_sender_addr);
+	}
 
 	res = true;
 	switch (*cmd_type) {
 		case REQUEST_SEND:
-			res = handle_node_send(server->addr, *payload, &server->routing, server->apps);
+			res = handle_node_send(server->addr, &payload->packet, &server->routing, server->apps);
 			break;
 		case REQUEST_ROUTE_DIRECT:
-			res = handle_node_route_direct(&server->routing, server->addr, *payload, server->apps);
+			res = handle_node_route_direct(&server->routing, server->addr, &payload->packet, server->apps);
 			break;
 		case REQUEST_ROUTE_INVERSE:
-			res = handle_node_route_inverse(&server->routing, *payload, server->addr);
+			res = handle_node_route_inverse(&server->routing, &payload->packet, server->addr);
 			break;
 		case REQUEST_UNICAST_CONTEST:
-			handle_unicast_contest(*payload, server->addr);
+			handle_unicast_contest(&payload->unicast, server->addr);
 			break;
 		case REQUEST_UNICAST_FIRST:
-			handle_unicast_first(*payload, server->addr);
+			handle_unicast_first(&payload->unicast, server->addr);
 			break;
 		case REQUEST_UNDEFINED:
 			node_log_error("Undefined request: received bytes %d", received_bytes);
@@ -111,7 +123,5 @@ static bool handle_node(node_server_t* server, enum request* cmd_type, void** pa
 			node_log_error("Unsupported request");
 	}
 
-	free(*payload);
-
 	return res;
 }
@@ -0,0 +1,257 @@
+#include "node_pool.h"
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "connection.h"
+#include "node_essentials.h"
+#include "settings.h"
+
+// server port and every node port map to [0, NODE_COUNT]
+#define PORT_COUNT (NODE_COUNT + 1)
+
+#define port_index(port) ((port) - SERVER_PORT)
+
+struct entry {
+	struct serving_conn* conn;
+	uint16_t port;
+	// lru list, most recently used first
+	struct entry* prev;
+	struct entry* next;
+};
+
+struct backoff {
+	// connect is skipped until this time
+	uint64_t until_ms;
+	// 0 if last connect succeeded
+	uint32_t delay_ms;
+};
+
+struct node_pool {
+	struct entry entries[NODE_POOL_SIZE];
+	struct entry server_entry;
+	struct entry* by_port[PORT_COUNT];
+	// port had connection before, so next connect is reconnect
+	bool seen[PORT_COUNT];
+	struct backoff backoffs[PORT_COUNT];
+	struct entry* lru_head;
+	struct entry* lru_tail;
+	// unused entries are linked through next
+	struct entry* free_entries;
+	struct node_pool_stats stats;
+	struct serving_data* serving;
+};
+
+static struct node_pool default_pool;
+
+// pool of node that runs on this thread (see node_host.c)
+static _Thread_local struct node_pool* pool = &default_pool;
+
+uint64_t node_pool_now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static void backoff_fail(struct backoff* b) {
+	if (b->delay_ms == 0) {
+		b->delay_ms = NODE_POOL_BACKOFF_MIN_MS;
+	} else if (b->delay_ms < NODE_POOL_BACKOFF_MAX_MS / 2) {
+		b->delay_ms *= 2;
+	} else {
+		b->delay_ms = NODE_POOL_BACKOFF_MAX_MS;
+	}
+	b->until_ms = node_pool_now_ms() + b->delay_ms;
+}
+
+static void lru_unlink(struct entry* e) {
+	if (e->prev) {
+		e->prev->next = e->next;
+	} else {
+		pool->lru_head = e->next;
+	}
+	if (e->next) {
+		e->next->prev = e->prev;
+	} else {
+		pool->lru_tail = e->prev;
+	}
+}
+
+static void lru_push(struct entry* e) {
+	e->prev = NULL;
+	e->next = pool->lru_head;
+	if (pool->lru_head) {
+		pool->lru_head->prev = e;
+	} else {
+		pool->lru_tail = e;
+	}
+	pool->lru_head = e;
+}
+
+// entry is unused after the call, its connection must be closed already
+static void release(struct entry* e) {
+	pool->by_port[port_index(e->port)] = NULL;
+	if (e->conn) {
+		pool->seen[port_index(e->port)] = true;
+		e->conn = NULL;
+	}
+
+	if (e == &pool->server_entry) {
+		return;
+	}
+
+	lru_unlink(e);
+	e->next = pool->free_entries;
+	pool->free_entries = e;
+}
+
+static void on_conn_closed(struct serving_conn* conn, void* ctx) {
+	(void) conn;
+
+	pool->stats.dead++;
+	release((struct entry*) ctx);
+}
+
+void node_pool_init(struct serving_data* node_serving) {
+	size_t i;
+
+	pool->serving = node_serving;
+	pool->lru_head = NULL;
+	pool->lru_tail = NULL;
+	pool->free_entries = NULL;
+	for (i = 0; i < NODE_POOL_SIZE; i++) {
+		pool->entries[i].conn = NULL;
+		pool->entries[i].next = pool->free_entries;
+		pool->free_entries = &pool->entries[i];
+	}
+	pool->server_entry.conn = NULL;
+	pool->server_entry.port = SERVER_PORT;
+
+	for (i = 0; i < PORT_COUNT; i++) {
+		pool->by_port[i] = NULL;
+		pool->seen[i] = false;
+		pool->backoffs[i].until_ms = 0;
+		pool->backoffs[i].delay_ms = 0;
+	}
+}
+
+__attribute__((warn_unused_result))
+static struct entry* take_entry(uint16_t port) {
+	struct entry* e;
+
+	if (port == SERVER_PORT) {
+		return &pool->server_entry;
+	}
+
+	if (!pool->free_entries) {
+		e = pool->lru_tail;
+		node_log_debug("Connection pool is full: evicting connection to %d", node_addr(e->port));
+		// frames queued by current handler are still sent
+		serving_finish_conn(pool->serving, e->conn);
+		pool->stats.evictions++;
+		release(e);
+	}
+
+	e = pool->free_entries;
+	pool->free_entries = e->next;
+	lru_push(e);
+
+	return e;
+}
+
+struct serving_conn* node_pool_get(uint16_t port) {
+	struct entry* e;
+	struct backoff* b;
+	int32_t fd;
+
+	if (port < SERVER_PORT || port_index(port) >= PORT_COUNT) {
+		return NULL;
+	}
+
+	e = pool->by_port[port_index(port)];
+	if (e) {
+		pool->stats.hits++;
+		if (e != &pool->server_entry && e != pool->lru_head) {
+			lru_unlink(e);
+			lru_push(e);
+		}
+		return e->conn;
+	}
+
+	pool->stats.misses++;
+
+	// peer that refused connect is likely dead: don't pay socket() and connect() on every flood
+	b = &pool->backoffs[port_index(port)];
+	if (b->delay_ms && node_pool_now_ms() < b->until_ms) {
+		pool->stats.skipped_connects++;
+		return NULL;
+	}
+
+	if (pool->seen[port_index(port)]) {
+		pool->stats.reconnects++;
+	}
+
+	fd = connection_socket_to_send(port);
+	if (fd < 0) {
+		pool->stats.failed_connects++;
+		backoff_fail(b);
+		node_log_debug("Failed to connect to %d: retry in %" PRIu32 " ms", node_addr(port), b->delay_ms);
+		return NULL;
+	}
+	b->delay_ms = 0;
+
+	e = take_entry(port);
+	e->port = port;
+	e->conn = serving_add_conn(pool->serving, fd, on_conn_closed, e);
+	if (!e->conn) {
+		release(e);
+		return NULL;
+	}
+	pool->by_port[port_index(port)] = e;
+
+	return e->conn;
+}
+
+void node_pool_alive(uint16_t port) {
+	if (port < SERVER_PORT || port_index(port) >= PORT_COUNT) {
+		return;
+	}
+
+	pool->backoffs[port_index(port)].delay_ms = 0;
+}
+
+void node_pool_reset(void) {
+	struct entry* e;
+	size_t i;
+
+	while (pool->lru_head) {
+		e = pool->lru_head;
+		serving_close_conn(pool->serving, e->conn);
+		release(e);
+	}
+
+	// killed nodes are revived on reset
+	for (i = 0; i < PORT_COUNT; i++) {
+		pool->backoffs[i].delay_ms = 0;
+	}
+}
+
+const struct node_pool_stats* node_pool_stats(void) {
+	return &pool->stats;
+}
+
+struct node_pool* node_pool_create(void) {
+	return calloc(1, sizeof(struct node_pool));
+}
+
+void node_pool_destroy(struct node_pool* node_pool) {
+	free(node_pool);
+}
+
+void node_pool_switch(struct node_pool* node_pool) {
+	pool = node_pool ? node_pool : &default_pool;
+}
@@ -3,3 +3,6 @@
 #include <stdint.h>
 
 void run_node(uint8_t node_addr);
+
+// one process runs nodes first_addr..first_addr + count - 1
+void run_node_host(uint8_t first_addr, uint8_t count);
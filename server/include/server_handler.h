@@ -6,26 +6,55 @@
 #include "serving.h"
 #include "format.h"
 
+// where result of client request goes
+struct client_ref {
+	int32_t fd;
+	// sequence number of request sent in session (answered by REQUEST_SESSION_RESULT), -1 for one request client
+	int32_t seq;
+};
+
+// handlers can be called from several workers at once: each node is guarded by its own lock
+void server_handler_init(void);
+
 __attribute__((nonnull(1), warn_unused_result))
-bool handle_ping(const struct node* children, int32_t client_fd, const void* payload);
+bool handle_ping(const struct node* children, struct client_ref client, const void* payload);
 
 __attribute__((nonnull(1), warn_unused_result))
-bool handle_kill(struct node* children, uint8_t addr, int32_t client_fd);
+bool handle_kill(struct node* children, uint8_t addr, struct client_ref client);
 
 __attribute__((nonnull(2), warn_unused_result))
-bool handle_notify(int32_t client_fd, notify_t* notify);
+bool handle_notify(struct client_ref client, notify_t* notify);
 
 __attribute__((nonnull(1, 2), warn_unused_result))
 bool handle_client_send(struct node* children, const void* payload);
 
+// registers batch (client is answered with errors if it can't be), its items are mapped to batch_id and index before sending by handle_client_send_batch
+__attribute__((nonnull(2, 3), warn_unused_result))
+bool batch_open(struct client_ref client, const send_batch_t* batch, uint16_t* batch_id);
+
+// splits batch by ingress node, items that can't be sent are answered with error at once
+__attribute__((nonnull(1, 3)))
+void handle_client_send_batch(struct node* children, uint16_t batch_id, send_batch_t* batch);
+
+// node notified about batch item, client gets statuses of whole batch when all items are answered
+__attribute__((nonnull(3)))
+void handle_batch_notify(uint16_t batch_id, uint8_t index, const notify_t* notify);
+
 __attribute__((nonnull(1, 2), warn_unused_result))
 bool handle_broadcast(struct node* children, const void* payload, enum request cmd);
 
 __attribute__((nonnull(1), warn_unused_result))
-bool handle_reset(struct node* children, int32_t client_fd);
+bool handle_reset(struct node* children, struct client_ref client);
 
 __attribute__((nonnull(1), warn_unused_result))
-bool handle_revive(struct node* children, uint8_t addr, int32_t client_fd);
+bool handle_revive(struct node* children, uint8_t addr, struct client_ref client);
 
 __attribute__((nonnull(1, 2)))
 void handle_update_child(const void* payload, struct node* children);
+
+// node answered ping or reset sent by server
+__attribute__((nonnull(1)))
+void handle_control_result(const control_t* control);
+
+// answers clients whose control requests and batches weren't answered by nodes in time, called by every worker periodically
+void server_handler_expire(void);
@@ -8,11 +8,11 @@
 #include "settings.h"
 
 typedef struct server {
-	int32_t client_fd;
 	struct node children[NODE_COUNT];
 } server_t;
 
+// safe to be called from several worker threads at once
 __attribute__((nonnull(1, 2)))
-bool server_listener_handle(server_t* server, const uint8_t* buf, int32_t conn_fd, void* data);
+bool server_listener_handle(server_t* server, const uint8_t* buf, size_t len, int32_t conn_fd, void* data);
 
 void server_listener_init(void);
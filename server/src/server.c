@@ -8,6 +8,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "connection.h"
 #include "control_utils.h"
@@ -18,6 +20,7 @@
 #include "io.h"
 #include "format.h"
 #include "server_essentials.h"
+#include "server_handler.h"
 
 static volatile bool keeprunning = true;
 
@@ -27,52 +30,190 @@ static void int_handler(int32_t dummy);
 
 static void term_handler(int32_t dummy);
 
-static bool handle_request(int32_t conn_fd, void* data);
+static bool handle_request(int32_t conn_fd, uint8_t* buf, size_t len, void* data);
 
-int32_t main(void) {
-	size_t i;
-	int32_t server_fd;
+#define MAX_WORKERS 64
+
+#define CONTROL_TICK_MS 100
+
+// every worker has its own event loop, connections are spread between workers by kernel
+struct worker {
+	pthread_t thread;
 	struct serving_data serving;
+	int32_t server_fd;
+};
+
+static struct worker workers[MAX_WORKERS];
+
+// server [-w <workers>] [-n <nodes per process>]
+__attribute__((nonnull(2, 3, 4), warn_unused_result))
+static bool parse_args(int32_t argc, char** argv, size_t* worker_count, size_t* host_size);
+
+static void start_nodes(size_t host_size);
+
+__attribute__((warn_unused_result))
+static bool open_listeners(size_t worker_count);
+
+static void* run_worker(void* arg);
+
+int32_t main(int32_t argc, char** argv) {
+	size_t i;
+	size_t worker_count;
+	size_t host_size;
 
 	signal(SIGINT, int_handler);
 	signal(SIGTERM, term_handler);
 
-	server_fd = connection_socket_to_listen(SERVER_PORT);
+	if (!parse_args(argc, argv, &worker_count, &host_size)) {
+		die("Usage: server [-w <workers 1..%d>] [-n <nodes per process 1..%d>]", MAX_WORKERS, NODE_COUNT);
+	}
 
-	if (server_fd < 0) {
+	if (!open_listeners(worker_count)) {
 		die("Failed to create server");
 	}
 
-	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		server_data.children[i].pid = fork();
-		if (server_data.children[i].pid < 0) {
+	start_nodes(host_size);
+
+	custom_log_debug("Started server on port %d (process %d, %zu workers, %zu nodes per process)", SERVER_PORT, getpid(), worker_count, host_size);
+	custom_log_info("-------------------------------New session-------------------------------");
+
+	server_listener_init();
+
+	// first worker runs on main thread
+	for (i = 1; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i])) {
+			die("Failed to start worker %zu", i);
+		}
+	}
+	run_worker(&workers[0]);
+
+	for (i = 1; i < worker_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	return 0;
+}
+
+static bool parse_args(int32_t argc, char** argv, size_t* worker_count, size_t* host_size) {
+	long count;
+	char* end;
+	int32_t i;
+
+	*worker_count = SERVER_WORKERS;
+	*host_size = 1;
+
+	for (i = 1; i < argc; i += 2) {
+		if (i + 1 == argc) {
+			return false;
+		}
+
+		count = strtol(argv[i + 1], &end, 10);
+		if (*end != '\0') {
+			return false;
+		}
+
+		if (strcmp(argv[i], "-w") == 0 && count >= 1 && count <= MAX_WORKERS) {
+			*worker_count = (size_t) count;
+		} else if (strcmp(argv[i], "-n") == 0 && count >= 1 && count <= NODE_COUNT) {
+			*host_size = (size_t) count;
+		} else {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void start_nodes(size_t host_size) {
+	size_t first;
+	size_t count;
+	size_t i;
+	pid_t pid;
+
+	for (first = 0; first < (size_t) NODE_COUNT; first += host_size) {
+		count = (size_t) NODE_COUNT - first < host_size ? (size_t) NODE_COUNT - first : host_size;
+
+		pid = fork();
+		if (pid < 0) {
 			custom_log_error("Failed to create child process");
-		} else if (server_data.children[i].pid == 0) {
-			run_node((uint8_t) i);
+		} else if (pid == 0) {
+			if (host_size == 1) {
+				run_node((uint8_t) first);
+			} else {
+				run_node_host((uint8_t) first, (uint8_t) count);
+			}
 			perror("execl()");
 			exit(EXIT_FAILURE);
-		} else {
-			// parent
+		}
+
+		// parent
+		for (i = first; i < first + count; i++) {
+			server_data.children[i].pid = pid;
 			server_data.children[i].write_fd = -1;
 			server_data.children[i].port = UINT16_MAX;
 			server_data.children[i].addr = UINT8_MAX;
+			server_data.children[i].hosted = host_size > 1;
 		}
 	}
-	server_data.client_fd = -1;
+}
 
-	custom_log_debug("Started server on port %d (process %d)", SERVER_PORT, getpid());
-	custom_log_info("-------------------------------New session-------------------------------");
+static bool open_listeners(size_t worker_count) {
+	size_t i;
 
-	serving_init(&serving, server_fd, handle_request);
-	server_listener_init();
+	if (worker_count == 1) {
+		workers[0].server_fd = connection_socket_to_listen(SERVER_PORT);
+		return workers[0].server_fd >= 0;
+	}
+
+	for (i = 0; i < worker_count; i++) {
+		workers[i].server_fd = connection_socket_to_listen_shared(SERVER_PORT);
+		if (workers[i].server_fd < 0) {
+			break;
+		}
+	}
+
+	if (i == worker_count) {
+		return true;
+	}
+
+	if (i > 0) {
+		custom_log_error("Failed to open listener for worker %zu", i);
+		return false;
+	}
+
+	// transport can't share port: workers accept from one listener, so it must not block
+	workers[0].server_fd = connection_socket_to_listen(SERVER_PORT);
+	if (workers[0].server_fd < 0) {
+		return false;
+	}
+	fcntl(workers[0].server_fd, F_SETFL, fcntl(workers[0].server_fd, F_GETFL) | O_NONBLOCK);
+	for (i = 1; i < worker_count; i++) {
+		workers[i].server_fd = dup(workers[0].server_fd);
+		if (workers[i].server_fd < 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void* run_worker(void* arg) {
+	struct worker* worker;
+
+	worker = (struct worker*) arg;
+
+	serving_init(&worker->serving, worker->server_fd, handle_request);
+	// deadlines of control requests are checked between polls
+	worker->serving.timeout_ms = CONTROL_TICK_MS;
 
 	while (keeprunning) {
-		serving_poll(&serving, server_data.children);
+		serving_poll(&worker->serving, server_data.children);
+		server_handler_expire();
 	}
 
-	serving_free(&serving);
+	serving_free(&worker->serving);
 
-	return 0;
+	return NULL;
 }
 
 static void int_handler(int32_t dummy) {
@@ -83,53 +224,20 @@ static void int_handler(int32_t dummy) {
 static void term_handler(int32_t dummy) {
 	size_t i;
 	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (server_data.children[i].pid > 0) {
+		// nodes of host process share pid, it is signaled once
+		if (server_data.children[i].pid > 0 && (i == 0 || server_data.children[i].pid != server_data.children[i - 1].pid)) {
 			kill(server_data.children[i].pid, SIGINT);
 		}
 	}
 	int_handler(dummy);
 }
 
-static bool handle_request(int32_t conn_fd, void* data) {
-	int16_t received_bytes;
-	uint8_t buf[MAX_MSG_LEN];
-	uint8_t msg_len;
-
-	msg_len = 0;
-
-	if (!io_read_all(conn_fd, &msg_len, sizeof(msg_len), &received_bytes)) {
-		custom_log_error("Failed to read message length");
-		return false;
-	}
-
-	if (received_bytes > 0) {
-		if (!io_read_all(conn_fd, buf, msg_len - sizeof(msg_len), &received_bytes)) {
-			custom_log_error("Failed to read message");
-			return false;
-		}
-
-		if (!format_is_message_correct((size_t) received_bytes, msg_len - sizeof(msg_len))) {
-			custom_log_error("Incorrect message format");
-			return false;
-		}
-	} else {
+static bool handle_request(int32_t conn_fd, uint8_t* buf, size_t len, void* data) {
+	// serving passes only complete frames
+	if (!server_listener_handle(&server_data, buf, len, conn_fd, data)) {
+		custom_log_error("Failed to parse request");
 		return false;
 	}
 
-	if (received_bytes > 0) {
-		bool processed;
-
-		processed = server_listener_handle(&server_data, (uint8_t*) buf, conn_fd, data);
-
-		if (processed) {
-			return true;
-		} else {
-			custom_log_error("Failed to parse request");
-			return false;
-		}
-	} else {
-		custom_log_error("Failed to receive message: declared length %d", msg_len);
-	}
-
-	return false;
+	return true;
 }
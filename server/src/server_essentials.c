@@ -22,3 +22,23 @@ void run_node(uint8_t node_addr) {
 	}
 }
 
+
+void run_node_host(uint8_t first_addr, uint8_t count) {
+	// 3 digits and null terminator
+	char first_addr_str[4];
+	char count_str[4];
+	int32_t len;
+
+	len = snprintf(first_addr_str, sizeof(first_addr_str), "%d", first_addr);
+	if (len < 0 || (size_t) len > sizeof(first_addr_str)) {
+		die("Failed to convert first_addr to str");
+	}
+	len = snprintf(count_str, sizeof(count_str), "%d", count);
+	if (len < 0 || (size_t) len > sizeof(count_str)) {
+		die("Failed to convert count to str");
+	}
+
+	if (execl("../node/mesh_node", "mesh_node", "-n", count_str, first_addr_str, (char*) NULL)) {
+		exit(EXIT_FAILURE);
+	}
+}
@@ -1,8 +1,11 @@
 #include "server_handler.h"
 
+#include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
+#include <string.h>
 
 #include "settings.h"
 #include "custom_logger.h"
@@ -12,62 +15,180 @@
 #include "crc.h"
 
 __attribute__((warn_unused_result))
-static bool send_res_to_client(int32_t client_fd, enum request_result res);
+static bool send_res_to_client(struct client_ref client, enum request_result res);
 
-bool handle_ping(const struct node* children, int32_t client_fd, const void* payload) {
+// node with address i is always children[i] (see main), lock i guards it
+static pthread_mutex_t node_locks[NODE_COUNT];
+
+// true if node is known and locked, it must be unlocked by unlock_node
+__attribute__((warn_unused_result))
+static bool lock_node(const struct node* children, uint8_t addr);
+
+static void unlock_node(uint8_t addr);
+
+// session sockets are spread over these locks by fd
+#define SESSION_LOCKS 16
+static pthread_mutex_t session_locks[SESSION_LOCKS];
+
+// control requests sent to nodes are answered asynchronously, client gets result when all answers are collected
+#define MAX_PENDING 64
+#define CONTROL_TIMEOUT_MS 2000
+
+struct pending {
+	bool used;
+	uint16_t id;
+	enum request req;
+	struct client_ref client;
+	// answers not received yet, one more is held by request handler until all nodes are asked
+	uint16_t waiting;
+	// worst result of answers
+	enum request_result res;
+	uint64_t deadline_ms;
+};
+
+// request with id is in slot id % MAX_PENDING
+static struct pending pending[MAX_PENDING];
+static uint16_t next_control_id = 0;
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+__attribute__((warn_unused_result))
+static bool pending_add(enum request req, struct client_ref client, uint16_t* id);
+
+static void pending_expect(uint16_t id);
+
+static void pending_done(uint16_t id, enum request_result res);
+
+__attribute__((warn_unused_result))
+static bool send_control(int32_t fd, enum request req, uint16_t id);
+
+static uint64_t now_ms(void);
+
+// batch is answered with status of every item, items not notified in time are unknown
+#define MAX_BATCHES 64
+
+struct batch {
+	bool used;
+	uint16_t id;
+	struct client_ref client;
+	uint16_t tag;
+	uint8_t count;
+	uint8_t answered;
+	bool done[SEND_BATCH_MAX];
+	enum request_result res[SEND_BATCH_MAX];
+	uint64_t deadline_ms;
+};
+
+// batch with id is in slot id % MAX_BATCHES
+static struct batch batches[MAX_BATCHES];
+static uint16_t next_batch_id = 0;
+static pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void batch_item_done(uint16_t batch_id, uint8_t index, enum request_result res);
+
+__attribute__((warn_unused_result))
+static bool send_batch_result_to_client(struct client_ref client, const send_batch_result_t* result);
+
+static enum request_result notify_result(const notify_t* notify);
+
+void server_handler_init(void) {
 	size_t i;
-	uint8_t* p;
-	struct timeval tv;
 
-	p = (uint8_t*) payload;
 	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (children[i].addr == *p) {
-			uint8_t b[MAX_MSG_LEN];
-			msg_len_type buf_len;
-			uint8_t received;
-
-			if (children[i].write_fd == -1) {
-				custom_log_error("Node killed %d", *p);
-				return send_res_to_client(client_fd, REQUEST_ERR);
-			}
+		pthread_mutex_init(&node_locks[i], NULL);
+	}
+	for (i = 0; i < SESSION_LOCKS; i++) {
+		pthread_mutex_init(&session_locks[i], NULL);
+	}
+}
 
-			format_create(REQUEST_PING, NULL, b, &buf_len, REQUEST_SENDER_SERVER);
+bool handle_ping(const struct node* children, struct client_ref client, const void* payload) {
+	uint8_t* p;
+	uint16_t id;
 
-			if (!io_write_all(children[i].write_fd, b, buf_len)) {
-				custom_log_error("Failed to send request to node");
-				return send_res_to_client(client_fd, REQUEST_ERR);
-			}
-			tv.tv_sec = 2;
-			tv.tv_usec = 0;
-			setsockopt(children[i].write_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-			received = (uint8_t) recv(children[i].write_fd, b, sizeof(b), 0);
-
-			tv.tv_sec = 0;
-			tv.tv_usec = 0;
-			setsockopt(children[i].write_fd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tv, sizeof(tv));
-
-			if (received > 0) {
-				if (!io_write_all(client_fd, b, received)) {
-					custom_log_error("Failed to send ping result to client");
-					return false;
-				}
-			} else {
-				custom_log_error("Failed to get response from node %d", *p);
-				return send_res_to_client(client_fd, REQUEST_ERR);
-			}
+	p = (uint8_t*) payload;
+	if (lock_node(children, *p)) {
+		if (children[*p].write_fd == -1) {
+			unlock_node(*p);
+			custom_log_error("Node killed %d", *p);
+			return send_res_to_client(client, REQUEST_ERR);
+		}
 
-			break;
+		if (!pending_add(REQUEST_PING, client, &id)) {
+			unlock_node(*p);
+			return send_res_to_client(client, REQUEST_ERR);
+		}
+
+		// answer comes as REQUEST_CONTROL_RESULT, possibly to other worker
+		pending_expect(id);
+		if (!send_control(children[*p].write_fd, REQUEST_PING, id)) {
+			custom_log_error("Failed to send request to node");
+			pending_done(id, REQUEST_ERR);
 		}
+		unlock_node(*p);
+
+		pending_done(id, REQUEST_OK);
 	}
 
 	return true;
 }
 
+void handle_control_result(const control_t* control) {
+	pending_done(control->id, control->res);
+}
+
+void server_handler_expire(void) {
+	uint64_t now;
+	struct client_ref expired[MAX_PENDING];
+	size_t expired_count;
+	size_t i;
+
+	now = now_ms();
+
+	expired_count = 0;
+	pthread_mutex_lock(&pending_lock);
+	for (i = 0; i < MAX_PENDING; i++) {
+		if (pending[i].used && pending[i].deadline_ms <= now) {
+			custom_log_error("Control request %d timed out: %d nodes didn't answer", pending[i].id, pending[i].waiting);
+			expired[expired_count++] = pending[i].client;
+			pending[i].used = false;
+		}
+	}
+	pthread_mutex_unlock(&pending_lock);
+
+	for (i = 0; i < expired_count; i++) {
+		if (!send_res_to_client(expired[i], REQUEST_ERR)) {
+			custom_log_error("Failed to send timeout to client");
+		}
+	}
+
+	// expired batches are answered one by one, result is too big to collect them all on stack
+	for (i = 0; i < MAX_BATCHES; i++) {
+		send_batch_result_t result;
+		struct client_ref client;
+
+		pthread_mutex_lock(&batches_lock);
+		if (!batches[i].used || batches[i].deadline_ms > now) {
+			pthread_mutex_unlock(&batches_lock);
+			continue;
+		}
+		custom_log_error("Batch %d timed out: %d of %d items answered", batches[i].id, batches[i].answered, batches[i].count);
+		client = batches[i].client;
+		result.tag = batches[i].tag;
+		result.count = batches[i].count;
+		memcpy(result.res, batches[i].res, sizeof(result.res));
+		batches[i].used = false;
+		pthread_mutex_unlock(&batches_lock);
+
+		if (!send_batch_result_to_client(client, &result)) {
+			custom_log_error("Failed to send batch timeout to client");
+		}
+	}
+}
+
 __attribute__((warn_unused_result))
 static bool kill_node(struct node* children, uint8_t addr);
 
-bool handle_kill(struct node* children, uint8_t addr, int32_t client_fd) { // NOLINT
+bool handle_kill(struct node* children, uint8_t addr, struct client_ref client) { // NOLINT
 	enum request_result req_res;
 
 	if (!kill_node(children, addr)) {
@@ -77,107 +198,199 @@ bool handle_kill(struct node* children, uint8_t addr, int32_t client_fd) { // NO
 		req_res = REQUEST_OK;
 	}
 
-	return send_res_to_client(client_fd, req_res);
+	return send_res_to_client(client, req_res);
 }
 
-bool handle_notify(int32_t client_fd, notify_t* notify) {
+bool handle_notify(struct client_ref client, notify_t* notify) {
 	enum request_result req_res;
-	bool res;
 
-	req_res = REQUEST_OK;
-	res = true;
+	if (client.fd < 0) {
+		return true;
+	}
 
-	switch(notify->type) {
-		case NOTIFY_GOT_MESSAGE:
-			if (client_fd > 0 && !io_write_all(client_fd, (uint8_t*) &req_res, sizeof(req_res))) {
-				custom_log_error("Failed to response to notify");
-				res = false;
-			}
-			break;
-		case NOTIFY_FAIL:
-			req_res = REQUEST_ERR;
-			if (client_fd > 0 && !io_write_all(client_fd, (uint8_t*) &req_res, sizeof(req_res))) {
-				custom_log_error("Failed to response to notify");
-				res = false;
-			}
-			break;
+	req_res = notify_result(notify);
+
+	if (!send_res_to_client(client, req_res)) {
+		custom_log_error("Failed to response to notify");
+		return false;
 	}
 
-	return res;
+	return true;
 }
 
 static void revivie_node(struct node* node);
 
-bool handle_reset(struct node* children, int32_t client_fd) {
-	uint8_t b[sizeof(notify_t) + MSG_BASE_LEN];
-	msg_len_type buf_len;
+bool handle_reset(struct node* children, struct client_ref client) {
 	size_t i;
-	bool res;
+	uint16_t id;
 
-	format_create(REQUEST_RESET, NULL, b, &buf_len, REQUEST_SENDER_SERVER);
+	if (!pending_add(REQUEST_RESET, client, &id)) {
+		return send_res_to_client(client, REQUEST_ERR);
+	}
 
+	// client is answered when every living node has reset, revived nodes start clean
 	for (i = 0; i < (size_t) NODE_COUNT; i++) {
+		pthread_mutex_lock(&node_locks[i]);
 		if (children[i].write_fd != -1) {
-			if (!io_write_all(children[i].write_fd, b, buf_len)) {
+			pending_expect(id);
+			if (!send_control(children[i].write_fd, REQUEST_RESET, id)) {
 				custom_log_error("Failed to send reset request to node %d", children[i].addr);
-				res = send_res_to_client(client_fd, REQUEST_UNKNOWN);
+				pending_done(id, REQUEST_UNKNOWN);
 			}
 		} else {
 			revivie_node(&children[i]);
 		}
+		pthread_mutex_unlock(&node_locks[i]);
 	}
 
 	custom_log_debug("Reset nodes");
-	res = send_res_to_client(client_fd, REQUEST_OK);
+	pending_done(id, REQUEST_OK);
 
-	return res;
+	return true;
 }
 
 __attribute__((warn_unused_result))
 static bool make_send_to_node(const struct node* children, const void* payload);
 
+__attribute__((warn_unused_result))
+static bool send_to_node(const struct node* children, uint8_t addr, const uint8_t* buf, msg_len_type len);
+
 bool handle_client_send(struct node* children, const void* payload) {
 	custom_log_debug("Send command from client");
 	return make_send_to_node(children, payload);
 }
 
-bool handle_broadcast(struct node* children, const void* payload, enum request cmd) {
-	uint8_t b[MAX_MSG_LEN];
-	msg_len_type buf_len;
+bool batch_open(struct client_ref client, const send_batch_t* batch, uint16_t* batch_id) {
+	struct batch* b;
 	size_t i;
 
-	format_create(cmd, payload, (uint8_t*) b, &buf_len, REQUEST_SENDER_SERVER);
+	pthread_mutex_lock(&batches_lock);
+	for (i = 0; i < MAX_BATCHES; i++) {
+		b = &batches[next_batch_id % MAX_BATCHES];
+		if (!b->used) {
+			break;
+		}
+		next_batch_id++;
+	}
 
-	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (children[i].addr == ((node_packet_t*) payload)->sender_addr) {
-			if (!io_write_all(children[i].write_fd, b, buf_len)) {
-				custom_log_error("Failed to send request to node");
-				return false;
-			}
+	if (i == MAX_BATCHES) {
+		send_batch_result_t result;
+
+		pthread_mutex_unlock(&batches_lock);
+		custom_log_error("Too many batches in flight");
+
+		result.tag = batch->tag;
+		result.count = batch->count;
+		for (i = 0; i < SEND_BATCH_MAX; i++) {
+			result.res[i] = REQUEST_ERR;
+		}
+		if (!send_batch_result_to_client(client, &result)) {
+			custom_log_error("Failed to send batch result to client");
 		}
+		return false;
+	}
+
+	b->used = true;
+	b->id = next_batch_id++;
+	b->client = client;
+	b->tag = batch->tag;
+	b->count = batch->count;
+	b->answered = 0;
+	for (i = 0; i < SEND_BATCH_MAX; i++) {
+		b->done[i] = false;
+		b->res[i] = REQUEST_UNKNOWN;
 	}
+	b->deadline_ms = now_ms() + CONTROL_TIMEOUT_MS;
+	*batch_id = b->id;
+	pthread_mutex_unlock(&batches_lock);
 
 	return true;
 }
 
-bool handle_revive(struct node* children, uint8_t addr, int32_t client_fd) { // NOLINT
-	size_t i;
-	bool res;
+void handle_client_send_batch(struct node* children, uint16_t batch_id, send_batch_t* batch) {
+	uint8_t b[MAX_MSG_LEN];
+	msg_len_type buf_len;
+	send_batch_t node_batch;
+	uint8_t indices[SEND_BATCH_MAX];
+	bool sent[SEND_BATCH_MAX] = { false };
+	uint8_t addr;
+	uint8_t i;
+	uint8_t j;
+
+	custom_log_debug("Send batch command from client: %d sends", batch->count);
+
+	// one frame per ingress node, subset of batch always fits into frame
+	for (i = 0; i < batch->count; i++) {
+		if (sent[i]) {
+			continue;
+		}
 
-	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (children[i].addr == addr) {
-			if (children[i].write_fd == -1) {
-				revivie_node(&children[i]);
-				custom_log_debug("Revived node %d", children[i].addr);
-				res = send_res_to_client(client_fd, REQUEST_OK);
-			} else {
-				custom_log_error("Failed to revive node: probably it is not killed");
-				res = send_res_to_client(client_fd, REQUEST_ERR);
+		addr = batch->packets[i].sender_addr;
+		node_batch.tag = batch->tag;
+		node_batch.count = 0;
+		for (j = i; j < batch->count; j++) {
+			if (!sent[j] && batch->packets[j].sender_addr == addr) {
+				batch->packets[j].crc = packet_crc(&batch->packets[j]);
+				indices[node_batch.count] = j;
+				node_batch.packets[node_batch.count++] = batch->packets[j];
+				sent[j] = true;
 			}
 		}
+
+		format_create(REQUEST_SEND_BATCH, &node_batch, b, &buf_len, REQUEST_SENDER_SERVER);
+
+		if (!lock_node(children, addr)) {
+			custom_log_error("Batch sender %d is unknown", addr);
+		} else {
+			bool written;
+
+			written = io_write_all(children[addr].write_fd, b, buf_len);
+			unlock_node(addr);
+			if (written) {
+				continue;
+			}
+			custom_log_error("Failed to send batch to node %d", addr);
+		}
+
+		for (j = 0; j < node_batch.count; j++) {
+			batch_item_done(batch_id, indices[j], REQUEST_ERR);
+		}
 	}
+}
 
-	return res;
+void handle_batch_notify(uint16_t batch_id, uint8_t index, const notify_t* notify) {
+	batch_item_done(batch_id, index, notify_result(notify));
+}
+
+bool handle_broadcast(struct node* children, const void* payload, enum request cmd) {
+	uint8_t b[MAX_MSG_LEN];
+	msg_len_type buf_len;
+
+	format_create(cmd, payload, (uint8_t*) b, &buf_len, REQUEST_SENDER_SERVER);
+
+	return send_to_node(children, ((node_packet_t*) payload)->sender_addr, b, buf_len);
+}
+
+bool handle_revive(struct node* children, uint8_t addr, struct client_ref client) { // NOLINT
+	bool killed;
+
+	if (!lock_node(children, addr)) {
+		return send_res_to_client(client, REQUEST_ERR);
+	}
+
+	killed = children[addr].write_fd == -1;
+	if (killed) {
+		revivie_node(&children[addr]);
+	}
+	unlock_node(addr);
+
+	if (killed) {
+		custom_log_debug("Revived node %d", addr);
+		return send_res_to_client(client, REQUEST_OK);
+	}
+
+	custom_log_error("Failed to revive node: probably it is not killed");
+	return send_res_to_client(client, REQUEST_ERR);
 }
 
 void handle_update_child(const void* payload, struct node* children) {
@@ -186,24 +399,48 @@ void handle_update_child(const void* payload, struct node* children) {
 
 	ret = (node_update_t*) payload;
 
-	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (children[i].pid == ret->pid) {
-			children[i].port = ret->port;
-			children[i].addr = ret->addr;
-
-			children[i].write_fd = connection_socket_to_send(children[i].port);
-			if (children[i].write_fd < 0) {
-				custom_log_error("Failed to establish connection with node port=%d", children[i].port);
-			} else {
-				custom_log_debug("Established connection with node: addr=%d", children[i].addr);
-			}
-			break;
+	// nodes of one host process share pid, so node is found by its address
+	i = ret->addr;
+	if (i >= (size_t) NODE_COUNT) {
+		custom_log_error("Update from node with wrong address %zu", i);
+		return;
+	}
+
+	pthread_mutex_lock(&node_locks[i]);
+	if (children[i].pid == ret->pid) {
+		children[i].port = ret->port;
+		children[i].addr = ret->addr;
+
+		children[i].write_fd = connection_socket_to_send(children[i].port);
+		if (children[i].write_fd < 0) {
+			custom_log_error("Failed to establish connection with node port=%d", children[i].port);
+		} else {
+			custom_log_debug("Established connection with node: addr=%d", children[i].addr);
 		}
 	}
+	pthread_mutex_unlock(&node_locks[i]);
 }
 
-static bool send_res_to_client(int32_t client_fd, enum request_result res) {
-	if (!io_write_all(client_fd, (uint8_t*) &res, sizeof(res))) {
+static bool send_res_to_client(struct client_ref client, enum request_result res) {
+	uint8_t b[sizeof(session_result_t) + MSG_BASE_LEN];
+	msg_len_type buf_len;
+	session_result_t result;
+	bool written;
+
+	if (client.seq >= 0) {
+		result.seq = (uint16_t) client.seq;
+		result.res = res;
+		format_create(REQUEST_SESSION_RESULT, &result, b, &buf_len, REQUEST_SENDER_SERVER);
+
+		// results of one session can be sent by several workers at once
+		pthread_mutex_lock(&session_locks[client.fd % SESSION_LOCKS]);
+		written = io_write_all(client.fd, b, buf_len);
+		pthread_mutex_unlock(&session_locks[client.fd % SESSION_LOCKS]);
+	} else {
+		written = io_write_all(client.fd, (uint8_t*) &res, sizeof(res));
+	}
+
+	if (!written) {
 		custom_log_error("Failed to send ping result to client");
 		return false;
 	}
@@ -211,51 +448,242 @@ static bool send_res_to_client(int32_t client_fd, enum request_result res) {
 	return true;
 }
 
+static void batch_item_done(uint16_t batch_id, uint8_t index, enum request_result res) {
+	struct batch* b;
+	send_batch_result_t result;
+	struct client_ref client;
+
+	pthread_mutex_lock(&batches_lock);
+	b = &batches[batch_id % MAX_BATCHES];
+	if (!b->used || b->id != batch_id || index >= b->count || b->done[index]) {
+		pthread_mutex_unlock(&batches_lock);
+		custom_log_warn("Answer to unknown batch item %d:%d (probably timed out)", batch_id, index);
+		return;
+	}
+
+	b->done[index] = true;
+	b->res[index] = res;
+	b->answered++;
+	if (b->answered < b->count) {
+		pthread_mutex_unlock(&batches_lock);
+		return;
+	}
+
+	client = b->client;
+	result.tag = b->tag;
+	result.count = b->count;
+	memcpy(result.res, b->res, sizeof(result.res));
+	b->used = false;
+	pthread_mutex_unlock(&batches_lock);
+
+	if (!send_batch_result_to_client(client, &result)) {
+		custom_log_error("Failed to send batch result to client");
+	}
+}
+
+static bool send_batch_result_to_client(struct client_ref client, const send_batch_result_t* result) {
+	uint8_t b[sizeof(send_batch_result_t) + MSG_BASE_LEN];
+	msg_len_type buf_len;
+	bool written;
+
+	format_create(REQUEST_SEND_BATCH_RESULT, result, b, &buf_len, REQUEST_SENDER_SERVER);
+
+	// client pipelines batches, results can be sent by several workers at once
+	pthread_mutex_lock(&session_locks[client.fd % SESSION_LOCKS]);
+	written = io_write_all(client.fd, b, buf_len);
+	pthread_mutex_unlock(&session_locks[client.fd % SESSION_LOCKS]);
+
+	return written;
+}
+
+static enum request_result notify_result(const notify_t* notify) {
+	switch(notify->type) {
+		case NOTIFY_GOT_MESSAGE:
+			return REQUEST_OK;
+		case NOTIFY_FAIL:
+		default:
+			return REQUEST_ERR;
+	}
+}
+
 static bool kill_node(struct node* children, uint8_t addr) {
+	pid_t pid;
+
+	if (!lock_node(children, addr)) {
+		return false;
+	}
+
+	pid = children[addr].pid;
+	if (children[addr].hosted) {
+		// signal would kill every node of host process
+		if (!send_control(children[addr].write_fd, REQUEST_KILL_NODE, 0)) {
+			custom_log_error("Failed to send kill request to node %d", addr);
+		}
+	} else {
+		kill(pid, SIGTERM);
+	}
+	close(children[addr].write_fd);
+	children[addr].write_fd = -1;
+	unlock_node(addr);
+
+	custom_log_debug("Killed node %d, pid %d", addr, pid);
+
+	return true;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / 1000000;
+}
+
+static bool pending_add(enum request req, struct client_ref client, uint16_t* id) {
+	struct pending* p;
 	size_t i;
 
-	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (children[i].addr == addr) {
-			close(children[i].write_fd);
-			children[i].write_fd = -1;
-			kill(children[i].pid, SIGTERM);
-			custom_log_debug("Killed node %d, pid %d", addr, children[i].pid);
-			return true;
+	pthread_mutex_lock(&pending_lock);
+	for (i = 0; i < MAX_PENDING; i++) {
+		p = &pending[next_control_id % MAX_PENDING];
+		if (!p->used) {
+			break;
 		}
+		next_control_id++;
+	}
+
+	if (i == MAX_PENDING) {
+		pthread_mutex_unlock(&pending_lock);
+		custom_log_error("Too many control requests in flight");
+		return false;
 	}
 
-	return false;
+	p->used = true;
+	p->id = next_control_id++;
+	p->req = req;
+	p->client = client;
+	p->waiting = 1;
+	p->res = REQUEST_OK;
+	p->deadline_ms = now_ms() + CONTROL_TIMEOUT_MS;
+	*id = p->id;
+	pthread_mutex_unlock(&pending_lock);
+
+	return true;
+}
+
+static void pending_expect(uint16_t id) {
+	struct pending* p;
+
+	pthread_mutex_lock(&pending_lock);
+	p = &pending[id % MAX_PENDING];
+	if (p->used && p->id == id) {
+		p->waiting++;
+	}
+	pthread_mutex_unlock(&pending_lock);
+}
+
+static void pending_done(uint16_t id, enum request_result res) {
+	struct pending* p;
+	struct client_ref client;
+
+	pthread_mutex_lock(&pending_lock);
+	p = &pending[id % MAX_PENDING];
+	if (!p->used || p->id != id) {
+		pthread_mutex_unlock(&pending_lock);
+		custom_log_warn("Answer to unknown control request %d (probably timed out)", id);
+		return;
+	}
+
+	if (res != REQUEST_OK) {
+		p->res = res;
+	}
+	p->waiting--;
+	if (p->waiting > 0) {
+		pthread_mutex_unlock(&pending_lock);
+		return;
+	}
+
+	client = p->client;
+	res = p->res;
+	p->used = false;
+	pthread_mutex_unlock(&pending_lock);
+
+	if (!send_res_to_client(client, res)) {
+		custom_log_error("Failed to send control result to client");
+	}
+}
+
+static bool send_control(int32_t fd, enum request req, uint16_t id) {
+	uint8_t b[sizeof(control_t) + MSG_BASE_LEN];
+	msg_len_type buf_len;
+	control_t control;
+
+	control.req = req;
+	control.id = id;
+	control.res = REQUEST_UNKNOWN;
+	format_create(REQUEST_CONTROL, &control, b, &buf_len, REQUEST_SENDER_SERVER);
+
+	return io_write_all(fd, b, buf_len);
+}
+
+static bool lock_node(const struct node* children, uint8_t addr) {
+	if (addr >= NODE_COUNT) {
+		return false;
+	}
+
+	pthread_mutex_lock(&node_locks[addr]);
+	// address is set when node sends update
+	if (children[addr].addr != addr) {
+		pthread_mutex_unlock(&node_locks[addr]);
+		return false;
+	}
+
+	return true;
+}
+
+static void unlock_node(uint8_t addr) {
+	pthread_mutex_unlock(&node_locks[addr]);
 }
 
 static bool make_send_to_node(const struct node* children, const void* payload) {
 	uint8_t b[MAX_MSG_LEN];
 	msg_len_type buf_len;
-	size_t i;
 
 	((node_packet_t*) payload)->crc = packet_crc(((node_packet_t*) payload));
 
 	format_create(REQUEST_SEND, payload, (uint8_t*) b, &buf_len, REQUEST_SENDER_SERVER);
 
-	for (i = 0; i < (size_t) NODE_COUNT; i++) {
-		if (children[i].addr == ((node_packet_t*) payload)->sender_addr) {
-			if (!io_write_all(children[i].write_fd, b, buf_len)) {
-				custom_log_error("Failed to send request to node");
-				return false;
-			}
-		}
+	return send_to_node(children, ((node_packet_t*) payload)->sender_addr, b, buf_len);
+}
+
+static bool send_to_node(const struct node* children, uint8_t addr, const uint8_t* buf, msg_len_type len) {
+	bool res;
+
+	if (!lock_node(children, addr)) {
+		return true;
 	}
 
-	return true;
+	// frames from different workers must not interleave on node connection
+	res = io_write_all(children[addr].write_fd, buf, len);
+	unlock_node(addr);
+
+	if (!res) {
+		custom_log_error("Failed to send request to node");
+	}
+
+	return res;
 }
 
 static void revivie_node(struct node* node) {
 	pid_t pid;
 
+	// revived node of host process runs in its own process
 	pid = fork();
 	if (pid == 0) {
 		run_node(node->addr);
 	} else {
 		node->pid = pid;
+		node->hosted = false;
 	}
 	custom_log_debug("Rerun node %d", node->addr);
 }
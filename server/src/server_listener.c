@@ -1,5 +1,6 @@
 #include "server_listener.h"
 
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -8,54 +9,73 @@
 
 #include "custom_logger.h"
 #include "format.h"
-#include "format.h"
 #include "server_handler.h"
 #include "crc.h"
 #include "format_app.h"
 
-#define MAX_CLIENT 4
-
-static uint16_t app_msg_id = 0;
+static _Atomic uint16_t app_msg_id = 0;
 
-typedef struct client {
-	int32_t fd;
-	uint16_t app_id;
-} client_t;
+// client waiting for notify about message, indexed by app message id
+// notify may be handled by other worker than the one that got request, so table is lock free
+// fd and session seq are packed into one word (see pack_client)
+static _Atomic uint64_t clients[UINT16_MAX + 1];
 
-client_t clients[MAX_CLIENT];
-uint8_t client_num;
+#define NO_CLIENT UINT64_MAX
+// upper half of entry of batch item, lower half keeps batch id and item index
+#define BATCH_ITEM 0xFFFFFFFEull
 
 static void init_clients(void);
 
-static void set_client(uint16_t id, int32_t fd);
+static void set_client(uint16_t id, struct client_ref client);
+
+static void set_batch_item(uint16_t id, uint16_t batch_id, uint8_t index);
 
 __attribute__((warn_unused_result))
-static int32_t get_client_fd_by_id(uint16_t id);
+static uint64_t take_client(uint16_t id);
 
 __attribute__((warn_unused_result))
-static bool handle_client_request(server_t* server_data, void** payload, const uint8_t* buf, void* data);
+static struct client_ref unpack_client(uint64_t packed);
 
 __attribute__((warn_unused_result))
-static bool handle_node_request(void** payload, const uint8_t* buf, void* data);
+static bool handle_client_request(server_t* server_data, struct client_ref client, union format_payload* payload, const uint8_t* buf, size_t len, void* data);
+
+__attribute__((warn_unused_result))
+static bool handle_node_request(union format_payload* payload, const uint8_t* buf, size_t len, void* data);
 
 void server_listener_init(void) {
 	init_clients();
+	server_handler_init();
 }
 
-bool server_listener_handle(server_t* server, const uint8_t* buf, int32_t conn_fd, void* data) {
+bool server_listener_handle(server_t* server, const uint8_t* buf, size_t len, int32_t conn_fd, void* data) {
 	bool processed;
 	enum request_sender sender;
-	void* payload;
+	union format_payload payload;
 
 	sender = format_define_sender(buf);
 
 	switch(sender) {
 		case REQUEST_SENDER_CLIENT:
-			server->client_fd = conn_fd;
-			processed = handle_client_request(server, &payload, buf, data);
+			{
+				struct client_ref client;
+				uint16_t seq;
+
+				client.fd = conn_fd;
+				client.seq = -1;
+				// session request wraps ordinary one, its result is tagged with seq
+				if (format_define_request(buf) == REQUEST_SESSION) {
+					buf = format_parse_session(buf, &len, &seq);
+					if (buf == NULL) {
+						custom_log_error("Broken session request");
+						return false;
+					}
+					client.seq = seq;
+				}
+				processed = handle_client_request(server, client, &payload, buf, len, data);
+			}
 			break;
 		case REQUEST_SENDER_NODE:
-			processed = handle_node_request(&payload, buf, data);
+			processed = handle_node_request(&payload, buf, len, data);
 			break;
 		default:
 			processed = false;
@@ -66,13 +86,15 @@ bool server_listener_handle(server_t* server, const uint8_t* buf, int32_t conn_f
 	return processed;
 }
 
-static bool handle_client_request(server_t* server_data, void** payload, const uint8_t* buf, void* data) {
+static bool handle_client_request(server_t* server_data, struct client_ref client, union format_payload* payload, const uint8_t* buf, size_t len, void* data) {
 	(void) data;
 	enum request cmd_type;
 	bool res;
 
-	*payload = NULL;
-	format_parse(&cmd_type, payload, buf);
+	if (!format_parse(&cmd_type, payload, buf, len)) {
+		custom_log_error("Broken client request");
+		return false;
+	}
 
 	res = true;
 	switch (cmd_type) {
@@ -81,27 +103,51 @@ static bool handle_client_request(server_t* server_data, void** payload, const u
 				node_packet_t* packet;
 				struct app_payload* app_ptr;
 
-				packet = (node_packet_t*) *payload;
-				packet->app_payload.id = app_msg_id++;
+				packet = &payload->packet;
+				packet->app_payload.id = atomic_fetch_add(&app_msg_id, 1);
 				app_ptr = &packet->app_payload;
+				// message goes to network uncompressed, ingress node picks codec
+				app_ptr->codec = APP_CODEC_NONE;
+				app_ptr->checksum = (uint8_t) crc_kind_preferred();
 				packet->app_payload.crc = app_crc(app_ptr);
-				set_client(((node_packet_t*) *payload)->app_payload.id, server_data->client_fd);
-				res = handle_client_send(server_data->children, *payload);
+				set_client(packet->app_payload.id, client);
+				res = handle_client_send(server_data->children, packet);
+			}
+			break;
+		case REQUEST_SEND_BATCH:
+			{
+				send_batch_t* batch;
+				uint16_t batch_id;
+				uint8_t i;
+
+				batch = &payload->batch;
+				if (!batch_open(client, batch, &batch_id)) {
+					break;
+				}
+				// items are mapped before sending, node may notify before last item is sent
+				for (i = 0; i < batch->count; i++) {
+					batch->packets[i].app_payload.id = atomic_fetch_add(&app_msg_id, 1);
+					batch->packets[i].app_payload.codec = APP_CODEC_NONE;
+					batch->packets[i].app_payload.checksum = (uint8_t) crc_kind_preferred();
+					batch->packets[i].app_payload.crc = app_crc(&batch->packets[i].app_payload);
+					set_batch_item(batch->packets[i].app_payload.id, batch_id, i);
+				}
+				handle_client_send_batch(server_data->children, batch_id, batch);
 			}
 			break;
 		case REQUEST_PING:
 			custom_log_debug("Ping command from client");
-			res = handle_ping(server_data->children, server_data->client_fd, *payload);
+			res = handle_ping(server_data->children, client, &payload->addr);
 			break;
 		case REQUEST_KILL_NODE:
-			res = handle_kill(server_data->children, *((uint8_t*) *payload), server_data->client_fd);
+			res = handle_kill(server_data->children, payload->addr, client);
 			break;
 		case REQUEST_RESET:
-			app_msg_id = 0;
-			res = handle_reset(server_data->children, server_data->client_fd);
+			atomic_store(&app_msg_id, 0);
+			res = handle_reset(server_data->children, client);
 			break;
 		case REQUEST_REVIVE_NODE:
-			res = handle_revive(server_data->children, *((uint8_t*) *payload), server_data->client_fd);
+			res = handle_revive(server_data->children, payload->addr, client);
 			break;
 		case REQUEST_BROADCAST:
 		case REQUEST_UNICAST:
@@ -109,12 +155,15 @@ static bool handle_client_request(server_t* server_data, void** payload, const u
 				node_packet_t* packet;
 				struct app_payload* app_ptr;
 
-				packet = (node_packet_t*) *payload;
-				packet->app_payload.id = app_msg_id++;
+				packet = &payload->packet;
+				packet->app_payload.id = atomic_fetch_add(&app_msg_id, 1);
 				app_ptr = &packet->app_payload;
+				// message goes to network uncompressed, ingress node picks codec
+				app_ptr->codec = APP_CODEC_NONE;
+				app_ptr->checksum = (uint8_t) crc_kind_preferred();
 				packet->app_payload.crc = app_crc(app_ptr);
-				set_client(((node_packet_t*) *payload)->app_payload.id, server_data->client_fd);
-				res = handle_broadcast(server_data->children, *payload, cmd_type);
+				set_client(packet->app_payload.id, client);
+				res = handle_broadcast(server_data->children, packet, cmd_type);
 			}
 			break;
 		default:
@@ -123,30 +172,39 @@ static bool handle_client_request(server_t* server_data, void** payload, const u
 			break;
 	}
 
-	free(*payload);
-
 	return res;
 }
 
-static bool handle_node_request(void** payload, const uint8_t* buf, void* data) {
+static bool handle_node_request(union format_payload* payload, const uint8_t* buf, size_t len, void* data) {
 	enum request cmd_type;
 	bool res;
-	int32_t client_fd;
+	struct client_ref client;
+	uint64_t packed;
 
-	*payload = NULL;
-	format_parse(&cmd_type, payload, buf);
+	if (!format_parse(&cmd_type, payload, buf, len)) {
+		custom_log_error("Broken node request");
+		return false;
+	}
 
 	res = true;
 	switch (cmd_type) {
 		case REQUEST_UPDATE:
-			handle_update_child(*payload, data);
+			handle_update_child(&payload->update, data);
+			break;
+		case REQUEST_CONTROL_RESULT:
+			handle_control_result(&payload->control);
 			break;
 		case REQUEST_NOTIFY:
-			client_fd = get_client_fd_by_id(((notify_t*) *payload)->app_msg_id);
-			if (client_fd < 0) {
-				custom_log_warn("Client fd is %d when sending return notify (id %d)", client_fd, ((notify_t*) *payload)->app_msg_id);
+			packed = take_client(payload->notify.app_msg_id);
+			if ((packed >> 32) == BATCH_ITEM) {
+				handle_batch_notify((uint16_t) (packed >> 8), (uint8_t) packed, &payload->notify);
+				break;
+			}
+			client = unpack_client(packed);
+			if (client.fd < 0) {
+				custom_log_warn("Client fd is %d when sending return notify (id %d)", client.fd, payload->notify.app_msg_id);
 			}
-			res = handle_notify(client_fd,  *payload);
+			res = handle_notify(client, &payload->notify);
 			break;
 		default:
 			custom_log_error("Unsupported request");
@@ -154,41 +212,39 @@ static bool handle_node_request(void** payload, const uint8_t* buf, void* data)
 			break;
 	}
 
-	free(*payload);
-
 	return res;
 }
 
 static void init_clients(void) {
-		uint8_t i;
+	size_t i;
 
-		for (i = 0; i < MAX_CLIENT; i++) {
-			clients[i].fd = -1;
-		}
-		client_num = 0;
+	for (i = 0; i <= UINT16_MAX; i++) {
+		atomic_init(&clients[i], NO_CLIENT);
+	}
 }
 
-static void set_client(uint16_t id, int32_t fd) {
-	if (client_num == MAX_CLIENT) {
-		client_num = 0;
-	}
+static uint64_t pack_client(struct client_ref client) {
+	return ((uint64_t) (uint32_t) client.seq << 32) | (uint32_t) client.fd;
+}
 
-	clients[client_num].app_id = id;
-	clients[client_num].fd = fd;
-	client_num++;
+static void set_client(uint16_t id, struct client_ref client) {
+	atomic_store(&clients[id], pack_client(client));
 }
 
-static int32_t get_client_fd_by_id(uint16_t id) {
-	uint8_t i;
-	int32_t fd;
+static void set_batch_item(uint16_t id, uint16_t batch_id, uint8_t index) {
+	atomic_store(&clients[id], (BATCH_ITEM << 32) | ((uint64_t) batch_id << 8) | index);
+}
 
-	for (i = 0; i < MAX_CLIENT; i++) {
-		if (clients[i].app_id == id) {
-			fd = clients[i].fd;
-			clients[i].fd = -1;
-			return fd;
-		}
-	}
+static uint64_t take_client(uint16_t id) {
+	// client is notified once
+	return atomic_exchange(&clients[id], NO_CLIENT);
+}
+
+static struct client_ref unpack_client(uint64_t packed) {
+	struct client_ref client;
+
+	client.fd = (int32_t) (uint32_t) packed;
+	client.seq = (int32_t) (uint32_t) (packed >> 32);
 
-	return -1;
+	return client;
 }
@@ -14,3 +14,23 @@ test_send() {
 		echo "Passed: send from $1 to $2"
 	fi
 }
+
+# $2 is printf format of request lines, $3 of expected result lines
+test_session() {
+	result=$(printf "$2" | make -s client TARGET_ARGS="session" 2> /dev/null | grep -E "^[0-9]+ " | sort -n)
+	if [ "$result" != "$(printf "$3")" ]; then
+		echo "Failed: $1"
+	else
+		echo "Passed: $1"
+	fi
+}
+
+# same as test_session, frames of batch are answered in order of their completion
+test_batch() {
+	result=$(printf "$2" | make -s client TARGET_ARGS="batch -" 2> /dev/null | grep -E "^[0-9]+ " | sort -n)
+	if [ "$result" != "$(printf "$3")" ]; then
+		echo "Failed: $1"
+	else
+		echo "Passed: $1"
+	fi
+}
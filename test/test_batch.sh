@@ -0,0 +1,42 @@
+echo "Testing batch of sends"
+
+. ./common.sh --source-only
+
+cd ..
+
+# run server beforehand
+
+# $1 sends crossing the grid, every fifth one comes from missing node and fails whatever routing is
+sends() {
+	for i in $(seq 0 $(($1 - 1)));
+	do
+		if [ $((i % 5)) = 3 ]; then
+			printf 'send -s 100 -r %d\\n' $i
+		else
+			printf 'send -s %d -r %d\\n' $i $((99 - i))
+		fi
+	done
+}
+
+results() {
+	for i in $(seq 0 $(($1 - 1)));
+	do
+		if [ $((i % 5)) = 3 ]; then
+			printf '%d [ERR]: 1\\n' $i
+		else
+			printf '%d [OK]: 0\\n' $i
+		fi
+	done
+}
+
+reset_mesh
+
+test_batch "batch of one send" 'send -s 1 -r 99\n' '0 [OK]: 0'
+test_batch "batch of one frame" "$(sends 4)" "$(results 4)"
+# more sends than SEND_BATCH_MAX are split into several frames
+test_batch "batch of several frames" "$(sends 20)" "$(results 20)"
+test_batch "batch of mostly one sender" \
+	'send -s 45 -r 23\nsend -s 100 -r 45\nsend -s 45 -r 56\nsend -s 45 -r 0\n' \
+	'0 [OK]: 0\n1 [ERR]: 1\n2 [OK]: 0\n3 [OK]: 0'
+
+reset_mesh
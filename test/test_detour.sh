@@ -0,0 +1,31 @@
+echo "Testing delivery around wall of dead nodes"
+
+. ./common.sh --source-only
+
+cd ..
+
+# run server beforehand, with ROUTING=geo send walks around wall by right hand rule
+
+reset_mesh
+
+# columns from 4 to 6 are dead except last row, so wall is wider than BROADCAST_RADIUS
+for i in $(seq 0 8);
+do
+	for j in $(seq 4 6);
+	do
+		kill_node $((i * 10 + j))
+	done
+done
+
+sleep 5
+
+test_send 40 49 0
+test_send 49 40 0
+test_send 0 9 0
+test_send 83 87 0
+test_send 30 99 0
+test_send 93 97 0
+test_send 33 35 2
+test_send 0 95 0
+
+reset_mesh
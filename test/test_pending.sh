@@ -0,0 +1,39 @@
+echo "Testing sends held until route is found"
+
+. ./common.sh --source-only
+
+cd ..
+
+# run server beforehand, geo routing doesn't discover routes and doesn't hold sends
+if [ "$ROUTING" = "geo" ]; then
+	exit 0
+fi
+
+reset_mesh
+
+# routes are forgotten on reset, so every send waits for route discovery first
+test_session "held send released by route" \
+	'send -s 0 -r 99\n' \
+	'0 [OK]: 0'
+test_session "held sends to one receiver released together" \
+	'send -s 10 -r 89\nsend -s 10 -r 89\nsend -s 10 -r 89\nsend -s 90 -r 9\n' \
+	'0 [OK]: 0\n1 [OK]: 0\n2 [OK]: 0\n3 [OK]: 0'
+
+kill_node 55
+
+# held send expires before session gives up on it, so it fails instead of being unknown
+test_session "held send to dead node expires" \
+	'send -s 0 -r 55\n' \
+	'0 [ERR]: 1'
+test_session "held send to missing node expires" \
+	'send -s 1 -r 100\nsend -s 0 -r 99\n' \
+	'0 [ERR]: 1\n1 [OK]: 0'
+test_session "held send expires while others are delivered" \
+	'send -s 44 -r 55\nsend -s 44 -r 66\nsend -s 44 -r 55\n' \
+	'0 [ERR]: 1\n1 [OK]: 0\n2 [ERR]: 1'
+# reset forgets held send long before it expires, so it fails right away
+test_session "held send fails on reset" \
+	'send -s 0 -r 55\nreset\n' \
+	'0 [ERR]: 1\n1 [OK]: 0'
+
+reset_mesh
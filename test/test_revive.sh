@@ -0,0 +1,31 @@
+echo "Testing killed and revived nodes"
+
+. ./common.sh --source-only
+
+cd ..
+
+# run server beforehand, with nodes per process (-n) killed node of host process is stopped by request and revived
+# as separate process
+
+reset_mesh
+
+test_send 44 55 0
+test_send 54 56 0
+
+kill_node 55
+kill_node 45
+
+test_send 44 55 2
+test_send 0 45 2
+test_send 54 56 0
+test_send 35 65 0
+test_send 0 99 0
+
+reset_mesh
+
+test_send 44 55 0
+test_send 0 45 0
+test_send 55 45 0
+test_send 54 56 0
+
+reset_mesh
@@ -0,0 +1,25 @@
+echo "Testing client session"
+
+. ./common.sh --source-only
+
+cd ..
+
+# run server beforehand
+
+reset_mesh
+
+# ping of dead node fails right away whatever routing is
+kill_node 55
+
+# results come out of order, seq tells which request they belong to
+test_session "session of one request" \
+	'send -s 1 -r 99\n' \
+	'0 [OK]: 0'
+test_session "session seq of mixed requests" \
+	'ping 5\nsend -s 1 -r 99\nping 55\nsend -s 50 -r 39\nsend -s 20 -r 25\nping 55\n' \
+	'0 [OK]: 0\n1 [OK]: 0\n2 [ERR]: 1\n3 [OK]: 0\n4 [OK]: 0\n5 [ERR]: 1'
+test_session "session of failed requests" \
+	'ping 55\nping 55\n' \
+	'0 [ERR]: 1\n1 [ERR]: 1'
+
+reset_mesh